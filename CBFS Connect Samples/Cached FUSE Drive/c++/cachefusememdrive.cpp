@@ -40,6 +40,7 @@
 
 #include "cbfsconnectcommon.h"
 #include "virtualfile.h"
+#include "probes.h"
 
 #ifdef _UNICODE
 #include "../../include/unicode/fuse.h"
@@ -89,6 +90,8 @@ class MemDriveCBCache : public CBCache
 
     INT FireReadData(CBCacheReadDataEventParams* e)
     {
+        PROBE_HANDLER(cbcache, readdata, e->FileId, e->Position, e->BytesToRead, e->ResultCode);
+
         e->BytesRead = 0;
         if (e->BytesToRead == 0)
             return e->ResultCode;
@@ -129,6 +132,8 @@ class MemDriveCBCache : public CBCache
 
     INT FireWriteData(CBCacheWriteDataEventParams* e)
     {
+        PROBE_HANDLER(cbcache, writedata, e->FileId, e->Position, e->BytesToWrite, e->ResultCode);
+
         e->BytesWritten = 0;
         if (e->BytesToWrite == 0)
             return e->ResultCode;
@@ -195,15 +200,36 @@ public: // Events
 
     int FireAccess(FUSEAccessEventParams* e) override
     {
+        PROBE_HANDLER(fuse, access, e->Path, -1, -1, e->Result);
+
+        return 0;
+    }
+
+    int FireChmod(FUSEChmodEventParams* e) override
+    {
+        PROBE_HANDLER(fuse, chmod, e->Path, -1, -1, e->Result);
+
+        return 0;
+    }
+
+    int FireChown(FUSEChownEventParams* e) override
+    {
+        PROBE_HANDLER(fuse, chown, e->Path, -1, -1, e->Result);
+
         return 0;
     }
 
-    int FireChmod(FUSEChmodEventParams* e) override { return 0; }
-    int FireChown(FUSEChownEventParams* e) override { return 0; }
-    int FireCopyFileRange(FUSECopyFileRangeEventParams* e) override { return 0; }
+    int FireCopyFileRange(FUSECopyFileRangeEventParams* e) override
+    {
+        PROBE_HANDLER(fuse, copyfilerange, e->PathIn, e->OffsetIn, e->Size, e->Result);
+
+        return 0;
+    }
 
     int FireCreate(FUSECreateEventParams* e) override
     {
+        PROBE_HANDLER(fuse, create, e->Path, -1, -1, e->Result);
+
         VirtualFile* vfile = NULL, * vdir = NULL;
         int64 now;
 #ifdef UNIX
@@ -244,6 +270,8 @@ public: // Events
 
     int FireDestroy(FUSEDestroyEventParams* e) override
     {
+        PROBE_HANDLER(fuse, destroy, NULL, -1, -1, e->Result);
+
         return 0;
     }
 
@@ -254,6 +282,8 @@ public: // Events
 
     int FireFAllocate(FUSEFAllocateEventParams* e) override
     {
+        PROBE_HANDLER(fuse, fallocate, e->Path, e->Offset, e->Length, e->Result);
+
         VirtualFile* vfile = NULL;
 
         if (FindVirtualFile(e->Path, vfile))
@@ -290,16 +320,22 @@ public: // Events
 
     int FireFlush(FUSEFlushEventParams* e) override
     {
+        PROBE_HANDLER(fuse, flush, e->Path, -1, -1, e->Result);
+
         return 0;
     }
 
     int FireFSync(FUSEFSyncEventParams* e) override
     {
+        PROBE_HANDLER(fuse, fsync, e->Path, -1, -1, e->Result);
+
         return 0;
     }
 
     int FireGetAttr(FUSEGetAttrEventParams* e) override
     {
+        PROBE_HANDLER(fuse, getattr, e->Path, -1, -1, e->Result);
+
         e->Result = -ENOENT;
 
         VirtualFile* vfile = NULL;
@@ -330,11 +366,15 @@ public: // Events
 
     int FireInit(FUSEInitEventParams* e) override
     {
+        PROBE_HANDLER(fuse, init, NULL, -1, -1, e->Result);
+
         return 0;
     }
 
     int FireMkDir(FUSEMkDirEventParams* e) override
     {
+        PROBE_HANDLER(fuse, mkdir, e->Path, -1, -1, e->Result);
+
         VirtualFile* vfile = NULL, * vdir = NULL;
         int64 now;
 #ifdef UNIX
@@ -373,6 +413,8 @@ public: // Events
 
     int FireOpen(FUSEOpenEventParams* e) override
     {
+        PROBE_HANDLER(fuse, open, e->Path, -1, -1, e->Result);
+
         VirtualFile* vfile;
         if (FindVirtualFile(e->Path, vfile))
         {
@@ -390,6 +432,8 @@ public: // Events
 
     int FireRead(FUSEReadEventParams* e) override
     {
+        PROBE_HANDLER(fuse, read, e->Path, e->Offset, e->Size, e->Result);
+
         int BytesRead;
         VirtualFile* vfile;
 
@@ -411,6 +455,8 @@ public: // Events
 
     int FireReadDir(FUSEReadDirEventParams* e) override
     {
+        PROBE_HANDLER(fuse, readdir, e->Path, -1, -1, e->Result);
+
         VirtualFile* vdir = NULL, * vfile = NULL;
 
         if (FindVirtualDirectory(e->Path, vdir))
@@ -449,12 +495,16 @@ public: // Events
 
     int FireRelease(FUSEReleaseEventParams* e) override
     {
+        PROBE_HANDLER(fuse, release, e->Path, -1, -1, e->Result);
+
         cache->FileCloseEx(e->Path, cbcConstants::FLUSH_IMMEDIATE, cbcConstants::PURGE_NONE);
         return 0;
     }
 
     int FireRename(FUSERenameEventParams* e) override
     {
+        PROBE_HANDLER(fuse, rename, e->OldPath, -1, -1, e->Result);
+
         VirtualFile* voldfile = NULL, * vnewfile = NULL, * vnewparent = NULL;
 
         if (FindVirtualFile(e->OldPath, voldfile))
@@ -495,6 +545,8 @@ public: // Events
 
     int FireRmDir(FUSERmDirEventParams* e) override
     {
+        PROBE_HANDLER(fuse, rmdir, e->Path, -1, -1, e->Result);
+
         VirtualFile* vfile = NULL;
 
         if (FindVirtualFile(e->Path, vfile))
@@ -510,6 +562,8 @@ public: // Events
 
     int FireStatFS(FUSEStatFSEventParams* e) override
     {
+        PROBE_HANDLER(fuse, statfs, e->Path, -1, -1, e->Result);
+
         int SectorSize;
         int64 TotalMemory;
 #ifdef WIN32
@@ -534,6 +588,8 @@ public: // Events
 
     int FireTruncate(FUSETruncateEventParams* e) override
     {
+        PROBE_HANDLER(fuse, truncate, e->Path, -1, e->Size, e->Result);
+
         VirtualFile* vfile = NULL;
 
         if (FindVirtualFile(e->Path, vfile))
@@ -549,6 +605,8 @@ public: // Events
 
     int FireUnlink(FUSEUnlinkEventParams* e) override
     {
+        PROBE_HANDLER(fuse, unlink, e->Path, -1, -1, e->Result);
+
         VirtualFile* vfile = NULL;
 
         if (FindVirtualFile(e->Path, vfile))
@@ -565,6 +623,8 @@ public: // Events
 
     int FireUtimens(FUSEUtimensEventParams* e) override
     {
+        PROBE_HANDLER(fuse, utimens, e->Path, -1, -1, e->Result);
+
         VirtualFile* vfile = NULL;
 
         if (FindVirtualFile(e->Path, vfile))
@@ -582,6 +642,8 @@ public: // Events
 
     int FireWrite(FUSEWriteEventParams* e) override
     {
+        PROBE_HANDLER(fuse, write, e->Path, e->Offset, e->Size, e->Result);
+
         int BytesWritten;
         VirtualFile* vfile;
 
@@ -0,0 +1,51 @@
+#if !defined _PROBES_H
+#define _PROBES_H
+
+#include <stdint.h>
+
+// USDT probes for bpftrace, perf and SystemTap.
+//
+// Every event handler fires <provider>:<handler>_entry when it starts and
+// <provider>:<handler>_return when it returns, VirtualFile::Read and Write
+// fire virtualfile:read_entry / read_return and write_entry / write_return.
+// The entry probes pass the path, the offset and the size, the return
+// probes add the result; offset and size are -1 for requests without them.
+// For example, the latency of FUSE reads of a running sample:
+//
+//   bpftrace -e 'usdt:./fusememdrive:fuse:read_entry { @start[tid] = nsecs; }
+//                usdt:./fusememdrive:fuse:read_return /@start[tid]/ {
+//                    @us = hist((nsecs - @start[tid]) / 1000); delete(@start[tid]); }'
+//
+// A probe is a nop instruction until a tracer attaches to it. The probes
+// are built from <sys/sdt.h> (systemtap-sdt-dev on Debian and Ubuntu,
+// systemtap-sdt-devel on Fedora and RHEL); without that header, on Windows,
+// or with -DNO_PROBES they compile to nothing.
+
+#if defined(UNIX) && !defined(NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PROBES_ENABLED
+#endif
+#endif
+
+#ifdef PROBES_ENABLED
+#define PROBE3(Provider, Name, Arg1, Arg2, Arg3) DTRACE_PROBE3(Provider, Name, Arg1, Arg2, Arg3)
+#define PROBE4(Provider, Name, Arg1, Arg2, Arg3, Arg4) DTRACE_PROBE4(Provider, Name, Arg1, Arg2, Arg3, Arg4)
+#else
+#define PROBE3(Provider, Name, Arg1, Arg2, Arg3) do { } while (0)
+#define PROBE4(Provider, Name, Arg1, Arg2, Arg3, Arg4) do { } while (0)
+#endif
+
+// fires Provider:Name_entry now and Provider:Name_return when the scope is left
+#define PROBE_HANDLER(Provider, Name, Path, Offset, Size, Result) \
+    PROBE3(Provider, Name##_entry, (const void*)(Path), (int64_t)(Offset), (int64_t)(Size)); \
+    struct probe_##Name##_exit \
+    { \
+        const void* mPath; \
+        int64_t mOffset; \
+        int64_t mSize; \
+        const int* mResult; \
+        ~probe_##Name##_exit() { PROBE4(Provider, Name##_return, mPath, mOffset, mSize, *mResult); } \
+    } probe_exit = { (const void*)(Path), (int64_t)(Offset), (int64_t)(Size), &(Result) }
+
+#endif //#if !defined _PROBES_H
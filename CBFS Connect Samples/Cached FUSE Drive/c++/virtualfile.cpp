@@ -1,6 +1,7 @@
 #include <assert.h>
 
 #include "virtualfile.h"
+#include "probes.h"
 
 #ifdef _UNICODE
 #include "../../include/unicode/fuse.h"
@@ -194,6 +195,7 @@ DirectoryEnumerationContext* VirtualFile::get_Context(void)
 void VirtualFile::Write(void *WriteBuf, int64 Position, int BytesToWrite, int *BytesWritten)
 {
     assert(WriteBuf);
+    PROBE3(virtualfile, write_entry, (const void*)mName, Position, (int64)BytesToWrite);
     
     if(mSize - Position < BytesToWrite)
     {
@@ -204,12 +206,14 @@ void VirtualFile::Write(void *WriteBuf, int64 Position, int BytesToWrite, int *B
 
     memcpy((void*)&((char*)mStream)[Position] , WriteBuf, BytesToWrite);
     *BytesWritten = BytesToWrite;
+    PROBE4(virtualfile, write_return, (const void*)mName, Position, (int64)BytesToWrite, *BytesWritten);
 }
 
 void VirtualFile::Read(void *ReadBuf, int64 Position, int BytesToRead, int *BytesRead)
 {
     assert(ReadBuf);
     int MaxRead;
+    PROBE3(virtualfile, read_entry, (const void*)mName, Position, (int64)BytesToRead);
     if (Position > mSize)
         MaxRead = 0;
     else
@@ -217,6 +221,7 @@ void VirtualFile::Read(void *ReadBuf, int64 Position, int BytesToRead, int *Byte
     if (MaxRead > 0)
         memcpy(ReadBuf, (void*)&((char*)mStream)[Position], MaxRead);
     *BytesRead = MaxRead;
+    PROBE4(virtualfile, read_return, (const void*)mName, Position, (int64)BytesToRead, MaxRead);
 }
 
 void VirtualFile::Initializer(const fuse_char *Name)
@@ -0,0 +1,999 @@
+/*
+ * CBFS Connect 2024 C++ Edition - Sample Project
+ *
+ * This sample project demonstrates the usage of CBFS Connect in a
+ * simple, straightforward way. It is not intended to be a complete
+ * application. Error handling and other checks are simplified for clarity.
+ *
+ * www.callback.com/cbfsconnect
+ *
+ * This code is subject to the terms and conditions specified in the
+ * corresponding product license agreement which outlines the authorized
+ * usage and restrictions.
+ */
+
+// Benchmarks of the VirtualFile tree of the FUSE Drive sample.
+//
+// The tree is driven the way the FUSE handlers drive it, through the path
+// helpers of filetree.cpp, but without the FUSE class: neither the CBFS
+// library nor the driver is needed. Results are written to stdout as JSON.
+//
+//   fusememdrive_bench [-quick] [benchmark ...]
+//
+// random_read_large reads big files with pages from the heap and, where
+// transparent huge pages are available, from the data arena; on Linux it
+// also reports the data TLB misses per read if the kernel exposes the
+// counter, and how much of the file data ended up in huge pages.
+//
+// large_file writes and reads a file of 6 GiB, sparse but for the ranges
+// around 2 GiB and 4 GiB where 32-bit offsets would wrap, and checks every
+// block it reads; the "errors" of its results must be 0.
+//
+// tree_walk walks a deep tree and a flat directory with one thread and
+// with one per core, then verifies the tree with renames blocked.
+//
+// compact fills the data arena, deletes three files in four and times the
+// compaction of the holes; it reports the fragmentation and the resident
+// bytes of the arena before and after.
+//
+// expire runs last: once an expiry policy is set, every node created or
+// freed also goes through the expiry index. It deletes the stale half of
+// the files below a policy directory in batches and reports the longest
+// batch.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <chrono>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef UNIX
+#include <sys/stat.h>
+#endif
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "virtualfile.h"
+#include "filetree.h"
+#include "treewalk.h"
+
+#define BENCH_SECTOR_SIZE 512
+
+typedef std::basic_string<fuse_char> bench_string;
+
+typedef struct
+{
+    const char* Name;
+    std::string Params;     // the members of a JSON object
+    int64 Ops;
+    double Seconds;
+}   BENCH_RESULT;
+
+static std::vector<BENCH_RESULT> g_Results;
+static bool g_Quick = false;
+static std::mt19937_64 g_Random(1);
+
+class BenchTimer
+{
+public:
+    BenchTimer() : mStart(std::chrono::steady_clock::now()) {}
+
+    double Seconds(void)
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - mStart).count();
+    }
+
+private:
+    std::chrono::steady_clock::time_point mStart;
+};
+
+// the data TLB misses of the calling thread since the counter was created,
+// -1 where the kernel does not count them (not Linux, or no counter in a VM)
+class TlbMissCounter
+{
+public:
+    TlbMissCounter() : mFd(-1)
+    {
+#ifdef __linux__
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        mFd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (mFd >= 0)
+            ioctl(mFd, PERF_EVENT_IOC_RESET, 0);
+#endif
+    }
+    ~TlbMissCounter()
+    {
+#ifdef __linux__
+        if (mFd >= 0)
+            close(mFd);
+#endif
+    }
+
+    int64 Misses(void)
+    {
+        long long count = -1;
+#ifdef __linux__
+        if (mFd >= 0 && read(mFd, &count, sizeof(count)) != sizeof(count))
+            count = -1;
+#endif
+        return count;
+    }
+
+private:
+    TlbMissCounter(const TlbMissCounter&);
+    TlbMissCounter& operator=(const TlbMissCounter&);
+    int mFd;
+};
+
+// the anonymous memory of the process in huge pages, -1 where unknown
+static int64 HugePageBytes(void)
+{
+    int64 bytes = -1;
+#ifdef __linux__
+    FILE* file = fopen("/proc/self/smaps_rollup", "r");
+    char line[256];
+    long long kb;
+
+    if (file == NULL)
+        return -1;
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        if (sscanf(line, "AnonHugePages: %lld kB", &kb) == 1)
+            bytes = (int64)kb * 1024;
+    }
+    fclose(file);
+#endif
+    return bytes;
+}
+
+static void AddResult(const char* Name, const std::string& Params, int64 Ops, double Seconds)
+{
+    BENCH_RESULT result = { Name, Params, Ops, Seconds };
+    g_Results.push_back(result);
+}
+
+static std::string Param(const char* Name, int64 Value)
+{
+    char text[64];
+    snprintf(text, sizeof(text), "\"%s\": %lld", Name, (long long)Value);
+    return text;
+}
+
+// the paths are plain ASCII, so widening them char by char is enough
+static bench_string MakePath(const std::string& Path)
+{
+    return bench_string(Path.begin(), Path.end());
+}
+
+static std::string ChildPath(const std::string& Dir, const char* Prefix, int64 Index)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "/%s%lld", Prefix, (long long)Index);
+    return Dir + name;
+}
+
+//-----------------------------------------------------------------------------------------------------------
+// the tree operations, as FireMkDir, FireCreate, FireWrite, FireRead and FireRename do them
+
+// Time, if not 0, is the time() of the node, set as FireCreate sets it
+static VirtualFile* CreateNode(const std::string& Path, int Mode, int64 Time = 0)
+{
+    bench_string path = MakePath(Path);
+    VirtualFile* vdir = NULL, * vfile = NULL;
+
+    if (!GetParentVirtualDirectory(path.c_str(), vdir))
+    {
+        fprintf(stderr, "no parent directory for %s\n", Path.c_str());
+        exit(1);
+    }
+
+    vdir->LockExclusive();
+    vfile = new VirtualFile(GetFileName(path.c_str()), Mode);
+    if (Time != 0)
+    {
+        int64 fileTime = (Time + 11644473600LL) * 10000000;
+        vfile->set_CreationTime(fileTime);
+        vfile->set_LastAccessTime(fileTime);
+        vfile->set_LastWriteTime(fileTime);
+    }
+    vdir->AddFile(vfile);
+    vdir->UnlockExclusive();
+    vdir->Release();
+    return vfile;
+}
+
+static void MakeDir(const std::string& Path)
+{
+    CreateNode(Path, S_IFDIR | 0755);
+}
+
+static void MakeFile(const std::string& Path)
+{
+    CreateNode(Path, S_IFREG | 0644);
+}
+
+static int64 WriteFile(const bench_string& Path, const char* Buffer, int64 Offset, int Size)
+{
+    VirtualFile* vfile;
+    int64 written = 0;
+
+    if (FindVirtualFile(Path.c_str(), vfile))
+    {
+        vfile->LockShared();
+        vfile->Write((void*)Buffer, Offset, Size, &written);
+        vfile->UnlockShared();
+        vfile->Release();
+    }
+    return written;
+}
+
+static int64 ReadFile(const bench_string& Path, char* Buffer, int64 Offset, int Size)
+{
+    VirtualFile* vfile;
+    int64 read = 0;
+
+    if (FindVirtualFile(Path.c_str(), vfile))
+    {
+        vfile->LockShared();
+        vfile->Read(Buffer, Offset, Size, &read);
+        vfile->UnlockShared();
+        vfile->Release();
+    }
+    return read;
+}
+
+static void TruncateFile(const bench_string& Path, int64 Size)
+{
+    VirtualFile* vfile;
+
+    if (FindVirtualFile(Path.c_str(), vfile))
+    {
+        vfile->LockExclusive();
+        vfile->set_Size(Size);
+        vfile->UnlockExclusive();
+        vfile->Release();
+    }
+}
+
+static bool RenameNode(const bench_string& OldPath, const bench_string& NewPath)
+{
+    VirtualFile* voldfile = NULL, * voldparent = NULL, * vnewparent = NULL;
+    bool result = false;
+
+    if (!GetParentVirtualDirectory(OldPath.c_str(), voldparent))
+        return false;
+    if (!GetParentVirtualDirectory(NewPath.c_str(), vnewparent))
+    {
+        voldparent->Release();
+        return false;
+    }
+
+    VirtualFile::LockRename(voldparent, vnewparent);
+    if (voldparent->get_Context()->GetFile(GetFileName(OldPath.c_str()), voldfile))
+    {
+        voldfile->Remove();
+        voldfile->Rename(GetFileName(NewPath.c_str()));
+        vnewparent->AddFile(voldfile);
+        result = true;
+    }
+    VirtualFile::UnlockRename(voldparent, vnewparent);
+
+    voldparent->Release();
+    vnewparent->Release();
+    return result;
+}
+
+// as FireUnlink does it
+static void UnlinkFile(const std::string& Path)
+{
+    bench_string path = MakePath(Path);
+    VirtualFile* vdir = NULL, * vfile;
+
+    if (!GetParentVirtualDirectory(path.c_str(), vdir))
+        return;
+    vdir->LockExclusive();
+    if (vdir->get_Context()->GetFile(GetFileName(path.c_str()), vfile))
+    {
+        vfile->Remove();
+        vfile->Release();
+    }
+    vdir->UnlockExclusive();
+    vdir->Release();
+}
+
+// removes the directory of a benchmark with everything below it
+static void RemoveTree(const std::string& Path)
+{
+    bench_string path = MakePath(Path);
+    VirtualFile* vdir = NULL;
+
+    if (FindVirtualFile(path.c_str(), vdir))
+    {
+        RemoveAllFiles(vdir);
+        g_DiskContext->LockExclusive();
+        vdir->Remove();
+        g_DiskContext->UnlockExclusive();
+        vdir->Release();
+    }
+    EpochFlush();
+}
+
+//-----------------------------------------------------------------------------------------------------------
+
+static void BenchLookupDepth(void)
+{
+    static const int depths[] = { 1, 4, 16, 64 };
+    int64 ops = g_Quick ? 20000 : 500000;
+
+    for (size_t d = 0; d < sizeof(depths) / sizeof(depths[0]); d++)
+    {
+        std::string path = "/lookup_depth";
+        VirtualFile* vfile;
+
+        MakeDir(path);
+        for (int i = 0; i < depths[d]; i++)
+        {
+            path = ChildPath(path, "d", i);
+            MakeDir(path);
+        }
+
+        bench_string target = MakePath(path);
+        BenchTimer timer;
+        for (int64 i = 0; i < ops; i++)
+        {
+            if (FindVirtualFile(target.c_str(), vfile))
+                vfile->Release();
+        }
+        AddResult("lookup_depth", Param("depth", depths[d]), ops, timer.Seconds());
+
+        RemoveTree("/lookup_depth");
+    }
+}
+
+static void BenchLookupWidth(void)
+{
+    static const int widths[] = { 10, 100, 1000, 10000 };
+
+    for (size_t w = 0; w < sizeof(widths) / sizeof(widths[0]); w++)
+    {
+        int width = widths[w];
+        int64 ops = (g_Quick ? 2000000 : 50000000) / width;
+        std::vector<bench_string> paths;
+        VirtualFile* vfile;
+
+        if (ops < 1000)
+            ops = 1000;
+
+        MakeDir("/lookup_width");
+        for (int i = 0; i < width; i++)
+        {
+            std::string path = ChildPath("/lookup_width", "f", i);
+            MakeFile(path);
+            paths.push_back(MakePath(path));
+        }
+
+        std::uniform_int_distribution<int> pick(0, width - 1);
+        BenchTimer timer;
+        for (int64 i = 0; i < ops; i++)
+        {
+            if (FindVirtualFile(paths[pick(g_Random)].c_str(), vfile))
+                vfile->Release();
+        }
+        AddResult("lookup_width", Param("width", width), ops, timer.Seconds());
+
+        RemoveTree("/lookup_width");
+    }
+}
+
+static void BenchReadDir(void)
+{
+    static const int sizes[] = { 1000, 10000, 100000 };
+    int count = g_Quick ? 2 : 3;
+
+    for (int s = 0; s < count; s++)
+    {
+        int entries = sizes[s];
+        int64 ops = (g_Quick ? 200000 : 5000000) / entries;
+        int64 listed = 0;
+
+        if (ops < 10)
+            ops = 10;
+
+        MakeDir("/readdir");
+        for (int i = 0; i < entries; i++)
+            MakeFile(ChildPath("/readdir", "f", i));
+
+        bench_string path = MakePath("/readdir");
+        BenchTimer timer;
+        for (int64 i = 0; i < ops; i++)
+        {
+            VirtualFile* vdir = NULL;
+            std::vector<VIRTUALFILE_ENTRY> entries;
+            EpochGuard guard;
+
+            if (LookupVirtualFile(path.c_str(), vdir))
+            {
+                vdir->get_Context()->GetEntries(entries);
+                listed += entries.size();
+            }
+        }
+        double seconds = timer.Seconds();
+
+        if (listed != ops * entries)
+            fprintf(stderr, "readdir listed %lld entries, %lld expected\n", (long long)listed, (long long)(ops * entries));
+        AddResult("readdir_large", Param("entries", entries), ops, seconds);
+
+        RemoveTree("/readdir");
+    }
+}
+
+static void BenchSeqAppend(void)
+{
+    static const int sizes[] = { 4096, 131072 };
+    int64 total = (int64)(g_Quick ? 16 : 256) << 20;
+    std::vector<char> buffer(131072, 'x');
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        int64 ops = total / sizes[s];
+
+        MakeDir("/append");
+        MakeFile("/append/file");
+
+        bench_string path = MakePath("/append/file");
+        BenchTimer timer;
+        for (int64 i = 0; i < ops; i++)
+            WriteFile(path, buffer.data(), i * sizes[s], sizes[s]);
+        AddResult("seq_append", Param("request_size", sizes[s]) + ", " + Param("file_size", total), ops, timer.Seconds());
+
+        RemoveTree("/append");
+    }
+}
+
+static void BenchRandomReadWrite(void)
+{
+    const int request = 4096;
+    int64 fileSize = (int64)(g_Quick ? 16 : 256) << 20;
+    int64 ops = g_Quick ? 50000 : 1000000;
+    std::vector<char> buffer(VIRTUALFILE_PAGE_SIZE, 'x');
+    std::uniform_int_distribution<int64> pick(0, fileSize / request - 1);
+    std::string params = Param("request_size", request) + ", " + Param("file_size", fileSize);
+
+    MakeDir("/random");
+    MakeFile("/random/file");
+
+    bench_string path = MakePath("/random/file");
+    for (int64 offset = 0; offset < fileSize; offset += VIRTUALFILE_PAGE_SIZE)
+        WriteFile(path, buffer.data(), offset, VIRTUALFILE_PAGE_SIZE);
+
+    BenchTimer readTimer;
+    for (int64 i = 0; i < ops; i++)
+        ReadFile(path, buffer.data(), pick(g_Random) * request, request);
+    AddResult("random_read", params, ops, readTimer.Seconds());
+
+    BenchTimer writeTimer;
+    for (int64 i = 0; i < ops; i++)
+        WriteFile(path, buffer.data(), pick(g_Random) * request, request);
+    AddResult("random_write", params, ops, writeTimer.Seconds());
+
+    RemoveTree("/random");
+}
+
+// random reads of big files, with the pages from the heap and from the arena
+static void BenchRandomReadLarge(void)
+{
+    static const int sizes[] = { 256, 1024 };
+    const int request = 4096;
+    int count = g_Quick ? 1 : 2;
+    int64 ops = g_Quick ? 200000 : 2000000;
+    std::vector<char> buffer(VIRTUALFILE_PAGE_SIZE, 'x');
+
+    for (int s = 0; s < count; s++)
+    {
+        int64 fileSize = (int64)sizes[s] << 20;
+        std::uniform_int_distribution<int64> pick(0, fileSize / request - 1);
+
+        for (int arena = 0; arena < 2; arena++)
+        {
+            if (!VirtualFile::SetDataArena(arena != 0))
+            {
+                fprintf(stderr, "random_read_large: huge pages are not available, the arena is skipped\n");
+                break;
+            }
+
+            MakeDir("/random_large");
+            MakeFile("/random_large/file");
+
+            int64 hugeBefore = HugePageBytes();
+            bench_string path = MakePath("/random_large/file");
+            for (int64 offset = 0; offset < fileSize; offset += VIRTUALFILE_PAGE_SIZE)
+                WriteFile(path, buffer.data(), offset, VIRTUALFILE_PAGE_SIZE);
+            int64 hugeBytes = HugePageBytes() - hugeBefore;
+
+            TlbMissCounter tlb;
+            BenchTimer timer;
+            for (int64 i = 0; i < ops; i++)
+                ReadFile(path, buffer.data(), pick(g_Random) * request, request);
+            double seconds = timer.Seconds();
+            int64 misses = tlb.Misses();
+
+            char tlbParam[64];
+            snprintf(tlbParam, sizeof(tlbParam), "\"dtlb_misses_per_op\": %.3f", misses < 0 ? -1.0 : (double)misses / ops);
+            AddResult("random_read_large", Param("file_size", fileSize) + ", " + Param("request_size", request) +
+                ", \"pages\": \"" + (arena ? "arena" : "heap") + "\", " + Param("huge_page_bytes", hugeBefore < 0 ? -1 : hugeBytes) +
+                ", " + tlbParam, ops, seconds);
+
+            RemoveTree("/random_large");
+        }
+    }
+    VirtualFile::SetDataArena(false);
+}
+
+// every block of a large_file window starts with its offset
+#define BENCH_LARGE_BLOCK 4096
+
+static void StampBlocks(char* Buffer, int64 Offset, int Size)
+{
+    for (int i = 0; i < Size; i += BENCH_LARGE_BLOCK)
+    {
+        int64 stamp = Offset + i;
+        memcpy(Buffer + i, &stamp, sizeof(stamp));
+    }
+}
+
+static int64 CheckBlocks(const char* Buffer, int64 Offset, int Size)
+{
+    int64 errors = 0;
+
+    for (int i = 0; i < Size; i += BENCH_LARGE_BLOCK)
+    {
+        int64 stamp;
+        memcpy(&stamp, Buffer + i, sizeof(stamp));
+        if (stamp != Offset + i)
+            errors++;
+    }
+    return errors;
+}
+
+// a file past 4 GiB: sequential I/O of 1 MiB and random I/O of 4 KiB in
+// windows across the 2 GiB and 4 GiB boundaries, the rest is a hole
+static void BenchLargeFile(void)
+{
+    const int request = 1 << 20;
+    const int64 fileSize = (int64)6 << 30;
+    static const int64 boundaries[] = { (int64)2 << 30, (int64)4 << 30 };
+    const int windows = (int)(sizeof(boundaries) / sizeof(boundaries[0]));
+    int64 window = (int64)(g_Quick ? 64 : 512) << 20;
+    int64 ops = g_Quick ? 50000 : 500000;
+    int64 errors = 0;
+    std::vector<char> buffer(request, 'x');
+    std::uniform_int_distribution<int64> pickWindow(0, windows - 1);
+    std::uniform_int_distribution<int64> pickBlock(0, window / BENCH_LARGE_BLOCK - 1);
+    std::string params = Param("file_size", fileSize) + ", " + Param("window_bytes", windows * window);
+
+    MakeDir("/large");
+    MakeFile("/large/file");
+
+    bench_string path = MakePath("/large/file");
+    TruncateFile(path, fileSize);
+
+    BenchTimer writeTimer;
+    for (int w = 0; w < windows; w++)
+    {
+        for (int64 offset = boundaries[w] - window / 2; offset < boundaries[w] + window / 2; offset += request)
+        {
+            StampBlocks(buffer.data(), offset, request);
+            if (WriteFile(path, buffer.data(), offset, request) != request)
+                errors++;
+        }
+    }
+    AddResult("large_seq_write", params + ", " + Param("request_size", request) + ", " + Param("errors", errors),
+        windows * window / request, writeTimer.Seconds());
+
+    errors = 0;
+    BenchTimer readTimer;
+    for (int w = 0; w < windows; w++)
+    {
+        for (int64 offset = boundaries[w] - window / 2; offset < boundaries[w] + window / 2; offset += request)
+        {
+            if (ReadFile(path, buffer.data(), offset, request) != request)
+                errors++;
+            errors += CheckBlocks(buffer.data(), offset, request);
+        }
+    }
+
+    // the end of the file is a hole, and nothing is read past it
+    memset(buffer.data(), 'x', BENCH_LARGE_BLOCK);
+    if (ReadFile(path, buffer.data(), fileSize - BENCH_LARGE_BLOCK, BENCH_LARGE_BLOCK) != BENCH_LARGE_BLOCK ||
+        buffer[0] != 0 || buffer[BENCH_LARGE_BLOCK - 1] != 0 || ReadFile(path, buffer.data(), fileSize, BENCH_LARGE_BLOCK) != 0)
+    {
+        fprintf(stderr, "large_file: the end of the file reads wrong\n");
+        errors++;
+    }
+    AddResult("large_seq_read", params + ", " + Param("request_size", request) + ", " + Param("errors", errors),
+        windows * window / request, readTimer.Seconds());
+
+    errors = 0;
+    BenchTimer randomReadTimer;
+    for (int64 i = 0; i < ops; i++)
+    {
+        int64 offset = boundaries[pickWindow(g_Random)] - window / 2 + pickBlock(g_Random) * BENCH_LARGE_BLOCK;
+        ReadFile(path, buffer.data(), offset, BENCH_LARGE_BLOCK);
+        errors += CheckBlocks(buffer.data(), offset, BENCH_LARGE_BLOCK);
+    }
+    AddResult("large_random_read", params + ", " + Param("request_size", BENCH_LARGE_BLOCK) + ", " + Param("errors", errors),
+        ops, randomReadTimer.Seconds());
+
+    errors = 0;
+    BenchTimer randomWriteTimer;
+    for (int64 i = 0; i < ops; i++)
+    {
+        int64 offset = boundaries[pickWindow(g_Random)] - window / 2 + pickBlock(g_Random) * BENCH_LARGE_BLOCK;
+        StampBlocks(buffer.data(), offset, BENCH_LARGE_BLOCK);
+        if (WriteFile(path, buffer.data(), offset, BENCH_LARGE_BLOCK) != BENCH_LARGE_BLOCK)
+            errors++;
+    }
+    AddResult("large_random_write", params + ", " + Param("request_size", BENCH_LARGE_BLOCK) + ", " + Param("errors", errors),
+        ops, randomWriteTimer.Seconds());
+
+    RemoveTree("/large");
+}
+
+static void BenchCompact(void)
+{
+    int files = g_Quick ? 256 : 2048;
+    const int pages = 4;
+    std::vector<char> buffer(VIRTUALFILE_PAGE_SIZE, 'x');
+    PAGEARENA_STATS before, after;
+
+    if (!VirtualFile::SetDataArena(true))
+    {
+        fprintf(stderr, "compact: huge pages are not available, skipped\n");
+        return;
+    }
+
+    // the pages of the files are written in turns, so every region holds
+    // pages of many files
+    MakeDir("/compact");
+    for (int i = 0; i < files; i++)
+        MakeFile(ChildPath("/compact", "f", i));
+    for (int p = 0; p < pages; p++)
+    {
+        for (int i = 0; i < files; i++)
+            WriteFile(MakePath(ChildPath("/compact", "f", i)), buffer.data(), (int64)p * VIRTUALFILE_PAGE_SIZE, VIRTUALFILE_PAGE_SIZE);
+    }
+    for (int i = 0; i < files; i++)
+    {
+        if (i % 4 != 0)
+            UnlinkFile(ChildPath("/compact", "f", i));
+    }
+    EpochFlush();
+    VirtualFile::GetDataArenaStats(&before);
+
+    BenchTimer timer;
+    int64 moved = 0, step;
+    while ((step = VirtualFile::CompactData(PAGEARENA_REGION_SIZE)) >= 0)
+        moved += step;
+    double seconds = timer.Seconds();
+    VirtualFile::GetDataArenaStats(&after);
+
+    char fragmentation[96];
+    snprintf(fragmentation, sizeof(fragmentation), "\"fragmentation_before\": %.3f, \"fragmentation_after\": %.3f",
+        before.Fragmentation, after.Fragmentation);
+    AddResult("compact", Param("files", files) + ", " + Param("bytes_moved", moved) + ", " + fragmentation + ", " +
+        Param("resident_before", before.ResidentBytes) + ", " + Param("resident_after", after.ResidentBytes),
+        moved / VIRTUALFILE_PAGE_SIZE, seconds);
+
+    RemoveTree("/compact");
+    VirtualFile::SetDataArena(false);
+}
+
+static void BenchExpire(void)
+{
+    int files = g_Quick ? 10000 : 100000;
+    const int dirs = 100, batch = 64;
+    int64 now = (int64)time(NULL);
+    VIRTUALFILE_EXPIRY_STATS before, after;
+    double longest = 0;
+    int expired = 0, count;
+
+    VirtualFile::SetExpiryPolicy(MakePath("/expire").c_str(), 3600);
+    MakeDir("/expire");
+    for (int d = 0; d < dirs; d++)
+        MakeDir(ChildPath("/expire", "d", d));
+    for (int i = 0; i < files; i++)
+        CreateNode(ChildPath(ChildPath("/expire", "d", i % dirs), "f", i), S_IFREG | 0644, i % 2 == 0 ? now - 7200 : now);
+    VirtualFile::GetExpiryStats(&before);
+
+    BenchTimer timer;
+    do
+    {
+        BenchTimer batchTimer;
+        count = VirtualFile::ExpireFiles(now, batch);
+        if (batchTimer.Seconds() > longest)
+            longest = batchTimer.Seconds();
+        expired += count;
+    } while (count > 0);
+    double seconds = timer.Seconds();
+    VirtualFile::GetExpiryStats(&after);
+
+    char batchParam[64];
+    snprintf(batchParam, sizeof(batchParam), "\"longest_batch_us\": %.1f", longest * 1e6);
+    AddResult("expire", Param("files", files) + ", " + Param("tracked_before", before.Tracked) + ", " +
+        Param("tracked_after", after.Tracked) + ", " + Param("batch", batch) + ", " + batchParam, expired, seconds);
+
+    RemoveTree("/expire");
+}
+
+static void BenchRename(void)
+{
+    int files = g_Quick ? 1000 : 10000;
+
+    MakeDir("/rename");
+    MakeDir("/rename/a");
+    MakeDir("/rename/b");
+    for (int i = 0; i < files; i++)
+        MakeFile(ChildPath("/rename/a", "f", i));
+
+    // within a directory, then every file into another one and back
+    BenchTimer sameTimer;
+    for (int i = 0; i < files; i++)
+        RenameNode(MakePath(ChildPath("/rename/a", "f", i)), MakePath(ChildPath("/rename/a", "g", i)));
+    AddResult("rename", "\"directories\": \"same\", " + Param("entries", files), files, sameTimer.Seconds());
+
+    BenchTimer crossTimer;
+    for (int i = 0; i < files; i++)
+        RenameNode(MakePath(ChildPath("/rename/a", "g", i)), MakePath(ChildPath("/rename/b", "f", i)));
+    for (int i = 0; i < files; i++)
+        RenameNode(MakePath(ChildPath("/rename/b", "f", i)), MakePath(ChildPath("/rename/a", "f", i)));
+    AddResult("rename", "\"directories\": \"different\", " + Param("entries", files), 2 * (int64)files, crossTimer.Seconds());
+
+    RemoveTree("/rename");
+}
+
+// a tree of Fanout directories per level, with Fanout files in each directory of the last level
+static int64 BuildTree(const std::string& Path, int Fanout, int Depth, int64 FileSize, const char* Buffer)
+{
+    int64 nodes = 0;
+
+    for (int i = 0; i < Fanout; i++)
+    {
+        if (Depth > 1)
+        {
+            std::string dir = ChildPath(Path, "d", i);
+            MakeDir(dir);
+            nodes += 1 + BuildTree(dir, Fanout, Depth - 1, FileSize, Buffer);
+        }
+        else
+        {
+            std::string file = ChildPath(Path, "f", i);
+            MakeFile(file);
+            if (FileSize > 0)
+                WriteFile(MakePath(file), Buffer, 0, (int)FileSize);
+            nodes++;
+        }
+    }
+    return nodes;
+}
+
+static void BenchUnlinkTree(void)
+{
+    int depth = g_Quick ? 3 : 5;
+
+    MakeDir("/unlink");
+    int64 nodes = BuildTree("/unlink", 10, depth, 0, NULL);
+
+    VirtualFile* vdir;
+    bench_string path = MakePath("/unlink");
+    FindVirtualFile(path.c_str(), vdir);
+
+    // the nodes are freed once the epoch allows it, which is part of the cost
+    BenchTimer timer;
+    RemoveAllFiles(vdir);
+    EpochFlush();
+    AddResult("unlink_tree", Param("nodes", nodes) + ", " + Param("fanout", 10), nodes, timer.Seconds());
+
+    vdir->Release();
+    RemoveTree("/unlink");
+}
+
+typedef struct
+{
+    int64 Bytes;
+    char Padding[64 - sizeof(int64)];
+}   BENCH_WALK_SUM;
+
+static bool SumWalkNode(const TREEWALK_NODE* Node, void* Context)
+{
+    ((BENCH_WALK_SUM*)Context)[Node->Worker].Bytes += Node->File->get_AllocationSize();
+    return true;
+}
+
+static void BenchTreeWalk(void)
+{
+    static const char* shapes[] = { "deep", "flat" };
+    int depth = g_Quick ? 4 : 6;
+    int flat = g_Quick ? 20000 : 200000;
+    int cores = (int)std::thread::hardware_concurrency();
+    std::vector<int> threads(1, 1);
+    int64 nodes = 2;
+
+    if (cores > 1)
+        threads.push_back(cores);
+
+    MakeDir("/walk");
+    MakeDir("/walk/deep");
+    nodes += BuildTree("/walk/deep", 10, depth, 0, NULL);
+    MakeDir("/walk/flat");
+    for (int i = 0; i < flat; i++)
+        MakeFile(ChildPath("/walk/flat", "f", i));
+    nodes += flat;
+
+    for (size_t s = 0; s < sizeof(shapes) / sizeof(shapes[0]); s++)
+    {
+        VirtualFile* vdir;
+        bench_string path = MakePath(std::string("/walk/") + shapes[s]);
+        FindVirtualFile(path.c_str(), vdir);
+
+        for (size_t t = 0; t < threads.size(); t++)
+        {
+            std::vector<BENCH_WALK_SUM> sums(TREEWALK_MAX_THREADS);
+            TREEWALK_STATS stats;
+
+            BenchTimer timer;
+            TreeWalk(vdir, 0, threads[t], SumWalkNode, sums.data(), &stats);
+            double seconds = timer.Seconds();
+
+            int64 visited = stats.Directories + stats.Files;
+            AddResult("tree_walk", std::string("\"shape\": \"") + shapes[s] + "\", " + Param("nodes", visited) + ", " +
+                Param("threads", stats.Threads) + ", " + Param("steals", stats.Steals), visited, seconds);
+        }
+        vdir->Release();
+    }
+
+    VirtualFile* vdir;
+    bench_string path = MakePath("/walk");
+    FindVirtualFile(path.c_str(), vdir);
+    BenchTimer verifyTimer;
+    int64 problems = VerifyTree(vdir);
+    AddResult("verify_tree", Param("nodes", nodes) + ", " + Param("problems", problems), nodes, verifyTimer.Seconds());
+    vdir->Release();
+
+    RemoveTree("/walk");
+}
+
+static void BenchStatFS(void)
+{
+    int depth = g_Quick ? 3 : 4;
+    int64 ops = g_Quick ? 20 : 200;
+    std::vector<char> buffer(1000, 'x');
+    int64 size = 0;
+
+    MakeDir("/statfs");
+    int64 nodes = BuildTree("/statfs", 10, depth, (int64)buffer.size(), buffer.data());
+
+    // StatFS reads the running total; the walk is what it used to do
+    BenchTimer timer;
+    for (int64 i = 0; i < ops; i++)
+        size += VirtualFile::GetPageBytes();
+    double seconds = timer.Seconds();
+
+    AddResult("statfs", Param("nodes", nodes) + ", " + Param("used_bytes", size / ops), ops, seconds);
+
+    size = 0;
+    BenchTimer walkTimer;
+    for (int64 i = 0; i < ops; i++)
+        size += CalculateFolderSize(g_DiskContext, BENCH_SECTOR_SIZE);
+    seconds = walkTimer.Seconds();
+
+    AddResult("folder_size", Param("nodes", nodes) + ", " + Param("used_bytes", size / ops), ops, seconds);
+
+    RemoveTree("/statfs");
+}
+
+//-----------------------------------------------------------------------------------------------------------
+
+typedef struct
+{
+    const char* Name;
+    void (*Run)(void);
+}   BENCHMARK;
+
+static const BENCHMARK g_Benchmarks[] =
+{
+    { "lookup_depth", BenchLookupDepth },
+    { "lookup_width", BenchLookupWidth },
+    { "readdir_large", BenchReadDir },
+    { "seq_append", BenchSeqAppend },
+    { "random_rw", BenchRandomReadWrite },
+    { "random_read_large", BenchRandomReadLarge },
+    { "large_file", BenchLargeFile },
+    { "compact", BenchCompact },
+    { "rename", BenchRename },
+    { "unlink_tree", BenchUnlinkTree },
+    { "tree_walk", BenchTreeWalk },
+    { "statfs", BenchStatFS },
+    { "expire", BenchExpire },
+};
+
+#define BENCHMARK_COUNT (sizeof(g_Benchmarks) / sizeof(g_Benchmarks[0]))
+
+static void PrintResults(FILE* Output)
+{
+    fprintf(Output, "{\n  \"quick\": %s,\n  \"results\": [\n", g_Quick ? "true" : "false");
+    for (size_t i = 0; i < g_Results.size(); i++)
+    {
+        const BENCH_RESULT& result = g_Results[i];
+        double seconds = result.Seconds > 0 ? result.Seconds : 1e-9;
+
+        fprintf(Output, "    { \"benchmark\": \"%s\", \"params\": { %s }, \"ops\": %lld, \"seconds\": %.6f, \"ops_per_sec\": %.1f, \"ns_per_op\": %.1f }%s\n",
+            result.Name, result.Params.c_str(), (long long)result.Ops, result.Seconds,
+            result.Ops / seconds, seconds * 1e9 / result.Ops, i + 1 < g_Results.size() ? "," : "");
+    }
+    fprintf(Output, "  ]\n}\n");
+}
+
+static void PrintUsage(void)
+{
+    fprintf(stderr, "usage: fusememdrive_bench [-quick] [benchmark ...]\n\nbenchmarks:\n");
+    for (size_t i = 0; i < BENCHMARK_COUNT; i++)
+        fprintf(stderr, "  %s\n", g_Benchmarks[i].Name);
+}
+
+int main(int argc, char* argv[])
+{
+    std::vector<const BENCHMARK*> selected;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-quick"))
+        {
+            g_Quick = true;
+            continue;
+        }
+
+        size_t b = 0;
+        for (; b < BENCHMARK_COUNT; b++)
+        {
+            if (!strcmp(argv[i], g_Benchmarks[b].Name))
+                break;
+        }
+        if (b == BENCHMARK_COUNT)
+        {
+            PrintUsage();
+            return 1;
+        }
+        selected.push_back(&g_Benchmarks[b]);
+    }
+
+    if (selected.empty())
+    {
+        for (size_t b = 0; b < BENCHMARK_COUNT; b++)
+            selected.push_back(&g_Benchmarks[b]);
+    }
+
+    g_DiskContext = new VirtualFile(TEXT("/"), S_IFDIR);
+
+    for (size_t i = 0; i < selected.size(); i++)
+    {
+        fprintf(stderr, "%s...\n", selected[i]->Name);
+        selected[i]->Run();
+    }
+
+    PrintResults(stdout);
+    return 0;
+}
@@ -6,6 +6,8 @@
 
 #ifdef _UNICODE
 #include "../../include/unicode/fuse.h"
+#elif defined CBFS_STANDIN
+#include "standin/fuse.h"
 #else
 #include "../../include/fuse.h"
 #endif
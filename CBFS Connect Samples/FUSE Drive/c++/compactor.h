@@ -0,0 +1,33 @@
+#if !defined _COMPACTOR_H
+#define _COMPACTOR_H
+
+// Background compaction of the file data.
+//
+// Long-running drives that create, append, truncate and delete files leave
+// the memory of their data full of holes: freed pages stay resident, and so
+// the resident size of the process grows far past the bytes stored. The
+// thread started by CompactorStart wakes every COMPACTOR_INTERVAL_MS and,
+// while more than COMPACTOR_THRESHOLD of the resident pages of the data
+// arena are not in use, moves the pages of its emptiest regions into the
+// others and returns the emptied regions to the system
+// (VirtualFile::CompactData). It moves at most MegabytesPerSecond per
+// second, in steps of one region, and locks one page at a time, so that
+// the handlers hardly notice it.
+//
+// Pages taken from the heap (the arena is off or unavailable) cannot be
+// moved; on glibc the thread trims the heap every COMPACTOR_TRIM_INTERVAL_S
+// instead, which returns the free memory at its top and in its unused
+// pages. The nodes, names and small file buffers are slab objects that the
+// handlers hold pointers to, and stay where they are.
+
+// share of the resident bytes of the arena not in use above which it is compacted
+#define COMPACTOR_THRESHOLD 0.10
+
+#define COMPACTOR_INTERVAL_MS 100
+#define COMPACTOR_TRIM_INTERVAL_S 10
+
+void CompactorStart(int MegabytesPerSecond);
+
+void CompactorStop(void);
+
+#endif //#if !defined _COMPACTOR_H
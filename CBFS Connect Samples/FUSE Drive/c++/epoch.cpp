@@ -0,0 +1,259 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "epoch.h"
+
+// number of objects a thread retires before it hands them to the reclaimer
+#define EPOCH_RECLAIM_THRESHOLD 64
+// pause of the reclaimer while a reader still holds back the epoch
+#define EPOCH_RECLAIM_PAUSE_MS 1
+
+typedef struct
+{
+    void* Ptr;
+    void (*Release)(void*);
+    uint64_t Epoch;
+}   EPOCH_RETIRED;
+
+typedef struct _EPOCH_THREAD
+{
+    std::atomic<uint64_t> Epoch;    // 0 while the thread is outside of a read section
+    std::atomic<bool> InUse;
+    int Nesting;
+    std::vector<EPOCH_RETIRED> Retired; // touched only by the owner of the record
+    struct _EPOCH_THREAD* Next;
+}   EPOCH_THREAD, * PEPOCH_THREAD;
+
+// the reclaimer runs the releases on its own thread, so that they never run
+// under the locks that the retiring thread holds
+typedef struct
+{
+    std::mutex Lock;
+    std::condition_variable Wake;
+    std::condition_variable Idle;
+    std::vector<EPOCH_RETIRED> Pending;
+    bool Busy;                      // releases are running outside of Lock
+}   EPOCH_RECLAIMER, * PEPOCH_RECLAIMER;
+
+static std::atomic<uint64_t> g_GlobalEpoch(1);
+static std::atomic<PEPOCH_THREAD> g_EpochThreads(NULL);
+
+// created on first use and never destroyed, the reclaimer may outlive main
+static std::mutex g_ReclaimerStartLock;
+static std::atomic<PEPOCH_RECLAIMER> g_Reclaimer(NULL);
+
+static void HandOffRetired(PEPOCH_THREAD Record, PEPOCH_RECLAIMER Reclaimer);
+
+static PEPOCH_THREAD AcquireThreadRecord(void)
+{
+    // records are never freed, a record of a finished thread is reused
+    // together with whatever it still has retired
+    for (PEPOCH_THREAD rec = g_EpochThreads.load(std::memory_order_acquire); rec != NULL; rec = rec->Next)
+    {
+        bool expected = false;
+        if (!rec->InUse.load(std::memory_order_relaxed) &&
+            rec->InUse.compare_exchange_strong(expected, true, std::memory_order_acquire))
+            return rec;
+    }
+
+    PEPOCH_THREAD rec = new EPOCH_THREAD;
+    rec->Epoch.store(0, std::memory_order_relaxed);
+    rec->InUse.store(true, std::memory_order_relaxed);
+    rec->Nesting = 0;
+    rec->Next = g_EpochThreads.load(std::memory_order_relaxed);
+    while (!g_EpochThreads.compare_exchange_weak(rec->Next, rec, std::memory_order_release, std::memory_order_relaxed))
+        ;
+    return rec;
+}
+
+class EpochThreadHolder
+{
+public:
+    EpochThreadHolder() : mRecord(AcquireThreadRecord()) {}
+    ~EpochThreadHolder()
+    {
+        assert(mRecord->Nesting == 0);
+
+        // a reclaimer is not started on the way out of a thread
+        PEPOCH_RECLAIMER reclaimer = g_Reclaimer.load(std::memory_order_acquire);
+        if (reclaimer != NULL && !mRecord->Retired.empty())
+            HandOffRetired(mRecord, reclaimer);
+        mRecord->InUse.store(false, std::memory_order_release);
+    }
+    PEPOCH_THREAD mRecord;
+};
+
+static PEPOCH_THREAD GetThreadRecord(void)
+{
+    static thread_local EpochThreadHolder holder;
+    return holder.mRecord;
+}
+
+void EpochEnter(void)
+{
+    PEPOCH_THREAD rec = GetThreadRecord();
+    if (rec->Nesting++ == 0)
+    {
+        // release orders the previous read section before the announcement, the
+        // fence makes the announcement visible before any shared node is read
+        rec->Epoch.store(g_GlobalEpoch.load(std::memory_order_relaxed), std::memory_order_release);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+}
+
+void EpochExit(void)
+{
+    PEPOCH_THREAD rec = GetThreadRecord();
+    assert(rec->Nesting > 0);
+    if (--rec->Nesting == 0)
+        rec->Epoch.store(0, std::memory_order_release);
+}
+
+static bool TryAdvanceEpoch(void)
+{
+    uint64_t epoch = g_GlobalEpoch.load(std::memory_order_relaxed);
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    for (PEPOCH_THREAD rec = g_EpochThreads.load(std::memory_order_acquire); rec != NULL; rec = rec->Next)
+    {
+        uint64_t local = rec->Epoch.load(std::memory_order_acquire);
+        if (local != 0 && local != epoch)
+            return false;
+    }
+    return g_GlobalEpoch.compare_exchange_strong(epoch, epoch + 1, std::memory_order_acq_rel);
+}
+
+// moves the objects of From that no reader can reach anymore to Ready
+static void CollectRetired(std::vector<EPOCH_RETIRED>& From, std::vector<EPOCH_RETIRED>& Ready)
+{
+    uint64_t epoch = g_GlobalEpoch.load(std::memory_order_acquire);
+    size_t kept = 0;
+
+    for (size_t i = 0; i < From.size(); i++)
+    {
+        if (From[i].Epoch + 2 <= epoch)
+            Ready.push_back(From[i]);
+        else
+            From[kept++] = From[i];
+    }
+    From.resize(kept);
+}
+
+static void ReclaimerThread(PEPOCH_RECLAIMER Reclaimer)
+{
+    PEPOCH_THREAD rec = GetThreadRecord();
+    std::vector<EPOCH_RETIRED> ready;
+    std::unique_lock<std::mutex> lock(Reclaimer->Lock);
+
+    for (;;)
+    {
+        Reclaimer->Wake.wait(lock, [Reclaimer] { return !Reclaimer->Pending.empty(); });
+
+        bool advanced = TryAdvanceEpoch();
+        CollectRetired(Reclaimer->Pending, ready);
+        if (ready.empty())
+        {
+            if (!advanced)
+                Reclaimer->Wake.wait_for(lock, std::chrono::milliseconds(EPOCH_RECLAIM_PAUSE_MS));
+            continue;
+        }
+
+        Reclaimer->Busy = true;
+        lock.unlock();
+        for (size_t i = 0; i < ready.size(); i++)
+            ready[i].Release(ready[i].Ptr);
+        ready.clear();
+        lock.lock();
+
+        // a release may retire more objects, they were queued on this thread's record
+        Reclaimer->Pending.insert(Reclaimer->Pending.end(), rec->Retired.begin(), rec->Retired.end());
+        rec->Retired.clear();
+        Reclaimer->Busy = false;
+        Reclaimer->Idle.notify_all();
+    }
+}
+
+static PEPOCH_RECLAIMER GetReclaimer(void)
+{
+    PEPOCH_RECLAIMER reclaimer = g_Reclaimer.load(std::memory_order_acquire);
+    if (reclaimer != NULL)
+        return reclaimer;
+
+    std::lock_guard<std::mutex> lock(g_ReclaimerStartLock);
+    reclaimer = g_Reclaimer.load(std::memory_order_relaxed);
+    if (reclaimer == NULL)
+    {
+        reclaimer = new EPOCH_RECLAIMER;
+        reclaimer->Busy = false;
+        std::thread(ReclaimerThread, reclaimer).detach();
+        g_Reclaimer.store(reclaimer, std::memory_order_release);
+    }
+    return reclaimer;
+}
+
+static void HandOffRetired(PEPOCH_THREAD Record, PEPOCH_RECLAIMER Reclaimer)
+{
+    {
+        std::lock_guard<std::mutex> lock(Reclaimer->Lock);
+        Reclaimer->Pending.insert(Reclaimer->Pending.end(), Record->Retired.begin(), Record->Retired.end());
+    }
+    Record->Retired.clear();
+    Reclaimer->Wake.notify_one();
+}
+
+void EpochRetire(void* Ptr, void (*Release)(void*))
+{
+    PEPOCH_THREAD rec = GetThreadRecord();
+    EPOCH_RETIRED item;
+
+    item.Ptr = Ptr;
+    item.Release = Release;
+    item.Epoch = g_GlobalEpoch.load(std::memory_order_acquire);
+
+    // only queued here, the caller may hold locks that a release takes as well;
+    // the shared lock is taken once per batch
+    rec->Retired.push_back(item);
+    if (rec->Retired.size() >= EPOCH_RECLAIM_THRESHOLD)
+        HandOffRetired(rec, GetReclaimer());
+}
+
+// moves everything the threads still hold to Ready
+static void TakeThreadRetired(std::vector<EPOCH_RETIRED>& Ready)
+{
+    for (PEPOCH_THREAD rec = g_EpochThreads.load(std::memory_order_acquire); rec != NULL; rec = rec->Next)
+    {
+        Ready.insert(Ready.end(), rec->Retired.begin(), rec->Retired.end());
+        rec->Retired.clear();
+    }
+}
+
+void EpochFlush(void)
+{
+    PEPOCH_RECLAIMER reclaimer = g_Reclaimer.load(std::memory_order_acquire);
+    std::vector<EPOCH_RETIRED> ready;
+
+    do
+    {
+        ready.clear();
+        if (reclaimer != NULL)
+        {
+            // the reclaimer touches its own record only under the lock or while busy
+            std::unique_lock<std::mutex> lock(reclaimer->Lock);
+            reclaimer->Idle.wait(lock, [reclaimer] { return !reclaimer->Busy; });
+            ready.swap(reclaimer->Pending);
+            TakeThreadRetired(ready);
+        }
+        else
+            TakeThreadRetired(ready);
+
+        for (size_t i = 0; i < ready.size(); i++)
+            ready[i].Release(ready[i].Ptr);
+    } while (!ready.empty());
+}
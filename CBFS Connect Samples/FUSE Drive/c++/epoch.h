@@ -0,0 +1,31 @@
+#if !defined _EPOCH_H
+#define _EPOCH_H
+
+// Epoch based reclamation for the lock-free read path of the VirtualFile tree.
+//
+// Readers wrap every access to shared nodes in EpochEnter/EpochExit (or an
+// EpochGuard) and take no locks. Writers unlink a node under the usual locks
+// and hand it to EpochRetire; it is released only after every thread that
+// could still hold a pointer to it has left its read section. The releases
+// run on a reclaimer thread, never under the locks of the retiring thread.
+
+void EpochEnter(void);
+
+void EpochExit(void);
+
+void EpochRetire(void* Ptr, void (*Release)(void*));
+
+// releases everything retired so far; only for use when no readers are active
+void EpochFlush(void);
+
+class EpochGuard
+{
+public:
+    EpochGuard() { EpochEnter(); }
+    ~EpochGuard() { EpochExit(); }
+private:
+    EpochGuard(const EpochGuard&);
+    EpochGuard& operator=(const EpochGuard&);
+};
+
+#endif //#if !defined _EPOCH_H
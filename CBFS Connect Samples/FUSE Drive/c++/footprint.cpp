@@ -0,0 +1,295 @@
+/*
+ * CBFS Connect 2024 C++ Edition - Sample Project
+ *
+ * This sample project demonstrates the usage of CBFS Connect in a
+ * simple, straightforward way. It is not intended to be a complete
+ * application. Error handling and other checks are simplified for clarity.
+ *
+ * www.callback.com/cbfsconnect
+ *
+ * This code is subject to the terms and conditions specified in the
+ * corresponding product license agreement which outlines the authorized
+ * usage and restrictions.
+ */
+
+// Memory footprint of the VirtualFile tree of the FUSE Drive sample.
+//
+// Builds a tree of many directories and files the way the FUSE handlers do,
+// without the FUSE class, and measures in phases what it costs:
+//
+//   directories   empty directories of -perdir files each
+//   empty_files   -files empty files with names of -namelen characters
+//   small_files   -size bytes written to the first -small files, kept in
+//                 pages or, below -smalllimit, in the buffer of a small file
+//   removed       what is left after the tree is removed again
+//
+// Every phase reports the heap bytes in use (from the allocator) and the
+// resident bytes of the process, per object. The empty files are broken
+// down into the nodes, the names and the rest (mostly the unused parts of
+// the slabs) as counted by VirtualFile::GetMemoryStats; the node itself is
+// broken down by group of fields (VirtualFile::GetLayout).
+// Results are written to stdout as JSON.
+//
+//   fusememdrive_footprint [-files N] [-perdir N] [-namelen N] [-small N] [-size N] [-smalllimit N]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#ifdef UNIX
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+#if defined(__APPLE__)
+#include <malloc/malloc.h>
+#include <mach/mach.h>
+#endif
+
+#include "virtualfile.h"
+#include "filetree.h"
+
+typedef struct
+{
+    int64 Heap;
+    int64 Resident;
+    VIRTUALFILE_MEMORY_STATS Tree;
+}   FOOTPRINT_SAMPLE;
+
+// the heap bytes in use, -1 where the allocator does not tell
+static int64 HeapBytes(void)
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    struct mallinfo2 info = mallinfo2();
+    return (int64)(info.uordblks + info.hblkhd);
+#elif defined(__GLIBC__)
+    struct mallinfo info = mallinfo();
+    return (int64)(unsigned)info.uordblks + (int64)(unsigned)info.hblkhd;
+#elif defined(__APPLE__)
+    malloc_statistics_t stats;
+    malloc_zone_statistics(NULL, &stats);
+    return (int64)stats.size_in_use;
+#else
+    return -1;
+#endif
+}
+
+// the resident bytes of the process, -1 where unknown
+static int64 ResidentBytes(void)
+{
+#if defined(__linux__)
+    long long size = 0, resident = 0;
+    FILE* statm = fopen("/proc/self/statm", "r");
+    if (statm == NULL)
+        return -1;
+    if (fscanf(statm, "%lld %lld", &size, &resident) != 2)
+        resident = -1;
+    fclose(statm);
+    return resident < 0 ? -1 : (int64)resident * sysconf(_SC_PAGESIZE);
+#elif defined(__APPLE__)
+    mach_task_basic_info_data_t info;
+    mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+    if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, (task_info_t)&info, &count) != KERN_SUCCESS)
+        return -1;
+    return (int64)info.resident_size;
+#else
+    return -1;
+#endif
+}
+
+static FOOTPRINT_SAMPLE Sample(void)
+{
+    FOOTPRINT_SAMPLE sample;
+
+    sample.Heap = HeapBytes();
+    sample.Resident = ResidentBytes();
+    VirtualFile::GetMemoryStats(&sample.Tree);
+    return sample;
+}
+
+static double PerObject(int64 Bytes, int64 Count)
+{
+    return Count > 0 ? (double)Bytes / Count : 0.0;
+}
+
+static VirtualFile* AddNode(VirtualFile* Dir, const fuse_char* Name, int Mode)
+{
+    VirtualFile* vfile = new VirtualFile(Name, Mode);
+
+    Dir->LockExclusive();
+    Dir->AddFile(vfile);
+    Dir->UnlockExclusive();
+    return vfile;
+}
+
+// a name of exactly Length characters that ends in Index
+static void MakeName(fuse_char* Name, int Length, char Prefix, int64 Index)
+{
+    char digits[32];
+    int count = snprintf(digits, sizeof(digits), "%lld", (long long)Index);
+    int i = 0;
+
+    Name[i++] = Prefix;
+    for (; i < Length - count; i++)
+        Name[i] = '_';
+    for (int j = 0; j < count && i < Length; j++)
+        Name[i++] = digits[j];
+    Name[i] = 0;
+}
+
+static void PrintPhase(FILE* Output, const char* Name, const FOOTPRINT_SAMPLE& Before, const FOOTPRINT_SAMPLE& After,
+    const char* Per, int64 Count, const std::string& Extra, bool Last)
+{
+    int64 heap = After.Heap - Before.Heap;
+    int64 resident = After.Resident - Before.Resident;
+
+    fprintf(Output, "  \"%s\": { \"heap_bytes\": %lld, \"resident_bytes\": %lld, \"heap_per_%s\": %.1f, \"resident_per_%s\": %.1f%s%s }%s\n",
+        Name, (long long)heap, (long long)resident, Per, PerObject(heap, Count), Per, PerObject(resident, Count),
+        Extra.empty() ? "" : ", ", Extra.c_str(), Last ? "" : ",");
+}
+
+int main(int argc, char* argv[])
+{
+    int64 files = 1000000;
+    int64 perDir = 1000;
+    int64 smallFiles = 10000;
+    int nameLength = 16;
+    int fileSize = 100;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-files") && i + 1 < argc)
+            files = atoll(argv[++i]);
+        else if (!strcmp(argv[i], "-perdir") && i + 1 < argc)
+            perDir = atoll(argv[++i]);
+        else if (!strcmp(argv[i], "-namelen") && i + 1 < argc)
+            nameLength = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-small") && i + 1 < argc)
+            smallFiles = atoll(argv[++i]);
+        else if (!strcmp(argv[i], "-size") && i + 1 < argc)
+            fileSize = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-smalllimit") && i + 1 < argc)
+            VirtualFile::SetSmallFileLimit(atoi(argv[++i]));
+        else
+        {
+            fprintf(stderr, "usage: fusememdrive_footprint [-files N] [-perdir N] [-namelen N] [-small N] [-size N] [-smalllimit N]\n");
+            return 1;
+        }
+    }
+    if (files < 1)
+        files = 1;
+    if (perDir < 1)
+        perDir = 1;
+    if (nameLength < 8)
+        nameLength = 8;
+    if (nameLength > 255)
+        nameLength = 255;
+    if (smallFiles > files)
+        smallFiles = files;
+    if (fileSize < 1)
+        fileSize = 1;
+
+    int64 dirs = (files + perDir - 1) / perDir;
+    std::vector<fuse_char> name(nameLength + 1);
+    std::vector<char> data(fileSize, 'x');
+    std::vector<VirtualFile*> dirNodes;
+    std::vector<VirtualFile*> fileNodes;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    g_DiskContext = new VirtualFile(TEXT("/"), S_IFDIR);
+    VirtualFile* top = AddNode(g_DiskContext, TEXT("footprint"), S_IFDIR | 0755);
+
+    // the lists of nodes are filled in up front, so they are not measured
+    dirNodes.resize((size_t)dirs);
+    fileNodes.resize((size_t)files);
+
+    FOOTPRINT_SAMPLE base = Sample();
+    for (int64 d = 0; d < dirs; d++)
+    {
+        MakeName(name.data(), nameLength, 'd', d);
+        dirNodes[(size_t)d] = AddNode(top, name.data(), S_IFDIR | 0755);
+    }
+    FOOTPRINT_SAMPLE afterDirs = Sample();
+
+    fprintf(stderr, "%lld directories, creating %lld files...\n", (long long)dirs, (long long)files);
+    for (int64 f = 0; f < files; f++)
+    {
+        MakeName(name.data(), nameLength, 'f', f);
+        fileNodes[(size_t)f] = AddNode(dirNodes[(size_t)(f / perDir)], name.data(), S_IFREG | 0644);
+    }
+    FOOTPRINT_SAMPLE afterFiles = Sample();
+
+    fprintf(stderr, "writing %lld small files...\n", (long long)smallFiles);
+    int64 pageBytes = VirtualFile::GetPageBytes();
+    for (int64 f = 0; f < smallFiles; f++)
+    {
+        int64 written;
+        fileNodes[(size_t)f]->LockShared();
+        fileNodes[(size_t)f]->Write(data.data(), 0, fileSize, &written);
+        fileNodes[(size_t)f]->UnlockShared();
+    }
+    VirtualFile::FlushIoStats();
+    FOOTPRINT_SAMPLE afterSmall = Sample();
+    pageBytes = VirtualFile::GetPageBytes() - pageBytes;
+
+    // what the files themselves take from the slabs
+    int64 nodeBytes = afterFiles.Tree.Nodes - afterDirs.Tree.Nodes;
+    int64 nameBytes = afterFiles.Tree.Names - afterDirs.Tree.Names;
+    int64 nameChars = files * (nameLength + 1) * (int64)sizeof(fuse_char);
+    int64 dataBytes = afterSmall.Tree.FileData - afterFiles.Tree.FileData;
+
+    int64 nodeAllocated = nodeBytes / files;
+
+    // the nodes carry only the reference of the tree
+    fprintf(stderr, "removing the tree...\n");
+    fileNodes.clear();
+    dirNodes.clear();
+    RemoveAllFiles(top);
+    g_DiskContext->LockExclusive();
+    top->Remove();
+    g_DiskContext->UnlockExclusive();
+    top->Release();
+    EpochFlush();
+    FOOTPRINT_SAMPLE afterRemove = Sample();
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::vector<VIRTUALFILE_FIELD_GROUP> layout;
+    VirtualFile::GetLayout(layout);
+
+    FILE* out = stdout;
+    char extra[512];
+
+    fprintf(out, "{\n  \"files\": %lld, \"directories\": %lld, \"name_length\": %d, \"small_files\": %lld, \"file_size\": %d, \"small_limit\": %d, \"seconds\": %.3f,\n",
+        (long long)files, (long long)dirs, nameLength, (long long)smallFiles, fileSize, VirtualFile::GetSmallFileLimit(), seconds);
+    fprintf(out, "  \"node\": { \"sizeof\": %d, \"allocated\": %lld, \"fields\": {", (int)sizeof(VirtualFile),
+        (long long)nodeAllocated);
+    for (size_t i = 0; i < layout.size(); i++)
+        fprintf(out, "%s \"%s\": %d", i > 0 ? "," : "", layout[i].Name, layout[i].Size);
+    fprintf(out, " } },\n");
+
+    PrintPhase(out, "directories", base, afterDirs, "directory", dirs, "", false);
+
+    int64 fileHeap = afterFiles.Heap - afterDirs.Heap;
+    snprintf(extra, sizeof(extra), "\"node_per_file\": %.1f, \"name_per_file\": %.1f, \"name_per_byte\": %.3f, \"other_per_file\": %.1f",
+        PerObject(nodeBytes, files), PerObject(nameBytes, files), PerObject(nameBytes, nameChars),
+        PerObject(fileHeap - nodeBytes - nameBytes, files));
+    PrintPhase(out, "empty_files", afterDirs, afterFiles, "file", files, extra, false);
+
+    int64 smallHeap = afterSmall.Heap - afterFiles.Heap;
+    // the rest is the page tables, or the headers of the small file buffers
+    snprintf(extra, sizeof(extra), "\"data_bytes_per_file\": %.1f, \"data_state_per_file\": %.1f, \"other_per_file\": %.1f, \"heap_per_data_byte\": %.1f",
+        PerObject(pageBytes, smallFiles), PerObject(dataBytes, smallFiles), PerObject(smallHeap - pageBytes - dataBytes, smallFiles),
+        PerObject(smallHeap, smallFiles * fileSize));
+    PrintPhase(out, "small_files", afterFiles, afterSmall, "file", smallFiles, extra, false);
+
+    // the slabs are kept for the next files
+    snprintf(extra, sizeof(extra), "\"slab_bytes\": %lld", (long long)(afterRemove.Tree.SlabBytes - base.Tree.SlabBytes));
+    PrintPhase(out, "removed", base, afterRemove, "file", files, extra, true);
+    fprintf(out, "}\n");
+    return 0;
+}
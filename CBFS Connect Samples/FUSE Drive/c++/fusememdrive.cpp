@@ -15,12 +15,15 @@
 #include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <limits.h>
 #include <assert.h> 
 #include <time.h>
 #include <iostream>
 #include <filesystem>
 #include <string>
+#include <vector>
+#include <algorithm>
 
 #ifdef WIN32
 #include <tchar.h>
@@ -32,6 +35,7 @@
 #include <poll.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 
 #include <sys/param.h>
 #include <sys/mount.h>
@@ -42,9 +46,19 @@
 
 #include "cbfsconnectcommon.h"
 #include "virtualfile.h"
+#include "filetree.h"
+#include "opstats.h"
+#include "probes.h"
+#include "metrics.h"
+#include "watchdog.h"
+#include "compactor.h"
+#include "sweeper.h"
+#include "recorder.h"
 
 #ifdef _UNICODE
 #include "../../include/unicode/fuse.h"
+#elif defined CBFS_STANDIN
+#include "standin/fuse.h"
 #else
 #include "../../include/fuse.h"
 #endif
@@ -53,6 +67,10 @@
 #define FALLOC_FL_KEEP_SIZE 1 
 #endif
 
+#ifndef O_ACCMODE
+#define O_ACCMODE 3
+#endif
+
 using namespace std;
 
 #ifdef UNICODE
@@ -73,15 +91,14 @@ typedef struct
     bool ExactMatch;
 }   ENUM_INFO, * PENUM_INFO;
 
-VirtualFile* g_DiskContext = NULL;
+// files listed by DumpHotFiles
+int g_HotFileCount = 10;
+
+// serve the live counters in /.cbfs, see metrics.h
+bool g_StatsDir = false;
 
 //support routines
-bool FindVirtualFile(const fuse_char* FileName, VirtualFile*& vfile);
-bool FindVirtualDirectory(const fuse_char* FileName, VirtualFile*& vfile);
-bool GetParentVirtualDirectory(const fuse_char* FileName, VirtualFile*& vfile);
-const fuse_char* GetFileName(const fuse_char* fullpath);
-void RemoveAllFiles(VirtualFile* root);
-int64 CalculateFolderSize(VirtualFile* root);
+void DumpHotFiles(FILE* Output);
 
 class MemDriveFUSE : public FUSE
 {
@@ -102,15 +119,48 @@ public: // Events
 
     int FireAccess(FUSEAccessEventParams* e) override
     {
+        OPSTATS_SCOPE("FUSE Access", e->Result, OPSTATS_NEGATIVE_ERROR, -1);
+        PROBE_HANDLER(fuse, access, e->Path, -1, -1, e->Result);
+        WATCHDOG_SCOPE("FUSE Access", e->Path, -1, -1);
+        RECORDER_SCOPE(RECORDER_OP_FUSE_ACCESS, e->Path, NULL, -1, -1, e->Mask, e->Result, NULL);
+
+        return 0;
+    }
+
+    int FireChmod(FUSEChmodEventParams* e) override
+    {
+        PROBE_HANDLER(fuse, chmod, e->Path, -1, -1, e->Result);
+
         return 0;
     }
 
-    int FireChmod(FUSEChmodEventParams* e) override { return 0; }
-    int FireChown(FUSEChownEventParams* e) override { return 0; }
-    int FireCopyFileRange(FUSECopyFileRangeEventParams* e) override { return 0; }
+    int FireChown(FUSEChownEventParams* e) override
+    {
+        PROBE_HANDLER(fuse, chown, e->Path, -1, -1, e->Result);
+
+        return 0;
+    }
+
+    int FireCopyFileRange(FUSECopyFileRangeEventParams* e) override
+    {
+        PROBE_HANDLER(fuse, copyfilerange, e->PathIn, e->OffsetIn, e->Size, e->Result);
+
+        return 0;
+    }
 
     int FireCreate(FUSECreateEventParams* e) override
     {
+        OPSTATS_SCOPE("FUSE Create", e->Result, OPSTATS_NEGATIVE_ERROR, -1);
+        PROBE_HANDLER(fuse, create, e->Path, -1, -1, e->Result);
+        WATCHDOG_SCOPE("FUSE Create", e->Path, -1, -1);
+        RECORDER_SCOPE(RECORDER_OP_FUSE_CREATE, e->Path, NULL, -1, -1, e->Mode, e->Result, NULL);
+
+        if (g_StatsDir && MetricsGetFile(e->Path) != METRICS_NONE)
+        {
+            e->Result = -EACCES;
+            return e->Result;
+        }
+
         VirtualFile* vfile = NULL, * vdir = NULL;
         int64 now;
 #ifdef UNIX
@@ -122,19 +172,31 @@ public: // Events
         GetSystemTimeAsFileTime((LPFILETIME)&now);
 #endif // WIND32
 
-        if (FindVirtualFile(e->Path, vfile))
+        if (!GetParentVirtualDirectory(e->Path, vdir))
         {
-            e->Result = -EEXIST;
+            e->Result = -ENOENT;
             return e->Result;
         }
 
-        if (!GetParentVirtualDirectory(e->Path, vdir))
+        vdir->LockExclusive();
+
+        if (vdir->get_Context()->GetFile(GetFileName(e->Path), vfile))
         {
-            e->Result = -ENOENT;
+            vdir->UnlockExclusive();
+            vdir->Release();
+            e->Result = -EEXIST;
             return e->Result;
         }
 
         vfile = new VirtualFile(GetFileName(e->Path), e->Mode);
+        if (vfile->get_Name() == NULL)
+        {
+            vfile->Release();
+            vdir->UnlockExclusive();
+            vdir->Release();
+            e->Result = -ENOMEM;
+            return e->Result;
+        }
 
         vfile->set_Gid(GetGid());
         vfile->set_Uid(GetUid());
@@ -145,11 +207,16 @@ public: // Events
 
         vdir->AddFile(vfile);
 
+        vdir->UnlockExclusive();
+        vdir->Release();
+
         return 0;
     }
 
     int FireDestroy(FUSEDestroyEventParams* e) override
     {
+        PROBE_HANDLER(fuse, destroy, NULL, -1, -1, e->Result);
+
         return 0;
     }
 
@@ -160,6 +227,11 @@ public: // Events
 
     int FireFAllocate(FUSEFAllocateEventParams* e) override
     {
+        OPSTATS_SCOPE("FUSE FAllocate", e->Result, OPSTATS_NEGATIVE_ERROR, -1);
+        PROBE_HANDLER(fuse, fallocate, e->Path, e->Offset, e->Length, e->Result);
+        WATCHDOG_SCOPE("FUSE FAllocate", e->Path, e->Offset, e->Length);
+        RECORDER_SCOPE(RECORDER_OP_FUSE_FALLOCATE, e->Path, NULL, e->Offset, e->Length, e->Mode, e->Result, NULL);
+
         VirtualFile* vfile = NULL;
 
         if (FindVirtualFile(e->Path, vfile))
@@ -168,25 +240,31 @@ public: // Events
             int flags = e->Mode & (~FALLOC_FL_KEEP_SIZE);
             if (flags != 0) // if we detect unsupported flags in Mode, we deny the request
             {
+                vfile->Release();
                 e->Result = -EOPNOTSUPP;
                 return e->Result;
             }
 
+            vfile->LockExclusive();
+
             int64 fsize = vfile->get_Size();
 
             if (e->Offset + e->Length >= fsize)
             {
                 int64 newSize = e->Offset + e->Length;
-                vfile->set_AllocationSize(newSize);
-
-                // fallocate may be used on non-Windows systems to expand file size
-                // Windows component always sets the FALLOC_FL_KEEP_SIZE flag
-                if ((e->Mode & FALLOC_FL_KEEP_SIZE) != FALLOC_FL_KEEP_SIZE)
+                if (!vfile->set_AllocationSize(newSize))
+                    e->Result = -ENOMEM;
+                else if ((e->Mode & FALLOC_FL_KEEP_SIZE) != FALLOC_FL_KEEP_SIZE)
                 {
+                    // fallocate may be used on non-Windows systems to expand file size
+                    // Windows component always sets the FALLOC_FL_KEEP_SIZE flag
                     if (fsize < newSize)
                         vfile->set_Size(newSize);
                 }
             }
+
+            vfile->UnlockExclusive();
+            vfile->Release();
         }
         else
             e->Result = -ENOENT;
@@ -196,35 +274,60 @@ public: // Events
 
     int FireFlush(FUSEFlushEventParams* e) override
     {
+        OPSTATS_SCOPE("FUSE Flush", e->Result, OPSTATS_NEGATIVE_ERROR, -1);
+        PROBE_HANDLER(fuse, flush, e->Path, -1, -1, e->Result);
+        WATCHDOG_SCOPE("FUSE Flush", e->Path, -1, -1);
+        RECORDER_SCOPE(RECORDER_OP_FUSE_FLUSH, e->Path, NULL, -1, -1, 0, e->Result, NULL);
+
         return 0;
     }
 
     int FireFSync(FUSEFSyncEventParams* e) override
     {
+        OPSTATS_SCOPE("FUSE FSync", e->Result, OPSTATS_NEGATIVE_ERROR, -1);
+        PROBE_HANDLER(fuse, fsync, e->Path, -1, -1, e->Result);
+        WATCHDOG_SCOPE("FUSE FSync", e->Path, -1, -1);
+        RECORDER_SCOPE(RECORDER_OP_FUSE_FSYNC, e->Path, NULL, -1, -1, e->DataSync, e->Result, NULL);
+
         return 0;
     }
 
     int FireGetAttr(FUSEGetAttrEventParams* e) override
     {
+        OPSTATS_SCOPE("FUSE GetAttr", e->Result, OPSTATS_NEGATIVE_ERROR, -1);
+        PROBE_HANDLER(fuse, getattr, e->Path, -1, -1, e->Result);
+        WATCHDOG_SCOPE("FUSE GetAttr", e->Path, -1, -1);
+        RECORDER_SCOPE(RECORDER_OP_FUSE_GETATTR, e->Path, NULL, -1, -1, 0, e->Result, NULL);
+
+        int stats = g_StatsDir ? MetricsGetFile(e->Path) : METRICS_NONE;
+        if (stats != METRICS_NONE)
+        {
+            e->Result = GetStatsAttr(e, stats);
+            return e->Result;
+        }
+
         e->Result = -ENOENT;
 
         VirtualFile* vfile = NULL;
+        VIRTUALFILE_ATTRIBUTES attr;
+        EpochGuard guard;
 
-        if (FindVirtualFile(e->Path, vfile))
+        if (LookupVirtualFile(e->Path, vfile))
         {
+            vfile->GetAttributes(&attr);
             e->Result = 0;
             *(e->pIno) = (int64)vfile;
-            e->Mode = vfile->get_Mode();
-            e->Uid = vfile->get_Uid();
-            e->Gid = vfile->get_Gid();
+            e->Mode = attr.Mode;
+            e->Uid = attr.Uid;
+            e->Gid = attr.Gid;
             e->LinkCount = 1;
             if ((e->Mode & S_IFDIR) != 0)
                 *(e->pSize) = 512;
             else
-                *(e->pSize) = vfile->get_Size();
-            *(e->pCTime) = vfile->get_CreationTime();
-            *(e->pMTime) = vfile->get_LastWriteTime();
-            *(e->pATime) = vfile->get_LastAccessTime();
+                *(e->pSize) = attr.Size;
+            *(e->pCTime) = attr.CreationTime;
+            *(e->pMTime) = attr.LastWriteTime;
+            *(e->pATime) = attr.LastAccessTime;
         }
 
         return e->Result;
@@ -232,11 +335,24 @@ public: // Events
 
     int FireInit(FUSEInitEventParams* e) override
     {
+        PROBE_HANDLER(fuse, init, NULL, -1, -1, e->Result);
+
         return 0;
     }
 
     int FireMkDir(FUSEMkDirEventParams* e) override
     {
+        OPSTATS_SCOPE("FUSE MkDir", e->Result, OPSTATS_NEGATIVE_ERROR, -1);
+        PROBE_HANDLER(fuse, mkdir, e->Path, -1, -1, e->Result);
+        WATCHDOG_SCOPE("FUSE MkDir", e->Path, -1, -1);
+        RECORDER_SCOPE(RECORDER_OP_FUSE_MKDIR, e->Path, NULL, -1, -1, e->Mode, e->Result, NULL);
+
+        if (g_StatsDir && MetricsGetFile(e->Path) != METRICS_NONE)
+        {
+            e->Result = -EACCES;
+            return e->Result;
+        }
+
         VirtualFile* vfile = NULL, * vdir = NULL;
         int64 now;
 #ifdef UNIX
@@ -248,19 +364,31 @@ public: // Events
         GetSystemTimeAsFileTime((LPFILETIME)&now);
 #endif // WIND32
 
-        if (FindVirtualFile(e->Path, vfile))
+        if (!GetParentVirtualDirectory(e->Path, vdir))
         {
-            e->Result = -EEXIST;
+            e->Result = -ENOENT;
             return e->Result;
         }
 
-        if (!GetParentVirtualDirectory(e->Path, vdir))
+        vdir->LockExclusive();
+
+        if (vdir->get_Context()->GetFile(GetFileName(e->Path), vfile))
         {
-            e->Result = -ENOENT;
+            vdir->UnlockExclusive();
+            vdir->Release();
+            e->Result = -EEXIST;
             return e->Result;
         }
 
         vfile = new VirtualFile(GetFileName(e->Path), e->Mode);
+        if (vfile->get_Name() == NULL)
+        {
+            vfile->Release();
+            vdir->UnlockExclusive();
+            vdir->Release();
+            e->Result = -ENOMEM;
+            return e->Result;
+        }
 
         vfile->set_Gid(GetGid());
         vfile->set_Uid(GetUid());
@@ -270,14 +398,37 @@ public: // Events
 
         vdir->AddFile(vfile);
 
+        vdir->UnlockExclusive();
+        vdir->Release();
+
         return 0;
     }
 
     int FireOpen(FUSEOpenEventParams* e) override
     {
+        OPSTATS_SCOPE("FUSE Open", e->Result, OPSTATS_NEGATIVE_ERROR, -1);
+        PROBE_HANDLER(fuse, open, e->Path, -1, -1, e->Result);
+        WATCHDOG_SCOPE("FUSE Open", e->Path, -1, -1);
+        RECORDER_SCOPE(RECORDER_OP_FUSE_OPEN, e->Path, NULL, -1, -1, e->Flags, e->Result, NULL);
+
+        int stats = g_StatsDir ? MetricsGetFile(e->Path) : METRICS_NONE;
+        if (stats != METRICS_NONE)
+        {
+            if (stats < 0)
+                e->Result = stats == METRICS_DIR ? -EISDIR : -ENOENT;
+            else if ((e->Flags & O_ACCMODE) != O_RDONLY)
+                e->Result = -EACCES;
+            else
+                e->DirectIO = TRUE; // the size changes with every rendering
+            return e->Result;
+        }
+
         VirtualFile* vfile;
         if (FindVirtualFile(e->Path, vfile))
+        {
+            vfile->Release();
             return 0;
+        }
         else
             e->Result = -ENOENT;
         return e->Result;
@@ -285,13 +436,29 @@ public: // Events
 
     int FireRead(FUSEReadEventParams* e) override
     {
-        int BytesRead;
+        OPSTATS_SCOPE("FUSE Read", e->Result, OPSTATS_NEGATIVE_ERROR, e->Size);
+        PROBE_HANDLER(fuse, read, e->Path, e->Offset, e->Size, e->Result);
+        WATCHDOG_SCOPE("FUSE Read", e->Path, e->Offset, e->Size);
+        RECORDER_SCOPE(RECORDER_OP_FUSE_READ, e->Path, NULL, e->Offset, e->Size, 0, e->Result, NULL);
+
+        int stats = g_StatsDir ? MetricsGetFile(e->Path) : METRICS_NONE;
+        if (stats != METRICS_NONE)
+        {
+            e->Result = ReadStatsFile(e, stats);
+            return e->Result < 0 ? e->Result : 0;
+        }
+
+        int64 BytesRead;
         VirtualFile* vfile;
 
         if (FindVirtualFile(e->Path, vfile))
         {
-            vfile->Read((void*)e->Buffer, e->Offset, (int)e->Size, &BytesRead);
-            e->Result = BytesRead;
+            // Result is an int, a larger request is served in part
+            vfile->LockShared();
+            vfile->Read((void*)e->Buffer, e->Offset, e->Size < INT_MAX ? e->Size : INT_MAX, &BytesRead);
+            vfile->UnlockShared();
+            vfile->Release();
+            e->Result = (int)BytesRead;
             return 0;
         }
         else
@@ -301,17 +468,35 @@ public: // Events
 
     int FireReadDir(FUSEReadDirEventParams* e) override
     {
-        VirtualFile* vdir = NULL, * vfile = NULL;
+        OPSTATS_SCOPE("FUSE ReadDir", e->Result, OPSTATS_NEGATIVE_ERROR, -1);
+        PROBE_HANDLER(fuse, readdir, e->Path, -1, -1, e->Result);
+        WATCHDOG_SCOPE("FUSE ReadDir", e->Path, -1, -1);
+        RECORDER_SCOPE(RECORDER_OP_FUSE_READDIR, e->Path, NULL, -1, -1, 0, e->Result, NULL);
+
+        int stats = g_StatsDir ? MetricsGetFile(e->Path) : METRICS_NONE;
+        if (stats != METRICS_NONE)
+        {
+            if (stats == METRICS_DIR)
+                ListStatsDir(e);
+            else
+                e->Result = stats == METRICS_NO_FILE ? -ENOENT : -ENOTDIR;
+            return 0;
+        }
 
-        if (FindVirtualDirectory(e->Path, vdir))
+        VirtualFile* vdir = NULL;
+        std::vector<VIRTUALFILE_ENTRY> entries;
+        EpochGuard guard;
+
+        if (LookupVirtualFile(e->Path, vdir) && (vdir->get_Mode() & S_IFDIR) != 0)
         {
-            for (int i = 0; i < vdir->get_Context()->GetCount(); i++)
+            vdir->get_Context()->GetEntries(entries);
+            for (size_t i = 0; i < entries.size(); i++)
             {
-                vdir->get_Context()->GetFile(i, vfile);
-                FillDir(e->FillerContext, vfile->get_Name(), 0,
-                    vfile->get_Mode(), vfile->get_Uid(), vfile->get_Gid(), 1,
-                    vfile->get_Size(), vfile->get_LastAccessTime(),
-                    vfile->get_LastWriteTime(), vfile->get_CreationTime());
+                VIRTUALFILE_ATTRIBUTES& attr = entries[i].Attributes;
+                FillDir(e->FillerContext, entries[i].Name, 0,
+                    attr.Mode, attr.Uid, attr.Gid, 1,
+                    attr.Size, attr.LastAccessTime,
+                    attr.LastWriteTime, attr.CreationTime);
             }
         }
         else
@@ -322,60 +507,147 @@ public: // Events
 
     int FireRelease(FUSEReleaseEventParams* e) override
     {
+        OPSTATS_SCOPE("FUSE Release", e->Result, OPSTATS_NEGATIVE_ERROR, -1);
+        PROBE_HANDLER(fuse, release, e->Path, -1, -1, e->Result);
+        WATCHDOG_SCOPE("FUSE Release", e->Path, -1, -1);
+        RECORDER_SCOPE(RECORDER_OP_FUSE_RELEASE, e->Path, NULL, -1, -1, e->Flags, e->Result, NULL);
+
         return 0;
     }
 
     int FireRename(FUSERenameEventParams* e) override
     {
-        VirtualFile* voldfile = NULL, * vnewfile = NULL, * vnewparent = NULL;
+        OPSTATS_SCOPE("FUSE Rename", e->Result, OPSTATS_NEGATIVE_ERROR, -1);
+        PROBE_HANDLER(fuse, rename, e->OldPath, -1, -1, e->Result);
+        WATCHDOG_SCOPE("FUSE Rename", e->OldPath, -1, -1);
+        RECORDER_SCOPE(RECORDER_OP_FUSE_RENAME, e->OldPath, e->NewPath, -1, -1, e->Flags, e->Result, NULL);
 
-        if (FindVirtualFile(e->OldPath, voldfile))
+        if (g_StatsDir && (MetricsGetFile(e->OldPath) != METRICS_NONE || MetricsGetFile(e->NewPath) != METRICS_NONE))
         {
-            if (FindVirtualFile(e->NewPath, vnewfile))
+            e->Result = -EACCES;
+            return e->Result;
+        }
+
+        VirtualFile* voldfile = NULL, * vnewfile = NULL, * voldparent = NULL, * vnewparent = NULL;
+
+        if (!GetParentVirtualDirectory(e->OldPath, voldparent))
+        {
+            e->Result = -ENOENT;
+            return e->Result;
+        }
+
+        if (!GetParentVirtualDirectory(e->NewPath, vnewparent))
+        {
+            voldparent->Release();
+            e->Result = -ENOENT;
+            return e->Result;
+        }
+
+        VirtualFile::LockRename(voldparent, vnewparent);
+
+        if (!voldparent->get_Context()->GetFile(GetFileName(e->OldPath), voldfile))
+            e->Result = -ENOENT;
+        else if (voldfile == vnewparent || voldfile->IsAncestorOf(vnewparent))
+            e->Result = -EINVAL;
+        else
+        {
+            if (vnewparent->get_Context()->GetFile(GetFileName(e->NewPath), vnewfile) && vnewfile != voldfile)
             {
-                if (e->Flags == 0)
+                if (e->Flags != 0)
+                    e->Result = -EEXIST;
+                else if ((vnewfile->get_Mode() & S_IFDIR) != 0)
                 {
-                    vnewfile->Remove();
-                    delete vnewfile;
+                    // an ancestor of the source is never empty, and it must not be locked after its descendant
+                    if (vnewfile == voldparent || vnewfile->IsAncestorOf(voldparent))
+                        e->Result = -ENOTEMPTY;
+                    else
+                    {
+                        vnewfile->LockShared();
+                        if (!vnewfile->get_Context()->IsEmpty())
+                            e->Result = -ENOTEMPTY;
+                        vnewfile->UnlockShared();
+                    }
                 }
-                else
-                    e->Result = -EEXIST;
             }
-            if (e->Result == 0)
+            if (e->Result == 0 && vnewfile != voldfile)
             {
-                if (GetParentVirtualDirectory(e->NewPath, vnewparent))
+                // the target is replaced only once the new name is allocated
+                voldfile->Remove();
+                if (!voldfile->Rename(GetFileName(e->NewPath)))
                 {
-                    voldfile->Remove();
-                    voldfile->Rename(GetFileName(e->NewPath));
-                    vnewparent->AddFile(voldfile);
+                    voldparent->AddFile(voldfile);
+                    e->Result = -ENOMEM;
                 }
                 else
-                    e->Result = -ENOENT;
+                {
+                    if (vnewfile != NULL)
+                    {
+                        vnewfile->Remove();
+                        vnewfile->Release();
+                    }
+                    vnewparent->AddFile(voldfile);
+                }
             }
         }
-        else
-            e->Result = -ENOENT;
+
+        VirtualFile::UnlockRename(voldparent, vnewparent);
+
+        voldparent->Release();
+        vnewparent->Release();
 
         return e->Result;
     }
 
     int FireRmDir(FUSERmDirEventParams* e) override
     {
-        VirtualFile* vfile = NULL;
+        OPSTATS_SCOPE("FUSE RmDir", e->Result, OPSTATS_NEGATIVE_ERROR, -1);
+        PROBE_HANDLER(fuse, rmdir, e->Path, -1, -1, e->Result);
+        WATCHDOG_SCOPE("FUSE RmDir", e->Path, -1, -1);
+        RECORDER_SCOPE(RECORDER_OP_FUSE_RMDIR, e->Path, NULL, -1, -1, 0, e->Result, NULL);
 
-        if (FindVirtualFile(e->Path, vfile))
+        VirtualFile* vfile = NULL, * vdir = NULL;
+
+        if (!GetParentVirtualDirectory(e->Path, vdir))
         {
-            vfile->Remove();
-            delete vfile;
+            e->Result = -ENOENT;
+            return e->Result;
+        }
+
+        vdir->LockExclusive();
+
+        if (vdir->get_Context()->GetFile(GetFileName(e->Path), vfile))
+        {
+            vfile->LockShared();
+            bool directory = (vfile->get_Mode() & S_IFDIR) != 0;
+            bool empty = vfile->get_Context()->IsEmpty();
+            vfile->UnlockShared();
+
+            if (!directory)
+                e->Result = -ENOTDIR;
+            else if (!empty)
+                e->Result = -ENOTEMPTY;
+            else
+            {
+                vfile->Remove();
+                vfile->Release();
+            }
         }
         else
             e->Result = -ENOENT;
 
+        vdir->UnlockExclusive();
+        vdir->Release();
+
         return e->Result;
     }
 
     int FireStatFS(FUSEStatFSEventParams* e) override
     {
+        OPSTATS_SCOPE("FUSE StatFS", e->Result, OPSTATS_NEGATIVE_ERROR, -1);
+        PROBE_HANDLER(fuse, statfs, e->Path, -1, -1, e->Result);
+        WATCHDOG_SCOPE("FUSE StatFS", e->Path, -1, -1);
+        RECORDER_SCOPE(RECORDER_OP_FUSE_STATFS, e->Path, NULL, -1, -1, 0, e->Result, NULL);
+
         int SectorSize;
         int64 TotalMemory;
 #ifdef WIN32
@@ -391,19 +663,31 @@ public: // Events
         SectorSize = 512;
 #endif
 
+        // the data bytes are counted as pages and buffers are allocated and
+        // freed, rather than summed over the tree for every call
         * (e->pBlockSize) = GetSectorSize();
         *(e->pTotalBlocks) = TotalMemory / SectorSize;
-        *(e->pFreeBlocks) = *(e->pFreeBlocksAvail) = (TotalMemory - CalculateFolderSize(g_DiskContext) + SectorSize / 2) / SectorSize;
+        *(e->pFreeBlocks) = *(e->pFreeBlocksAvail) = (TotalMemory - VirtualFile::GetPageBytes() + SectorSize / 2) / SectorSize;
 
         return 0;
     }
 
     int FireTruncate(FUSETruncateEventParams* e) override
     {
+        OPSTATS_SCOPE("FUSE Truncate", e->Result, OPSTATS_NEGATIVE_ERROR, -1);
+        PROBE_HANDLER(fuse, truncate, e->Path, -1, e->Size, e->Result);
+        WATCHDOG_SCOPE("FUSE Truncate", e->Path, -1, e->Size);
+        RECORDER_SCOPE(RECORDER_OP_FUSE_TRUNCATE, e->Path, NULL, -1, e->Size, 0, e->Result, NULL);
+
         VirtualFile* vfile = NULL;
 
         if (FindVirtualFile(e->Path, vfile))
+        {
+            vfile->LockExclusive();
             vfile->set_Size(e->Size);
+            vfile->UnlockExclusive();
+            vfile->Release();
+        }
         else
             e->Result = -ENOENT;
 
@@ -412,29 +696,59 @@ public: // Events
 
     int FireUnlink(FUSEUnlinkEventParams* e) override
     {
-        VirtualFile* vfile = NULL;
+        OPSTATS_SCOPE("FUSE Unlink", e->Result, OPSTATS_NEGATIVE_ERROR, -1);
+        PROBE_HANDLER(fuse, unlink, e->Path, -1, -1, e->Result);
+        WATCHDOG_SCOPE("FUSE Unlink", e->Path, -1, -1);
+        RECORDER_SCOPE(RECORDER_OP_FUSE_UNLINK, e->Path, NULL, -1, -1, 0, e->Result, NULL);
 
-        if (FindVirtualFile(e->Path, vfile))
+        VirtualFile* vfile = NULL, * vdir = NULL;
+
+        if (!GetParentVirtualDirectory(e->Path, vdir))
+        {
+            e->Result = -ENOENT;
+            return e->Result;
+        }
+
+        vdir->LockExclusive();
+
+        if (vdir->get_Context()->GetFile(GetFileName(e->Path), vfile))
         {
-            vfile->Remove();
-            delete vfile;
+            // unlink(2) never removes directories
+            if ((vfile->get_Mode() & S_IFDIR) != 0)
+                e->Result = -EISDIR;
+            else
+            {
+                vfile->Remove();
+                vfile->Release();
+            }
         }
         else
             e->Result = -ENOENT;
 
+        vdir->UnlockExclusive();
+        vdir->Release();
+
         return e->Result;
     }
 
     int FireUTime(FUSEUTimeEventParams* e) override
     {
+        OPSTATS_SCOPE("FUSE UTime", e->Result, OPSTATS_NEGATIVE_ERROR, -1);
+        PROBE_HANDLER(fuse, utime, e->Path, -1, -1, e->Result);
+        WATCHDOG_SCOPE("FUSE UTime", e->Path, -1, -1);
+        RECORDER_SCOPE(RECORDER_OP_FUSE_UTIME, e->Path, NULL, e->ATime, e->MTime, 0, e->Result, NULL);
+
         VirtualFile* vfile = NULL;
 
         if (FindVirtualFile(e->Path, vfile))
         {
+            vfile->LockExclusive();
             if (e->ATime != 0)
                 vfile->set_LastAccessTime(e->ATime);
             if (e->MTime != 0)
                 vfile->set_LastWriteTime(e->MTime);
+            vfile->UnlockExclusive();
+            vfile->Release();
         }
         else
             e->Result = -ENOENT;
@@ -444,20 +758,112 @@ public: // Events
 
     int FireWrite(FUSEWriteEventParams* e) override
     {
-        int BytesWritten;
+        OPSTATS_SCOPE("FUSE Write", e->Result, OPSTATS_NEGATIVE_ERROR, e->Size);
+        PROBE_HANDLER(fuse, write, e->Path, e->Offset, e->Size, e->Result);
+        WATCHDOG_SCOPE("FUSE Write", e->Path, e->Offset, e->Size);
+        RECORDER_SCOPE(RECORDER_OP_FUSE_WRITE, e->Path, NULL, e->Offset, e->Size, 0, e->Result, e->Buffer);
+
+        int64 BytesWritten;
         VirtualFile* vfile;
 
         if (FindVirtualFile(e->Path, vfile))
         {
-            vfile->set_AllocationSize(e->Offset + e->Size);
-            vfile->Write((void*)e->Buffer, e->Offset, (int)e->Size, &BytesWritten);
-            e->Result = BytesWritten;
+            // writers of disjoint ranges of the file run in parallel; Result
+            // is an int, a larger request is written in part
+            vfile->LockShared();
+            bool written = vfile->Write((void*)e->Buffer, e->Offset, e->Size < INT_MAX ? e->Size : INT_MAX, &BytesWritten);
+            vfile->UnlockShared();
+            vfile->Release();
+            // a write cut short by a lack of memory reports the part written
+            e->Result = !written && BytesWritten == 0 ? -ENOMEM : (int)BytesWritten;
             return 0;
         }
         else
             e->Result = -ENOENT;
         return e->Result;
     }
+
+private: // the synthetic directory; its nodes are not in the tree
+
+    // vfile addresses never come this low
+    static int64 GetStatsIno(int Stats)
+    {
+        return Stats == METRICS_DIR ? 1 : 2 + Stats;
+    }
+
+    int GetStatsAttr(FUSEGetAttrEventParams* e, int Stats)
+    {
+        int64 now;
+#ifdef UNIX
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        now = UnixTimeToFileTime(tv.tv_sec, tv.tv_usec * 1000);
+#endif // UNIX
+#ifdef WIN32
+        GetSystemTimeAsFileTime((LPFILETIME)&now);
+#endif // WIND32
+
+        if (Stats == METRICS_NO_FILE)
+            return -ENOENT;
+
+        *(e->pIno) = GetStatsIno(Stats);
+        e->Uid = GetUid();
+        e->Gid = GetGid();
+        e->LinkCount = 1;
+        if (Stats == METRICS_DIR)
+        {
+            e->Mode = S_IFDIR | 0555;
+            *(e->pSize) = 512;
+        }
+        else
+        {
+            e->Mode = S_IFREG | 0444;
+            *(e->pSize) = (int64)MetricsGetText(Stats)->size();
+        }
+        *(e->pCTime) = now;
+        *(e->pMTime) = now;
+        *(e->pATime) = now;
+        return 0;
+    }
+
+    void ListStatsDir(FUSEReadDirEventParams* e)
+    {
+        FUSEGetAttrEventParams attr;
+        int64 ino, size, ctime, mtime, atime;
+        fuse_char name[16];
+
+        memset(&attr, 0, sizeof(attr));
+        attr.pIno = &ino;
+        attr.pSize = &size;
+        attr.pCTime = &ctime;
+        attr.pMTime = &mtime;
+        attr.pATime = &atime;
+        for (int file = 0; file < METRICS_FILES; file++)
+        {
+            size_t len = 0;
+            for (const char* c = g_MetricsFileNames[file]; *c != 0; c++)
+                name[len++] = (fuse_char)*c;
+            name[len] = 0;
+
+            GetStatsAttr(&attr, file);
+            FillDir(e->FillerContext, name, ino,
+                attr.Mode, attr.Uid, attr.Gid, 1,
+                size, atime, mtime, ctime);
+        }
+    }
+
+    // returns the bytes read or a negated error code
+    int ReadStatsFile(FUSEReadEventParams* e, int Stats)
+    {
+        if (Stats < 0)
+            return Stats == METRICS_DIR ? -EISDIR : -ENOENT;
+
+        std::shared_ptr<const std::string> text = MetricsGetText(Stats);
+        if (e->Offset >= (int64)text->size())
+            return 0;
+        int64 count = (int64)text->size() - e->Offset < e->Size ? (int64)text->size() - e->Offset : e->Size;
+        return (int)text->copy((char*)e->Buffer, (size_t)count, (size_t)e->Offset);
+    }
 };
 
 
@@ -498,6 +904,21 @@ void usage(void)
     printf("  -drv {cab_file} - Install drivers from CAB file\n");
 #endif
     printf("  -ps (pid|proc_name) - Add process, permitted to access vault\n");
+    printf("  -serialize - Fire events on a single worker thread\n");
+    printf("  -stats {file} - Collect handler latency histograms and write them to the file\n");
+    printf("  -statsinterval {seconds} - How often the histograms are written (default: 60; SIGUSR1 writes them at once)\n");
+    printf("  -hotfiles {count} - Number of the most read and written files listed with the statistics (default: 10)\n");
+    printf("  -smallfiles {bytes} - Keep files of up to this size in one buffer instead of 64 KB pages (default: 4096, 0 - off)\n");
+    printf("  -hugepages - Take the pages of file data from 2 MB regions backed by transparent huge pages (Linux)\n");
+    printf("  -compact {MB per second} - Move file data out of fragmented regions in the background and return freed memory\n");
+    printf("  -expire {directory} {seconds} - Delete the files below the directory that were not used for this long (repeatable)\n");
+    printf("  -slowops {milliseconds} - Log the operations that run longer (SIGUSR2 lists the operations in flight)\n");
+    printf("  -statsdir - Show live counters in the read-only files of /" METRICS_DIR_NAME "\n");
+    printf("  -record {file} - Record the requests to the file, for replay with fusememdrive_replay\n");
+    printf("  -recorddata - Record the data of writes as well\n");
+#ifdef UNIX
+    printf("  -metrics {socket} - Serve the counters in Prometheus format over HTTP on a Unix domain socket\n");
+#endif
     printf("  -- Stop switches scanning\n\n");
     printf("Example: fusememdrive Y:\n\n");
 }
@@ -673,6 +1094,8 @@ cbt_string ConvertRelativePathToAbsolute(const cbt_string& path, bool acceptMoun
     return path;
 }
 
+// the stand-in build (standin/fuse.h) brings its own main, see standin.cpp
+#ifndef CBFS_STANDIN
 int main(int argc, char* argv[]) {
 #ifndef WIN32
     struct pollfd cinfd[1];
@@ -683,7 +1106,15 @@ int main(int argc, char* argv[]) {
 #endif
     const fuse_char* mount_point = NULL;
     fuse_char* opt_proc_name = NULL;
-    int argi, arg_len, stop_opt = 0, mounted = 0, opt_pid = 0;
+    int argi, arg_len, stop_opt = 0, mounted = 0, opt_pid = 0, opt_serialize = 0;
+    const char* opt_stats_file = NULL;
+    int opt_stats_interval = 60;
+    const char* opt_metrics_socket = NULL;
+    int opt_slow_ms = 0;
+    int opt_compact_rate = 0;
+    int opt_expire = 0;
+    const char* opt_record_file = NULL;
+    int opt_record_data = 0;
 
     banner();
     if (argc < 2) {
@@ -715,6 +1146,76 @@ int main(int argc, char* argv[]) {
                                 opt_proc_name = argv[argi];
                         }
                     }
+                    else if (optcmp(argv[argi], (char*)"-serialize"))
+                        opt_serialize = 1;
+                    else if (optcmp(argv[argi], (char*)"-stats"))
+                    {
+                        argi++;
+                        if (argi < argc)
+                            opt_stats_file = argv[argi];
+                    }
+                    else if (optcmp(argv[argi], (char*)"-statsinterval"))
+                    {
+                        argi++;
+                        if (argi < argc)
+                            opt_stats_interval = atoi(argv[argi]);
+                    }
+                    else if (optcmp(argv[argi], (char*)"-hotfiles"))
+                    {
+                        argi++;
+                        if (argi < argc)
+                            g_HotFileCount = atoi(argv[argi]);
+                    }
+                    else if (optcmp(argv[argi], (char*)"-smallfiles"))
+                    {
+                        argi++;
+                        if (argi < argc)
+                            VirtualFile::SetSmallFileLimit(atoi(argv[argi]));
+                    }
+                    else if (optcmp(argv[argi], (char*)"-hugepages"))
+                    {
+                        if (!VirtualFile::SetDataArena(true))
+                            printf("Huge pages are not available, file data is kept on the heap\n");
+                    }
+                    else if (optcmp(argv[argi], (char*)"-compact"))
+                    {
+                        argi++;
+                        if (argi < argc)
+                            opt_compact_rate = atoi(argv[argi]);
+                    }
+                    else if (optcmp(argv[argi], (char*)"-expire"))
+                    {
+                        argi += 2;
+                        if (argi < argc)
+                        {
+                            VirtualFile::SetExpiryPolicy(argv[argi - 1], atoi(argv[argi]));
+                            opt_expire = 1;
+                        }
+                    }
+                    else if (optcmp(argv[argi], (char*)"-slowops"))
+                    {
+                        argi++;
+                        if (argi < argc)
+                            opt_slow_ms = atoi(argv[argi]);
+                    }
+                    else if (optcmp(argv[argi], (char*)"-statsdir"))
+                        g_StatsDir = true;
+                    else if (optcmp(argv[argi], (char*)"-record"))
+                    {
+                        argi++;
+                        if (argi < argc)
+                            opt_record_file = argv[argi];
+                    }
+                    else if (optcmp(argv[argi], (char*)"-recorddata"))
+                        opt_record_data = 1;
+#ifdef UNIX
+                    else if (optcmp(argv[argi], (char*)"-metrics"))
+                    {
+                        argi++;
+                        if (argi < argc)
+                            opt_metrics_socket = argv[argi];
+                    }
+#endif
 #ifdef WIN32
                     else if (optcmp(argv[argi], (char*)"-drv")) {
                         argi++;
@@ -763,6 +1264,10 @@ int main(int argc, char* argv[]) {
 
                 //cbfs_fuse.Config("LinuxFUSEParams=-d");
 
+                // the tree is safe for concurrent access, so events are fired
+                // on multiple worker threads unless -serialize is given
+                cbfs_fuse.SetSerializeEvents(opt_serialize ? TRUE : FALSE);
+
                 if (NULL == g_DiskContext)
                     g_DiskContext = new VirtualFile(TEXT("/"), S_IFDIR);
 
@@ -787,9 +1292,33 @@ int main(int argc, char* argv[]) {
                   cbfs_fuse.AddGrantedProcess(opt_proc_name, 0, TRUE, cbcConstants::STG_DACCESS_READWRITE);
                 }
 
+                if (opt_stats_file != NULL)
+                {
+                    OpStatsSetDumpHook(DumpHotFiles);
+                    OpStatsStart(opt_stats_file, opt_stats_interval);
+                }
+                if (g_StatsDir || opt_metrics_socket != NULL)
+                    OpStatsEnable();
+                if (opt_metrics_socket != NULL && !MetricsStart(opt_metrics_socket))
+                    fprintf(stderr, "Error: cannot serve the metrics on %s\n", opt_metrics_socket);
+                if (opt_slow_ms > 0)
+                    WatchdogStart(opt_slow_ms, NULL);
+                if (opt_compact_rate > 0)
+                    CompactorStart(opt_compact_rate);
+                if (opt_expire)
+                    SweeperStart();
+                if (opt_record_file != NULL && !RecorderStart(opt_record_file, opt_record_data != 0))
+                    fprintf(stderr, "Error: cannot record to %s\n", opt_record_file);
+
                 retVal = cbfs_fuse.Mount(mount_point);
                 if (0 != retVal) {
                     fprintf(stderr, "Error: %s", cbfs_fuse.GetLastError());
+                    RecorderStop();
+                    CompactorStop();
+                    SweeperStop();
+                    WatchdogStop();
+                    MetricsStop();
+                    OpStatsStop();
                     return retVal;
                 }
                 else
@@ -828,138 +1357,100 @@ int main(int argc, char* argv[]) {
 #endif
     }
 
+    RecorderStop();
+    CompactorStop();
+    SweeperStop();
+    WatchdogStop();
+    MetricsStop();
+    OpStatsStop();
+    DeleteDiskContext();
     return 0;
 }
+#endif //#ifndef CBFS_STANDIN
 
 //-----------------------------------------------------------------------------------------------------------
 
-bool FindVirtualFile(const fuse_char* FileName, VirtualFile*& vfile)
-{
-    assert(FileName);
-
-    bool result = true;
-
-    VirtualFile* root = g_DiskContext;
-
-    fuse_char* buffer = (fuse_char*)malloc((fuse_slen(FileName) + 1) * sizeof(fuse_char));
-
-    assert(buffer);
-
-    fuse_scpy(buffer, FileName);
-
-    fuse_char* token = fuse_stok(buffer, TEXT("/"));
-
-    vfile = root;
-
-    while (token != NULL)
-    {
-        if (fuse_scmp(vfile->get_Name(), token) == 0)
-        {
-            root = vfile;
-            break;
-        }
-        else if (result = root->get_Context()->GetFile(token, vfile))
-            root = vfile;
-        token = fuse_stok(NULL, TEXT("/"));
-    }
-    free(buffer);
-
-    return result;
-}
-
-//-----------------------------------------------------------------------------------------------------------
-
-bool GetParentVirtualDirectory(const fuse_char* FileName, VirtualFile*& vfile)
-{
-    assert(FileName);
-
-    const fuse_char* result = GetFileName(FileName);
-
-    fuse_char* buffer = (fuse_char*)malloc((result - FileName + 1) * sizeof(fuse_char));
-
-    memcpy(buffer, FileName, (result - FileName) * sizeof(fuse_char));
-
-    buffer[result - FileName] = 0;
-
-    bool find = FindVirtualFile(buffer, vfile);
-
-    free(buffer);
-
-    return find;
-}
-
-//-----------------------------------------------------------------------------------------------------------
-
-bool FindVirtualDirectory(const fuse_char* FileName, VirtualFile*& vfile)
+typedef struct
 {
-    assert(FileName);
-
-    bool find = false;
-
-    if (FindVirtualFile(FileName, vfile) && ((vfile->get_Mode() & S_IFDIR) != 0))
-        return true;
-    else
-        find = GetParentVirtualDirectory(FileName, vfile);
+    cbt_string Path;
+    VIRTUALFILE_IO_STATS Stats;
+}   HOT_FILE;
 
-    assert(find == true);
-    return find;
-}
-
-
-//-----------------------------------------------------------------------------------------------------------
-const fuse_char* GetFileName(const fuse_char* fullpath)
+static bool IsHotter(const HOT_FILE& File1, const HOT_FILE& File2)
 {
-    assert(fullpath);
-
-    const fuse_char* result = &fullpath[fuse_slen(fullpath)];
+    int64 bytes1 = File1.Stats.ReadBytes + File1.Stats.WriteBytes;
+    int64 bytes2 = File2.Stats.ReadBytes + File2.Stats.WriteBytes;
 
-    while (--result != fullpath)
-    {
-        if (*result == '/')
-            break;
-    }
-    return ++result;
+    if (bytes1 != bytes2)
+        return bytes1 > bytes2;
+    return File1.Stats.ReadOps + File1.Stats.WriteOps > File2.Stats.ReadOps + File2.Stats.WriteOps;
 }
 
-//-----------------------------------------------------------------------------------------------------------
-void RemoveAllFiles(VirtualFile* root)
+static void CollectHotFiles(VirtualFile* root, const cbt_string& RootPath, std::vector<HOT_FILE>& Files)
 {
-    assert(root);
     VirtualFile* vfile;
+    HOT_FILE hot;
 
-    root->get_Context()->ResetEnumeration();
-
-    while (root->get_Context()->GetNextFile(vfile))
+    root->LockShared();
+    for (bool found = root->get_Context()->GetFirstFile(vfile); found; found = root->get_Context()->GetNextFile(vfile))
     {
         if ((vfile->get_Mode() & S_IFDIR) != 0)
-            RemoveAllFiles(vfile);
-        vfile->Remove();
+        {
+            CollectHotFiles(vfile, RootPath + TEXT("/") + vfile->get_Name(), Files);
+            continue;
+        }
+
+        vfile->GetIoStats(&hot.Stats);
+        if (hot.Stats.ReadOps + hot.Stats.WriteOps == 0)
+            continue;
+        hot.Path = RootPath + TEXT("/") + vfile->get_Name();
+        Files.push_back(hot);
 
-        delete vfile;
+        // keep the list short on large trees
+        if (Files.size() >= 2 * (size_t)g_HotFileCount)
+        {
+            std::nth_element(Files.begin(), Files.begin() + g_HotFileCount - 1, Files.end(), IsHotter);
+            Files.resize(g_HotFileCount);
+        }
     }
+    root->UnlockShared();
 }
 
-//-----------------------------------------------------------------------------------------------------------
-
-int64 CalculateFolderSize(VirtualFile* root)
+void DumpHotFiles(FILE* Output)
 {
-    if (root == NULL)
-        return 0;
-    VirtualFile* vfile;
-    int64 DiskSize = 0;
-    int Index = 0;
-
-    while (root->get_Context()->GetFile(Index++, vfile))
+    static const char* patterns[] = { "-", "sequential", "strided", "random" };
+    std::vector<HOT_FILE> files;
+    int64 now = (int64)time(NULL);
+
+    if (g_HotFileCount <= 0 || g_DiskContext == NULL)
+        return;
+
+    VirtualFile::FlushIoStats();
+    CollectHotFiles(g_DiskContext, cbt_string(), files);
+    std::sort(files.begin(), files.end(), IsHotter);
+    if (files.size() > (size_t)g_HotFileCount)
+        files.resize(g_HotFileCount);
+
+    fprintf(Output, "# hottest files by bytes read and written\n");
+    fprintf(Output, "%10s %14s %10s %14s %-10s %5s %5s %5s %8s  %s\n",
+        "reads", "read bytes", "writes", "write bytes", "pattern", "seq%", "str%", "rnd%", "idle s", "path");
+    for (size_t i = 0; i < files.size(); i++)
     {
-        if ((vfile->get_Mode() & S_IFDIR) != 0)
-            DiskSize += CalculateFolderSize(vfile);
-        DiskSize += (vfile->get_AllocationSize() + cbfs_fuse.GetSectorSize() - 1) & ~(cbfs_fuse.GetSectorSize() - 1);
-    }
-    return DiskSize;
-}
+        const VIRTUALFILE_IO_STATS* st = &files[i].Stats;
+        int64 ops = st->SequentialOps + st->StridedOps + st->RandomOps;
 
- 
- 
- 
- 
+        // the counters are read while other threads flush their batches, so
+        // a file may show accesses but no pattern yet; it shows 0% then
+        if (ops == 0)
+            ops = 1;
 
+#ifdef UNICODE
+        fprintf(Output, "%10lld %14lld %10lld %14lld %-10s %5d %5d %5d %8lld  %ls\n",
+#else
+        fprintf(Output, "%10lld %14lld %10lld %14lld %-10s %5d %5d %5d %8lld  %s\n",
+#endif
+            (long long)st->ReadOps, (long long)st->ReadBytes, (long long)st->WriteOps, (long long)st->WriteBytes,
+            patterns[st->Pattern], (int)(st->SequentialOps * 100 / ops), (int)(st->StridedOps * 100 / ops),
+            (int)(st->RandomOps * 100 / ops), (long long)(now - st->LastAccess), files[i].Path.c_str());
+    }
+}
@@ -0,0 +1,69 @@
+#if !defined _METRICS_H
+#define _METRICS_H
+
+#include <memory>
+#include <string>
+
+// Live counters of the drive, for the synthetic directory and the exporter.
+//
+// The texts are rendered from the merged handler histograms (opstats.h) and
+// the global counters of VirtualFile; rendering never touches the file tree
+// or its locks. A rendering is kept for a second, so the size reported by
+// GetAttr matches the reads that follow, and a busy reader does not merge
+// the histograms on every request.
+//
+// The synthetic directory is not a node of the tree: the samples recognize
+// its paths by MetricsGetFile before any lookup and do not list it in the
+// root directory.
+
+#define METRICS_DIR_NAME        ".cbfs"
+
+#define METRICS_FILE_STATS      0   // a table for people
+#define METRICS_FILE_PROMETHEUS 1   // Prometheus text exposition format
+#define METRICS_FILES           2
+
+// what MetricsGetFile returns for paths that are not one of the files
+#define METRICS_NONE            -1  // not in the synthetic directory
+#define METRICS_DIR             -2  // the directory itself
+#define METRICS_NO_FILE         -3  // in the directory, but no such file
+
+extern const char* const g_MetricsFileNames[METRICS_FILES];
+
+// classifies an absolute path by comparing its characters; the path is
+// not looked up
+template <typename CharType>
+int MetricsGetFile(const CharType* Path)
+{
+    const char* name = "/" METRICS_DIR_NAME;
+
+    for (; *name != 0; name++, Path++)
+    {
+        if (*Path != (CharType)*name)
+            return METRICS_NONE;
+    }
+    if (*Path == 0)
+        return METRICS_DIR;
+    if (*Path++ != (CharType)'/')
+        return METRICS_NONE;
+
+    for (int file = 0; file < METRICS_FILES; file++)
+    {
+        const CharType* p = Path;
+        for (name = g_MetricsFileNames[file]; *name != 0 && *p == (CharType)*name; name++, p++)
+            ;
+        if (*name == 0 && *p == 0)
+            return file;
+    }
+    return METRICS_NO_FILE;
+}
+
+// the text of a file; it stays valid while the pointer is held
+std::shared_ptr<const std::string> MetricsGetText(int File);
+
+// serves the Prometheus text over HTTP on a Unix domain socket; returns
+// false if the socket cannot be created or the platform has none
+bool MetricsStart(const char* SocketPath);
+
+void MetricsStop(void);
+
+#endif //#if !defined _METRICS_H
@@ -0,0 +1,133 @@
+#if !defined _OPSTATS_H
+#define _OPSTATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+// Latency histograms of the event handlers.
+//
+// Every handler opens an OPSTATS_SCOPE; when it returns, the elapsed time
+// is added to a log-linear histogram (8 sub-buckets per power of two, about
+// 12% precision) of the calling thread, keyed by the operation, by the
+// outcome (success or the error code) and, for reads and writes, by the
+// request size. Threads never share counters; a dump merges the shards.
+//
+// Recording is off until OpStatsStart is called. The dump is written every
+// IntervalSeconds and, on Linux and macOS, whenever SIGUSR1 is received.
+//
+// Built with -DOPSTATS_ALLOCS, the allocations made while a handler runs
+// are counted as well and the dump lists the calls and bytes per operation.
+// With glibc malloc, calloc and realloc are replaced, so every allocation
+// of the process is seen; elsewhere only operator new is replaced and the
+// direct malloc calls are missed. Without the flag nothing is replaced.
+
+#define OPSTATS_MAX_OPS         64
+#define OPSTATS_MAX_ERRORS      8   // distinct error codes per operation, the rest are merged
+#define OPSTATS_SIZE_BUCKETS    5   // no size, <= 4K, <= 64K, <= 1M, larger
+#define OPSTATS_BUCKETS         328 // up to 2^43 ns, about two hours
+
+// totals of an operation over all outcomes and sizes
+typedef struct
+{
+    const char* Name;
+    uint64_t Count;
+    uint64_t Errors;
+    double SumUs;
+    double P50Us;
+    double P90Us;
+    double P99Us;
+    double MaxUs;
+}   OPSTATS_SUMMARY;
+
+// how the Result of a handler tells an error
+#define OPSTATS_NONZERO_ERROR   0   // NFS and CBFS: 0 or an error code
+#define OPSTATS_NEGATIVE_ERROR  1   // FUSE: a negated errno, or a byte count
+
+extern std::atomic<bool> g_OpStatsEnabled;
+
+#ifdef OPSTATS_ALLOCS
+// allocations of the calling thread since it started
+extern thread_local uint64_t g_OpStatsAllocCount;
+extern thread_local uint64_t g_OpStatsAllocBytes;
+#endif
+
+// returns the index of the operation, registering a name twice returns the same index
+int OpStatsRegister(const char* Name);
+
+// ErrorCode is 0 for success, Size is -1 for operations without a size
+void OpStatsRecord(int Op, int ErrorCode, int64_t Size, uint64_t Nanoseconds, uint64_t Allocs, uint64_t AllocBytes);
+
+void OpStatsDump(FILE* Output);
+
+// one entry per registered operation, in the order of registration
+void OpStatsSummarize(std::vector<OPSTATS_SUMMARY>& Summary);
+
+// Hook is called at the end of every dump to add the sections of the sample
+void OpStatsSetDumpHook(void (*Hook)(FILE* Output));
+
+// Path may be NULL to dump to stderr
+void OpStatsStart(const char* Path, int IntervalSeconds);
+
+// writes a last dump
+void OpStatsStop(void);
+
+// starts recording without the periodic dump, for OpStatsSummarize
+void OpStatsEnable(void);
+
+class OpTimer
+{
+public:
+    OpTimer(int Op, const int* Result, int ResultKind, int64_t Size)
+        : mOp(Op), mResult(Result), mResultKind(ResultKind), mSize(Size)
+        , mEnabled(g_OpStatsEnabled.load(std::memory_order_relaxed))
+    {
+        if (!mEnabled)
+            return;
+#ifdef OPSTATS_ALLOCS
+        mAllocCount = g_OpStatsAllocCount;
+        mAllocBytes = g_OpStatsAllocBytes;
+#endif
+        mStart = std::chrono::steady_clock::now();
+    }
+
+    ~OpTimer()
+    {
+        if (!mEnabled)
+            return;
+
+        uint64_t ns = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - mStart).count();
+        uint64_t allocs = 0, bytes = 0;
+        int code = *mResult;
+#ifdef OPSTATS_ALLOCS
+        allocs = g_OpStatsAllocCount - mAllocCount;
+        bytes = g_OpStatsAllocBytes - mAllocBytes;
+#endif
+        if (mResultKind == OPSTATS_NEGATIVE_ERROR)
+            code = code < 0 ? -code : 0;
+        OpStatsRecord(mOp, code, mSize, ns, allocs, bytes);
+    }
+
+private:
+    OpTimer(const OpTimer&);
+    OpTimer& operator=(const OpTimer&);
+
+    int mOp;
+    const int* mResult;
+    int mResultKind;
+    int64_t mSize;
+    bool mEnabled;
+    std::chrono::steady_clock::time_point mStart;
+#ifdef OPSTATS_ALLOCS
+    uint64_t mAllocCount;
+    uint64_t mAllocBytes;
+#endif
+};
+
+#define OPSTATS_SCOPE(Name, Result, ResultKind, Size) \
+    static const int opstats_op = OpStatsRegister(Name); \
+    OpTimer opstats_timer(opstats_op, &(Result), ResultKind, Size)
+
+#endif //#if !defined _OPSTATS_H
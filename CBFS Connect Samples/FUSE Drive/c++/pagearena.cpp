@@ -0,0 +1,256 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef UNIX
+#include <sys/mman.h>
+#endif
+
+#include "pagearena.h"
+
+#if defined UNIX && defined MADV_HUGEPAGE
+#define PAGEARENA_SUPPORTED
+#endif
+
+#ifdef PAGEARENA_SUPPORTED
+static bool HugePagesEnabled(void)
+{
+    // "always [madvise] never", the advice is only ignored with never
+    FILE* file = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+    char line[128];
+    bool enabled = false;
+
+    if (file == NULL)
+        return false;
+    if (fgets(line, sizeof(line), file) != NULL)
+        enabled = strstr(line, "[never]") == NULL;
+    fclose(file);
+    return enabled;
+}
+#endif
+
+PageArena::PageArena(size_t PageSize)
+    :mPageSize(PageSize)
+    ,mPagesPerRegion((int)(PAGEARENA_REGION_SIZE / PageSize))
+    ,mAvailable(false)
+    ,mDraining(NULL)
+    ,mUsed(0)
+    ,mResident(0)
+    ,mAllocations(0)
+    ,mFallbacks(0)
+    ,mCompactions(0)
+    ,mReleased(0)
+{
+    assert(PageSize >= sizeof(void*) && PAGEARENA_REGION_SIZE % PageSize == 0);
+#ifdef PAGEARENA_SUPPORTED
+    mAvailable = HugePagesEnabled();
+#endif
+}
+
+PageArena::PAGEARENA_REGION* PageArena::Reserve(void)
+{
+    // mLock must be held
+#ifdef PAGEARENA_SUPPORTED
+    // twice the size, so that an aligned region fits in it; the rest goes back
+    size_t size = 2 * (size_t)PAGEARENA_REGION_SIZE;
+    char* block = (char*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (block == (char*)MAP_FAILED)
+        return NULL;
+
+    char* base = (char*)(((uintptr_t)block + PAGEARENA_REGION_SIZE - 1) & ~(uintptr_t)(PAGEARENA_REGION_SIZE - 1));
+    char* end = base + PAGEARENA_REGION_SIZE;
+    if (base > block)
+        munmap(block, (size_t)(base - block));
+    if (block + size > end)
+        munmap(end, (size_t)(block + size - end));
+
+    // a kernel without huge pages refuses the advice, the heap serves from now on
+    if (madvise(base, PAGEARENA_REGION_SIZE, MADV_HUGEPAGE) != 0)
+    {
+        munmap(base, PAGEARENA_REGION_SIZE);
+        mAvailable = false;
+        return NULL;
+    }
+
+    PAGEARENA_REGION* region = new PAGEARENA_REGION;
+    region->Base = base;
+    region->Free = NULL;
+    region->Used = 0;
+    region->Fresh = 0;
+    region->Draining = false;
+    region->Owners = new PAGEARENA_OWNER[mPagesPerRegion];
+    mRegions[base] = region;
+    return region;
+#else
+    return NULL;
+#endif
+}
+
+void* PageArena::Alloc(void* Owner, int64_t Index)
+{
+    void* page;
+    bool used;
+
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        PAGEARENA_REGION* region = NULL;
+
+        // regions returned to the system are only touched again when the
+        // others are full
+        if (!mPartial.empty())
+            region = mPartial.back();
+        else if (!mEmpty.empty())
+        {
+            region = mEmpty.back();
+            mEmpty.pop_back();
+            mPartial.push_back(region);
+        }
+        else if (mAvailable && (region = Reserve()) != NULL)
+            mPartial.push_back(region);
+        if (region == NULL)
+        {
+            mFallbacks++;
+            return NULL;
+        }
+
+        used = region->Free != NULL;
+        if (used)
+        {
+            page = region->Free;
+            region->Free = *(void**)page;
+        }
+        else
+        {
+            page = region->Base + (size_t)region->Fresh++ * mPageSize;
+            mResident++;
+        }
+        PAGEARENA_OWNER* owner = &region->Owners[((char*)page - region->Base) / mPageSize];
+        owner->Owner = Owner;
+        owner->Index = Index;
+        if (++region->Used == mPagesPerRegion)
+            mPartial.pop_back();
+        mUsed++;
+        mAllocations++;
+    }
+
+    // new pages come zeroed from the kernel, freed ones are cleared
+    if (used)
+        memset(page, 0, mPageSize);
+    return page;
+}
+
+bool PageArena::Free(void* Page)
+{
+    char* base = (char*)((uintptr_t)Page & ~(uintptr_t)(PAGEARENA_REGION_SIZE - 1));
+    std::lock_guard<std::mutex> lock(mLock);
+
+    std::map<char*, PAGEARENA_REGION*>::iterator it = mRegions.find(base);
+    if (it == mRegions.end())
+        return false;
+
+    PAGEARENA_REGION* region = it->second;
+    if (region->Used-- == mPagesPerRegion && !region->Draining)
+        mPartial.push_back(region);
+    region->Owners[((char*)Page - region->Base) / mPageSize].Owner = NULL;
+    *(void**)Page = region->Free;
+    region->Free = Page;
+    mUsed--;
+    return true;
+}
+
+bool PageArena::BeginCompaction(int MaxPages, bool (*Pin)(void* Owner), std::vector<PAGEARENA_PAGE>& Pages)
+{
+    std::lock_guard<std::mutex> lock(mLock);
+    PAGEARENA_REGION* region = NULL;
+    size_t i, victim = 0;
+
+    if (mDraining != NULL)
+        return false;
+
+    // the region that gives back the most memory; a full region has no
+    // holes and is not in mPartial
+    for (i = 0; i < mPartial.size(); i++)
+    {
+        PAGEARENA_REGION* candidate = mPartial[i];
+        if (candidate->Fresh == candidate->Used || candidate->Used > MaxPages)
+            continue;
+        if (region == NULL || candidate->Fresh - candidate->Used > region->Fresh - region->Used)
+        {
+            region = candidate;
+            victim = i;
+        }
+    }
+    if (region == NULL)
+        return false;
+
+    mPartial.erase(mPartial.begin() + victim);
+    region->Draining = true;
+    mDraining = region;
+
+    Pages.clear();
+    for (int page = 0; page < region->Fresh; page++)
+    {
+        PAGEARENA_OWNER* owner = &region->Owners[page];
+        if (owner->Owner == NULL || !Pin(owner->Owner))
+            continue;
+        PAGEARENA_PAGE entry;
+        entry.Page = region->Base + (size_t)page * mPageSize;
+        entry.Owner = owner->Owner;
+        entry.Index = owner->Index;
+        Pages.push_back(entry);
+    }
+    return true;
+}
+
+void PageArena::EndCompaction(void)
+{
+    PAGEARENA_REGION* region;
+
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        region = mDraining;
+        if (region == NULL)
+            return;
+        if (region->Used > 0)
+        {
+            // pages whose owner could not be pinned, or that were not moved
+            region->Draining = false;
+            mDraining = NULL;
+            mPartial.push_back(region);
+            mCompactions++;
+            return;
+        }
+    }
+
+    // nothing is handed out from a draining region and none of its pages is
+    // in use, so the memory is returned without the lock held
+#ifdef PAGEARENA_SUPPORTED
+    madvise(region->Base, PAGEARENA_REGION_SIZE, MADV_DONTNEED);
+#endif
+
+    std::lock_guard<std::mutex> lock(mLock);
+    mResident -= region->Fresh;
+    mReleased += region->Fresh;
+    region->Free = NULL;
+    region->Fresh = 0;
+    region->Draining = false;
+    mDraining = NULL;
+    mEmpty.push_back(region);
+    mCompactions++;
+}
+
+void PageArena::GetStats(PAGEARENA_STATS* Stats)
+{
+    std::lock_guard<std::mutex> lock(mLock);
+
+    Stats->Regions = (int64_t)mRegions.size();
+    Stats->RegionBytes = Stats->Regions * PAGEARENA_REGION_SIZE;
+    Stats->UsedBytes = mUsed * (int64_t)mPageSize;
+    Stats->FreeBytes = Stats->RegionBytes - Stats->UsedBytes;
+    Stats->ResidentBytes = mResident * (int64_t)mPageSize;
+    Stats->Allocations = mAllocations;
+    Stats->Fallbacks = mFallbacks;
+    Stats->Compactions = mCompactions;
+    Stats->ReleasedBytes = mReleased * (int64_t)mPageSize;
+    Stats->Fragmentation = mResident > 0 ? (double)(mResident - mUsed) / mResident : 0;
+    Stats->Available = mAvailable;
+}
@@ -0,0 +1,388 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <wchar.h>
+#include <time.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+#include "recorder.h"
+
+// bytes buffered per thread before they are written to the file
+#define RECORDER_BUFFER_SIZE (64 * 1024)
+
+// bytes kept from a path
+#define RECORDER_PATH_LENGTH 0xFFFF
+
+static_assert(sizeof(RECORDER_HEADER) == 24, "RECORDER_HEADER is part of the file format");
+static_assert(sizeof(RECORDER_RECORD) == 56, "RECORDER_RECORD is part of the file format");
+
+// the owning thread appends under Lock, RecorderStop takes it to write out the rest
+typedef struct _RECORDER_BUFFER
+{
+    std::mutex Lock;
+    size_t Used;
+    std::atomic<bool> InUse;
+    int Id;
+    struct _RECORDER_BUFFER* Next;
+    char Data[RECORDER_BUFFER_SIZE];
+}   RECORDER_BUFFER, * PRECORDER_BUFFER;
+
+std::atomic<bool> g_RecorderEnabled(false);
+
+static std::atomic<PRECORDER_BUFFER> g_RecorderBuffers(NULL);
+static std::atomic<int> g_RecorderBufferCount(0);
+static std::atomic<int64_t> g_RecorderEpoch(0);   // steady clock nanoseconds at RecorderStart
+static std::atomic<bool> g_RecorderWithData(false);
+
+static std::mutex g_RecorderFileLock;
+static FILE* g_RecorderFile = NULL;
+static bool g_RecorderFailed = false;
+
+static const char* g_RecorderOpNames[] =
+{
+    NULL, "FUSE Access", "FUSE Create", "FUSE FAllocate", "FUSE Flush", "FUSE FSync", "FUSE GetAttr",
+    "FUSE MkDir", "FUSE Open", "FUSE Read", "FUSE ReadDir", "FUSE Release", "FUSE Rename", "FUSE RmDir",
+    "FUSE StatFS", "FUSE Truncate", "FUSE Unlink", "FUSE UTime", "FUSE Write"
+};
+
+static const char* g_RecorderNfsOpNames[] =
+{
+    "NFS CreateLink", "NFS GetAttr", "NFS Lookup", "NFS MkDir", "NFS Open", "NFS Read", "NFS ReadDir",
+    "NFS ReadLink", "NFS Rename", "NFS RmDir", "NFS Truncate", "NFS Unlink", "NFS UTime", "NFS Write"
+};
+
+const char* RecorderOpName(int Op)
+{
+    const char* name = NULL;
+
+    if (Op > 0 && Op < (int)(sizeof(g_RecorderOpNames) / sizeof(g_RecorderOpNames[0])))
+        name = g_RecorderOpNames[Op];
+    else if (Op >= RECORDER_OP_NFS_CREATELINK && Op - RECORDER_OP_NFS_CREATELINK < (int)(sizeof(g_RecorderNfsOpNames) / sizeof(g_RecorderNfsOpNames[0])))
+        name = g_RecorderNfsOpNames[Op - RECORDER_OP_NFS_CREATELINK];
+    return name != NULL ? name : "?";
+}
+
+static int64_t GetSteadyTime(void)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int64_t RecorderGetTime(void)
+{
+    return GetSteadyTime() - g_RecorderEpoch.load(std::memory_order_relaxed);
+}
+
+static PRECORDER_BUFFER AcquireBuffer(void)
+{
+    // buffers are never freed, the buffer of a finished thread is reused
+    // together with its number
+    for (PRECORDER_BUFFER buffer = g_RecorderBuffers.load(std::memory_order_acquire); buffer != NULL; buffer = buffer->Next)
+    {
+        bool expected = false;
+        if (!buffer->InUse.load(std::memory_order_relaxed) &&
+            buffer->InUse.compare_exchange_strong(expected, true, std::memory_order_acquire))
+            return buffer;
+    }
+
+    PRECORDER_BUFFER buffer = new RECORDER_BUFFER;
+    buffer->Used = 0;
+    buffer->InUse.store(true, std::memory_order_relaxed);
+    buffer->Id = g_RecorderBufferCount.fetch_add(1, std::memory_order_relaxed) + 1;
+    buffer->Next = g_RecorderBuffers.load(std::memory_order_relaxed);
+    while (!g_RecorderBuffers.compare_exchange_weak(buffer->Next, buffer, std::memory_order_release, std::memory_order_relaxed))
+        ;
+    return buffer;
+}
+
+class RecorderBufferHolder
+{
+public:
+    RecorderBufferHolder() : mBuffer(AcquireBuffer()) {}
+    ~RecorderBufferHolder() { mBuffer->InUse.store(false, std::memory_order_release); }
+    PRECORDER_BUFFER mBuffer;
+};
+
+static PRECORDER_BUFFER GetThreadBuffer(void)
+{
+    static thread_local RecorderBufferHolder holder;
+    return holder.mBuffer;
+}
+
+static void WriteChunk(const char* Data, size_t Size)
+{
+    std::lock_guard<std::mutex> lock(g_RecorderFileLock);
+
+    // the records of handlers that outlive RecorderStop are lost
+    if (g_RecorderFile == NULL || Size == 0)
+        return;
+    if (fwrite(Data, 1, Size, g_RecorderFile) != Size && !g_RecorderFailed)
+    {
+        fprintf(stderr, "Recorder: cannot write the trace, it is incomplete\n");
+        g_RecorderFailed = true;
+    }
+}
+
+// an upper bound of the bytes EncodePath writes
+static size_t GetPathBound(const recorder_char* Path)
+{
+    if (Path == NULL)
+        return 0;
+#ifdef _UNICODE
+    size_t bound = wcslen(Path) * 3;
+#else
+    size_t bound = strlen(Path);
+#endif
+    return bound < RECORDER_PATH_LENGTH ? bound : RECORDER_PATH_LENGTH;
+}
+
+// returns the bytes written to Dest, at most Max
+static size_t EncodePath(char* Dest, const recorder_char* Path, size_t Max)
+{
+    size_t pos = 0;
+
+    if (Path == NULL)
+        return 0;
+#ifdef _UNICODE
+    for (; *Path != 0; Path++)
+    {
+        uint32_t c = (uint32_t)*Path;
+        char bytes[4];
+        size_t count;
+
+        // UTF-16 where wchar_t has two bytes
+        if (c >= 0xD800 && c < 0xDC00 && Path[1] >= 0xDC00 && Path[1] < 0xE000)
+        {
+            c = 0x10000 + ((c - 0xD800) << 10) + ((uint32_t)Path[1] - 0xDC00);
+            Path++;
+        }
+
+        if (c < 0x80)
+        {
+            bytes[0] = (char)c;
+            count = 1;
+        }
+        else if (c < 0x800)
+        {
+            bytes[0] = (char)(0xC0 | (c >> 6));
+            bytes[1] = (char)(0x80 | (c & 0x3F));
+            count = 2;
+        }
+        else if (c < 0x10000)
+        {
+            bytes[0] = (char)(0xE0 | (c >> 12));
+            bytes[1] = (char)(0x80 | ((c >> 6) & 0x3F));
+            bytes[2] = (char)(0x80 | (c & 0x3F));
+            count = 3;
+        }
+        else
+        {
+            bytes[0] = (char)(0xF0 | (c >> 18));
+            bytes[1] = (char)(0x80 | ((c >> 12) & 0x3F));
+            bytes[2] = (char)(0x80 | ((c >> 6) & 0x3F));
+            bytes[3] = (char)(0x80 | (c & 0x3F));
+            count = 4;
+        }
+
+        if (pos + count > Max)
+            break;
+        memcpy(Dest + pos, bytes, count);
+        pos += count;
+    }
+#else
+    pos = strlen(Path);
+    if (pos > Max)
+        pos = Max;
+    memcpy(Dest, Path, pos);
+#endif
+    return pos;
+}
+
+void RecorderWrite(int Op, int64_t Start, int64_t Duration, const recorder_char* Path, const recorder_char* Path2,
+    int64_t Offset, int64_t Length, int32_t Flags, int32_t Result, const void* Data, int64_t DataLength)
+{
+    PRECORDER_BUFFER buffer = GetThreadBuffer();
+    size_t pathBound = GetPathBound(Path);
+    size_t path2Bound = GetPathBound(Path2);
+    size_t dataLength = g_RecorderWithData.load(std::memory_order_relaxed) && Data != NULL && DataLength > 0 ? (size_t)DataLength : 0;
+    size_t bound = sizeof(RECORDER_RECORD) + pathBound + path2Bound + dataLength;
+    std::vector<char> large;
+    RECORDER_RECORD rec;
+    char* out;
+
+    std::lock_guard<std::mutex> lock(buffer->Lock);
+
+    if (buffer->Used + bound > RECORDER_BUFFER_SIZE)
+    {
+        WriteChunk(buffer->Data, buffer->Used);
+        buffer->Used = 0;
+    }
+    // a record that does not fit into a buffer goes out on its own
+    if (bound > RECORDER_BUFFER_SIZE)
+    {
+        large.resize(bound);
+        out = large.data();
+    }
+    else
+        out = buffer->Data + buffer->Used;
+
+    rec.Op = (uint16_t)Op;
+    rec.Thread = (uint16_t)buffer->Id;
+    rec.Time = Start;
+    rec.Duration = Duration;
+    rec.Offset = Offset;
+    rec.Length = Length;
+    rec.Flags = Flags;
+    rec.Result = Result;
+    rec.PathLength = (uint16_t)EncodePath(out + sizeof(rec), Path, pathBound);
+    rec.Path2Length = (uint16_t)EncodePath(out + sizeof(rec) + rec.PathLength, Path2, path2Bound);
+    rec.DataLength = (uint32_t)dataLength;
+    if (dataLength > 0)
+        memcpy(out + sizeof(rec) + rec.PathLength + rec.Path2Length, Data, dataLength);
+    rec.Size = (uint32_t)(sizeof(rec) + rec.PathLength + rec.Path2Length + dataLength);
+
+    // the buffer is not aligned for the record
+    memcpy(out, &rec, sizeof(rec));
+
+    if (bound > RECORDER_BUFFER_SIZE)
+        WriteChunk(out, rec.Size);
+    else
+        buffer->Used += rec.Size;
+}
+
+bool RecorderStart(const char* FileName, bool WithData)
+{
+    RECORDER_HEADER header;
+
+    assert(g_RecorderFile == NULL);
+
+    FILE* file = fopen(FileName, "wb");
+    if (file == NULL)
+        return false;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.Magic, RECORDER_MAGIC, sizeof(RECORDER_MAGIC));
+    header.Version = RECORDER_VERSION;
+    header.Flags = WithData ? RECORDER_WITH_DATA : 0;
+    header.StartTime = (int64_t)time(NULL);
+    if (fwrite(&header, sizeof(header), 1, file) != 1)
+    {
+        fclose(file);
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(g_RecorderFileLock);
+        g_RecorderFile = file;
+        g_RecorderFailed = false;
+    }
+    g_RecorderWithData.store(WithData, std::memory_order_relaxed);
+    g_RecorderEpoch.store(GetSteadyTime(), std::memory_order_relaxed);
+    g_RecorderEnabled.store(true, std::memory_order_release);
+    return true;
+}
+
+void RecorderStop(void)
+{
+    if (!g_RecorderEnabled.load(std::memory_order_relaxed))
+        return;
+
+    g_RecorderEnabled.store(false, std::memory_order_relaxed);
+
+    for (PRECORDER_BUFFER buffer = g_RecorderBuffers.load(std::memory_order_acquire); buffer != NULL; buffer = buffer->Next)
+    {
+        std::lock_guard<std::mutex> lock(buffer->Lock);
+        WriteChunk(buffer->Data, buffer->Used);
+        buffer->Used = 0;
+    }
+
+    std::lock_guard<std::mutex> lock(g_RecorderFileLock);
+    fclose(g_RecorderFile);
+    g_RecorderFile = NULL;
+}
+
+static bool IsEarlier(const RECORDER_ENTRY& Entry1, const RECORDER_ENTRY& Entry2)
+{
+    return Entry1.Record.Time < Entry2.Record.Time;
+}
+
+bool RecorderLoad(const char* FileName, std::vector<char>& File, RECORDER_HEADER* Header,
+    std::vector<RECORDER_ENTRY>& Entries, std::string& Error)
+{
+    FILE* file = fopen(FileName, "rb");
+    char chunk[RECORDER_BUFFER_SIZE];
+    size_t count;
+
+    if (file == NULL)
+    {
+        Error = std::string("cannot open ") + FileName;
+        return false;
+    }
+    File.clear();
+    while ((count = fread(chunk, 1, sizeof(chunk), file)) > 0)
+        File.insert(File.end(), chunk, chunk + count);
+    fclose(file);
+
+    if (File.size() < sizeof(RECORDER_HEADER) || memcmp(File.data(), RECORDER_MAGIC, sizeof(RECORDER_MAGIC)) != 0)
+    {
+        Error = std::string(FileName) + " is not a trace";
+        return false;
+    }
+    memcpy(Header, File.data(), sizeof(RECORDER_HEADER));
+    if (Header->Version != RECORDER_VERSION)
+    {
+        Error = std::string(FileName) + " has an unknown version";
+        return false;
+    }
+
+    Entries.clear();
+    for (size_t pos = sizeof(RECORDER_HEADER); pos + sizeof(RECORDER_RECORD) <= File.size(); )
+    {
+        RECORDER_ENTRY entry;
+        const char* data = File.data() + pos;
+
+        memcpy(&entry.Record, data, sizeof(RECORDER_RECORD));
+        if (entry.Record.Size != sizeof(RECORDER_RECORD) + entry.Record.PathLength + entry.Record.Path2Length + entry.Record.DataLength)
+        {
+            Error = std::string(FileName) + " is damaged";
+            return false;
+        }
+        if (pos + entry.Record.Size > File.size())
+            break;
+
+        data += sizeof(RECORDER_RECORD);
+        entry.Path.assign(data, entry.Record.PathLength);
+        data += entry.Record.PathLength;
+        entry.Path2.assign(data, entry.Record.Path2Length);
+        data += entry.Record.Path2Length;
+        entry.Data = entry.Record.DataLength > 0 ? data : NULL;
+
+        Entries.push_back(entry);
+        pos += entry.Record.Size;
+    }
+
+    // the chunks of different threads are out of order, the records of a thread are not
+    std::stable_sort(Entries.begin(), Entries.end(), IsEarlier);
+    return true;
+}
+
+void RecorderPrint(FILE* Output, const RECORDER_ENTRY& Entry)
+{
+    const RECORDER_RECORD* rec = &Entry.Record;
+
+    fprintf(Output, "%lld.%06lld [%d] %s %s", (long long)(rec->Time / 1000000000), (long long)(rec->Time % 1000000000 / 1000),
+        (int)rec->Thread, RecorderOpName(rec->Op), Entry.Path.c_str());
+    if (rec->Path2Length > 0)
+        fprintf(Output, " -> %s", Entry.Path2.c_str());
+    if (rec->Offset != -1)
+        fprintf(Output, " offset %lld", (long long)rec->Offset);
+    if (rec->Length != -1)
+        fprintf(Output, " length %lld", (long long)rec->Length);
+    if (rec->Flags != 0)
+        fprintf(Output, " flags 0x%x", (unsigned)rec->Flags);
+    fprintf(Output, " = %d, %lld.%03lld us\n", (int)rec->Result, (long long)(rec->Duration / 1000), (long long)(rec->Duration % 1000));
+}
@@ -0,0 +1,185 @@
+#if !defined _RECORDER_H
+#define _RECORDER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+// Recorder of the requests that reach the event handlers.
+//
+// Every handler opens a RECORDER_SCOPE; when it returns, a binary record of
+// the request (operation, paths, offset, size, flags, result, the recording
+// thread, the start time and the duration) is appended to a buffer owned by
+// the calling thread. Full buffers are written to the file as they are,
+// so the records of different threads interleave in chunks; the replayer
+// orders them by start time. Records are never dropped.
+//
+// The data of writes is recorded only when RecorderStart is asked to; a
+// replay of a trace without data writes a fill pattern of the same size.
+//
+// File layout, all integers in the byte order of the recording host:
+//
+//   RECORDER_HEADER
+//   RECORDER_RECORD, Path, Path2, Data    (repeated)
+//
+// Paths are UTF-8 without a terminator; Path2 is the new path of a rename
+// or the name of an NFS lookup.
+
+#define RECORDER_MAGIC      "CBFSREC"
+#define RECORDER_VERSION    1
+
+#define RECORDER_WITH_DATA  1   // RECORDER_HEADER.Flags
+
+typedef struct
+{
+    char Magic[8];              // RECORDER_MAGIC
+    uint32_t Version;
+    uint32_t Flags;
+    int64_t StartTime;          // seconds since 1970 when recording started
+}   RECORDER_HEADER;
+
+typedef struct
+{
+    uint32_t Size;              // of the record, the paths and the data
+    uint16_t Op;                // RECORDER_OP_*
+    uint16_t Thread;            // recording thread, numbered from 1
+    int64_t Time;               // nanoseconds from RecorderStart to the start of the request
+    int64_t Duration;           // nanoseconds the handler ran
+    int64_t Offset;             // -1 if none; the cookie of an NFS ReadDir, the access time of a UTime
+    int64_t Length;             // -1 if none; the size of a truncate, the modification time of a UTime
+    int32_t Flags;              // open flags, create mode, rename flags, NFS open type or stable how
+    int32_t Result;
+    uint16_t PathLength;
+    uint16_t Path2Length;
+    uint32_t DataLength;
+}   RECORDER_RECORD;
+
+// the operations of both FUSE and NFS; the values are part of the file format
+#define RECORDER_OP_FUSE_ACCESS      1
+#define RECORDER_OP_FUSE_CREATE      2
+#define RECORDER_OP_FUSE_FALLOCATE   3
+#define RECORDER_OP_FUSE_FLUSH       4
+#define RECORDER_OP_FUSE_FSYNC       5
+#define RECORDER_OP_FUSE_GETATTR     6
+#define RECORDER_OP_FUSE_MKDIR       7
+#define RECORDER_OP_FUSE_OPEN        8
+#define RECORDER_OP_FUSE_READ        9
+#define RECORDER_OP_FUSE_READDIR     10
+#define RECORDER_OP_FUSE_RELEASE     11
+#define RECORDER_OP_FUSE_RENAME      12
+#define RECORDER_OP_FUSE_RMDIR       13
+#define RECORDER_OP_FUSE_STATFS      14
+#define RECORDER_OP_FUSE_TRUNCATE    15
+#define RECORDER_OP_FUSE_UNLINK      16
+#define RECORDER_OP_FUSE_UTIME       17
+#define RECORDER_OP_FUSE_WRITE       18
+
+#define RECORDER_OP_NFS_CREATELINK   64
+#define RECORDER_OP_NFS_GETATTR      65
+#define RECORDER_OP_NFS_LOOKUP       66
+#define RECORDER_OP_NFS_MKDIR        67
+#define RECORDER_OP_NFS_OPEN         68
+#define RECORDER_OP_NFS_READ         69
+#define RECORDER_OP_NFS_READDIR      70
+#define RECORDER_OP_NFS_READLINK     71
+#define RECORDER_OP_NFS_RENAME       72
+#define RECORDER_OP_NFS_RMDIR        73
+#define RECORDER_OP_NFS_TRUNCATE     74
+#define RECORDER_OP_NFS_UNLINK       75
+#define RECORDER_OP_NFS_UTIME        76
+#define RECORDER_OP_NFS_WRITE        77
+
+#define RECORDER_MAX_OP              128
+
+#ifdef _UNICODE
+typedef wchar_t recorder_char;
+#else
+typedef char recorder_char;
+#endif
+
+extern std::atomic<bool> g_RecorderEnabled;
+
+// the name of an operation, "?" for unknown values
+const char* RecorderOpName(int Op);
+
+void RecorderWrite(int Op, int64_t Start, int64_t Duration, const recorder_char* Path, const recorder_char* Path2,
+    int64_t Offset, int64_t Length, int32_t Flags, int32_t Result, const void* Data, int64_t DataLength);
+
+// nanoseconds since RecorderStart
+int64_t RecorderGetTime(void);
+
+class RecorderScope
+{
+public:
+    // Path and Path2 (may be NULL) and Data (NULL unless written) must stay
+    // valid until the scope is left; Result is read then
+    RecorderScope(int Op, const recorder_char* Path, const recorder_char* Path2, int64_t Offset, int64_t Length,
+        int32_t Flags, const int* Result, const void* Data)
+        : mEnabled(g_RecorderEnabled.load(std::memory_order_relaxed))
+    {
+        if (!mEnabled)
+            return;
+        mOp = Op;
+        mPath = Path;
+        mPath2 = Path2;
+        mOffset = Offset;
+        mLength = Length;
+        mFlags = Flags;
+        mResult = Result;
+        mData = Data;
+        mStart = RecorderGetTime();
+    }
+
+    ~RecorderScope()
+    {
+        if (mEnabled)
+            RecorderWrite(mOp, mStart, RecorderGetTime() - mStart, mPath, mPath2, mOffset, mLength, mFlags, *mResult,
+                mData, mData != NULL ? mLength : 0);
+    }
+
+private:
+    RecorderScope(const RecorderScope&);
+    RecorderScope& operator=(const RecorderScope&);
+
+    bool mEnabled;
+    int mOp;
+    const recorder_char* mPath;
+    const recorder_char* mPath2;
+    int64_t mOffset;
+    int64_t mLength;
+    int32_t mFlags;
+    const int* mResult;
+    const void* mData;
+    int64_t mStart;
+};
+
+#define RECORDER_SCOPE(Op, Path, Path2, Offset, Length, Flags, Result, Data) \
+    RecorderScope recorder_scope(Op, Path, Path2, Offset, Length, Flags, &(Result), Data)
+
+// returns false if the file cannot be created; WithData records the data of writes
+bool RecorderStart(const char* FileName, bool WithData);
+
+// writes out the buffers of all threads and closes the file
+void RecorderStop(void);
+
+// a record of a loaded trace
+typedef struct
+{
+    RECORDER_RECORD Record;
+    std::string Path;
+    std::string Path2;
+    const char* Data;           // in the loaded file, NULL if not recorded
+}   RECORDER_ENTRY;
+
+// reads a trace into File and lists its records in Entries, ordered by start
+// time; returns false with a message in Error if the file is not a trace. A
+// truncated last record, as left by a recording that was killed, is skipped.
+bool RecorderLoad(const char* FileName, std::vector<char>& File, RECORDER_HEADER* Header,
+    std::vector<RECORDER_ENTRY>& Entries, std::string& Error);
+
+// one line per record, for a look at a trace
+void RecorderPrint(FILE* Output, const RECORDER_ENTRY& Entry);
+
+#endif //#if !defined _RECORDER_H
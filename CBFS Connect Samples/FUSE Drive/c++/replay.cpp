@@ -0,0 +1,262 @@
+/*
+ * CBFS Connect 2024 C++ Edition - Sample Project
+ *
+ * This sample project demonstrates the usage of CBFS Connect in a
+ * simple, straightforward way. It is not intended to be a complete
+ * application. Error handling and other checks are simplified for clarity.
+ *
+ * www.callback.com/cbfsconnect
+ *
+ * This code is subject to the terms and conditions specified in the
+ * corresponding product license agreement which outlines the authorized
+ * usage and restrictions.
+ */
+
+// Replays a trace recorded with -record (see recorder.h) against the
+// handlers of MemDriveFUSE, through the stand-in of the FUSE class.
+//
+// The tree starts empty, as it does when the sample mounts. By default the
+// requests of every recorded thread are replayed by a thread of its own at
+// the times they were recorded; -fast replays them as fast as the handlers
+// go, -threads N maps the recorded threads onto N threads (1 replays the
+// whole trace in order on one thread). The results are compared with the
+// recorded ones; differences are expected where the order of requests of
+// different threads was not kept. NFS requests in a trace are skipped.
+//
+//   fusememdrive_replay [-threads N] [-fast] [-stats file] [-list] <trace>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+#include <atomic>
+
+#include <sys/stat.h>
+
+#include "virtualfile.h"
+#include "filetree.h"
+#include "opstats.h"
+#include "recorder.h"
+
+#ifndef CBFS_STANDIN
+#error Build with -DCBFS_STANDIN, see the replay target of the makefile
+#endif
+
+// differences printed before they are only counted
+#define REPLAY_MAX_REPORTED 20
+
+typedef struct
+{
+    FUSEStandin* Client;
+    std::vector<std::vector<const RECORDER_ENTRY*> > Queues;   // per replay thread, in recorded order
+    int64_t FirstTime;
+    bool Fast;
+    std::chrono::steady_clock::time_point Start;
+    std::atomic<int64_t> Requests[RECORDER_MAX_OP];
+    std::atomic<int64_t> Differences[RECORDER_MAX_OP];
+    std::atomic<int64_t> Skipped;
+    std::atomic<int> Reported;
+}   REPLAY_CONTEXT;
+
+static int ReplayRequest(FUSEStandin& fs, const RECORDER_ENTRY* Entry, std::vector<char>& Buffer, bool* Replayed)
+{
+    const RECORDER_RECORD* rec = &Entry->Record;
+    const char* path = Entry->Path.c_str();
+    std::vector<FUSE_STANDIN_ENTRY> entries;
+    FUSE_STANDIN_ATTR attr;
+    FUSE_STANDIN_STATFS stat;
+
+    *Replayed = true;
+    switch (rec->Op)
+    {
+    case RECORDER_OP_FUSE_ACCESS:
+        return fs.Access(path, rec->Flags);
+    case RECORDER_OP_FUSE_CREATE:
+        return fs.Create(path, rec->Flags);
+    case RECORDER_OP_FUSE_FALLOCATE:
+        return fs.FAllocate(path, rec->Flags, rec->Offset, rec->Length);
+    case RECORDER_OP_FUSE_FLUSH:
+        return fs.Flush(path);
+    case RECORDER_OP_FUSE_FSYNC:
+        return fs.FSync(path, rec->Flags);
+    case RECORDER_OP_FUSE_GETATTR:
+        return fs.GetAttr(path, &attr);
+    case RECORDER_OP_FUSE_MKDIR:
+        return fs.MkDir(path, rec->Flags);
+    case RECORDER_OP_FUSE_OPEN:
+        return fs.Open(path, rec->Flags);
+    case RECORDER_OP_FUSE_READ:
+        if (Buffer.size() < (size_t)rec->Length)
+            Buffer.resize((size_t)rec->Length);
+        return fs.Read(path, Buffer.data(), rec->Offset, rec->Length);
+    case RECORDER_OP_FUSE_READDIR:
+        return fs.ReadDir(path, entries);
+    case RECORDER_OP_FUSE_RELEASE:
+        return fs.Release(path, rec->Flags);
+    case RECORDER_OP_FUSE_RENAME:
+        return fs.Rename(path, Entry->Path2.c_str(), rec->Flags);
+    case RECORDER_OP_FUSE_RMDIR:
+        return fs.RmDir(path);
+    case RECORDER_OP_FUSE_STATFS:
+        return fs.StatFS(path, &stat);
+    case RECORDER_OP_FUSE_TRUNCATE:
+        return fs.Truncate(path, rec->Length);
+    case RECORDER_OP_FUSE_UNLINK:
+        return fs.Unlink(path);
+    case RECORDER_OP_FUSE_UTIME:
+        return fs.UTime(path, rec->Offset, rec->Length);
+    case RECORDER_OP_FUSE_WRITE:
+        if (Entry->Data != NULL)
+            return fs.Write(path, Entry->Data, rec->Offset, rec->Length);
+        // a trace without data writes the fill pattern
+        if (Buffer.size() < (size_t)rec->Length)
+            Buffer.resize((size_t)rec->Length, 'x');
+        return fs.Write(path, Buffer.data(), rec->Offset, rec->Length);
+    }
+
+    *Replayed = false;
+    return 0;
+}
+
+static void Worker(int Thread, void* Context)
+{
+    REPLAY_CONTEXT* context = (REPLAY_CONTEXT*)Context;
+    const std::vector<const RECORDER_ENTRY*>& queue = context->Queues[Thread];
+    std::vector<char> buffer;
+    bool replayed;
+
+    for (size_t i = 0; i < queue.size(); i++)
+    {
+        const RECORDER_ENTRY* entry = queue[i];
+
+        if (!context->Fast)
+            std::this_thread::sleep_until(context->Start + std::chrono::nanoseconds(entry->Record.Time - context->FirstTime));
+
+        int result = ReplayRequest(*context->Client, entry, buffer, &replayed);
+        if (!replayed)
+        {
+            context->Skipped.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+
+        context->Requests[entry->Record.Op].fetch_add(1, std::memory_order_relaxed);
+        if (result != entry->Record.Result)
+        {
+            context->Differences[entry->Record.Op].fetch_add(1, std::memory_order_relaxed);
+            if (context->Reported.fetch_add(1) < REPLAY_MAX_REPORTED)
+                fprintf(stderr, "%s %s: %d, recorded %d\n", RecorderOpName(entry->Record.Op), entry->Path.c_str(),
+                    result, (int)entry->Record.Result);
+        }
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    int threads = 0;
+    bool fast = false, list = false, usage = false;
+    const char* statsFile = NULL;
+    const char* traceFile = NULL;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-threads") && i + 1 < argc)
+            threads = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-fast"))
+            fast = true;
+        else if (!strcmp(argv[i], "-stats") && i + 1 < argc)
+            statsFile = argv[++i];
+        else if (!strcmp(argv[i], "-list"))
+            list = true;
+        else if (argv[i][0] != '-' && traceFile == NULL)
+            traceFile = argv[i];
+        else
+            usage = true;
+    }
+    if (usage || traceFile == NULL)
+    {
+        fprintf(stderr, "usage: fusememdrive_replay [-threads N] [-fast] [-stats file] [-list] <trace>\n");
+        return 1;
+    }
+
+    std::vector<char> file;
+    std::vector<RECORDER_ENTRY> entries;
+    RECORDER_HEADER header;
+    std::string error;
+
+    if (!RecorderLoad(traceFile, file, &header, entries, error))
+    {
+        fprintf(stderr, "Error: %s\n", error.c_str());
+        return 1;
+    }
+    if (list)
+    {
+        for (size_t i = 0; i < entries.size(); i++)
+            RecorderPrint(stdout, entries[i]);
+        return 0;
+    }
+
+    // what main of the sample does before Mount
+    if (statsFile != NULL)
+        OpStatsStart(statsFile, 3600);
+    g_DiskContext = new VirtualFile(TEXT("/"), S_IFDIR);
+
+    FUSEStandin fs(FUSE::GetStandinInstance());
+    REPLAY_CONTEXT context;
+    std::map<int, int> threadMap;
+
+    // the recorded threads in the order they first appear
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        if (threadMap.find(entries[i].Record.Thread) == threadMap.end())
+        {
+            int index = (int)threadMap.size();
+            threadMap[entries[i].Record.Thread] = index;
+        }
+    }
+    if (threads <= 0)
+        threads = threadMap.empty() ? 1 : (int)threadMap.size();
+
+    context.Client = &fs;
+    context.Queues.resize(threads);
+    for (size_t i = 0; i < entries.size(); i++)
+        context.Queues[threadMap[entries[i].Record.Thread] % threads].push_back(&entries[i]);
+    context.FirstTime = entries.empty() ? 0 : entries[0].Record.Time;
+    context.Fast = fast;
+    for (int op = 0; op < RECORDER_MAX_OP; op++)
+    {
+        context.Requests[op].store(0);
+        context.Differences[op].store(0);
+    }
+    context.Skipped.store(0);
+    context.Reported.store(0);
+
+    fs.Init();
+    context.Start = std::chrono::steady_clock::now();
+    StandinRunThreads(threads, Worker, &context);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - context.Start).count();
+    fs.Destroy();
+
+    int64_t requests = 0, differences = 0;
+    printf("%-16s %10s %12s\n", "operation", "requests", "differences");
+    for (int op = 0; op < RECORDER_MAX_OP; op++)
+    {
+        if (context.Requests[op].load() == 0)
+            continue;
+        printf("%-16s %10lld %12lld\n", RecorderOpName(op), (long long)context.Requests[op].load(), (long long)context.Differences[op].load());
+        requests += context.Requests[op].load();
+        differences += context.Differences[op].load();
+    }
+
+    double recorded = entries.empty() ? 0.0 : (entries.back().Record.Time + entries.back().Record.Duration - context.FirstTime) / 1e9;
+    printf("%d thread(s)%s: %lld requests in %.3f s (recorded in %.3f s), %.0f requests/s, %lld difference(s), %lld skipped\n",
+        threads, fast ? ", fast" : "", (long long)requests, seconds, recorded, seconds > 0 ? requests / seconds : 0.0,
+        (long long)differences, (long long)context.Skipped.load());
+
+    OpStatsStop();
+    DeleteDiskContext();
+    return 0;
+}
@@ -0,0 +1,557 @@
+/*
+ * CBFS Connect 2024 C++ Edition - Sample Project
+ *
+ * This sample project demonstrates the usage of CBFS Connect in a
+ * simple, straightforward way. It is not intended to be a complete
+ * application. Error handling and other checks are simplified for clarity.
+ *
+ * www.callback.com/cbfsconnect
+ *
+ * This code is subject to the terms and conditions specified in the
+ * corresponding product license agreement which outlines the authorized
+ * usage and restrictions.
+ */
+
+// Scaling of the handlers of MemDriveFUSE with the number of threads.
+//
+// Every mix of requests runs for a fixed time with 1, 2, 4 ... 64 threads,
+// through the stand-in of the FUSE class (standin/fuse.h):
+//
+//   create_shared   Create, Release and Unlink of files in one directory
+//   create_private  the same, in a directory per thread
+//   getattr         GetAttr of random files of a tree of 16 x 256 files
+//   hot_read        4K reads at random offsets of one 1 MB file
+//   mixed           70% getattr, 20% hot_read, 5% 4K writes to a file per
+//                   thread, 5% creates and unlinks in one directory
+//
+// For every run the request rate, the speedup over the first thread count
+// and the acquisitions, waits and hold times of each lock class of the tree
+// are written to stdout as JSON. The lock classes are counted only when the
+// tree is built with VIRTUALFILE_LOCKSTATS, as the scale target of the
+// makefile does; counting takes time of its own, so the bare request rates
+// come from a build without it.
+//
+//   fusememdrive_scale [-threads 1,2,4,...] [-seconds S] [-quick] [mix ...]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <chrono>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <atomic>
+
+#include <sys/stat.h>
+
+#include "virtualfile.h"
+#include "filetree.h"
+
+#ifndef CBFS_STANDIN
+#error Build with -DCBFS_STANDIN, see the scale target of the makefile
+#endif
+
+#define SCALE_TREE_DIRS         16
+#define SCALE_TREE_FILES        256
+#define SCALE_HOT_SIZE          (1024 * 1024)
+#define SCALE_REQUEST_SIZE      4096
+#define SCALE_WRITE_SIZE        65536
+// files a thread creates before it unlinks them again
+#define SCALE_CREATE_BATCH      16
+// requests between two looks at the clock
+#define SCALE_STEP              16
+
+typedef struct
+{
+    FUSEStandin* Client;
+    int Threads;
+    int64 Duration;                 // nanoseconds
+    std::atomic<int64> Start;       // set by the first thread that runs
+    std::atomic<int64> Requests;
+    std::atomic<int> Failures;
+}   SCALE_CONTEXT;
+
+typedef struct
+{
+    std::mt19937_64 Random;
+    int64 Counter;
+    char Buffer[SCALE_REQUEST_SIZE];
+}   SCALE_THREAD;
+
+typedef struct
+{
+    const char* Name;
+    void (*Setup)(SCALE_CONTEXT* Context, int MaxThreads);
+    // runs about SCALE_STEP requests and returns how many
+    int (*Step)(SCALE_CONTEXT* Context, int Thread, SCALE_THREAD* State);
+    void (*Cleanup)(SCALE_CONTEXT* Context, int MaxThreads);
+}   SCALE_MIX;
+
+typedef struct
+{
+    const SCALE_MIX* Mix;
+    int Threads;
+    int64 Requests;
+    double Seconds;
+    bool HasLockStats;
+    VIRTUALFILE_LOCK_STATS Locks[VIRTUALFILE_LOCK_CLASSES];
+}   SCALE_RESULT;
+
+static int64 Now(void)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void Check(SCALE_CONTEXT* Context, const char* Request, const char* Path, int64 Result, int64 Expected)
+{
+    // the first failures are enough to see what went wrong
+    if (Result != Expected && Context->Failures.fetch_add(1) < 20)
+        fprintf(stderr, "%s %s: %lld, expected %lld\n", Request, Path, (long long)Result, (long long)Expected);
+}
+
+//-----------------------------------------------------------------------------------------------------------
+// the requests of the mixes
+
+static int CreateBatch(SCALE_CONTEXT* Context, const char* Dir, int Thread, SCALE_THREAD* State)
+{
+    FUSEStandin& fs = *Context->Client;
+    char path[SCALE_CREATE_BATCH][64];
+    int64 first = State->Counter;
+
+    State->Counter += SCALE_CREATE_BATCH;
+    for (int i = 0; i < SCALE_CREATE_BATCH; i++)
+    {
+        snprintf(path[i], sizeof(path[i]), "%s/t%d_%lld", Dir, Thread, (long long)(first + i));
+        Check(Context, "Create", path[i], fs.Create(path[i], S_IFREG | 0644), 0);
+        Check(Context, "Release", path[i], fs.Release(path[i], O_RDWR), 0);
+    }
+    for (int i = 0; i < SCALE_CREATE_BATCH; i++)
+        Check(Context, "Unlink", path[i], fs.Unlink(path[i]), 0);
+    return SCALE_CREATE_BATCH * 3;
+}
+
+static void GetAttrRandom(SCALE_CONTEXT* Context, SCALE_THREAD* State)
+{
+    FUSE_STANDIN_ATTR attr;
+    char path[64];
+    int64 index = (int64)(State->Random() % (SCALE_TREE_DIRS * SCALE_TREE_FILES));
+
+    snprintf(path, sizeof(path), "/tree/d%d/f%d", (int)(index / SCALE_TREE_FILES), (int)(index % SCALE_TREE_FILES));
+    Check(Context, "GetAttr", path, Context->Client->GetAttr(path, &attr), 0);
+}
+
+static void ReadHot(SCALE_CONTEXT* Context, SCALE_THREAD* State)
+{
+    int64 offset = (int64)(State->Random() % (SCALE_HOT_SIZE / SCALE_REQUEST_SIZE)) * SCALE_REQUEST_SIZE;
+
+    Check(Context, "Read", "/hot", Context->Client->Read("/hot", State->Buffer, offset, SCALE_REQUEST_SIZE), SCALE_REQUEST_SIZE);
+}
+
+//-----------------------------------------------------------------------------------------------------------
+// the mixes
+
+static void SetupCreateShared(SCALE_CONTEXT* Context, int MaxThreads)
+{
+    Check(Context, "MkDir", "/create", Context->Client->MkDir("/create", S_IFDIR | 0755), 0);
+}
+
+static int StepCreateShared(SCALE_CONTEXT* Context, int Thread, SCALE_THREAD* State)
+{
+    return CreateBatch(Context, "/create", Thread, State);
+}
+
+static void CleanupCreateShared(SCALE_CONTEXT* Context, int MaxThreads)
+{
+    Check(Context, "RmDir", "/create", Context->Client->RmDir("/create"), 0);
+}
+
+static void SetupCreatePrivate(SCALE_CONTEXT* Context, int MaxThreads)
+{
+    char path[64];
+
+    for (int i = 0; i < MaxThreads; i++)
+    {
+        snprintf(path, sizeof(path), "/t%d", i);
+        Check(Context, "MkDir", path, Context->Client->MkDir(path, S_IFDIR | 0755), 0);
+    }
+}
+
+static int StepCreatePrivate(SCALE_CONTEXT* Context, int Thread, SCALE_THREAD* State)
+{
+    char dir[64];
+
+    snprintf(dir, sizeof(dir), "/t%d", Thread);
+    return CreateBatch(Context, dir, Thread, State);
+}
+
+static void CleanupCreatePrivate(SCALE_CONTEXT* Context, int MaxThreads)
+{
+    char path[64];
+
+    for (int i = 0; i < MaxThreads; i++)
+    {
+        snprintf(path, sizeof(path), "/t%d", i);
+        Check(Context, "RmDir", path, Context->Client->RmDir(path), 0);
+    }
+}
+
+static void SetupTree(SCALE_CONTEXT* Context, int MaxThreads)
+{
+    FUSEStandin& fs = *Context->Client;
+    char path[64];
+
+    Check(Context, "MkDir", "/tree", fs.MkDir("/tree", S_IFDIR | 0755), 0);
+    for (int d = 0; d < SCALE_TREE_DIRS; d++)
+    {
+        snprintf(path, sizeof(path), "/tree/d%d", d);
+        Check(Context, "MkDir", path, fs.MkDir(path, S_IFDIR | 0755), 0);
+        for (int f = 0; f < SCALE_TREE_FILES; f++)
+        {
+            snprintf(path, sizeof(path), "/tree/d%d/f%d", d, f);
+            Check(Context, "Create", path, fs.Create(path, S_IFREG | 0644), 0);
+        }
+    }
+}
+
+static int StepGetAttr(SCALE_CONTEXT* Context, int Thread, SCALE_THREAD* State)
+{
+    for (int i = 0; i < SCALE_STEP; i++)
+        GetAttrRandom(Context, State);
+    return SCALE_STEP;
+}
+
+static void CleanupTree(SCALE_CONTEXT* Context, int MaxThreads)
+{
+    FUSEStandin& fs = *Context->Client;
+    char path[64];
+
+    for (int d = 0; d < SCALE_TREE_DIRS; d++)
+    {
+        for (int f = 0; f < SCALE_TREE_FILES; f++)
+        {
+            snprintf(path, sizeof(path), "/tree/d%d/f%d", d, f);
+            Check(Context, "Unlink", path, fs.Unlink(path), 0);
+        }
+        snprintf(path, sizeof(path), "/tree/d%d", d);
+        Check(Context, "RmDir", path, fs.RmDir(path), 0);
+    }
+    Check(Context, "RmDir", "/tree", fs.RmDir("/tree"), 0);
+}
+
+static void SetupHot(SCALE_CONTEXT* Context, int MaxThreads)
+{
+    std::vector<char> data(SCALE_HOT_SIZE, 'x');
+
+    Check(Context, "Create", "/hot", Context->Client->Create("/hot", S_IFREG | 0644), 0);
+    Check(Context, "Write", "/hot", Context->Client->Write("/hot", data.data(), 0, SCALE_HOT_SIZE), SCALE_HOT_SIZE);
+}
+
+static int StepHotRead(SCALE_CONTEXT* Context, int Thread, SCALE_THREAD* State)
+{
+    for (int i = 0; i < SCALE_STEP; i++)
+        ReadHot(Context, State);
+    return SCALE_STEP;
+}
+
+static void CleanupHot(SCALE_CONTEXT* Context, int MaxThreads)
+{
+    Check(Context, "Unlink", "/hot", Context->Client->Unlink("/hot"), 0);
+}
+
+static void SetupMixed(SCALE_CONTEXT* Context, int MaxThreads)
+{
+    char path[64];
+
+    SetupTree(Context, MaxThreads);
+    SetupHot(Context, MaxThreads);
+    SetupCreateShared(Context, MaxThreads);
+    for (int i = 0; i < MaxThreads; i++)
+    {
+        snprintf(path, sizeof(path), "/w%d", i);
+        Check(Context, "Create", path, Context->Client->Create(path, S_IFREG | 0644), 0);
+    }
+}
+
+static int StepMixed(SCALE_CONTEXT* Context, int Thread, SCALE_THREAD* State)
+{
+    int requests = 0;
+    char path[64];
+
+    while (requests < SCALE_STEP)
+    {
+        int pick = (int)(State->Random() % 100);
+
+        if (pick < 70)
+        {
+            GetAttrRandom(Context, State);
+            requests++;
+        }
+        else if (pick < 90)
+        {
+            ReadHot(Context, State);
+            requests++;
+        }
+        else if (pick < 95)
+        {
+            int64 offset = (int64)(State->Random() % (SCALE_WRITE_SIZE / SCALE_REQUEST_SIZE)) * SCALE_REQUEST_SIZE;
+
+            snprintf(path, sizeof(path), "/w%d", Thread);
+            Check(Context, "Write", path, Context->Client->Write(path, State->Buffer, offset, SCALE_REQUEST_SIZE), SCALE_REQUEST_SIZE);
+            requests++;
+        }
+        else
+        {
+            // one create and unlink, not a whole batch, to keep the mix
+            snprintf(path, sizeof(path), "/create/t%d_%lld", Thread, (long long)State->Counter++);
+            Check(Context, "Create", path, Context->Client->Create(path, S_IFREG | 0644), 0);
+            Check(Context, "Unlink", path, Context->Client->Unlink(path), 0);
+            requests += 2;
+        }
+    }
+    return requests;
+}
+
+static void CleanupMixed(SCALE_CONTEXT* Context, int MaxThreads)
+{
+    char path[64];
+
+    for (int i = 0; i < MaxThreads; i++)
+    {
+        snprintf(path, sizeof(path), "/w%d", i);
+        Check(Context, "Unlink", path, Context->Client->Unlink(path), 0);
+    }
+    CleanupCreateShared(Context, MaxThreads);
+    CleanupHot(Context, MaxThreads);
+    CleanupTree(Context, MaxThreads);
+}
+
+static const SCALE_MIX g_Mixes[] =
+{
+    { "create_shared", SetupCreateShared, StepCreateShared, CleanupCreateShared },
+    { "create_private", SetupCreatePrivate, StepCreatePrivate, CleanupCreatePrivate },
+    { "getattr", SetupTree, StepGetAttr, CleanupTree },
+    { "hot_read", SetupHot, StepHotRead, CleanupHot },
+    { "mixed", SetupMixed, StepMixed, CleanupMixed },
+};
+
+#define SCALE_MIX_COUNT (sizeof(g_Mixes) / sizeof(g_Mixes[0]))
+
+//-----------------------------------------------------------------------------------------------------------
+
+typedef struct
+{
+    SCALE_CONTEXT* Context;
+    const SCALE_MIX* Mix;
+}   SCALE_RUN;
+
+static void Worker(int Thread, void* Run)
+{
+    SCALE_CONTEXT* context = ((SCALE_RUN*)Run)->Context;
+    const SCALE_MIX* mix = ((SCALE_RUN*)Run)->Mix;
+    SCALE_THREAD* state = new SCALE_THREAD;
+    int64 requests = 0;
+
+    state->Random.seed(Thread + 1);
+    state->Counter = 0;
+    memset(state->Buffer, 'y', sizeof(state->Buffer));
+
+    // the threads start together, the first one starts the clock
+    int64 start = 0;
+    context->Start.compare_exchange_strong(start, Now());
+    int64 deadline = context->Start.load() + context->Duration;
+
+    do
+        requests += mix->Step(context, Thread, state);
+    while (Now() < deadline);
+
+    context->Requests.fetch_add(requests);
+    delete state;
+}
+
+static void RunMix(SCALE_CONTEXT* Context, const SCALE_MIX* Mix, int Threads, SCALE_RESULT* Result)
+{
+    SCALE_RUN run = { Context, Mix };
+
+    Context->Threads = Threads;
+    Context->Start.store(0);
+    Context->Requests.store(0);
+    VirtualFile::ResetLockStats();
+
+    StandinRunThreads(Threads, Worker, &run);
+    int64 end = Now();
+
+    Result->Mix = Mix;
+    Result->Threads = Threads;
+    Result->Requests = Context->Requests.load();
+    Result->Seconds = (end - Context->Start.load()) / 1e9;
+    for (int i = 0; i < VIRTUALFILE_LOCK_CLASSES; i++)
+        Result->HasLockStats = VirtualFile::GetLockStats(i, &Result->Locks[i]);
+
+    // what the threads unlinked is released once they are all gone
+    EpochFlush();
+}
+
+static void PrintLocks(FILE* Output, const SCALE_RESULT& Result)
+{
+    bool first = true;
+
+    if (!Result.HasLockStats)
+    {
+        fprintf(Output, "null");
+        return;
+    }
+
+    fprintf(Output, "{");
+    for (int i = 0; i < VIRTUALFILE_LOCK_CLASSES; i++)
+    {
+        const VIRTUALFILE_LOCK_STATS& locks = Result.Locks[i];
+        if (locks.Acquired == 0)
+            continue;
+
+        fprintf(Output, "%s\n        \"%s\": { \"acquired\": %lld, \"contended\": %lld, \"wait_ns\": %lld, \"max_wait_ns\": %lld, "
+            "\"avg_wait_ns\": %.1f, \"hold_ns\": %lld, \"max_hold_ns\": %lld, \"avg_hold_ns\": %.1f }",
+            first ? "" : ",", VirtualFile::GetLockClassName(i), (long long)locks.Acquired, (long long)locks.Contended,
+            (long long)locks.WaitTime, (long long)locks.MaxWaitTime,
+            locks.Contended > 0 ? (double)locks.WaitTime / locks.Contended : 0.0,
+            (long long)locks.HoldTime, (long long)locks.MaxHoldTime, (double)locks.HoldTime / locks.Acquired);
+        first = false;
+    }
+    fprintf(Output, first ? "}" : "\n      }");
+}
+
+static void PrintResults(FILE* Output, const std::vector<SCALE_RESULT>& Results, double Seconds)
+{
+    fprintf(Output, "{\n  \"cores\": %u,\n  \"seconds_per_run\": %.3f,\n  \"results\": [\n",
+        std::thread::hardware_concurrency(), Seconds);
+    for (size_t i = 0; i < Results.size(); i++)
+    {
+        const SCALE_RESULT& result = Results[i];
+        double rate = result.Seconds > 0 ? result.Requests / result.Seconds : 0.0;
+        double base = 0.0;
+        int baseThreads = 1;
+
+        // the speedup is over the first run of the same mix
+        for (size_t j = 0; j <= i; j++)
+        {
+            if (Results[j].Mix == result.Mix)
+            {
+                base = Results[j].Seconds > 0 ? Results[j].Requests / Results[j].Seconds : 0.0;
+                baseThreads = Results[j].Threads;
+                break;
+            }
+        }
+        double speedup = base > 0 ? rate / base : 0.0;
+
+        fprintf(Output, "    { \"mix\": \"%s\", \"threads\": %d, \"requests\": %lld, \"seconds\": %.6f, \"requests_per_sec\": %.1f, "
+            "\"speedup\": %.3f, \"efficiency\": %.3f,\n      \"locks\": ",
+            result.Mix->Name, result.Threads, (long long)result.Requests, result.Seconds, rate,
+            speedup, speedup * baseThreads / result.Threads);
+        PrintLocks(Output, result);
+        fprintf(Output, " }%s\n", i + 1 < Results.size() ? "," : "");
+    }
+    fprintf(Output, "  ]\n}\n");
+}
+
+static void PrintUsage(void)
+{
+    fprintf(stderr, "usage: fusememdrive_scale [-threads 1,2,4,...] [-seconds S] [-quick] [mix ...]\n\nmixes:\n");
+    for (size_t i = 0; i < SCALE_MIX_COUNT; i++)
+        fprintf(stderr, "  %s\n", g_Mixes[i].Name);
+}
+
+int main(int argc, char* argv[])
+{
+    std::vector<const SCALE_MIX*> selected;
+    std::vector<int> threads;
+    double seconds = 1.0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-threads") && i + 1 < argc)
+        {
+            // a comma separated list of thread counts
+            for (const char* p = argv[++i]; *p != 0; p++)
+            {
+                if (atoi(p) > 0)
+                    threads.push_back(atoi(p));
+                p = strchr(p, ',');
+                if (p == NULL)
+                    break;
+            }
+            continue;
+        }
+        if (!strcmp(argv[i], "-seconds") && i + 1 < argc)
+        {
+            seconds = atof(argv[++i]);
+            continue;
+        }
+        if (!strcmp(argv[i], "-quick"))
+        {
+            seconds = 0.2;
+            continue;
+        }
+
+        size_t m = 0;
+        for (; m < SCALE_MIX_COUNT; m++)
+        {
+            if (!strcmp(argv[i], g_Mixes[m].Name))
+                break;
+        }
+        if (m == SCALE_MIX_COUNT)
+        {
+            PrintUsage();
+            return 1;
+        }
+        selected.push_back(&g_Mixes[m]);
+    }
+
+    if (selected.empty())
+    {
+        for (size_t m = 0; m < SCALE_MIX_COUNT; m++)
+            selected.push_back(&g_Mixes[m]);
+    }
+    if (threads.empty())
+    {
+        for (int n = 1; n <= 64; n *= 2)
+            threads.push_back(n);
+    }
+    int maxThreads = 0;
+    for (size_t i = 0; i < threads.size(); i++)
+        maxThreads = threads[i] > maxThreads ? threads[i] : maxThreads;
+
+    // what main of the sample does before Mount
+    g_DiskContext = new VirtualFile(TEXT("/"), S_IFDIR);
+
+    FUSEStandin fs(FUSE::GetStandinInstance());
+    SCALE_CONTEXT context;
+    std::vector<SCALE_RESULT> results;
+
+    context.Client = &fs;
+    context.Duration = (int64)(seconds * 1e9);
+    context.Failures.store(0);
+
+    fs.Init();
+    for (size_t m = 0; m < selected.size(); m++)
+    {
+        selected[m]->Setup(&context, maxThreads);
+        for (size_t t = 0; t < threads.size(); t++)
+        {
+            SCALE_RESULT result;
+
+            fprintf(stderr, "%s, %d thread(s)...\n", selected[m]->Name, threads[t]);
+            RunMix(&context, selected[m], threads[t], &result);
+            results.push_back(result);
+        }
+        selected[m]->Cleanup(&context, maxThreads);
+    }
+    fs.Destroy();
+
+    PrintResults(stdout, results, seconds);
+    if (context.Failures.load() > 0)
+        fprintf(stderr, "%d failure(s)\n", context.Failures.load());
+    return context.Failures.load() == 0 ? 0 : 1;
+}
@@ -0,0 +1,229 @@
+/*
+ * CBFS Connect 2024 C++ Edition - Sample Project
+ *
+ * This sample project demonstrates the usage of CBFS Connect in a
+ * simple, straightforward way. It is not intended to be a complete
+ * application. Error handling and other checks are simplified for clarity.
+ *
+ * www.callback.com/cbfsconnect
+ *
+ * This code is subject to the terms and conditions specified in the
+ * corresponding product license agreement which outlines the authorized
+ * usage and restrictions.
+ */
+
+// Drives the handlers of MemDriveFUSE through the stand-in of the FUSE
+// class (standin/fuse.h), without the CBFS library, the kernel or a mount.
+//
+// Every thread runs the same cycle of requests in a directory of its own,
+// and in between creates files in a directory shared by all threads and
+// reads a file shared by all threads. The results of the requests are
+// checked, so the run doubles as a test of the handlers under concurrency;
+// the request rate it reports is that of the handlers alone.
+//
+// -record writes the requests to a trace for fusememdrive_replay.
+//
+//   fusememdrive_standin [-threads N] [-iterations N] [-stats file] [-record file [-recorddata]]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <atomic>
+
+#include <sys/stat.h>
+
+#include "virtualfile.h"
+#include "filetree.h"
+#include "opstats.h"
+#include "recorder.h"
+
+#ifndef CBFS_STANDIN
+#error Build with -DCBFS_STANDIN, see the standin target of the makefile
+#endif
+
+#define STANDIN_FILE_SIZE   12288
+#define STANDIN_SHARED_SIZE 65536
+
+typedef struct
+{
+    FUSEStandin* Client;
+    int Iterations;
+    std::atomic<int64> Requests;
+    std::atomic<int> Failures;
+}   STANDIN_CONTEXT;
+
+static void Fail(STANDIN_CONTEXT* Context, const char* Request, const std::string& Path, int64 Result, int64 Expected)
+{
+    // the first failures are enough to see what went wrong
+    if (Context->Failures.fetch_add(1) < 20)
+        fprintf(stderr, "%s %s: %lld, expected %lld\n", Request, Path.c_str(), (long long)Result, (long long)Expected);
+}
+
+static void Check(STANDIN_CONTEXT* Context, const char* Request, const std::string& Path, int64 Result, int64 Expected)
+{
+    if (Result != Expected)
+        Fail(Context, Request, Path, Result, Expected);
+}
+
+static void FillPattern(char* Buffer, int Size, int Seed)
+{
+    for (int i = 0; i < Size; i++)
+        Buffer[i] = (char)(Seed + i * 7);
+}
+
+static void RunCycle(STANDIN_CONTEXT* Context, FUSEStandin& fs, int Thread, int Iteration)
+{
+    char data[STANDIN_FILE_SIZE], buffer[STANDIN_FILE_SIZE];
+    char name[64];
+    std::vector<FUSE_STANDIN_ENTRY> entries;
+    FUSE_STANDIN_ATTR attr;
+    FUSE_STANDIN_STATFS stat;
+    int64 requests = 0;
+
+    snprintf(name, sizeof(name), "/t%d/d%d", Thread, Iteration);
+    std::string dir = name;
+    std::string file = dir + "/file";
+    std::string moved = dir + "/moved";
+
+    FillPattern(data, STANDIN_FILE_SIZE, Thread + Iteration);
+
+    Check(Context, "MkDir", dir, fs.MkDir(dir.c_str(), S_IFDIR | 0755), 0);
+    Check(Context, "Create", file, fs.Create(file.c_str(), S_IFREG | 0644), 0);
+    Check(Context, "Create", file, fs.Create(file.c_str(), S_IFREG | 0644), -EEXIST);
+    Check(Context, "Open", file, fs.Open(file.c_str(), O_RDWR), 0);
+    Check(Context, "Write", file, fs.Write(file.c_str(), data, 0, 8192), 8192);
+    Check(Context, "Write", file, fs.Write(file.c_str(), data + 8192, 8192, 4096), 4096);
+    Check(Context, "GetAttr", file, fs.GetAttr(file.c_str(), &attr), 0);
+    Check(Context, "GetAttr size", file, attr.Size, STANDIN_FILE_SIZE);
+    Check(Context, "Read", file, fs.Read(file.c_str(), buffer, 0, STANDIN_FILE_SIZE), STANDIN_FILE_SIZE);
+    if (memcmp(data, buffer, STANDIN_FILE_SIZE) != 0)
+        Fail(Context, "Read data", file, 1, 0);
+    Check(Context, "Flush", file, fs.Flush(file.c_str()), 0);
+    Check(Context, "Release", file, fs.Release(file.c_str(), O_RDWR), 0);
+    Check(Context, "Truncate", file, fs.Truncate(file.c_str(), 4096), 0);
+    Check(Context, "GetAttr", file, fs.GetAttr(file.c_str(), &attr), 0);
+    Check(Context, "GetAttr size", file, attr.Size, 4096);
+    Check(Context, "ReadDir", dir, fs.ReadDir(dir.c_str(), entries), 0);
+    Check(Context, "ReadDir entries", dir, entries.size(), 1);
+    Check(Context, "Rename", file, fs.Rename(file.c_str(), moved.c_str(), 0), 0);
+    Check(Context, "GetAttr", file, fs.GetAttr(file.c_str(), &attr), -ENOENT);
+    Check(Context, "RmDir", dir, fs.RmDir(dir.c_str()), -ENOTEMPTY);
+    Check(Context, "RmDir", moved, fs.RmDir(moved.c_str()), -ENOTDIR);
+    Check(Context, "Unlink", moved, fs.Unlink(moved.c_str()), 0);
+    Check(Context, "RmDir", dir, fs.RmDir(dir.c_str()), 0);
+    requests += 19;
+
+    // the directory and the file that every thread uses
+    snprintf(name, sizeof(name), "/shared/t%d_%d", Thread, Iteration);
+    std::string common = name;
+    Check(Context, "Create", common, fs.Create(common.c_str(), S_IFREG | 0644), 0);
+    Check(Context, "GetAttr", "/shared/file", fs.GetAttr("/shared/file", &attr), 0);
+    Check(Context, "Read", "/shared/file", fs.Read("/shared/file", buffer, (Iteration % 16) * 4096, 4096), 4096);
+    Check(Context, "Unlink", common, fs.Unlink(common.c_str()), 0);
+    requests += 4;
+
+    if (Iteration % 64 == 0)
+    {
+        Check(Context, "StatFS", "/", fs.StatFS("/", &stat), 0);
+        requests++;
+    }
+
+    Context->Requests.fetch_add(requests, std::memory_order_relaxed);
+}
+
+static void Worker(int Thread, void* Context)
+{
+    STANDIN_CONTEXT* context = (STANDIN_CONTEXT*)Context;
+    FUSEStandin& fs = *context->Client;
+    char dir[32];
+
+    snprintf(dir, sizeof(dir), "/t%d", Thread);
+    Check(context, "MkDir", dir, fs.MkDir(dir, S_IFDIR | 0755), 0);
+
+    for (int i = 0; i < context->Iterations; i++)
+        RunCycle(context, fs, Thread, i);
+
+    Check(context, "RmDir", dir, fs.RmDir(dir), 0);
+}
+
+int main(int argc, char* argv[])
+{
+    int threads = (int)std::thread::hardware_concurrency();
+    int iterations = 1000;
+    const char* statsFile = NULL;
+    const char* recordFile = NULL;
+    bool recordData = false;
+    std::vector<char> data(STANDIN_SHARED_SIZE, 'x');
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-threads") && i + 1 < argc)
+            threads = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-iterations") && i + 1 < argc)
+            iterations = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-stats") && i + 1 < argc)
+            statsFile = argv[++i];
+        else if (!strcmp(argv[i], "-record") && i + 1 < argc)
+            recordFile = argv[++i];
+        else if (!strcmp(argv[i], "-recorddata"))
+            recordData = true;
+        else
+        {
+            fprintf(stderr, "usage: fusememdrive_standin [-threads N] [-iterations N] [-stats file] [-record file [-recorddata]]\n");
+            return 1;
+        }
+    }
+    if (threads < 1)
+        threads = 1;
+
+    // what main of the sample does before Mount
+    if (statsFile != NULL)
+        OpStatsStart(statsFile, 3600);
+    if (recordFile != NULL && !RecorderStart(recordFile, recordData))
+    {
+        fprintf(stderr, "Error: cannot record to %s\n", recordFile);
+        return 1;
+    }
+    g_DiskContext = new VirtualFile(TEXT("/"), S_IFDIR);
+
+    FUSE* target = FUSE::GetStandinInstance();
+    FUSEStandin fs(target);
+    STANDIN_CONTEXT context;
+
+    context.Client = &fs;
+    context.Iterations = iterations;
+    context.Requests.store(0);
+    context.Failures.store(0);
+
+    fs.Init();
+    Check(&context, "MkDir", "/shared", fs.MkDir("/shared", S_IFDIR | 0755), 0);
+    Check(&context, "Create", "/shared/file", fs.Create("/shared/file", S_IFREG | 0644), 0);
+    Check(&context, "Write", "/shared/file", fs.Write("/shared/file", data.data(), 0, STANDIN_SHARED_SIZE), STANDIN_SHARED_SIZE);
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    StandinRunThreads(threads, Worker, &context);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // everything the threads created is gone again
+    std::vector<FUSE_STANDIN_ENTRY> entries;
+    Check(&context, "ReadDir", "/shared", fs.ReadDir("/shared", entries), 0);
+    Check(&context, "ReadDir entries", "/shared", entries.size(), 1);
+    Check(&context, "ReadDir", "/", fs.ReadDir("/", entries), 0);
+    Check(&context, "ReadDir entries", "/", entries.size(), 1);
+    fs.Destroy();
+
+    int64 requests = context.Requests.load();
+    printf("%d thread(s), %d iteration(s) each: %lld requests in %.3f s, %.0f requests/s, %d failure(s)\n",
+        threads, iterations, (long long)requests, seconds, seconds > 0 ? requests / seconds : 0.0, context.Failures.load());
+
+    RecorderStop();
+    OpStatsStop();
+    DeleteDiskContext();
+    return context.Failures.load() == 0 ? 0 : 1;
+}
@@ -0,0 +1,322 @@
+#if !defined _STANDIN_FUSE_H
+#define _STANDIN_FUSE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "standin.h"
+
+// Stand-in for the FUSE class of the CBFS Connect library.
+//
+// Built with -DCBFS_STANDIN, the sample includes this header instead of
+// ../../include/fuse.h. The handlers compile unchanged, but nothing is
+// mounted: Initialize, Mount and the other library calls succeed without
+// doing anything, and no driver, library or root access is needed.
+//
+// The events are fired by FUSEStandin, given the object of the sample (the
+// last FUSE object constructed, see GetStandinInstance). It fills the
+// *EventParams structures the way the library does and calls the Fire*
+// overrides directly. It keeps no state, so any number of threads may
+// fire events through one FUSEStandin at once; the handlers then run at
+// full speed, without the kernel and the transport in the way.
+//
+// Only the members used by the samples are declared.
+
+typedef int64_t int64;
+
+namespace cbcConstants
+{
+    const int INSTALL_REMOVE_OLD_VERSIONS = 0x00000002;
+    const int STG_DACCESS_READWRITE = 0x00000003;
+}
+
+typedef struct { const char* Path; int Mask; int Result; } FUSEAccessEventParams;
+typedef struct { const char* Path; void* FileContext; int Mode; int Result; } FUSEChmodEventParams;
+typedef struct { const char* Path; void* FileContext; int Uid; int Gid; int Result; } FUSEChownEventParams;
+typedef struct { const char* PathIn; int64 OffsetIn; const char* PathOut; int64 OffsetOut; int64 Size; int Flags; int Result; } FUSECopyFileRangeEventParams;
+typedef struct { const char* Path; int Mode; void* FileContext; int Result; } FUSECreateEventParams;
+typedef struct { int Result; } FUSEDestroyEventParams;
+typedef struct { int ErrorCode; const char* Description; } FUSEErrorEventParams;
+typedef struct { const char* Path; void* FileContext; int Mode; int64 Offset; int64 Length; int Result; } FUSEFAllocateEventParams;
+typedef struct { const char* Path; void* FileContext; int Result; } FUSEFlushEventParams;
+typedef struct { const char* Path; void* FileContext; int DataSync; int Result; } FUSEFSyncEventParams;
+typedef struct { const char* Path; void* FileContext; int64* pIno; int Mode; int Uid; int Gid; int LinkCount; int64* pSize; int64* pATime; int64* pMTime; int64* pCTime; int Result; } FUSEGetAttrEventParams;
+typedef struct { int ConnectionInfo; int Result; } FUSEInitEventParams;
+typedef struct { const char* Path; int Mode; int Result; } FUSEMkDirEventParams;
+typedef struct { const char* Path; int Flags; int DirectIO; void* FileContext; int Result; } FUSEOpenEventParams;
+typedef struct { const char* Path; void* FileContext; int64 Offset; void* Buffer; int64 Size; int Result; } FUSEReadEventParams;
+typedef struct { const char* Path; void* FillerContext; int Result; } FUSEReadDirEventParams;
+typedef struct { const char* Path; void* FileContext; int Flags; int Result; } FUSEReleaseEventParams;
+typedef struct { const char* OldPath; const char* NewPath; int Flags; int Result; } FUSERenameEventParams;
+typedef struct { const char* Path; int Result; } FUSERmDirEventParams;
+typedef struct { const char* Path; int64* pBlockSize; int64* pTotalBlocks; int64* pFreeBlocks; int64* pFreeBlocksAvail; int64* pTotalFiles; int64* pFreeFiles; int64* pFreeFilesAvail; int MaxFilenameLength; int Result; } FUSEStatFSEventParams;
+typedef struct { const char* Path; void* FileContext; int64 Size; int Result; } FUSETruncateEventParams;
+typedef struct { const char* Path; int Result; } FUSEUnlinkEventParams;
+typedef struct { const char* Path; void* FileContext; int64 ATime; int64 MTime; int Result; } FUSEUTimeEventParams;
+typedef struct { const char* Path; void* FileContext; int64 ATime; int64 MTime; int Result; } FUSEUtimensEventParams;
+typedef struct { const char* Path; void* FileContext; int64 Offset; const void* Buffer; int64 Size; int WritePage; int Result; } FUSEWriteEventParams;
+
+// an entry passed to FillDir
+typedef struct
+{
+    std::string Name;
+    int64 Ino;
+    int Mode;
+    int64 Size;
+}   FUSE_STANDIN_ENTRY;
+
+class FUSE
+{
+public:
+    FUSE() { GetStandinInstance() = this; }
+    virtual ~FUSE() { if (GetStandinInstance() == this) GetStandinInstance() = NULL; }
+
+    // the object of the sample, for the stand-in program
+    static FUSE*& GetStandinInstance()
+    {
+        static FUSE* instance = NULL;
+        return instance;
+    }
+
+    // the library calls, none of them has an effect
+    char* Config(const char* ConfigurationString) { return (char*)""; }
+    int GetDriverStatus(const char* ProductGUID) { return 0; }
+    int64 GetDriverVersion(const char* ProductGUID) { return 0; }
+    int Install(const char* CabFileName, const char* ProductGUID, const char* InstallationPath, int Flags) { return 0; }
+    int Initialize(const char* ProductGUID) { return 0; }
+    int Mount(const char* MountPoint) { return 0; }
+    int Unmount() { return 0; }
+    int SetProcessRestrictionsEnabled(int Value) { return 0; }
+    int AddGrantedProcess(const char* ProcessFileName, int ProcessId, int ChildProcesses, int DesiredAccess) { return 0; }
+    int SetSerializeEvents(int Value) { return 0; }
+    int GetSerializeEvents() { return FALSE; }
+    char* GetLastError() { return (char*)""; }
+    int GetLastErrorCode() { return 0; }
+
+    // the requests come from the stand-in itself
+    int GetUid() { return 0; }
+    int GetGid() { return 0; }
+
+    // FillerContext is the std::vector<FUSE_STANDIN_ENTRY> of FUSEStandin::ReadDir
+    int FillDir(void* FillerContext, const char* Name, int64 Ino, int Mode, int Uid, int Gid, int LinkCount,
+        int64 Size, int64 ATime, int64 MTime, int64 CTime)
+    {
+        FUSE_STANDIN_ENTRY entry = { Name, Ino, Mode, Size };
+        ((std::vector<FUSE_STANDIN_ENTRY>*)FillerContext)->push_back(entry);
+        return 0;
+    }
+
+    virtual int FireAccess(FUSEAccessEventParams* e) { return 0; }
+    virtual int FireChmod(FUSEChmodEventParams* e) { return 0; }
+    virtual int FireChown(FUSEChownEventParams* e) { return 0; }
+    virtual int FireCopyFileRange(FUSECopyFileRangeEventParams* e) { return 0; }
+    virtual int FireCreate(FUSECreateEventParams* e) { return 0; }
+    virtual int FireDestroy(FUSEDestroyEventParams* e) { return 0; }
+    virtual int FireError(FUSEErrorEventParams* e) { return 0; }
+    virtual int FireFAllocate(FUSEFAllocateEventParams* e) { return 0; }
+    virtual int FireFlush(FUSEFlushEventParams* e) { return 0; }
+    virtual int FireFSync(FUSEFSyncEventParams* e) { return 0; }
+    virtual int FireGetAttr(FUSEGetAttrEventParams* e) { return 0; }
+    virtual int FireInit(FUSEInitEventParams* e) { return 0; }
+    virtual int FireMkDir(FUSEMkDirEventParams* e) { return 0; }
+    virtual int FireOpen(FUSEOpenEventParams* e) { return 0; }
+    virtual int FireRead(FUSEReadEventParams* e) { return 0; }
+    virtual int FireReadDir(FUSEReadDirEventParams* e) { return 0; }
+    virtual int FireRelease(FUSEReleaseEventParams* e) { return 0; }
+    virtual int FireRename(FUSERenameEventParams* e) { return 0; }
+    virtual int FireRmDir(FUSERmDirEventParams* e) { return 0; }
+    virtual int FireStatFS(FUSEStatFSEventParams* e) { return 0; }
+    virtual int FireTruncate(FUSETruncateEventParams* e) { return 0; }
+    virtual int FireUnlink(FUSEUnlinkEventParams* e) { return 0; }
+    virtual int FireUTime(FUSEUTimeEventParams* e) { return 0; }
+    virtual int FireUtimens(FUSEUtimensEventParams* e) { return 0; }
+    virtual int FireWrite(FUSEWriteEventParams* e) { return 0; }
+};
+
+// what FUSEStandin::GetAttr returns
+typedef struct
+{
+    int64 Ino;
+    int Mode;
+    int Uid;
+    int Gid;
+    int LinkCount;
+    int64 Size;
+    int64 ATime;
+    int64 MTime;
+    int64 CTime;
+}   FUSE_STANDIN_ATTR;
+
+// what FUSEStandin::StatFS returns
+typedef struct
+{
+    int64 BlockSize;
+    int64 TotalBlocks;
+    int64 FreeBlocks;
+    int64 FreeBlocksAvail;
+    int64 TotalFiles;
+    int64 FreeFiles;
+    int64 FreeFilesAvail;
+}   FUSE_STANDIN_STATFS;
+
+// Fires the events of one request each. The methods return the Result of
+// the event: 0 or a negated errno, and the byte count for Read and Write.
+class FUSEStandin
+{
+public:
+    FUSEStandin(FUSE* Target) : mTarget(Target) {}
+
+    int Init(void)
+    {
+        FUSEInitEventParams e = { 0, 0 };
+        mTarget->FireInit(&e);
+        return e.Result;
+    }
+
+    int Destroy(void)
+    {
+        FUSEDestroyEventParams e = { 0 };
+        mTarget->FireDestroy(&e);
+        return e.Result;
+    }
+
+    int Access(const char* Path, int Mask)
+    {
+        FUSEAccessEventParams e = { Path, Mask, 0 };
+        mTarget->FireAccess(&e);
+        return e.Result;
+    }
+
+    int GetAttr(const char* Path, FUSE_STANDIN_ATTR* Attr)
+    {
+        FUSEGetAttrEventParams e = { Path, NULL, &Attr->Ino, 0, 0, 0, 0, &Attr->Size, &Attr->ATime, &Attr->MTime, &Attr->CTime, 0 };
+        mTarget->FireGetAttr(&e);
+        Attr->Mode = e.Mode;
+        Attr->Uid = e.Uid;
+        Attr->Gid = e.Gid;
+        Attr->LinkCount = e.LinkCount;
+        return e.Result;
+    }
+
+    int Create(const char* Path, int Mode)
+    {
+        FUSECreateEventParams e = { Path, Mode, NULL, 0 };
+        mTarget->FireCreate(&e);
+        return e.Result;
+    }
+
+    int MkDir(const char* Path, int Mode)
+    {
+        FUSEMkDirEventParams e = { Path, Mode, 0 };
+        mTarget->FireMkDir(&e);
+        return e.Result;
+    }
+
+    int Open(const char* Path, int Flags)
+    {
+        FUSEOpenEventParams e = { Path, Flags, 0, NULL, 0 };
+        mTarget->FireOpen(&e);
+        return e.Result;
+    }
+
+    int Release(const char* Path, int Flags)
+    {
+        FUSEReleaseEventParams e = { Path, NULL, Flags, 0 };
+        mTarget->FireRelease(&e);
+        return e.Result;
+    }
+
+    int Read(const char* Path, void* Buffer, int64 Offset, int64 Size)
+    {
+        FUSEReadEventParams e = { Path, NULL, Offset, Buffer, Size, 0 };
+        mTarget->FireRead(&e);
+        return e.Result;
+    }
+
+    int Write(const char* Path, const void* Buffer, int64 Offset, int64 Size)
+    {
+        FUSEWriteEventParams e = { Path, NULL, Offset, Buffer, Size, 0, 0 };
+        mTarget->FireWrite(&e);
+        return e.Result;
+    }
+
+    int Flush(const char* Path)
+    {
+        FUSEFlushEventParams e = { Path, NULL, 0 };
+        mTarget->FireFlush(&e);
+        return e.Result;
+    }
+
+    int FSync(const char* Path, int DataSync)
+    {
+        FUSEFSyncEventParams e = { Path, NULL, DataSync, 0 };
+        mTarget->FireFSync(&e);
+        return e.Result;
+    }
+
+    int FAllocate(const char* Path, int Mode, int64 Offset, int64 Length)
+    {
+        FUSEFAllocateEventParams e = { Path, NULL, Mode, Offset, Length, 0 };
+        mTarget->FireFAllocate(&e);
+        return e.Result;
+    }
+
+    int Truncate(const char* Path, int64 Size)
+    {
+        FUSETruncateEventParams e = { Path, NULL, Size, 0 };
+        mTarget->FireTruncate(&e);
+        return e.Result;
+    }
+
+    int UTime(const char* Path, int64 ATime, int64 MTime)
+    {
+        FUSEUTimeEventParams e = { Path, NULL, ATime, MTime, 0 };
+        mTarget->FireUTime(&e);
+        return e.Result;
+    }
+
+    // Entries receives the names passed to FillDir
+    int ReadDir(const char* Path, std::vector<FUSE_STANDIN_ENTRY>& Entries)
+    {
+        FUSEReadDirEventParams e = { Path, &Entries, 0 };
+        Entries.clear();
+        mTarget->FireReadDir(&e);
+        return e.Result;
+    }
+
+    int Rename(const char* OldPath, const char* NewPath, int Flags)
+    {
+        FUSERenameEventParams e = { OldPath, NewPath, Flags, 0 };
+        mTarget->FireRename(&e);
+        return e.Result;
+    }
+
+    int Unlink(const char* Path)
+    {
+        FUSEUnlinkEventParams e = { Path, 0 };
+        mTarget->FireUnlink(&e);
+        return e.Result;
+    }
+
+    int RmDir(const char* Path)
+    {
+        FUSERmDirEventParams e = { Path, 0 };
+        mTarget->FireRmDir(&e);
+        return e.Result;
+    }
+
+    int StatFS(const char* Path, FUSE_STANDIN_STATFS* Stat)
+    {
+        FUSEStatFSEventParams e = { Path, &Stat->BlockSize, &Stat->TotalBlocks, &Stat->FreeBlocks, &Stat->FreeBlocksAvail,
+            &Stat->TotalFiles, &Stat->FreeFiles, &Stat->FreeFilesAvail, 255, 0 };
+        mTarget->FireStatFS(&e);
+        return e.Result;
+    }
+
+private:
+    FUSE* mTarget;
+};
+
+#endif //#if !defined _STANDIN_FUSE_H
@@ -0,0 +1,294 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+
+#ifdef UNIX
+#include <signal.h>
+#endif
+
+#include "watchdog.h"
+
+// characters kept from the path of an operation
+#define WATCHDOG_PATH_LENGTH 256
+
+// the slots are checked four times per threshold, within these limits
+#define WATCHDOG_MIN_INTERVAL_MS 10
+#define WATCHDOG_MAX_INTERVAL_MS 100
+
+#ifdef _UNICODE
+#define WATCHDOG_PATH_FORMAT "%ls"
+#else
+#define WATCHDOG_PATH_FORMAT "%s"
+#endif
+
+// written by the owning thread only; Seq is odd while the fields change
+typedef struct _WATCHDOG_SLOT
+{
+    std::atomic<uint64_t> Seq;
+    std::atomic<const char*> Name;      // NULL while no operation runs
+    std::atomic<int64_t> Start;         // microseconds since g_WatchdogEpoch
+    std::atomic<int64_t> Offset;
+    std::atomic<int64_t> Size;
+    std::atomic<watchdog_char> Path[WATCHDOG_PATH_LENGTH];
+    std::atomic<uint64_t> Reported;     // Seq of the operation logged as running, written by the watchdog
+    std::atomic<bool> InUse;
+    int Id;
+    struct _WATCHDOG_SLOT* Next;
+}   WATCHDOG_SLOT, * PWATCHDOG_SLOT;
+
+// a consistent copy of a slot
+typedef struct
+{
+    uint64_t Seq;
+    const char* Name;
+    int64_t Start;
+    int64_t Offset;
+    int64_t Size;
+    watchdog_char Path[WATCHDOG_PATH_LENGTH];
+}   WATCHDOG_OP;
+
+std::atomic<bool> g_WatchdogEnabled(false);
+
+static std::atomic<PWATCHDOG_SLOT> g_WatchdogSlots(NULL);
+static std::atomic<int> g_WatchdogSlotCount(0);
+static const std::chrono::steady_clock::time_point g_WatchdogEpoch = std::chrono::steady_clock::now();
+
+static std::mutex g_WatchdogLogLock;
+static FILE* g_WatchdogOutput = NULL;
+static std::atomic<int64_t> g_WatchdogThresholdUs(0);
+static std::thread g_WatchdogThread;
+static std::atomic<bool> g_WatchdogStopping(false);
+static std::atomic<bool> g_WatchdogDumpRequested(false);
+
+static int64_t GetTime(void)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - g_WatchdogEpoch).count();
+}
+
+static PWATCHDOG_SLOT AcquireSlot(void)
+{
+    // slots are never freed, the slot of a finished thread is reused
+    for (PWATCHDOG_SLOT slot = g_WatchdogSlots.load(std::memory_order_acquire); slot != NULL; slot = slot->Next)
+    {
+        bool expected = false;
+        if (!slot->InUse.load(std::memory_order_relaxed) &&
+            slot->InUse.compare_exchange_strong(expected, true, std::memory_order_acquire))
+            return slot;
+    }
+
+    PWATCHDOG_SLOT slot = new WATCHDOG_SLOT;
+    slot->Seq.store(0, std::memory_order_relaxed);
+    slot->Name.store(NULL, std::memory_order_relaxed);
+    slot->Reported.store(0, std::memory_order_relaxed);
+    slot->InUse.store(true, std::memory_order_relaxed);
+    slot->Id = g_WatchdogSlotCount.fetch_add(1, std::memory_order_relaxed) + 1;
+    slot->Next = g_WatchdogSlots.load(std::memory_order_relaxed);
+    while (!g_WatchdogSlots.compare_exchange_weak(slot->Next, slot, std::memory_order_release, std::memory_order_relaxed))
+        ;
+    return slot;
+}
+
+class WatchdogSlotHolder
+{
+public:
+    WatchdogSlotHolder() : mSlot(AcquireSlot()) {}
+    ~WatchdogSlotHolder() { mSlot->InUse.store(false, std::memory_order_release); }
+    PWATCHDOG_SLOT mSlot;
+};
+
+static PWATCHDOG_SLOT GetThreadSlot(void)
+{
+    static thread_local WatchdogSlotHolder holder;
+    return holder.mSlot;
+}
+
+void WatchdogScope::Begin(const char* Name, const watchdog_char* Path, int64_t Offset, int64_t Size)
+{
+    PWATCHDOG_SLOT slot = GetThreadSlot();
+    uint64_t seq = slot->Seq.load(std::memory_order_relaxed);
+    int i = 0;
+
+    // a nested scope leaves the outer operation in the slot
+    if (slot->Name.load(std::memory_order_relaxed) != NULL)
+        return;
+
+    slot->Seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot->Name.store(Name, std::memory_order_relaxed);
+    slot->Start.store(GetTime(), std::memory_order_relaxed);
+    slot->Offset.store(Offset, std::memory_order_relaxed);
+    slot->Size.store(Size, std::memory_order_relaxed);
+    for (; Path != NULL && Path[i] != 0 && i < WATCHDOG_PATH_LENGTH - 1; i++)
+        slot->Path[i].store(Path[i], std::memory_order_relaxed);
+    slot->Path[i].store(0, std::memory_order_relaxed);
+
+    slot->Seq.store(seq + 2, std::memory_order_release);
+    mSlot = slot;
+}
+
+// returns false if no operation runs in the slot
+static bool ReadSlot(PWATCHDOG_SLOT Slot, WATCHDOG_OP* Op)
+{
+    // an operation that keeps changing under the reader is not stalled
+    for (int attempt = 0; attempt < 4; attempt++)
+    {
+        Op->Seq = Slot->Seq.load(std::memory_order_acquire);
+        if (Op->Seq & 1)
+            continue;
+
+        Op->Name = Slot->Name.load(std::memory_order_relaxed);
+        Op->Start = Slot->Start.load(std::memory_order_relaxed);
+        Op->Offset = Slot->Offset.load(std::memory_order_relaxed);
+        Op->Size = Slot->Size.load(std::memory_order_relaxed);
+        for (int i = 0; i < WATCHDOG_PATH_LENGTH; i++)
+        {
+            Op->Path[i] = Slot->Path[i].load(std::memory_order_relaxed);
+            if (Op->Path[i] == 0)
+                break;
+        }
+        Op->Path[WATCHDOG_PATH_LENGTH - 1] = 0;
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (Slot->Seq.load(std::memory_order_relaxed) == Op->Seq)
+            return Op->Name != NULL;
+    }
+    return false;
+}
+
+// g_WatchdogLogLock must be held
+static void WriteOp(FILE* Output, const char* What, int Id, const WATCHDOG_OP* Op, int64_t ElapsedUs)
+{
+    char stamp[32];
+    time_t now = time(NULL);
+    struct tm local;
+
+#ifdef WIN32
+    localtime_s(&local, &now);
+#else
+    localtime_r(&now, &local);
+#endif
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &local);
+
+    fprintf(Output, "%s [%d] %s %s " WATCHDOG_PATH_FORMAT, stamp, Id, What, Op->Name, Op->Path);
+    if (Op->Offset >= 0)
+        fprintf(Output, " offset %lld", (long long)Op->Offset);
+    if (Op->Size >= 0)
+        fprintf(Output, " size %lld", (long long)Op->Size);
+    fprintf(Output, " %lld.%03lld ms\n", (long long)(ElapsedUs / 1000), (long long)(ElapsedUs % 1000));
+    fflush(Output);
+}
+
+void WatchdogScope::End(void)
+{
+    PWATCHDOG_SLOT slot = mSlot;
+    int64_t elapsed = GetTime() - slot->Start.load(std::memory_order_relaxed);
+
+    // a late handler writes the record itself, the owner reads its slot without races
+    if (elapsed >= g_WatchdogThresholdUs.load(std::memory_order_relaxed))
+    {
+        WATCHDOG_OP op;
+        ReadSlot(slot, &op);
+
+        std::lock_guard<std::mutex> lock(g_WatchdogLogLock);
+        if (g_WatchdogOutput != NULL)
+            WriteOp(g_WatchdogOutput, "slow, took", slot->Id, &op, elapsed);
+    }
+
+    slot->Name.store(NULL, std::memory_order_release);
+}
+
+void WatchdogDump(FILE* Output)
+{
+    int64_t now = GetTime();
+    WATCHDOG_OP op;
+    int count = 0;
+
+    std::lock_guard<std::mutex> lock(g_WatchdogLogLock);
+    fprintf(Output, "# operations in flight at %lld\n", (long long)time(NULL));
+    for (PWATCHDOG_SLOT slot = g_WatchdogSlots.load(std::memory_order_acquire); slot != NULL; slot = slot->Next)
+    {
+        if (!ReadSlot(slot, &op))
+            continue;
+        WriteOp(Output, "in flight", slot->Id, &op, now - op.Start);
+        count++;
+    }
+    fprintf(Output, "# %d operation(s)\n", count);
+    fflush(Output);
+}
+
+static void CheckSlots(void)
+{
+    int64_t now = GetTime();
+    int64_t threshold = g_WatchdogThresholdUs.load(std::memory_order_relaxed);
+    WATCHDOG_OP op;
+
+    for (PWATCHDOG_SLOT slot = g_WatchdogSlots.load(std::memory_order_acquire); slot != NULL; slot = slot->Next)
+    {
+        if (!ReadSlot(slot, &op) || now - op.Start < threshold ||
+            slot->Reported.load(std::memory_order_relaxed) == op.Seq)
+            continue;
+
+        // logged once while it runs, and once more by the handler when it returns
+        slot->Reported.store(op.Seq, std::memory_order_relaxed);
+        std::lock_guard<std::mutex> lock(g_WatchdogLogLock);
+        WriteOp(g_WatchdogOutput, "slow, running for", slot->Id, &op, now - op.Start);
+    }
+}
+
+#ifdef UNIX
+static void OnDumpSignal(int Signal)
+{
+    g_WatchdogDumpRequested.store(true, std::memory_order_relaxed);
+}
+#endif
+
+static void WatchdogThread(void)
+{
+    int64_t interval = g_WatchdogThresholdUs.load(std::memory_order_relaxed) / 4000;
+    interval = std::min<int64_t>(std::max<int64_t>(interval, WATCHDOG_MIN_INTERVAL_MS), WATCHDOG_MAX_INTERVAL_MS);
+
+    while (!g_WatchdogStopping.load(std::memory_order_acquire))
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(interval));
+        if (g_WatchdogDumpRequested.exchange(false, std::memory_order_relaxed))
+            WatchdogDump(g_WatchdogOutput);
+        CheckSlots();
+    }
+}
+
+void WatchdogStart(int ThresholdMs, FILE* Output)
+{
+    assert(!g_WatchdogThread.joinable());
+
+    g_WatchdogOutput = Output != NULL ? Output : stderr;
+    g_WatchdogThresholdUs.store((int64_t)ThresholdMs * 1000, std::memory_order_relaxed);
+    g_WatchdogEnabled.store(true, std::memory_order_relaxed);
+
+#ifdef UNIX
+    signal(SIGUSR2, OnDumpSignal);
+#endif
+
+    g_WatchdogStopping.store(false, std::memory_order_relaxed);
+    g_WatchdogThread = std::thread(WatchdogThread);
+}
+
+void WatchdogStop(void)
+{
+    if (!g_WatchdogThread.joinable())
+        return;
+
+    g_WatchdogStopping.store(true, std::memory_order_release);
+    g_WatchdogThread.join();
+
+    // handlers still running log to nowhere
+    g_WatchdogEnabled.store(false, std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(g_WatchdogLogLock);
+    g_WatchdogOutput = NULL;
+}
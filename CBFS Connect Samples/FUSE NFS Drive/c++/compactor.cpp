@@ -0,0 +1,78 @@
+#include <assert.h>
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "compactor.h"
+#include "virtualfile.h"
+
+// regions compacted in one interval at most, regions that are empty
+// already included
+#define COMPACTOR_MAX_STEPS 16
+
+static std::thread g_CompactorThread;
+static std::atomic<bool> g_CompactorStopping(false);
+static int64_t g_CompactorBudget = 0;     // bytes per interval
+
+static void CompactorThread(void)
+{
+    int64_t credit = 0;
+    int64_t limit = g_CompactorBudget > PAGEARENA_REGION_SIZE ? g_CompactorBudget : PAGEARENA_REGION_SIZE;
+#ifdef __GLIBC__
+    int intervals = 0;
+#endif
+
+    while (!g_CompactorStopping.load(std::memory_order_acquire))
+    {
+        PAGEARENA_STATS stats;
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(COMPACTOR_INTERVAL_MS));
+
+        // at a low rate a region takes more than one interval, so the
+        // budget not spent is saved up to a region
+        credit += g_CompactorBudget;
+        if (credit > limit)
+            credit = limit;
+
+        for (int step = 0; step < COMPACTOR_MAX_STEPS && credit > 0; step++)
+        {
+            if (!VirtualFile::GetDataArenaStats(&stats) || stats.Fragmentation <= COMPACTOR_THRESHOLD)
+                break;
+            int64_t moved = VirtualFile::CompactData(credit);
+            if (moved < 0)
+                break;
+            credit -= moved;
+        }
+
+#ifdef __GLIBC__
+        if (++intervals * COMPACTOR_INTERVAL_MS >= COMPACTOR_TRIM_INTERVAL_S * 1000)
+        {
+            malloc_trim(0);
+            intervals = 0;
+        }
+#endif
+    }
+}
+
+void CompactorStart(int MegabytesPerSecond)
+{
+    assert(!g_CompactorThread.joinable());
+
+    g_CompactorBudget = (int64_t)MegabytesPerSecond * 1024 * 1024 * COMPACTOR_INTERVAL_MS / 1000;
+    g_CompactorStopping.store(false, std::memory_order_relaxed);
+    g_CompactorThread = std::thread(CompactorThread);
+}
+
+void CompactorStop(void)
+{
+    if (!g_CompactorThread.joinable())
+        return;
+
+    g_CompactorStopping.store(true, std::memory_order_release);
+    g_CompactorThread.join();
+}
@@ -0,0 +1,232 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#ifdef UNIX
+#include <sys/stat.h>
+#endif
+
+#include "virtualfile.h"
+#include "filetree.h"
+#include "treewalk.h"
+
+VirtualFile* g_DiskContext = NULL;
+
+//-----------------------------------------------------------------------------------------------------------
+
+bool LookupVirtualFile(const fuse_char* FileName, VirtualFile*& vfile)
+{
+    // lock-free walk, the caller is inside an epoch read section
+    // and the returned node carries no reference
+    assert(FileName);
+
+    bool result;
+    unsigned seq;
+
+    fuse_char* buffer = (fuse_char*)malloc((fuse_slen(FileName) + 1) * sizeof(fuse_char));
+
+    assert(buffer);
+
+    do
+    {
+        seq = VirtualFile::RenameSeqBegin();
+
+        fuse_scpy(buffer, FileName);
+
+        fuse_char* context = NULL;
+        fuse_char* token = fuse_stok_r(buffer, TEXT("/"), &context);
+
+        VirtualFile* root = g_DiskContext;
+        result = true;
+
+        while (token != NULL)
+        {
+            if (!root->get_Context()->GetFile(token, root))
+            {
+                result = false;
+                break;
+            }
+            token = fuse_stok_r(NULL, TEXT("/"), &context);
+        }
+        vfile = root;
+    } while (VirtualFile::RenameSeqRetry(seq));
+
+    free(buffer);
+
+    return result;
+}
+
+//-----------------------------------------------------------------------------------------------------------
+
+bool FindVirtualFile(const fuse_char* FileName, VirtualFile*& vfile)
+{
+    // the returned node carries a reference that the caller must release
+    EpochGuard guard;
+
+    if (LookupVirtualFile(FileName, vfile) && vfile->TryAddRef())
+        return true;
+
+    vfile = NULL;
+    return false;
+}
+
+//-----------------------------------------------------------------------------------------------------------
+
+bool GetParentVirtualDirectory(const fuse_char* FileName, VirtualFile*& vfile)
+{
+    assert(FileName);
+
+    const fuse_char* result = GetFileName(FileName);
+
+    fuse_char* buffer = (fuse_char*)malloc((result - FileName + 1) * sizeof(fuse_char));
+
+    memcpy(buffer, FileName, (result - FileName) * sizeof(fuse_char));
+
+    buffer[result - FileName] = 0;
+
+    bool find = FindVirtualFile(buffer, vfile);
+
+    free(buffer);
+
+    return find;
+}
+
+//-----------------------------------------------------------------------------------------------------------
+
+bool FindVirtualDirectory(const fuse_char* FileName, VirtualFile*& vfile)
+{
+    assert(FileName);
+
+    bool find = false;
+
+    if (FindVirtualFile(FileName, vfile))
+    {
+        if ((vfile->get_Mode() & S_IFDIR) != 0)
+            return true;
+        vfile->Release();
+    }
+
+    find = GetParentVirtualDirectory(FileName, vfile);
+
+    assert(find == true);
+    return find;
+}
+
+
+//-----------------------------------------------------------------------------------------------------------
+const fuse_char* GetFileName(const fuse_char* fullpath)
+{
+    assert(fullpath);
+
+    const fuse_char* result = &fullpath[fuse_slen(fullpath)];
+
+    while (--result != fullpath)
+    {
+        if (*result == '/')
+            break;
+    }
+    return ++result;
+}
+
+//-----------------------------------------------------------------------------------------------------------
+void DeleteDiskContext(void)
+{
+    if (g_DiskContext == NULL)
+        return;
+    RemoveAllFiles(g_DiskContext);
+    g_DiskContext->Release();
+    g_DiskContext = NULL;
+
+    // what was retired is only freed once no reader can see it, which is
+    // now, and leak checks would report it at exit otherwise
+    EpochFlush();
+}
+
+//-----------------------------------------------------------------------------------------------------------
+void RemoveAllFiles(VirtualFile* root)
+{
+    assert(root);
+
+    // the subtrees are emptied, and their files freed, in parallel
+    TreeWalk(root, TREEWALK_UNLINK, 0, NULL, NULL, NULL);
+}
+
+//-----------------------------------------------------------------------------------------------------------
+
+typedef struct
+{
+    int64 DiskSize;
+    char Padding[64 - sizeof(int64)];   // every thread adds to a line of its own
+}   FOLDER_SIZE;
+
+typedef struct
+{
+    int SectorSize;
+    FOLDER_SIZE Sizes[TREEWALK_MAX_THREADS];
+}   FOLDER_SIZE_CONTEXT;
+
+static bool AddFolderSize(const TREEWALK_NODE* Node, void* Context)
+{
+    FOLDER_SIZE_CONTEXT* context = (FOLDER_SIZE_CONTEXT*)Context;
+
+    context->Sizes[Node->Worker].DiskSize += (Node->File->get_AllocationSize() + context->SectorSize - 1) & ~(int64)(context->SectorSize - 1);
+    return true;
+}
+
+int64 CalculateFolderSize(VirtualFile* root, int SectorSize)
+{
+    if (root == NULL)
+        return 0;
+    FOLDER_SIZE_CONTEXT context;
+    int64 DiskSize = 0;
+
+    context.SectorSize = SectorSize;
+    for (int i = 0; i < TREEWALK_MAX_THREADS; i++)
+        context.Sizes[i].DiskSize = 0;
+
+    TreeWalk(root, 0, 0, AddFolderSize, &context, NULL);
+    for (int i = 0; i < TREEWALK_MAX_THREADS; i++)
+        DiskSize += context.Sizes[i].DiskSize;
+    return DiskSize;
+}
+
+//-----------------------------------------------------------------------------------------------------------
+
+static bool VerifyNode(const TREEWALK_NODE* Node, void* Context)
+{
+    std::atomic<int64>* problems = (std::atomic<int64>*)Context;
+    VirtualFile* vfile = Node->File;
+    VirtualFile* parent = vfile->get_Parent();
+    const fuse_char* name = vfile->get_Name();
+    const char* problem = NULL;
+
+    // a node unlinked since its directory was listed has no parent
+    if (parent != NULL && parent != Node->Parent)
+        problem = "is listed in a directory that is not its parent";
+    else if (name[0] == 0)
+        problem = "has an empty name";
+    else if ((vfile->get_Mode() & S_IFDIR) == 0 && !vfile->get_Context()->IsEmpty())
+        problem = "is not a directory but has children";
+    for (const fuse_char* p = name; problem == NULL && *p != 0; p++)
+    {
+        if (*p == '/')
+            problem = "has a name with a path separator";
+    }
+
+    if (problem != NULL)
+    {
+        fprintf(stderr, "VerifyTree: node %p at depth %d %s\n", (void*)vfile, Node->Depth, problem);
+        problems->fetch_add(1, std::memory_order_relaxed);
+    }
+    return true;
+}
+
+int64 VerifyTree(VirtualFile* root)
+{
+    assert(root);
+    std::atomic<int64> problems(0);
+
+    TreeWalk(root, TREEWALK_BLOCK_RENAMES, 0, VerifyNode, &problems, NULL);
+    return problems.load(std::memory_order_relaxed);
+}
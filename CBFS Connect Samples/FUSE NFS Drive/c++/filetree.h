@@ -0,0 +1,40 @@
+#if !defined _FILETREE_H
+#define _FILETREE_H
+
+#include "virtualfile.h"
+
+// Path helpers of the VirtualFile tree.
+//
+// They depend on nothing but the tree, so the benchmark links them without
+// the FUSE class. Paths are absolute and use '/' as the separator.
+
+// the root directory of the drive
+extern VirtualFile* g_DiskContext;
+
+// frees the tree and the nodes and pages its updates retired; nothing may
+// use the tree any more
+void DeleteDiskContext(void);
+
+// lock-free walk, the caller must be inside an epoch read section and the
+// returned node carries no reference
+bool LookupVirtualFile(const fuse_char* FileName, VirtualFile*& vfile);
+
+// the returned node carries a reference that the caller must release
+bool FindVirtualFile(const fuse_char* FileName, VirtualFile*& vfile);
+bool FindVirtualDirectory(const fuse_char* FileName, VirtualFile*& vfile);
+bool GetParentVirtualDirectory(const fuse_char* FileName, VirtualFile*& vfile);
+
+// the last component of the path
+const fuse_char* GetFileName(const fuse_char* fullpath);
+
+// the tree walks run on all cores, see treewalk.h
+void RemoveAllFiles(VirtualFile* root);
+
+// the space taken by the files below root, rounded up to whole sectors
+int64 CalculateFolderSize(VirtualFile* root, int SectorSize);
+
+// the nodes below root whose links or names are broken, each reported on
+// stderr; renames wait until the walk is done
+int64 VerifyTree(VirtualFile* root);
+
+#endif //#if !defined _FILETREE_H
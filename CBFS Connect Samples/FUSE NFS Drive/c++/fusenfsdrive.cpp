@@ -0,0 +1,2325 @@
+/*
+ * CBFS Connect 2024 C++ Edition - Sample Project
+ *
+ * This sample project demonstrates the usage of CBFS Connect in a 
+ * simple, straightforward way. It is not intended to be a complete 
+ * application. Error handling and other checks are simplified for clarity.
+ *
+ * www.callback.com/cbfsconnect
+ *
+ * This code is subject to the terms and conditions specified in the 
+ * corresponding product license agreement which outlines the authorized 
+ * usage and restrictions.
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <assert.h> 
+#include <time.h>
+#include <iostream>
+#include <filesystem>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+#ifdef WIN32
+#include <conio.h>
+#include <tchar.h>
+#include <Shlwapi.h>
+#endif
+
+#ifdef UNIX
+#include <unistd.h>
+#include <poll.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+
+#include <sys/param.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#endif
+
+#include "cbfsconnectcommon.h"
+#include "virtualfile.h"
+#include "filetree.h"
+#include "trace.h"
+#include "opstats.h"
+#include "probes.h"
+#include "metrics.h"
+#include "watchdog.h"
+#include "compactor.h"
+#include "sweeper.h"
+#include "treewalk.h"
+#include "recorder.h"
+
+#ifdef _UNICODE
+#include "../../include/unicode/fuse.h"
+#include "../../include/unicode/nfs.h"
+#else
+#include "../../include/fuse.h"
+#include "../../include/nfs.h"
+#endif
+
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE 1 
+#endif
+
+#ifndef O_ACCMODE
+#define O_ACCMODE 3
+#endif
+
+using namespace std;
+using namespace cbcConstants;
+
+#ifdef UNICODE
+#define sout wcout
+#define scin wcin
+typedef std::wstring cbt_string;
+#else
+#define sout cout
+#define scin cin
+typedef std::string cbt_string;
+#define _T(q) q
+#endif
+
+// files listed by DumpHotFiles
+int g_HotFileCount = 10;
+
+// serve the live counters in /.cbfs of the FUSE mount, see metrics.h
+bool g_StatsDir = false;
+
+//support routines
+void DumpHotFiles(FILE* Output);
+
+#ifndef UNIX
+#ifndef S_IFMT 
+#define S_IFMT 61440
+#endif 
+#define S_IFSOCK 49152
+#define S_IFLNK 40960
+#ifndef S_IFREG 
+#define S_IFREG 32768
+#endif
+#define S_IFBLK 24576
+#ifndef S_IFDIR 
+#define S_IFDIR 16384
+#endif
+#ifndef S_IFCHR 
+#define S_IFCHR 8192
+#endif
+#define S_IFIFO 4096
+#define S_ISUID 2048
+#define S_ISGID 1024
+#define S_ISVTX 512
+#define S_IRWXU 448
+#define S_IRUSR 256
+#define S_IWUSR 128
+#define S_IXUSR 64
+#define S_IRWXG 56
+#define S_IRGRP 32
+#define S_IWGRP 16
+#define S_IXGRP 8
+#define S_IRWXO 7
+#define S_IROTH 4
+#define S_IWOTH 2
+#define S_IXOTH 1
+#endif
+
+#define baseCookie 0x12345678
+
+// Type -> Directory, Permissions -> 755
+#define DIR_MODE S_IFDIR | S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH
+
+// Type -> File, Permissions 644
+#define FILE_MODE S_IFREG | S_IWUSR | S_IRUSR | S_IRGRP | S_IROTH
+
+class MemDriveFUSE : public FUSE
+{
+public: // Events
+
+    int GetSectorSize()
+    {
+        fuse_char* SS = this->Config(TEXT("SectorSize"));
+        if (SS != NULL && fuse_slen(SS) > 0)
+            return fuse_stoi(SS);
+        else
+            return 0;
+    }
+
+    MemDriveFUSE() : FUSE()
+    {
+    }
+
+    int FireAccess(FUSEAccessEventParams* e) override
+    {
+        OPSTATS_SCOPE("FUSE Access", e->Result, OPSTATS_NEGATIVE_ERROR, -1);
+        PROBE_HANDLER(fuse, access, e->Path, -1, -1, e->Result);
+        WATCHDOG_SCOPE("FUSE Access", e->Path, -1, -1);
+        RECORDER_SCOPE(RECORDER_OP_FUSE_ACCESS, e->Path, NULL, -1, -1, e->Mask, e->Result, NULL);
+
+        return 0;
+    }
+
+    int FireChmod(FUSEChmodEventParams* e) override
+    {
+        PROBE_HANDLER(fuse, chmod, e->Path, -1, -1, e->Result);
+
+        return 0;
+    }
+
+    int FireChown(FUSEChownEventParams* e) override
+    {
+        PROBE_HANDLER(fuse, chown, e->Path, -1, -1, e->Result);
+
+        return 0;
+    }
+
+    int FireCopyFileRange(FUSECopyFileRangeEventParams* e) override
+    {
+        PROBE_HANDLER(fuse, copyfilerange, e->PathIn, e->OffsetIn, e->Size, e->Result);
+
+        return 0;
+    }
+
+    int FireCreate(FUSECreateEventParams* e) override
+    {
+        OPSTATS_SCOPE("FUSE Create", e->Result, OPSTATS_NEGATIVE_ERROR, -1);
+        PROBE_HANDLER(fuse, create, e->Path, -1, -1, e->Result);
+        WATCHDOG_SCOPE("FUSE Create", e->Path, -1, -1);
+        RECORDER_SCOPE(RECORDER_OP_FUSE_CREATE, e->Path, NULL, -1, -1, e->Mode, e->Result, NULL);
+
+        if (g_StatsDir && MetricsGetFile(e->Path) != METRICS_NONE)
+        {
+            e->Result = -EACCES;
+            return e->Result;
+        }
+
+        VirtualFile* vfile = NULL, * vdir = NULL;
+        int64 now;
+#ifdef UNIX
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        now = UnixTimeToFileTime(tv.tv_sec, tv.tv_usec * 1000);
+#endif // UNIX
+#ifdef WIN32
+        GetSystemTimeAsFileTime((LPFILETIME)&now);
+#endif // WIND32
+
+        if (!GetParentVirtualDirectory(e->Path, vdir))
+        {
+            e->Result = -ENOENT;
+            return e->Result;
+        }
+
+        vdir->LockExclusive();
+
+        if (vdir->get_Context()->GetFile(GetFileName(e->Path), vfile))
+        {
+            vdir->UnlockExclusive();
+            vdir->Release();
+            e->Result = -EEXIST;
+            return e->Result;
+        }
+
+        vfile = new VirtualFile(GetFileName(e->Path), e->Mode);
+        if (vfile->get_Name() == NULL)
+        {
+            vfile->Release();
+            vdir->UnlockExclusive();
+            vdir->Release();
+            e->Result = -ENOMEM;
+            return e->Result;
+        }
+
+        vfile->set_Gid(GetGid());
+        vfile->set_Uid(GetUid());
+
+        vfile->set_CreationTime(now);
+        vfile->set_LastAccessTime(now);
+        vfile->set_LastWriteTime(now);
+
+        vdir->AddFile(vfile);
+
+        vdir->UnlockExclusive();
+        vdir->Release();
+
+        return 0;
+    }
+
+    int FireDestroy(FUSEDestroyEventParams* e) override
+    {
+        PROBE_HANDLER(fuse, destroy, NULL, -1, -1, e->Result);
+
+        return 0;
+    }
+
+    int FireError(FUSEErrorEventParams* e) override
+    {
+        return 0;
+    }
+
+    int FireFAllocate(FUSEFAllocateEventParams* e) override
+    {
+        OPSTATS_SCOPE("FUSE FAllocate", e->Result, OPSTATS_NEGATIVE_ERROR, -1);
+        PROBE_HANDLER(fuse, fallocate, e->Path, e->Offset, e->Length, e->Result);
+        WATCHDOG_SCOPE("FUSE FAllocate", e->Path, e->Offset, e->Length);
+        RECORDER_SCOPE(RECORDER_OP_FUSE_FALLOCATE, e->Path, NULL, e->Offset, e->Length, e->Mode, e->Result, NULL);
+
+        VirtualFile* vfile = NULL;
+
+        if (FindVirtualFile(e->Path, vfile))
+        {
+
+            int flags = e->Mode & (~FALLOC_FL_KEEP_SIZE);
+            if (flags != 0) // if we detect unsupported flags in Mode, we deny the request
+            {
+                vfile->Release();
+                e->Result = -EOPNOTSUPP;
+                return e->Result;
+            }
+
+            vfile->LockExclusive();
+
+            int64 fsize = vfile->get_Size();
+
+            if (e->Offset + e->Length >= fsize)
+            {
+                int64 newSize = e->Offset + e->Length;
+                if (!vfile->set_AllocationSize(newSize))
+                    e->Result = -ENOMEM;
+                else if ((e->Mode & FALLOC_FL_KEEP_SIZE) != FALLOC_FL_KEEP_SIZE)
+                {
+                    // fallocate may be used on non-Windows systems to expand file size
+                    // Windows component always sets the FALLOC_FL_KEEP_SIZE flag
+                    if (fsize < newSize)
+                        vfile->set_Size(newSize);
+                }
+            }
+
+            vfile->UnlockExclusive();
+            vfile->Release();
+        }
+        else
+            e->Result = -ENOENT;
+
+        return e->Result;
+    }
+
+    int FireFlush(FUSEFlushEventParams* e) override
+    {
+        OPSTATS_SCOPE("FUSE Flush", e->Result, OPSTATS_NEGATIVE_ERROR, -1);
+        PROBE_HANDLER(fuse, flush, e->Path, -1, -1, e->Result);
+        WATCHDOG_SCOPE("FUSE Flush", e->Path, -1, -1);
+        RECORDER_SCOPE(RECORDER_OP_FUSE_FLUSH, e->Path, NULL, -1, -1, 0, e->Result, NULL);
+
+        return 0;
+    }
+
+    int FireFSync(FUSEFSyncEventParams* e) override
+    {
+        OPSTATS_SCOPE("FUSE FSync", e->Result, OPSTATS_NEGATIVE_ERROR, -1);
+        PROBE_HANDLER(fuse, fsync, e->Path, -1, -1, e->Result);
+        WATCHDOG_SCOPE("FUSE FSync", e->Path, -1, -1);
+        RECORDER_SCOPE(RECORDER_OP_FUSE_FSYNC, e->Path, NULL, -1, -1, e->DataSync, e->Result, NULL);
+
+        return 0;
+    }
+
+    int FireGetAttr(FUSEGetAttrEventParams* e) override
+    {
+        OPSTATS_SCOPE("FUSE GetAttr", e->Result, OPSTATS_NEGATIVE_ERROR, -1);
+        PROBE_HANDLER(fuse, getattr, e->Path, -1, -1, e->Result);
+        WATCHDOG_SCOPE("FUSE GetAttr", e->Path, -1, -1);
+        RECORDER_SCOPE(RECORDER_OP_FUSE_GETATTR, e->Path, NULL, -1, -1, 0, e->Result, NULL);
+
+        int stats = g_StatsDir ? MetricsGetFile(e->Path) : METRICS_NONE;
+        if (stats != METRICS_NONE)
+        {
+            e->Result = GetStatsAttr(e, stats);
+            return e->Result;
+        }
+
+        e->Result = -ENOENT;
+
+        VirtualFile* vfile = NULL;
+        VIRTUALFILE_ATTRIBUTES attr;
+        EpochGuard guard;
+
+        if (LookupVirtualFile(e->Path, vfile))
+        {
+            vfile->GetAttributes(&attr);
+            e->Result = 0;
+            *(e->pIno) = (int64)vfile;
+            e->Mode = attr.Mode;
+            e->Uid = attr.Uid;
+            e->Gid = attr.Gid;
+            e->LinkCount = 1;
+            if ((e->Mode & S_IFDIR) != 0)
+                *(e->pSize) = 512;
+            else
+                *(e->pSize) = attr.Size;
+            *(e->pCTime) = attr.CreationTime;
+            *(e->pMTime) = attr.LastWriteTime;
+            *(e->pATime) = attr.LastAccessTime;
+        }
+
+        return e->Result;
+    }
+
+    int FireInit(FUSEInitEventParams* e) override
+    {
+        PROBE_HANDLER(fuse, init, NULL, -1, -1, e->Result);
+
+        return 0;
+    }
+
+    int FireMkDir(FUSEMkDirEventParams* e) override
+    {
+        OPSTATS_SCOPE("FUSE MkDir", e->Result, OPSTATS_NEGATIVE_ERROR, -1);
+        PROBE_HANDLER(fuse, mkdir, e->Path, -1, -1, e->Result);
+        WATCHDOG_SCOPE("FUSE MkDir", e->Path, -1, -1);
+        RECORDER_SCOPE(RECORDER_OP_FUSE_MKDIR, e->Path, NULL, -1, -1, e->Mode, e->Result, NULL);
+
+        if (g_StatsDir && MetricsGetFile(e->Path) != METRICS_NONE)
+        {
+            e->Result = -EACCES;
+            return e->Result;
+        }
+
+        VirtualFile* vfile = NULL, * vdir = NULL;
+        int64 now;
+#ifdef UNIX
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        now = UnixTimeToFileTime(tv.tv_sec, tv.tv_usec * 1000);
+#endif // UNIX
+#ifdef WIN32
+        GetSystemTimeAsFileTime((LPFILETIME)&now);
+#endif // WIND32
+
+        if (!GetParentVirtualDirectory(e->Path, vdir))
+        {
+            e->Result = -ENOENT;
+            return e->Result;
+        }
+
+        vdir->LockExclusive();
+
+        if (vdir->get_Context()->GetFile(GetFileName(e->Path), vfile))
+        {
+            vdir->UnlockExclusive();
+            vdir->Release();
+            e->Result = -EEXIST;
+            return e->Result;
+        }
+
+        vfile = new VirtualFile(GetFileName(e->Path), e->Mode);
+        if (vfile->get_Name() == NULL)
+        {
+            vfile->Release();
+            vdir->UnlockExclusive();
+            vdir->Release();
+            e->Result = -ENOMEM;
+            return e->Result;
+        }
+
+        vfile->set_Gid(GetGid());
+        vfile->set_Uid(GetUid());
+        vfile->set_CreationTime(now);
+        vfile->set_LastAccessTime(now);
+        vfile->set_LastWriteTime(now);
+
+        vdir->AddFile(vfile);
+
+        vdir->UnlockExclusive();
+        vdir->Release();
+
+        return 0;
+    }
+
+    int FireOpen(FUSEOpenEventParams* e) override
+    {
+        OPSTATS_SCOPE("FUSE Open", e->Result, OPSTATS_NEGATIVE_ERROR, -1);
+        PROBE_HANDLER(fuse, open, e->Path, -1, -1, e->Result);
+        WATCHDOG_SCOPE("FUSE Open", e->Path, -1, -1);
+        RECORDER_SCOPE(RECORDER_OP_FUSE_OPEN, e->Path, NULL, -1, -1, e->Flags, e->Result, NULL);
+
+        int stats = g_StatsDir ? MetricsGetFile(e->Path) : METRICS_NONE;
+        if (stats != METRICS_NONE)
+        {
+            if (stats < 0)
+                e->Result = stats == METRICS_DIR ? -EISDIR : -ENOENT;
+            else if ((e->Flags & O_ACCMODE) != O_RDONLY)
+                e->Result = -EACCES;
+            else
+                e->DirectIO = TRUE; // the size changes with every rendering
+            return e->Result;
+        }
+
+        VirtualFile* vfile;
+        if (FindVirtualFile(e->Path, vfile))
+        {
+            vfile->Release();
+            return 0;
+        }
+        else
+            e->Result = -ENOENT;
+        return e->Result;
+    }
+
+    int FireRead(FUSEReadEventParams* e) override
+    {
+        OPSTATS_SCOPE("FUSE Read", e->Result, OPSTATS_NEGATIVE_ERROR, e->Size);
+        PROBE_HANDLER(fuse, read, e->Path, e->Offset, e->Size, e->Result);
+        WATCHDOG_SCOPE("FUSE Read", e->Path, e->Offset, e->Size);
+        RECORDER_SCOPE(RECORDER_OP_FUSE_READ, e->Path, NULL, e->Offset, e->Size, 0, e->Result, NULL);
+
+        int stats = g_StatsDir ? MetricsGetFile(e->Path) : METRICS_NONE;
+        if (stats != METRICS_NONE)
+        {
+            e->Result = ReadStatsFile(e, stats);
+            return e->Result < 0 ? e->Result : 0;
+        }
+
+        int64 BytesRead;
+        VirtualFile* vfile;
+
+        if (FindVirtualFile(e->Path, vfile))
+        {
+            // Result is an int, a larger request is served in part
+            vfile->LockShared();
+            vfile->Read((void*)e->Buffer, e->Offset, e->Size < INT_MAX ? e->Size : INT_MAX, &BytesRead);
+            vfile->UnlockShared();
+            vfile->Release();
+            e->Result = (int)BytesRead;
+            return 0;
+        }
+        else
+            e->Result = -ENOENT;
+        return e->Result;
+    }
+
+    int FireReadDir(FUSEReadDirEventParams* e) override
+    {
+        OPSTATS_SCOPE("FUSE ReadDir", e->Result, OPSTATS_NEGATIVE_ERROR, -1);
+        PROBE_HANDLER(fuse, readdir, e->Path, -1, -1, e->Result);
+        WATCHDOG_SCOPE("FUSE ReadDir", e->Path, -1, -1);
+        RECORDER_SCOPE(RECORDER_OP_FUSE_READDIR, e->Path, NULL, -1, -1, 0, e->Result, NULL);
+
+        int stats = g_StatsDir ? MetricsGetFile(e->Path) : METRICS_NONE;
+        if (stats != METRICS_NONE)
+        {
+            if (stats == METRICS_DIR)
+                ListStatsDir(e);
+            else
+                e->Result = stats == METRICS_NO_FILE ? -ENOENT : -ENOTDIR;
+            return 0;
+        }
+
+        VirtualFile* vdir = NULL;
+        std::vector<VIRTUALFILE_ENTRY> entries;
+        EpochGuard guard;
+
+        if (LookupVirtualFile(e->Path, vdir) && (vdir->get_Mode() & S_IFDIR) != 0)
+        {
+            vdir->get_Context()->GetEntries(entries);
+            for (size_t i = 0; i < entries.size(); i++)
+            {
+                VIRTUALFILE_ATTRIBUTES& attr = entries[i].Attributes;
+                FillDir(e->FillerContext, entries[i].Name, 0,
+                    attr.Mode, attr.Uid, attr.Gid, 1,
+                    attr.Size, attr.LastAccessTime,
+                    attr.LastWriteTime, attr.CreationTime);
+            }
+        }
+        else
+            e->Result = -ENOTDIR;
+
+        return 0;
+    }
+
+    int FireRelease(FUSEReleaseEventParams* e) override
+    {
+        OPSTATS_SCOPE("FUSE Release", e->Result, OPSTATS_NEGATIVE_ERROR, -1);
+        PROBE_HANDLER(fuse, release, e->Path, -1, -1, e->Result);
+        WATCHDOG_SCOPE("FUSE Release", e->Path, -1, -1);
+        RECORDER_SCOPE(RECORDER_OP_FUSE_RELEASE, e->Path, NULL, -1, -1, e->Flags, e->Result, NULL);
+
+        return 0;
+    }
+
+    int FireRename(FUSERenameEventParams* e) override
+    {
+        OPSTATS_SCOPE("FUSE Rename", e->Result, OPSTATS_NEGATIVE_ERROR, -1);
+        PROBE_HANDLER(fuse, rename, e->OldPath, -1, -1, e->Result);
+        WATCHDOG_SCOPE("FUSE Rename", e->OldPath, -1, -1);
+        RECORDER_SCOPE(RECORDER_OP_FUSE_RENAME, e->OldPath, e->NewPath, -1, -1, e->Flags, e->Result, NULL);
+
+        if (g_StatsDir && (MetricsGetFile(e->OldPath) != METRICS_NONE || MetricsGetFile(e->NewPath) != METRICS_NONE))
+        {
+            e->Result = -EACCES;
+            return e->Result;
+        }
+
+        VirtualFile* voldfile = NULL, * vnewfile = NULL, * voldparent = NULL, * vnewparent = NULL;
+
+        if (!GetParentVirtualDirectory(e->OldPath, voldparent))
+        {
+            e->Result = -ENOENT;
+            return e->Result;
+        }
+
+        if (!GetParentVirtualDirectory(e->NewPath, vnewparent))
+        {
+            voldparent->Release();
+            e->Result = -ENOENT;
+            return e->Result;
+        }
+
+        VirtualFile::LockRename(voldparent, vnewparent);
+
+        if (!voldparent->get_Context()->GetFile(GetFileName(e->OldPath), voldfile))
+            e->Result = -ENOENT;
+        else if (voldfile == vnewparent || voldfile->IsAncestorOf(vnewparent))
+            e->Result = -EINVAL;
+        else
+        {
+            if (vnewparent->get_Context()->GetFile(GetFileName(e->NewPath), vnewfile) && vnewfile != voldfile)
+            {
+                if (e->Flags != 0)
+                    e->Result = -EEXIST;
+                else if ((vnewfile->get_Mode() & S_IFDIR) != 0)
+                {
+                    // an ancestor of the source is never empty, and it must not be locked after its descendant
+                    if (vnewfile == voldparent || vnewfile->IsAncestorOf(voldparent))
+                        e->Result = -ENOTEMPTY;
+                    else
+                    {
+                        vnewfile->LockShared();
+                        if (!vnewfile->get_Context()->IsEmpty())
+                            e->Result = -ENOTEMPTY;
+                        vnewfile->UnlockShared();
+                    }
+                }
+            }
+            if (e->Result == 0 && vnewfile != voldfile)
+            {
+                // the target is replaced only once the new name is allocated
+                voldfile->Remove();
+                if (!voldfile->Rename(GetFileName(e->NewPath)))
+                {
+                    voldparent->AddFile(voldfile);
+                    e->Result = -ENOMEM;
+                }
+                else
+                {
+                    if (vnewfile != NULL)
+                    {
+                        vnewfile->Remove();
+                        vnewfile->Release();
+                    }
+                    vnewparent->AddFile(voldfile);
+                }
+            }
+        }
+
+        VirtualFile::UnlockRename(voldparent, vnewparent);
+
+        voldparent->Release();
+        vnewparent->Release();
+
+        return e->Result;
+    }
+
+    int FireRmDir(FUSERmDirEventParams* e) override
+    {
+        OPSTATS_SCOPE("FUSE RmDir", e->Result, OPSTATS_NEGATIVE_ERROR, -1);
+        PROBE_HANDLER(fuse, rmdir, e->Path, -1, -1, e->Result);
+        WATCHDOG_SCOPE("FUSE RmDir", e->Path, -1, -1);
+        RECORDER_SCOPE(RECORDER_OP_FUSE_RMDIR, e->Path, NULL, -1, -1, 0, e->Result, NULL);
+
+        VirtualFile* vfile = NULL, * vdir = NULL;
+
+        if (!GetParentVirtualDirectory(e->Path, vdir))
+        {
+            e->Result = -ENOENT;
+            return e->Result;
+        }
+
+        vdir->LockExclusive();
+
+        if (vdir->get_Context()->GetFile(GetFileName(e->Path), vfile))
+        {
+            vfile->LockShared();
+            bool directory = (vfile->get_Mode() & S_IFDIR) != 0;
+            bool empty = vfile->get_Context()->IsEmpty();
+            vfile->UnlockShared();
+
+            if (!directory)
+                e->Result = -ENOTDIR;
+            else if (!empty)
+                e->Result = -ENOTEMPTY;
+            else
+            {
+                vfile->Remove();
+                vfile->Release();
+            }
+        }
+        else
+            e->Result = -ENOENT;
+
+        vdir->UnlockExclusive();
+        vdir->Release();
+
+        return e->Result;
+    }
+
+    int FireStatFS(FUSEStatFSEventParams* e) override
+    {
+        OPSTATS_SCOPE("FUSE StatFS", e->Result, OPSTATS_NEGATIVE_ERROR, -1);
+        PROBE_HANDLER(fuse, statfs, e->Path, -1, -1, e->Result);
+        WATCHDOG_SCOPE("FUSE StatFS", e->Path, -1, -1);
+        RECORDER_SCOPE(RECORDER_OP_FUSE_STATFS, e->Path, NULL, -1, -1, 0, e->Result, NULL);
+
+        int SectorSize;
+        int64 TotalMemory;
+#ifdef WIN32
+        MEMORYSTATUS status;
+        GlobalMemoryStatus(&status);
+
+        TotalMemory = status.dwTotalVirtual;
+        SectorSize = GetSectorSize();
+#endif
+
+#ifdef UNIX
+        TotalMemory = 1024 * 1024 * 1024;
+        SectorSize = 512;
+#endif
+
+        // the data bytes are counted as pages and buffers are allocated and
+        // freed, rather than summed over the tree for every call
+        * (e->pBlockSize) = GetSectorSize();
+        *(e->pTotalBlocks) = TotalMemory / SectorSize;
+        *(e->pFreeBlocks) = *(e->pFreeBlocksAvail) = (TotalMemory - VirtualFile::GetPageBytes() + SectorSize / 2) / SectorSize;
+
+        return 0;
+    }
+
+    int FireTruncate(FUSETruncateEventParams* e) override
+    {
+        OPSTATS_SCOPE("FUSE Truncate", e->Result, OPSTATS_NEGATIVE_ERROR, -1);
+        PROBE_HANDLER(fuse, truncate, e->Path, -1, e->Size, e->Result);
+        WATCHDOG_SCOPE("FUSE Truncate", e->Path, -1, e->Size);
+        RECORDER_SCOPE(RECORDER_OP_FUSE_TRUNCATE, e->Path, NULL, -1, e->Size, 0, e->Result, NULL);
+
+        VirtualFile* vfile = NULL;
+
+        if (FindVirtualFile(e->Path, vfile))
+        {
+            vfile->LockExclusive();
+            vfile->set_Size(e->Size);
+            vfile->UnlockExclusive();
+            vfile->Release();
+        }
+        else
+            e->Result = -ENOENT;
+
+        return e->Result;
+    }
+
+    int FireUnlink(FUSEUnlinkEventParams* e) override
+    {
+        OPSTATS_SCOPE("FUSE Unlink", e->Result, OPSTATS_NEGATIVE_ERROR, -1);
+        PROBE_HANDLER(fuse, unlink, e->Path, -1, -1, e->Result);
+        WATCHDOG_SCOPE("FUSE Unlink", e->Path, -1, -1);
+        RECORDER_SCOPE(RECORDER_OP_FUSE_UNLINK, e->Path, NULL, -1, -1, 0, e->Result, NULL);
+
+        VirtualFile* vfile = NULL, * vdir = NULL;
+
+        if (!GetParentVirtualDirectory(e->Path, vdir))
+        {
+            e->Result = -ENOENT;
+            return e->Result;
+        }
+
+        vdir->LockExclusive();
+
+        if (vdir->get_Context()->GetFile(GetFileName(e->Path), vfile))
+        {
+            // unlink(2) never removes directories
+            if ((vfile->get_Mode() & S_IFDIR) != 0)
+                e->Result = -EISDIR;
+            else
+            {
+                vfile->Remove();
+                vfile->Release();
+            }
+        }
+        else
+            e->Result = -ENOENT;
+
+        vdir->UnlockExclusive();
+        vdir->Release();
+
+        return e->Result;
+    }
+
+    int FireUTime(FUSEUTimeEventParams* e) override
+    {
+        OPSTATS_SCOPE("FUSE UTime", e->Result, OPSTATS_NEGATIVE_ERROR, -1);
+        PROBE_HANDLER(fuse, utime, e->Path, -1, -1, e->Result);
+        WATCHDOG_SCOPE("FUSE UTime", e->Path, -1, -1);
+        RECORDER_SCOPE(RECORDER_OP_FUSE_UTIME, e->Path, NULL, e->ATime, e->MTime, 0, e->Result, NULL);
+
+        VirtualFile* vfile = NULL;
+
+        if (FindVirtualFile(e->Path, vfile))
+        {
+            vfile->LockExclusive();
+            if (e->ATime != 0)
+                vfile->set_LastAccessTime(e->ATime);
+            if (e->MTime != 0)
+                vfile->set_LastWriteTime(e->MTime);
+            vfile->UnlockExclusive();
+            vfile->Release();
+        }
+        else
+            e->Result = -ENOENT;
+
+        return e->Result;
+    }
+
+    int FireWrite(FUSEWriteEventParams* e) override
+    {
+        OPSTATS_SCOPE("FUSE Write", e->Result, OPSTATS_NEGATIVE_ERROR, e->Size);
+        PROBE_HANDLER(fuse, write, e->Path, e->Offset, e->Size, e->Result);
+        WATCHDOG_SCOPE("FUSE Write", e->Path, e->Offset, e->Size);
+        RECORDER_SCOPE(RECORDER_OP_FUSE_WRITE, e->Path, NULL, e->Offset, e->Size, 0, e->Result, e->Buffer);
+
+        int64 BytesWritten;
+        VirtualFile* vfile;
+
+        if (FindVirtualFile(e->Path, vfile))
+        {
+            // writers of disjoint ranges of the file run in parallel; Result
+            // is an int, a larger request is written in part
+            vfile->LockShared();
+            bool written = vfile->Write((void*)e->Buffer, e->Offset, e->Size < INT_MAX ? e->Size : INT_MAX, &BytesWritten);
+            vfile->UnlockShared();
+            vfile->Release();
+            // a write cut short by a lack of memory reports the part written
+            e->Result = !written && BytesWritten == 0 ? -ENOMEM : (int)BytesWritten;
+            return 0;
+        }
+        else
+            e->Result = -ENOENT;
+        return e->Result;
+    }
+
+private: // the synthetic directory; its nodes are not in the tree
+
+    // vfile addresses never come this low
+    static int64 GetStatsIno(int Stats)
+    {
+        return Stats == METRICS_DIR ? 1 : 2 + Stats;
+    }
+
+    int GetStatsAttr(FUSEGetAttrEventParams* e, int Stats)
+    {
+        int64 now;
+#ifdef UNIX
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        now = UnixTimeToFileTime(tv.tv_sec, tv.tv_usec * 1000);
+#endif // UNIX
+#ifdef WIN32
+        GetSystemTimeAsFileTime((LPFILETIME)&now);
+#endif // WIND32
+
+        if (Stats == METRICS_NO_FILE)
+            return -ENOENT;
+
+        *(e->pIno) = GetStatsIno(Stats);
+        e->Uid = GetUid();
+        e->Gid = GetGid();
+        e->LinkCount = 1;
+        if (Stats == METRICS_DIR)
+        {
+            e->Mode = S_IFDIR | 0555;
+            *(e->pSize) = 512;
+        }
+        else
+        {
+            e->Mode = S_IFREG | 0444;
+            *(e->pSize) = (int64)MetricsGetText(Stats)->size();
+        }
+        *(e->pCTime) = now;
+        *(e->pMTime) = now;
+        *(e->pATime) = now;
+        return 0;
+    }
+
+    void ListStatsDir(FUSEReadDirEventParams* e)
+    {
+        FUSEGetAttrEventParams attr;
+        int64 ino, size, ctime, mtime, atime;
+        fuse_char name[16];
+
+        memset(&attr, 0, sizeof(attr));
+        attr.pIno = &ino;
+        attr.pSize = &size;
+        attr.pCTime = &ctime;
+        attr.pMTime = &mtime;
+        attr.pATime = &atime;
+        for (int file = 0; file < METRICS_FILES; file++)
+        {
+            size_t len = 0;
+            for (const char* c = g_MetricsFileNames[file]; *c != 0; c++)
+                name[len++] = (fuse_char)*c;
+            name[len] = 0;
+
+            GetStatsAttr(&attr, file);
+            FillDir(e->FillerContext, name, ino,
+                attr.Mode, attr.Uid, attr.Gid, 1,
+                size, atime, mtime, ctime);
+        }
+    }
+
+    // returns the bytes read or a negated error code
+    int ReadStatsFile(FUSEReadEventParams* e, int Stats)
+    {
+        if (Stats < 0)
+            return Stats == METRICS_DIR ? -EISDIR : -ENOENT;
+
+        std::shared_ptr<const std::string> text = MetricsGetText(Stats);
+        if (e->Offset >= (int64)text->size())
+            return 0;
+        int64 count = (int64)text->size() - e->Offset < e->Size ? (int64)text->size() - e->Offset : e->Size;
+        return (int)text->copy((char*)e->Buffer, (size_t)count, (size_t)e->Offset);
+    }
+};
+
+//-----------------------------------------------------------------------------------------------------------
+
+// The NFS requests are served by a pool of threads in a leader/followers
+// scheme: one thread, the leader, waits in DoEvents, the followers wait on
+// g_ServeCond. A request handler first hands the event loop to a follower,
+// so the next request is read while this one is still being served.
+std::mutex g_ServeLock;
+std::condition_variable g_ServeCond;
+bool g_ServeHasLeader = false;
+thread_local bool g_ServeLeader = false;
+
+// called first by the request handlers
+void handOffEventLoop()
+{
+    if (!g_ServeLeader)
+        return;
+
+    std::lock_guard<std::mutex> lock(g_ServeLock);
+    g_ServeLeader = false;
+    g_ServeHasLeader = false;
+    g_ServeCond.notify_one();
+}
+
+class MemDriveNFS : public NFS
+{
+public: // Events
+
+    MemDriveNFS() : NFS()
+    {
+        //this->Config(_T("LogLevel=4"));
+    }
+
+    int FireAccess(NFSAccessEventParams* e) override
+    {
+        PROBE_HANDLER(nfs, access, e->Path, -1, -1, e->Result);
+
+        return 0;
+    }
+
+    int FireChmod(NFSChmodEventParams* e) override
+    {
+        PROBE_HANDLER(nfs, chmod, e->Path, -1, -1, e->Result);
+
+        return 0;
+    }
+
+    int FireChown(NFSChownEventParams* e) override
+    {
+        PROBE_HANDLER(nfs, chown, e->Path, -1, -1, e->Result);
+
+        return 0;
+    }
+
+    int FireCreateLink(NFSCreateLinkEventParams* e) override
+    {
+        handOffEventLoop();
+        OPSTATS_SCOPE("NFS CreateLink", e->Result, OPSTATS_NONZERO_ERROR, -1);
+        PROBE_HANDLER(nfs, createlink, e->Path, -1, -1, e->Result);
+        WATCHDOG_SCOPE("NFS CreateLink", e->Path, -1, -1);
+        RECORDER_SCOPE(RECORDER_OP_NFS_CREATELINK, e->Path, e->LinkTarget, -1, -1, e->LinkType, e->Result, NULL);
+
+        TRACE(TRACE_LEVEL_DEBUG, _T("FireCreateLink"), e->Path);
+        e->Result = NFS4ERR_NOTSUPP;
+        return 0;
+    }
+
+    int FireReadLink(NFSReadLinkEventParams* e) override
+    {
+        handOffEventLoop();
+        OPSTATS_SCOPE("NFS ReadLink", e->Result, OPSTATS_NONZERO_ERROR, -1);
+        PROBE_HANDLER(nfs, readlink, e->Path, -1, -1, e->Result);
+        WATCHDOG_SCOPE("NFS ReadLink", e->Path, -1, -1);
+        RECORDER_SCOPE(RECORDER_OP_NFS_READLINK, e->Path, NULL, -1, e->BufferLength, 0, e->Result, NULL);
+
+        TRACE(TRACE_LEVEL_DEBUG, _T("FireReadLink"), e->Path);
+        e->Result = NFS4ERR_NOTSUPP;
+        return 0;
+    }
+
+    int FireConnected(NFSConnectedEventParams* e) override
+    {
+        TRACE_EVENT(TRACE_LEVEL_INFO, _T("Client connected"), e->Description, NULL, e->ConnectionId, e->StatusCode);
+        return 0;
+    }
+
+    int FireDisconnected(NFSDisconnectedEventParams* e) override
+    {
+        TRACE_EVENT(TRACE_LEVEL_INFO, _T("Client disconnected"), e->Description, NULL, e->ConnectionId, e->StatusCode);
+        return 0;
+    }
+
+    int FireError(NFSErrorEventParams* e) override
+    {
+        TRACE_EVENT(TRACE_LEVEL_ERROR, _T("Error"), e->Description, NULL, e->ConnectionId, e->ErrorCode);
+        return 0;
+    }
+
+    int FireLog(NFSLogEventParams* e) override
+    {
+        TRACE_EVENT(TRACE_LEVEL_INFO, _T("Log"), e->Message, NULL, e->ConnectionId, TRACE_NO_VALUE);
+        return 0;
+    }
+
+    int FireConnectionRequest(NFSConnectionRequestEventParams* e) override
+    {
+        TRACE_EVENT(TRACE_LEVEL_INFO, _T("Connection Request"), e->Address, NULL, e->Port, TRACE_NO_VALUE);
+        e->Accept = TRUE;
+        return 0;
+    }
+
+    int FireGetAttr(NFSGetAttrEventParams* e) override
+    {
+        handOffEventLoop();
+        OPSTATS_SCOPE("NFS GetAttr", e->Result, OPSTATS_NONZERO_ERROR, -1);
+        PROBE_HANDLER(nfs, getattr, e->Path, -1, -1, e->Result);
+        WATCHDOG_SCOPE("NFS GetAttr", e->Path, -1, -1);
+        RECORDER_SCOPE(RECORDER_OP_NFS_GETATTR, e->Path, NULL, -1, -1, 0, e->Result, NULL);
+
+        TRACE(TRACE_LEVEL_DEBUG, _T("FireGetAttr"), e->Path);
+
+        e->Result = NFS4ERR_NOENT;
+
+        VirtualFile* vfile = NULL;
+        VIRTUALFILE_ATTRIBUTES attr;
+        EpochGuard guard;
+
+        if (LookupVirtualFile(e->Path, vfile))
+        {
+            vfile->GetAttributes(&attr);
+            e->Result = 0;
+            e->LinkCount = 1;
+            e->Group = _T("0");
+            e->User = _T("0");
+            *(e->pSize) = attr.Size;
+            e->Mode = attr.Mode;
+            *(e->pCTime) = attr.CreationTime;
+            *(e->pMTime) = attr.LastWriteTime;
+            *(e->pATime) = attr.LastAccessTime;
+        }
+
+        return 0;
+    }
+
+    int FireLookup(NFSLookupEventParams* e) override
+    {
+        handOffEventLoop();
+        OPSTATS_SCOPE("NFS Lookup", e->Result, OPSTATS_NONZERO_ERROR, -1);
+        PROBE_HANDLER(nfs, lookup, e->Path, -1, -1, e->Result);
+        WATCHDOG_SCOPE("NFS Lookup", e->Path, -1, -1);
+        RECORDER_SCOPE(RECORDER_OP_NFS_LOOKUP, e->Path, e->Name, -1, -1, 0, e->Result, NULL);
+
+        TRACE(TRACE_LEVEL_DEBUG, _T("FireLookup"), e->Path);
+
+        VirtualFile* vfile;
+        EpochGuard guard;
+
+        if (LookupVirtualFile(e->Path, vfile)) {
+            return 0;
+        }
+
+        e->Result = NFS4ERR_NOENT;
+        return 0;
+    }
+
+    int FireMkDir(NFSMkDirEventParams* e) override
+    {
+        handOffEventLoop();
+        OPSTATS_SCOPE("NFS MkDir", e->Result, OPSTATS_NONZERO_ERROR, -1);
+        PROBE_HANDLER(nfs, mkdir, e->Path, -1, -1, e->Result);
+        WATCHDOG_SCOPE("NFS MkDir", e->Path, -1, -1);
+        RECORDER_SCOPE(RECORDER_OP_NFS_MKDIR, e->Path, NULL, -1, -1, 0, e->Result, NULL);
+
+        TRACE(TRACE_LEVEL_DEBUG, _T("FireMkDir"), e->Path);
+
+        // the synthetic directory of the FUSE side must not be shadowed
+        if (g_StatsDir && MetricsGetFile(e->Path) != METRICS_NONE)
+        {
+            e->Result = NFS4ERR_ACCESS;
+            return 0;
+        }
+
+        VirtualFile* vfile = NULL, * vdir = NULL;
+        int64 now;
+#ifdef UNIX
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        now = UnixTimeToFileTime(tv.tv_sec, tv.tv_usec * 1000);
+#endif // UNIX
+#ifdef WIN32
+        GetSystemTimeAsFileTime((LPFILETIME)&now);
+#endif // WIND32
+
+        if (!GetParentVirtualDirectory(e->Path, vdir))
+        {
+            e->Result = NFS4ERR_NOENT;
+            return 0;
+        }
+
+        vdir->LockExclusive();
+
+        if (vdir->get_Context()->GetFile(GetFileName(e->Path), vfile))
+        {
+            vdir->UnlockExclusive();
+            vdir->Release();
+            e->Result = NFS4ERR_EXIST;
+            return 0;
+        }
+
+        vfile = new VirtualFile(GetFileName(e->Path), DIR_MODE);
+        if (vfile->get_Name() == NULL)
+        {
+            vfile->Release();
+            vdir->UnlockExclusive();
+            vdir->Release();
+            e->Result = NFS4ERR_NOSPC;
+            return 0;
+        }
+
+        vfile->set_CreationTime(now);
+        vfile->set_LastAccessTime(now);
+        vfile->set_LastWriteTime(now);
+
+        vdir->AddFile(vfile);
+
+        vdir->UnlockExclusive();
+        vdir->Release();
+
+        return 0;
+    }
+
+    int FireOpen(NFSOpenEventParams* e) override
+    {
+        handOffEventLoop();
+        OPSTATS_SCOPE("NFS Open", e->Result, OPSTATS_NONZERO_ERROR, -1);
+        PROBE_HANDLER(nfs, open, e->Path, -1, -1, e->Result);
+        WATCHDOG_SCOPE("NFS Open", e->Path, -1, -1);
+        RECORDER_SCOPE(RECORDER_OP_NFS_OPEN, e->Path, NULL, -1, -1, e->OpenType, e->Result, NULL);
+
+        TRACE_EVENT(TRACE_LEVEL_DEBUG, _T("FireOpen"), e->Path, NULL, e->OpenType, TRACE_NO_VALUE);
+
+        int64 now;
+#ifdef UNIX
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        now = UnixTimeToFileTime(tv.tv_sec, tv.tv_usec * 1000);
+#endif // UNIX
+#ifdef WIN32
+        GetSystemTimeAsFileTime((LPFILETIME)&now);
+#endif // WIND32
+
+        if (e->OpenType == 1)
+        {
+            VirtualFile* vfile = NULL, * vdir = NULL;
+            if (g_StatsDir && MetricsGetFile(e->Path) != METRICS_NONE)
+            {
+                e->Result = NFS4ERR_ACCESS;
+                return 0;
+            }
+            if (!GetParentVirtualDirectory(e->Path, vdir))
+            {
+                e->Result = NFS4ERR_NOENT;
+                return 0;
+            }
+
+            vdir->LockExclusive();
+
+            if (vdir->get_Context()->GetFile(GetFileName(e->Path), vfile))
+            {
+                vdir->UnlockExclusive();
+                vdir->Release();
+                e->Result = NFS4ERR_EXIST;
+                return 0;
+            }
+
+            vfile = new VirtualFile(GetFileName(e->Path), FILE_MODE);
+            if (vfile->get_Name() == NULL)
+            {
+                vfile->Release();
+                vdir->UnlockExclusive();
+                vdir->Release();
+                e->Result = NFS4ERR_NOSPC;
+                return 0;
+            }
+
+            vfile->set_CreationTime(now);
+            vfile->set_LastAccessTime(now);
+            vfile->set_LastWriteTime(now);
+
+            vdir->AddFile(vfile);
+
+            vdir->UnlockExclusive();
+            vdir->Release();
+        }
+        else
+        {
+            VirtualFile* vfile;
+
+            if (!FindVirtualFile(e->Path, vfile))
+                e->Result = NFS4ERR_NOENT;
+            else
+            {
+                vfile->LockExclusive();
+                vfile->set_LastAccessTime(now);
+                vfile->UnlockExclusive();
+                vfile->Release();
+            }
+        }
+
+        return 0;
+    }
+
+    int FireRead(NFSReadEventParams* e) override
+    {
+        handOffEventLoop();
+        OPSTATS_SCOPE("NFS Read", e->Result, OPSTATS_NONZERO_ERROR, e->Count);
+        PROBE_HANDLER(nfs, read, e->Path, e->Offset, e->Count, e->Result);
+        WATCHDOG_SCOPE("NFS Read", e->Path, e->Offset, e->Count);
+        RECORDER_SCOPE(RECORDER_OP_NFS_READ, e->Path, NULL, e->Offset, e->Count, 0, e->Result, NULL);
+
+        TRACE_EVENT(TRACE_LEVEL_DEBUG, _T("FireRead"), e->Path, NULL, e->Offset, e->Count);
+
+        if (e->Count == 0) return 0;
+
+        int64 BytesRead;
+        VirtualFile* vfile;
+
+        if (FindVirtualFile(e->Path, vfile))
+        {
+            vfile->LockShared();
+            if (e->Offset >= vfile->get_Size())
+            {
+                vfile->UnlockShared();
+                vfile->Release();
+                e->Count = 0;
+                e->Eof = true;
+                return 0;
+            }
+            vfile->Read((void*)e->Buffer, e->Offset, e->Count, &BytesRead);
+            if (e->Offset + BytesRead == vfile->get_Size()) e->Eof = true;
+            vfile->UnlockShared();
+            vfile->Release();
+            e->Count = (int)BytesRead;
+        }
+        else
+            e->Result = NFS4ERR_NOENT;
+
+        return 0;
+    }
+
+    int FireReadDir(NFSReadDirEventParams* e) override
+    {
+        handOffEventLoop();
+        OPSTATS_SCOPE("NFS ReadDir", e->Result, OPSTATS_NONZERO_ERROR, -1);
+        PROBE_HANDLER(nfs, readdir, e->Path, -1, -1, e->Result);
+        WATCHDOG_SCOPE("NFS ReadDir", e->Path, -1, -1);
+        RECORDER_SCOPE(RECORDER_OP_NFS_READDIR, e->Path, NULL, e->Cookie, -1, 0, e->Result, NULL);
+
+        TRACE(TRACE_LEVEL_DEBUG, _T("FireReadDir"), e->Path);
+
+        VirtualFile* vdir = NULL;
+        std::vector<VIRTUALFILE_ENTRY> entries;
+        EpochGuard guard;
+
+        int readOffset = 0;
+        long long cookie = baseCookie;  // just an offset to avoid a chance to have cookie set to 0, 1, 2
+
+        // If Cookie != 0, continue listing entries from a specified cookie. Otherwise, start listing entries from the start.
+        if (e->Cookie != 0) {
+            readOffset = (int)e->Cookie - baseCookie + 1;
+            cookie = e->Cookie + 1;
+        }
+
+        if (LookupVirtualFile(e->Path, vdir) && (vdir->get_Mode() & S_IFDIR) != 0)
+        {
+            int ret_code = 0;
+            vdir->get_Context()->GetEntries(entries);
+            for (int i = readOffset; i < (int)entries.size(); i++)
+            {
+                VIRTUALFILE_ATTRIBUTES& attr = entries[i].Attributes;
+                ret_code = FillDir(e->ConnectionId, entries[i].Name, 0, cookie,
+                    attr.Mode, _T("0"), _T("0"), 1,
+                    attr.Size, attr.LastAccessTime,
+                    attr.LastWriteTime, attr.CreationTime);
+
+                // Return now assuming FillDir returned non-zero value, indicating maximum entries have been provided.
+                if (ret_code) 
+                    return 0;
+                else 
+                    cookie++;
+            }
+        }
+        else
+            e->Result = NFS4ERR_NOENT;
+
+        return 0;
+    }
+
+    int FireRename(NFSRenameEventParams* e) override
+    {
+        handOffEventLoop();
+        OPSTATS_SCOPE("NFS Rename", e->Result, OPSTATS_NONZERO_ERROR, -1);
+        PROBE_HANDLER(nfs, rename, e->OldPath, -1, -1, e->Result);
+        WATCHDOG_SCOPE("NFS Rename", e->OldPath, -1, -1);
+        RECORDER_SCOPE(RECORDER_OP_NFS_RENAME, e->OldPath, e->NewPath, -1, -1, 0, e->Result, NULL);
+
+        TRACE_EVENT(TRACE_LEVEL_DEBUG, _T("FireRename"), e->OldPath, e->NewPath, TRACE_NO_VALUE, TRACE_NO_VALUE);
+
+        if (fuse_scmp(e->OldPath, e->NewPath) == 0) return 0;
+
+        if (g_StatsDir && MetricsGetFile(e->NewPath) != METRICS_NONE)
+        {
+            e->Result = NFS4ERR_ACCESS;
+            return 0;
+        }
+
+        VirtualFile* voldfile = NULL, * vnewfile = NULL, * voldparent = NULL, * vnewparent = NULL;
+
+        if (!GetParentVirtualDirectory(e->OldPath, voldparent))
+        {
+            e->Result = NFS4ERR_NOENT;
+            return 0;
+        }
+
+        if (!GetParentVirtualDirectory(e->NewPath, vnewparent))
+        {
+            voldparent->Release();
+            e->Result = NFS4ERR_NOENT;
+            return 0;
+        }
+
+        VirtualFile::LockRename(voldparent, vnewparent);
+
+        if (!voldparent->get_Context()->GetFile(GetFileName(e->OldPath), voldfile))
+            e->Result = NFS4ERR_NOENT;
+        else if (voldfile == vnewparent || voldfile->IsAncestorOf(vnewparent))
+            e->Result = NFS4ERR_INVAL;
+        else if (vnewparent->get_Context()->GetFile(GetFileName(e->NewPath), vnewfile))
+        {
+            if ((voldfile->get_Mode() & S_IFDIR) != 0)
+            {
+                // Check for compatibility
+                if ((vnewfile->get_Mode() & S_IFDIR) == 0)
+                    e->Result = NFS4ERR_EXIST;
+                // An ancestor of the source is never empty, and it must not be locked after its descendant
+                else if (vnewfile == voldparent || vnewfile->IsAncestorOf(voldparent))
+                    e->Result = NFS4ERR_EXIST;
+                else
+                {
+                    // Remove directory if it exists and is empty
+                    vnewfile->LockShared();
+                    int fileCount = vnewfile->get_Context()->GetCount();
+                    vnewfile->UnlockShared();
+                    if (fileCount != 0)
+                        e->Result = NFS4ERR_EXIST;
+                }
+            }
+            else if ((vnewfile->get_Mode() & S_IFDIR) != 0)
+                e->Result = NFS4ERR_EXIST;
+
+        }
+
+        // Move file or directory; the existing file or empty directory is
+        // replaced only once the new name is allocated
+        if (voldfile != NULL && e->Result == 0)
+        {
+            voldfile->Remove();
+            if (!voldfile->Rename(GetFileName(e->NewPath)))
+            {
+                voldparent->AddFile(voldfile);
+                e->Result = NFS4ERR_NOSPC;
+            }
+            else
+            {
+                if (vnewfile != NULL)
+                {
+                    vnewfile->Remove();
+                    vnewfile->Release();
+                }
+                vnewparent->AddFile(voldfile);
+            }
+        }
+
+        VirtualFile::UnlockRename(voldparent, vnewparent);
+
+        voldparent->Release();
+        vnewparent->Release();
+
+        return 0;
+    }
+
+    int FireRmDir(NFSRmDirEventParams* e) override
+    {
+        handOffEventLoop();
+        OPSTATS_SCOPE("NFS RmDir", e->Result, OPSTATS_NONZERO_ERROR, -1);
+        PROBE_HANDLER(nfs, rmdir, e->Path, -1, -1, e->Result);
+        WATCHDOG_SCOPE("NFS RmDir", e->Path, -1, -1);
+        RECORDER_SCOPE(RECORDER_OP_NFS_RMDIR, e->Path, NULL, -1, -1, 0, e->Result, NULL);
+
+        TRACE(TRACE_LEVEL_DEBUG, _T("FireRmDir"), e->Path);
+
+        VirtualFile* vfile = NULL, * vdir = NULL;
+
+        if (!GetParentVirtualDirectory(e->Path, vdir))
+        {
+            e->Result = NFS4ERR_NOENT;
+            return 0;
+        }
+
+        vdir->LockExclusive();
+
+        if (vdir->get_Context()->GetFile(GetFileName(e->Path), vfile))
+        {
+            vfile->LockShared();
+            bool directory = (vfile->get_Mode() & S_IFDIR) != 0;
+            bool empty = vfile->get_Context()->IsEmpty();
+            vfile->UnlockShared();
+
+            if (!directory)
+                e->Result = NFS4ERR_NOTDIR;
+            else if (!empty)
+                e->Result = NFS4ERR_NOTEMPTY;
+            else
+            {
+                vfile->Remove();
+                vfile->Release();
+            }
+        }
+        else
+            e->Result = NFS4ERR_NOENT;
+
+        vdir->UnlockExclusive();
+        vdir->Release();
+
+        return 0;
+    }
+
+    int FireTruncate(NFSTruncateEventParams* e) override
+    {
+        handOffEventLoop();
+        OPSTATS_SCOPE("NFS Truncate", e->Result, OPSTATS_NONZERO_ERROR, -1);
+        PROBE_HANDLER(nfs, truncate, e->Path, -1, e->Size, e->Result);
+        WATCHDOG_SCOPE("NFS Truncate", e->Path, -1, e->Size);
+        RECORDER_SCOPE(RECORDER_OP_NFS_TRUNCATE, e->Path, NULL, -1, e->Size, 0, e->Result, NULL);
+
+        TRACE(TRACE_LEVEL_DEBUG, _T("FireTruncate"), e->Path);
+
+        VirtualFile* vfile = NULL;
+
+        if (FindVirtualFile(e->Path, vfile))
+        {
+            vfile->LockExclusive();
+            vfile->set_Size(e->Size);
+            vfile->UnlockExclusive();
+            vfile->Release();
+        }
+        else
+            e->Result = NFS4ERR_NOENT;
+
+        return 0;
+    }
+
+    int FireUnlink(NFSUnlinkEventParams* e) override
+    {
+        handOffEventLoop();
+        OPSTATS_SCOPE("NFS Unlink", e->Result, OPSTATS_NONZERO_ERROR, -1);
+        PROBE_HANDLER(nfs, unlink, e->Path, -1, -1, e->Result);
+        WATCHDOG_SCOPE("NFS Unlink", e->Path, -1, -1);
+        RECORDER_SCOPE(RECORDER_OP_NFS_UNLINK, e->Path, NULL, -1, -1, 0, e->Result, NULL);
+
+        TRACE(TRACE_LEVEL_DEBUG, _T("FireUnlink"), e->Path);
+
+        VirtualFile* vfile = NULL, * vdir = NULL;
+
+        if (!GetParentVirtualDirectory(e->Path, vdir))
+        {
+            e->Result = NFS4ERR_NOENT;
+            return 0;
+        }
+
+        vdir->LockExclusive();
+
+        if (vdir->get_Context()->GetFile(GetFileName(e->Path), vfile))
+        {
+            bool empty = true;
+            if ((vfile->get_Mode() & S_IFDIR) != 0)
+            {
+                vfile->LockShared();
+                empty = vfile->get_Context()->IsEmpty();
+                vfile->UnlockShared();
+            }
+
+            if (!empty)
+                e->Result = NFS4ERR_NOTEMPTY;
+            else
+            {
+                vfile->Remove();
+                vfile->Release();
+            }
+        }
+        else
+            e->Result = NFS4ERR_NOENT;
+
+        vdir->UnlockExclusive();
+        vdir->Release();
+
+        return 0;
+    }
+
+    int FireUTime(NFSUTimeEventParams* e) override
+    {
+        handOffEventLoop();
+        OPSTATS_SCOPE("NFS UTime", e->Result, OPSTATS_NONZERO_ERROR, -1);
+        PROBE_HANDLER(nfs, utime, e->Path, -1, -1, e->Result);
+        WATCHDOG_SCOPE("NFS UTime", e->Path, -1, -1);
+        RECORDER_SCOPE(RECORDER_OP_NFS_UTIME, e->Path, NULL, e->ATime, e->MTime, 0, e->Result, NULL);
+
+        TRACE(TRACE_LEVEL_DEBUG, _T("FireUTime"), e->Path);
+
+        VirtualFile* vfile = NULL;
+
+        if (FindVirtualFile(e->Path, vfile))
+        {
+            vfile->LockExclusive();
+            if (e->ATime != 0)
+                vfile->set_LastAccessTime(e->ATime);
+            if (e->MTime != 0)
+                vfile->set_LastWriteTime(e->MTime);
+            vfile->UnlockExclusive();
+            vfile->Release();
+        }
+        else
+            e->Result = NFS4ERR_NOENT;
+
+        return 0;
+    }
+
+    int FireWrite(NFSWriteEventParams* e) override
+    {
+        handOffEventLoop();
+        OPSTATS_SCOPE("NFS Write", e->Result, OPSTATS_NONZERO_ERROR, e->Count);
+        PROBE_HANDLER(nfs, write, e->Path, e->Offset, e->Count, e->Result);
+        WATCHDOG_SCOPE("NFS Write", e->Path, e->Offset, e->Count);
+        RECORDER_SCOPE(RECORDER_OP_NFS_WRITE, e->Path, NULL, e->Offset, e->Count, e->Stable, e->Result, e->Buffer);
+
+        TRACE_EVENT(TRACE_LEVEL_DEBUG, _T("FireWrite"), e->Path, NULL, e->Offset, e->Count);
+
+        if (e->Count == 0) return 0;
+
+        int64 BytesWritten;
+        VirtualFile* vfile;
+
+        if (FindVirtualFile(e->Path, vfile))
+        {
+            // writers of disjoint ranges of the file run in parallel
+            vfile->LockShared();
+            bool written = vfile->Write((void*)e->Buffer, e->Offset, e->Count, &BytesWritten);
+            vfile->UnlockShared();
+            vfile->Release();
+
+            // a write cut short by a lack of memory reports the part written
+            if (!written && BytesWritten == 0)
+                e->Result = NFS4ERR_NOSPC;
+            e->Count = (int)BytesWritten;
+            e->Stable = FILE_SYNC4;
+        }
+        else
+            e->Result = NFS4ERR_NOENT;
+
+        return 0;
+    }
+};
+
+const fuse_char* g_Guid = TEXT("{713CC6CE-B3E2-4fd9-838D-E28F558F6866}");
+
+const char* strSuccess = "Success";
+const char* strInvalidOption = "Invalid option \"%s\"\n";
+
+//-----------------------------------------------------------------------------------------------------------
+
+int optcmp(char* arg, char* opt)
+{
+    while (1)
+    {
+        if (*arg >= 'A' && *arg <= 'Z')
+            *arg = *arg - 'A' + 'a';
+        if (*arg != *opt)
+            return 0;
+        if (*arg == 0)
+            return 1;
+        arg++;
+        opt++;
+    }
+}
+
+void banner(void)
+{
+    printf("CBFS Connect Copyright (c) Callback Technologies, Inc.\n\n");
+    printf("This demo shows how to mount a virtual drive that is stored in memory using the FUSE component\n");
+    printf("and export the same drive to remote hosts using the NFS component.\n\n");
+}
+
+void usage(void)
+{
+    printf("Usage: fusenfsdrive [-<switch 1> ... -<switch N>] <mounting point>\n\n");
+    printf("<Switches>\n");
+#ifdef WIN32
+    printf("  -drv {cab_file} - Install drivers from CAB file\n");
+#endif
+    printf("  -ps (pid|proc_name) - Add process, permitted to access vault\n");
+    printf("  -serialize - Fire FUSE events on a single worker thread\n");
+    printf("  -port {port} - Local port of the NFS server (default: 2049)\n");
+    printf("  -threads {count} - Number of threads that serve NFS requests (default: number of processors)\n");
+    printf("  -trace {level} - NFS trace level: 0 - none, 1 - errors, 2 - connections (default), 3 - every request\n");
+    printf("  -tracefile {file} - Write the trace to a file instead of the standard output\n");
+    printf("  -stats {file} - Collect handler latency histograms and write them to the file\n");
+    printf("  -statsinterval {seconds} - How often the histograms are written (default: 60; SIGUSR1 writes them at once)\n");
+    printf("  -hotfiles {count} - Number of the most read and written files listed with the statistics (default: 10)\n");
+    printf("  -smallfiles {bytes} - Keep files of up to this size in one buffer instead of 64 KB pages (default: 4096, 0 - off)\n");
+    printf("  -hugepages - Take the pages of file data from 2 MB regions backed by transparent huge pages (Linux)\n");
+    printf("  -compact {MB per second} - Move file data out of fragmented regions in the background and return freed memory\n");
+    printf("  -expire {directory} {seconds} - Delete the files below the directory that were not used for this long (repeatable)\n");
+    printf("  -slowops {milliseconds} - Log the operations that run longer (SIGUSR2 lists the operations in flight)\n");
+    printf("  -record {file} - Record the FUSE and NFS requests to the file, for replay with fusememdrive_replay and nfs_replay\n");
+    printf("  -recorddata - Record the data of writes as well\n");
+    printf("  -statsdir - Show live counters in the read-only files of /" METRICS_DIR_NAME " on the FUSE mount\n");
+#ifdef UNIX
+    printf("  -metrics {socket} - Serve the counters in Prometheus format over HTTP on a Unix domain socket\n");
+#endif
+    printf("  -- Stop switches scanning\n\n");
+    printf("Example: fusenfsdrive -port 2049 /mnt/memdrive\n\n");
+}
+
+// ----------------------------------------------------------------------------------
+
+MemDriveFUSE cbfs_fuse;
+MemDriveNFS cbfs_nfs;
+
+// set once the program is asked to stop; the NFS worker threads leave their event loops
+std::atomic<bool> g_Stopping(false);
+
+#ifdef UNIX
+// the signal handler wakes up the main thread through this pipe
+int g_StopPipe[2] = { -1, -1 };
+
+void onStopSignal(int sig)
+{
+    char c = 0;
+    g_Stopping.store(true);
+    if (write(g_StopPipe[1], &c, 1) < 0) {}
+}
+#endif
+
+#ifdef WIN32
+BOOL WINAPI onConsoleCtrl(DWORD CtrlType)
+{
+    g_Stopping.store(true);
+    return TRUE;
+}
+#endif
+
+// longest wait of the leader after a DoEvents call that brought no request
+#define SERVE_IDLE_WAIT_MS 16
+
+void serveRequests()
+{
+    std::unique_lock<std::mutex> lock(g_ServeLock);
+    int idleWait = 0;
+
+    while (!g_Stopping.load(std::memory_order_relaxed))
+    {
+        if (g_ServeHasLeader)
+        {
+            g_ServeCond.wait(lock);
+            continue;
+        }
+
+        g_ServeHasLeader = true;
+        g_ServeLeader = true;
+        lock.unlock();
+        cbfs_nfs.DoEvents();
+        lock.lock();
+
+        if (!g_ServeLeader)
+        {
+            // a handler on this thread passed the event loop on
+            idleWait = 0;
+            continue;
+        }
+
+        // no request came in; the leader waits a little longer every time,
+        // so that an idle server does not spin, and a stop ends the wait
+        if (idleWait < SERVE_IDLE_WAIT_MS)
+            idleWait = idleWait == 0 ? 1 : idleWait * 2;
+        g_ServeCond.wait_for(lock, std::chrono::milliseconds(idleWait),
+            [] { return g_Stopping.load(std::memory_order_relaxed); });
+        g_ServeLeader = false;
+        g_ServeHasLeader = false;
+    }
+}
+
+// wakes up the followers, so that they see g_Stopping
+void stopServing()
+{
+    std::lock_guard<std::mutex> lock(g_ServeLock);
+    g_Stopping.store(true);
+    g_ServeCond.notify_all();
+}
+
+#ifdef WIN32
+#define R_OK 0
+#define access(filename, mode) (GetFileAttributes(filename) != INVALID_FILE_ATTRIBUTES ? 0 : 1)
+
+void check_driver()
+{
+    int state;
+
+    state = cbfs_fuse.GetDriverStatus(g_Guid);
+    if (state == SERVICE_RUNNING)
+    {
+        LONG64 version;
+        version = cbfs_fuse.GetDriverVersion(g_Guid);
+        printf("CBFSFUSE driver is installed, version: %d.%d.%d.%d\n",
+            (int)((version & 0x7FFF000000000000) >> 48),
+            (int)((version & 0xFFFF00000000) >> 32),
+            (int)((version & 0xFFFF0000) >> 16),
+            (int)(version & 0xFFFF));
+    }
+    else
+    {
+        printf("CBFSFUSE driver is not installed\n");
+        exit(0);
+    }
+}
+
+fuse_char* a2w(char* source)
+{
+    fuse_char* result = NULL;
+    if (source == NULL)
+    {
+        result = (fuse_char*)malloc(sizeof(WCHAR));
+        result[0] = 0;
+        return result;
+    }
+    else
+    {
+        int wstrLen = MultiByteToWideChar(CP_ACP, 0, source, -1, NULL, 0);
+        if (wstrLen > 0)
+        {
+            result = (fuse_char*)malloc((wstrLen + 1) * sizeof(WCHAR));
+
+            if (MultiByteToWideChar(CP_ACP, 0, source, -1, result, wstrLen) == 0)
+                return NULL;
+            else
+                return result;
+        }
+        else
+            return NULL;
+    }
+}
+#else
+#define a2w(str) (fuse_char*)(str)
+#endif
+
+bool IsDriveLetter(const cbt_string& path) {
+    if (path.empty())
+        return false;
+
+    wchar_t c = path[0];
+    if (((c >= L'A' && c <= L'Z') || (c >= L'a' && c <= L'z')) && path.size() == 2 && path[1] == L':')
+        return true;
+    else
+        return false;
+}
+
+bool IsAbsolutePath(const cbt_string& path) {
+    if (path.empty()) {
+        return false;
+    }
+
+#ifdef _WIN32
+    // On Windows, check if the path starts with a drive letter followed by a colon and a separator
+    if ((path.size() >= 3) && iswalpha(path[0]) && (path[1] == L':') && (path[2] == L'\\' || path[2] == L'/')) {
+        return true;
+    }
+
+    // Check for UNC paths (e.g., \\server\share)
+    if (path.size() >= 2 && (path[0] == L'\\') && (path[1] == L'\\')) {
+        return true;
+    }
+#else
+    // On Linux and Unix, check if the path starts with a '/'
+    if (path[0] == _T('/')) {
+        return true;
+    }
+#endif
+
+    return false;
+}
+
+cbt_string ConvertRelativePathToAbsolute(const cbt_string& path, bool acceptMountingPoint = false) {
+    cbt_string res;
+
+    if (!path.empty()) {
+        res = path;
+
+#ifndef _WIN32
+        // Linux/Unix-specific case of using a home directory
+        if (path == "~" || path.find("~/") == 0) {
+            const char* homeDir = getenv("HOME");
+
+            if (path == "~") {
+                return homeDir ? homeDir : "";
+            }
+            else {
+                return homeDir ? cbt_string(homeDir) + path.substr(1) : "";
+            }
+        }
+#else
+        size_t semicolonCount = std::count(path.begin(), path.end(), ';');
+        bool isNetworkMountingPoint = semicolonCount == 2;
+        if (isNetworkMountingPoint) {
+            if (!acceptMountingPoint) {
+                sout << L"The path '" << path << L"' format cannot be equal to the Network Mounting Point" << std::endl;
+                return _T("");
+            }
+            size_t pos = path.find(L";");
+            if (pos != cbt_string::npos) {
+                res = path.substr(0, pos);
+                if (res.empty()) {
+                    return path;
+                }
+            }
+        }
+
+#endif
+        if (!IsAbsolutePath(res)) {
+#ifdef _WIN32
+            if (IsDriveLetter(res)) {
+                if (!acceptMountingPoint) {
+                    sout << L"The path '" << res << L"' cannot be equal to the drive letter" << std::endl;
+                    return _T("");
+                }
+                return path;
+            }
+            wchar_t currentDir[_MAX_PATH];
+            const char pathSeparator = '\\';
+            if (_wgetcwd(currentDir, _MAX_PATH) == nullptr) {
+                sout << "Error getting current directory." << std::endl;
+                return _T("");
+            }
+#else
+            char currentDir[PATH_MAX];
+            const char pathSeparator = '/';
+            if (getcwd(currentDir, sizeof(currentDir)) == nullptr) {
+                sout << "Error getting current directory." << std::endl;
+                return _T("");
+            }
+#endif
+            cbt_string currentDirStr(currentDir);
+
+            // Ensure that the current directory has a trailing backslash
+            if (currentDirStr.back() != pathSeparator) {
+                currentDirStr += pathSeparator;
+            }
+
+            return currentDirStr + path;
+        }
+    }
+    else {
+        sout << L"Error: The input path is empty." << std::endl;
+        return _T("");
+    }
+    return path;
+}
+
+int main(int argc, char* argv[]) {
+#ifndef WIN32
+    struct pollfd cinfd[2];
+#else
+    int drv_reboot = 0;
+#endif
+    const fuse_char* mount_point = NULL;
+    fuse_char* opt_proc_name = NULL;
+    int argi, arg_len, stop_opt = 0, mounted = 0, opt_pid = 0, opt_serialize = 0;
+    int port = 2049;
+    int threadCount = (int)std::thread::hardware_concurrency();
+    int traceLevel = TRACE_LEVEL_INFO;
+    FILE* traceOutput = stdout;
+    const char* opt_stats_file = NULL;
+    int opt_stats_interval = 60;
+    const char* opt_metrics_socket = NULL;
+    int opt_slow_ms = 0;
+    int opt_compact_rate = 0;
+    int opt_expire = 0;
+    const char* opt_record_file = NULL;
+    int opt_record_data = 0;
+    std::vector<std::thread> workers;
+
+    banner();
+    if (argc < 2) {
+        usage();
+#ifdef WIN32
+        check_driver();
+#endif
+        return 0;
+    }
+
+    int retVal;
+    for (argi = 1; argi < argc; argi++) {
+        arg_len = (int)strlen(argv[argi]);
+        if (arg_len > 0) {
+            if ((argv[argi][0] == '-') && !stop_opt) {
+                if (arg_len < 2)
+                    fprintf(stderr, strInvalidOption, argv[argi]);
+                else {
+                    if (optcmp(argv[argi], (char*)"--"))
+                        stop_opt = 1;
+                    else if (optcmp(argv[argi], (char*)"-ps"))
+                    {
+                        argi++;
+                        
+                        if (argi < argc)
+                        {
+                            opt_pid = atoi(argv[argi]);
+                            if (opt_pid == 0)
+                                opt_proc_name = argv[argi];
+                        }
+                    }
+                    else if (optcmp(argv[argi], (char*)"-serialize"))
+                        opt_serialize = 1;
+                    else if (optcmp(argv[argi], (char*)"-port"))
+                    {
+                        argi++;
+                        if (argi < argc)
+                            port = atoi(argv[argi]);
+                    }
+                    else if (optcmp(argv[argi], (char*)"-threads"))
+                    {
+                        argi++;
+                        if (argi < argc)
+                            threadCount = atoi(argv[argi]);
+                    }
+                    else if (optcmp(argv[argi], (char*)"-trace"))
+                    {
+                        argi++;
+                        if (argi < argc)
+                            traceLevel = atoi(argv[argi]);
+                    }
+                    else if (optcmp(argv[argi], (char*)"-tracefile"))
+                    {
+                        argi++;
+                        if (argi < argc && (traceOutput = fopen(argv[argi], "a")) == NULL)
+                        {
+                            fprintf(stderr, "Cannot open trace file %s\n", argv[argi]);
+                            return 0;
+                        }
+                    }
+                    else if (optcmp(argv[argi], (char*)"-stats"))
+                    {
+                        argi++;
+                        if (argi < argc)
+                            opt_stats_file = argv[argi];
+                    }
+                    else if (optcmp(argv[argi], (char*)"-statsinterval"))
+                    {
+                        argi++;
+                        if (argi < argc)
+                            opt_stats_interval = atoi(argv[argi]);
+                    }
+                    else if (optcmp(argv[argi], (char*)"-hotfiles"))
+                    {
+                        argi++;
+                        if (argi < argc)
+                            g_HotFileCount = atoi(argv[argi]);
+                    }
+                    else if (optcmp(argv[argi], (char*)"-smallfiles"))
+                    {
+                        argi++;
+                        if (argi < argc)
+                            VirtualFile::SetSmallFileLimit(atoi(argv[argi]));
+                    }
+                    else if (optcmp(argv[argi], (char*)"-hugepages"))
+                    {
+                        if (!VirtualFile::SetDataArena(true))
+                            printf("Huge pages are not available, file data is kept on the heap\n");
+                    }
+                    else if (optcmp(argv[argi], (char*)"-compact"))
+                    {
+                        argi++;
+                        if (argi < argc)
+                            opt_compact_rate = atoi(argv[argi]);
+                    }
+                    else if (optcmp(argv[argi], (char*)"-expire"))
+                    {
+                        argi += 2;
+                        if (argi < argc)
+                        {
+                            VirtualFile::SetExpiryPolicy(argv[argi - 1], atoi(argv[argi]));
+                            opt_expire = 1;
+                        }
+                    }
+                    else if (optcmp(argv[argi], (char*)"-slowops"))
+                    {
+                        argi++;
+                        if (argi < argc)
+                            opt_slow_ms = atoi(argv[argi]);
+                    }
+                    else if (optcmp(argv[argi], (char*)"-record"))
+                    {
+                        argi++;
+                        if (argi < argc)
+                            opt_record_file = argv[argi];
+                    }
+                    else if (optcmp(argv[argi], (char*)"-recorddata"))
+                        opt_record_data = 1;
+                    else if (optcmp(argv[argi], (char*)"-statsdir"))
+                        g_StatsDir = true;
+#ifdef UNIX
+                    else if (optcmp(argv[argi], (char*)"-metrics"))
+                    {
+                        argi++;
+                        if (argi < argc)
+                            opt_metrics_socket = argv[argi];
+                    }
+#endif
+#ifdef WIN32
+                    else if (optcmp(argv[argi], (char*)"-drv")) {
+                        argi++;
+                        if (argi < argc) {
+                            printf("Installing drivers from '%s'\n", argv[argi]);
+                            cbt_string driver_path_wstr = ConvertRelativePathToAbsolute(a2w(argv[argi]));
+                            if (driver_path_wstr.empty()) {
+                                printf("Error: Invalid Driver Path\n");
+                                exit(1);
+                            }
+                            LPCWSTR driver_path = wcsdup(driver_path_wstr.c_str());
+                            drv_reboot = cbfs_fuse.Install(driver_path, g_Guid, NULL,
+                                cbcConstants::INSTALL_REMOVE_OLD_VERSIONS);
+
+                            retVal = cbfs_fuse.GetLastErrorCode();
+                            if (0 != retVal) {
+                                if (retVal == ERROR_PRIVILEGE_NOT_HELD)
+                                    fprintf(stderr, "Drivers are not installed due to insufficient privileges. Please, run installation with administrator rights");
+                                else
+                                    fprintf(stderr, "Drivers are not installed, error %s", cbfs_fuse.GetLastError());
+                                return retVal;
+                            }
+
+                            printf("Drivers installed successfully");
+                            if (drv_reboot != 0) {
+                                printf(", reboot is required\n");
+                                exit(0);
+                            }
+                            else {
+                                printf("\n");
+                                exit(0);
+                            }
+                        }
+                    }
+#endif
+                    else
+                        fprintf(stderr, strInvalidOption, argv[argi]);
+                }
+            }
+            else {
+                mount_point = a2w(argv[argi]);
+                break;
+            }
+        }
+    }
+
+    if (mount_point == NULL) {
+        fprintf(stderr, "Virtual Disk: Invalid parameters, mounting point not specified\n");
+        return 0;
+    }
+    if (threadCount < 1)
+        threadCount = 1;
+
+    if (NULL == g_DiskContext)
+    {
+        int64 now;
+#ifdef UNIX
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        now = UnixTimeToFileTime(tv.tv_sec, tv.tv_usec * 1000);
+#endif // UNIX
+#ifdef WIN32
+        GetSystemTimeAsFileTime((LPFILETIME)&now);
+#endif // WIND32
+
+        g_DiskContext = new VirtualFile(TEXT("/"), DIR_MODE);
+
+        g_DiskContext->set_CreationTime(now);
+        g_DiskContext->set_LastAccessTime(now);
+        g_DiskContext->set_LastWriteTime(now);
+
+        g_DiskContext->set_Size(4096);
+    }
+
+    // handlers only queue their trace records, a background thread writes them out
+    TraceStart(traceLevel, traceOutput);
+    if (opt_stats_file != NULL)
+    {
+        OpStatsSetDumpHook(DumpHotFiles);
+        OpStatsStart(opt_stats_file, opt_stats_interval);
+    }
+    if (g_StatsDir || opt_metrics_socket != NULL)
+        OpStatsEnable();
+    if (opt_metrics_socket != NULL && !MetricsStart(opt_metrics_socket))
+        fprintf(stderr, "Error: cannot serve the metrics on %s\n", opt_metrics_socket);
+    if (opt_slow_ms > 0)
+        WatchdogStart(opt_slow_ms, NULL);
+    if (opt_compact_rate > 0)
+        CompactorStart(opt_compact_rate);
+    if (opt_expire)
+        SweeperStart();
+    if (opt_record_file != NULL && !RecorderStart(opt_record_file, opt_record_data != 0))
+        fprintf(stderr, "Error: cannot record to %s\n", opt_record_file);
+
+    // NFS side: the server starts listening before the drive is mounted
+    cbfs_nfs.SetLocalPort(port);
+    retVal = cbfs_nfs.StartListening();
+    if (0 != retVal) {
+        sout << _T("Error starting NFS server: ") << cbfs_nfs.GetLastErrorCode() << _T(": ") << cbfs_nfs.GetLastError() << endl;
+        RecorderStop();
+        CompactorStop();
+        SweeperStop();
+        WatchdogStop();
+        MetricsStop();
+        OpStatsStop();
+        TraceStop();
+        return retVal;
+    }
+
+    for (int i = 0; i < threadCount; i++)
+        workers.push_back(std::thread(serveRequests));
+
+    // FUSE side
+    retVal = cbfs_fuse.Initialize(g_Guid);
+    if (0 == retVal) {
+        cbfs_fuse.SetSerializeEvents(opt_serialize ? TRUE : FALSE);
+
+        cbt_string mount_point_wstr = ConvertRelativePathToAbsolute(mount_point, true);
+        if (!mount_point_wstr.empty()) {
+#ifdef UNICODE
+            mount_point = wcsdup(mount_point_wstr.c_str());
+#else
+            mount_point = strdup(mount_point_wstr.c_str());
+#endif
+            if (opt_pid != 0)
+            {
+              cbfs_fuse.SetProcessRestrictionsEnabled(TRUE);
+              cbfs_fuse.AddGrantedProcess(NULL, opt_pid, TRUE, cbcConstants::STG_DACCESS_READWRITE);
+            }
+            else if (opt_proc_name != NULL)
+            {
+              cbfs_fuse.SetProcessRestrictionsEnabled(TRUE);
+              cbfs_fuse.AddGrantedProcess(opt_proc_name, 0, TRUE, cbcConstants::STG_DACCESS_READWRITE);
+            }
+
+            retVal = cbfs_fuse.Mount(mount_point);
+            if (0 == retVal)
+                mounted = 1;
+        }
+        else
+            printf("Error: Invalid Mounting Point Path\n");
+    }
+
+    if (!mounted) {
+        fprintf(stderr, "Virtual Disk: Failed to mount the disk: %s\n", cbfs_fuse.GetLastError());
+        g_Stopping.store(true);
+    }
+    else {
+        sout << _T("Drive mounted, NFS server started on port ") << port << _T(", ") << threadCount << _T(" serving thread(s)") << endl;
+        printf("Press Enter to unmount the disk and stop the server\n");
+
+#ifndef WIN32
+        if (pipe(g_StopPipe) == 0)
+        {
+            signal(SIGINT, onStopSignal);
+            signal(SIGTERM, onStopSignal);
+        }
+
+        cinfd[0].fd = fileno(stdin);
+        cinfd[0].events = POLLIN;
+        cinfd[1].fd = g_StopPipe[0];
+        cinfd[1].events = POLLIN;
+        while (poll(cinfd, g_StopPipe[0] != -1 ? 2 : 1, -1) < 0 && errno == EINTR)
+            ;
+#else
+        SetConsoleCtrlHandler(onConsoleCtrl, TRUE);
+        while (!g_Stopping.load() && !_kbhit())
+            Sleep(100);
+#endif
+        g_Stopping.store(true);
+
+        printf("Unmounting mounting point\n");
+        retVal = cbfs_fuse.Unmount();
+        if (0 != retVal)
+            fprintf(stderr, "Error: %s", cbfs_fuse.GetLastError());
+        else
+            printf("Unmount done\n");
+    }
+
+    stopServing();
+    for (size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+
+    sout << _T("Stopping server...") << endl;
+    cbfs_nfs.StopListening();
+    sout << _T("Server stopped") << endl;
+
+    RecorderStop();
+    CompactorStop();
+    SweeperStop();
+    WatchdogStop();
+    MetricsStop();
+    OpStatsStop();
+    TraceStop();
+    if (traceOutput != stdout)
+        fclose(traceOutput);
+
+    DeleteDiskContext();
+    return 0;
+}
+
+//-----------------------------------------------------------------------------------------------------------
+
+typedef struct
+{
+    cbt_string Path;
+    VIRTUALFILE_IO_STATS Stats;
+}   HOT_FILE;
+
+static bool IsHotter(const HOT_FILE& File1, const HOT_FILE& File2)
+{
+    int64 bytes1 = File1.Stats.ReadBytes + File1.Stats.WriteBytes;
+    int64 bytes2 = File2.Stats.ReadBytes + File2.Stats.WriteBytes;
+
+    if (bytes1 != bytes2)
+        return bytes1 > bytes2;
+    return File1.Stats.ReadOps + File1.Stats.WriteOps > File2.Stats.ReadOps + File2.Stats.WriteOps;
+}
+
+static void CollectHotFiles(VirtualFile* root, const cbt_string& RootPath, std::vector<HOT_FILE>& Files)
+{
+    VirtualFile* vfile;
+    HOT_FILE hot;
+
+    root->LockShared();
+    for (bool found = root->get_Context()->GetFirstFile(vfile); found; found = root->get_Context()->GetNextFile(vfile))
+    {
+        if ((vfile->get_Mode() & S_IFDIR) != 0)
+        {
+            CollectHotFiles(vfile, RootPath + TEXT("/") + vfile->get_Name(), Files);
+            continue;
+        }
+
+        vfile->GetIoStats(&hot.Stats);
+        if (hot.Stats.ReadOps + hot.Stats.WriteOps == 0)
+            continue;
+        hot.Path = RootPath + TEXT("/") + vfile->get_Name();
+        Files.push_back(hot);
+
+        // keep the list short on large trees
+        if (Files.size() >= 2 * (size_t)g_HotFileCount)
+        {
+            std::nth_element(Files.begin(), Files.begin() + g_HotFileCount - 1, Files.end(), IsHotter);
+            Files.resize(g_HotFileCount);
+        }
+    }
+    root->UnlockShared();
+}
+
+void DumpHotFiles(FILE* Output)
+{
+    static const char* patterns[] = { "-", "sequential", "strided", "random" };
+    std::vector<HOT_FILE> files;
+    int64 now = (int64)time(NULL);
+
+    if (g_HotFileCount <= 0 || g_DiskContext == NULL)
+        return;
+
+    VirtualFile::FlushIoStats();
+    CollectHotFiles(g_DiskContext, cbt_string(), files);
+    std::sort(files.begin(), files.end(), IsHotter);
+    if (files.size() > (size_t)g_HotFileCount)
+        files.resize(g_HotFileCount);
+
+    fprintf(Output, "# hottest files by bytes read and written\n");
+    fprintf(Output, "%10s %14s %10s %14s %-10s %5s %5s %5s %8s  %s\n",
+        "reads", "read bytes", "writes", "write bytes", "pattern", "seq%", "str%", "rnd%", "idle s", "path");
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        const VIRTUALFILE_IO_STATS* st = &files[i].Stats;
+        int64 ops = st->SequentialOps + st->StridedOps + st->RandomOps;
+
+        // the counters are read while other threads flush their batches, so
+        // a file may show accesses but no pattern yet; it shows 0% then
+        if (ops == 0)
+            ops = 1;
+
+#ifdef UNICODE
+        fprintf(Output, "%10lld %14lld %10lld %14lld %-10s %5d %5d %5d %8lld  %ls\n",
+#else
+        fprintf(Output, "%10lld %14lld %10lld %14lld %-10s %5d %5d %5d %8lld  %s\n",
+#endif
+            (long long)st->ReadOps, (long long)st->ReadBytes, (long long)st->WriteOps, (long long)st->WriteBytes,
+            patterns[st->Pattern], (int)(st->SequentialOps * 100 / ops), (int)(st->StridedOps * 100 / ops),
+            (int)(st->RandomOps * 100 / ops), (long long)(now - st->LastAccess), files[i].Path.c_str());
+    }
+}
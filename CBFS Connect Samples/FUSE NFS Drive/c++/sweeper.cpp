@@ -0,0 +1,47 @@
+#include <assert.h>
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include "sweeper.h"
+#include "virtualfile.h"
+
+static std::thread g_SweeperThread;
+static std::atomic<bool> g_SweeperStopping(false);
+
+static void SweeperThread(void)
+{
+    int interval = 0;
+
+    while (!g_SweeperStopping.load(std::memory_order_acquire))
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(SWEEPER_PAUSE_MS));
+        interval += SWEEPER_PAUSE_MS;
+        if (interval < SWEEPER_INTERVAL_MS)
+            continue;
+
+        // a batch that deleted files may have left more behind, the next
+        // one follows after the pause
+        if (VirtualFile::ExpireFiles((int64_t)time(NULL), SWEEPER_BATCH) == 0)
+            interval = 0;
+    }
+}
+
+void SweeperStart(void)
+{
+    assert(!g_SweeperThread.joinable());
+
+    g_SweeperStopping.store(false, std::memory_order_relaxed);
+    g_SweeperThread = std::thread(SweeperThread);
+}
+
+void SweeperStop(void)
+{
+    if (!g_SweeperThread.joinable())
+        return;
+
+    g_SweeperStopping.store(true, std::memory_order_release);
+    g_SweeperThread.join();
+}
@@ -0,0 +1,213 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <wchar.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include "trace.h"
+
+// records per thread; must be a power of two
+#define TRACE_RING_SIZE 1024
+
+// characters kept from the texts of a record
+#define TRACE_TEXT_LENGTH 128
+
+// how long the drainer sleeps when there is nothing to write
+#define TRACE_DRAIN_INTERVAL_MS 20
+
+typedef struct
+{
+    int64_t Time;               // microseconds since the first trace point
+    const trace_char* Event;
+    int64_t Value1;
+    int64_t Value2;
+    int Level;
+    trace_char Text[TRACE_TEXT_LENGTH];
+}   TRACE_RECORD;
+
+// single producer (the owning thread), single consumer (the drainer)
+typedef struct _TRACE_RING
+{
+    std::atomic<uint64_t> Head;
+    std::atomic<uint64_t> Tail;
+    std::atomic<uint64_t> Dropped;
+    uint64_t DroppedReported;   // drainer only
+    std::atomic<bool> InUse;
+    int Id;
+    struct _TRACE_RING* Next;
+    TRACE_RECORD Records[TRACE_RING_SIZE];
+}   TRACE_RING, * PTRACE_RING;
+
+std::atomic<int> g_TraceLevel(TRACE_LEVEL_INFO);
+
+static std::atomic<PTRACE_RING> g_TraceRings(NULL);
+static std::atomic<int> g_TraceRingCount(0);
+static const std::chrono::steady_clock::time_point g_TraceEpoch = std::chrono::steady_clock::now();
+
+static FILE* g_TraceOutput = NULL;
+static std::thread g_TraceDrainer;
+static std::atomic<bool> g_TraceStopping(false);
+
+static PTRACE_RING AcquireRing(void)
+{
+    // rings are never freed, the ring of a finished thread is reused
+    // once the drainer has emptied it
+    for (PTRACE_RING ring = g_TraceRings.load(std::memory_order_acquire); ring != NULL; ring = ring->Next)
+    {
+        bool expected = false;
+        if (!ring->InUse.load(std::memory_order_relaxed) &&
+            ring->Head.load(std::memory_order_relaxed) == ring->Tail.load(std::memory_order_acquire) &&
+            ring->InUse.compare_exchange_strong(expected, true, std::memory_order_acquire))
+            return ring;
+    }
+
+    PTRACE_RING ring = new TRACE_RING;
+    ring->Head.store(0, std::memory_order_relaxed);
+    ring->Tail.store(0, std::memory_order_relaxed);
+    ring->Dropped.store(0, std::memory_order_relaxed);
+    ring->DroppedReported = 0;
+    ring->InUse.store(true, std::memory_order_relaxed);
+    ring->Id = g_TraceRingCount.fetch_add(1, std::memory_order_relaxed) + 1;
+    ring->Next = g_TraceRings.load(std::memory_order_relaxed);
+    while (!g_TraceRings.compare_exchange_weak(ring->Next, ring, std::memory_order_release, std::memory_order_relaxed))
+        ;
+    return ring;
+}
+
+class TraceRingHolder
+{
+public:
+    TraceRingHolder() : mRing(AcquireRing()) {}
+    ~TraceRingHolder() { mRing->InUse.store(false, std::memory_order_release); }
+    PTRACE_RING mRing;
+};
+
+static PTRACE_RING GetThreadRing(void)
+{
+    static thread_local TraceRingHolder holder;
+    return holder.mRing;
+}
+
+static size_t CopyText(trace_char* Dest, size_t Pos, const trace_char* Src)
+{
+    while (Src && *Src && Pos < TRACE_TEXT_LENGTH - 1)
+        Dest[Pos++] = *Src++;
+    Dest[Pos] = 0;
+    return Pos;
+}
+
+void TraceWrite(int Level, const trace_char* Event, const trace_char* Text, const trace_char* Text2, int64_t Value1, int64_t Value2)
+{
+    PTRACE_RING ring = GetThreadRing();
+    uint64_t head = ring->Head.load(std::memory_order_relaxed);
+
+    if (head - ring->Tail.load(std::memory_order_acquire) >= TRACE_RING_SIZE)
+    {
+        ring->Dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    TRACE_RECORD* rec = &ring->Records[head & (TRACE_RING_SIZE - 1)];
+    size_t pos;
+
+    rec->Time = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - g_TraceEpoch).count();
+    rec->Event = Event;
+    rec->Value1 = Value1;
+    rec->Value2 = Value2;
+    rec->Level = Level;
+    pos = CopyText(rec->Text, 0, Text);
+    if (Text2)
+    {
+#ifdef _UNICODE
+        pos = CopyText(rec->Text, pos, L" -> ");
+#else
+        pos = CopyText(rec->Text, pos, " -> ");
+#endif
+        CopyText(rec->Text, pos, Text2);
+    }
+
+    ring->Head.store(head + 1, std::memory_order_release);
+}
+
+static void WriteRecord(FILE* Output, int Id, const TRACE_RECORD* rec)
+{
+#ifdef _UNICODE
+    fwprintf(Output, L"%lld.%06lld [%d] %ls: %ls", (long long)(rec->Time / 1000000), (long long)(rec->Time % 1000000), Id, rec->Event, rec->Text);
+    if (rec->Value1 != TRACE_NO_VALUE)
+        fwprintf(Output, L" %lld", (long long)rec->Value1);
+    if (rec->Value2 != TRACE_NO_VALUE)
+        fwprintf(Output, L" %lld", (long long)rec->Value2);
+    fputwc(L'\n', Output);
+#else
+    fprintf(Output, "%lld.%06lld [%d] %s: %s", (long long)(rec->Time / 1000000), (long long)(rec->Time % 1000000), Id, rec->Event, rec->Text);
+    if (rec->Value1 != TRACE_NO_VALUE)
+        fprintf(Output, " %lld", (long long)rec->Value1);
+    if (rec->Value2 != TRACE_NO_VALUE)
+        fprintf(Output, " %lld", (long long)rec->Value2);
+    fputc('\n', Output);
+#endif
+}
+
+// writes out the records of all rings, returns the number of records written
+static size_t DrainRings(FILE* Output)
+{
+    size_t count = 0;
+
+    for (PTRACE_RING ring = g_TraceRings.load(std::memory_order_acquire); ring != NULL; ring = ring->Next)
+    {
+        uint64_t tail = ring->Tail.load(std::memory_order_relaxed);
+        uint64_t head = ring->Head.load(std::memory_order_acquire);
+        uint64_t dropped = ring->Dropped.load(std::memory_order_relaxed);
+
+        for (; tail != head; tail++, count++)
+            WriteRecord(Output, ring->Id, &ring->Records[tail & (TRACE_RING_SIZE - 1)]);
+        ring->Tail.store(tail, std::memory_order_release);
+
+        if (dropped != ring->DroppedReported)
+        {
+#ifdef _UNICODE
+            fwprintf(Output, L"[%d] %llu records dropped\n", ring->Id, (unsigned long long)(dropped - ring->DroppedReported));
+#else
+            fprintf(Output, "[%d] %llu records dropped\n", ring->Id, (unsigned long long)(dropped - ring->DroppedReported));
+#endif
+            ring->DroppedReported = dropped;
+        }
+    }
+
+    // one flush per pass instead of one per line
+    if (count > 0)
+        fflush(Output);
+    return count;
+}
+
+static void DrainerThread(void)
+{
+    while (!g_TraceStopping.load(std::memory_order_acquire))
+    {
+        if (DrainRings(g_TraceOutput) == 0)
+            std::this_thread::sleep_for(std::chrono::milliseconds(TRACE_DRAIN_INTERVAL_MS));
+    }
+    DrainRings(g_TraceOutput);
+}
+
+void TraceStart(int Level, FILE* Output)
+{
+    assert(Output);
+    assert(!g_TraceDrainer.joinable());
+
+    g_TraceLevel.store(Level, std::memory_order_relaxed);
+    g_TraceOutput = Output;
+    g_TraceStopping.store(false, std::memory_order_relaxed);
+    g_TraceDrainer = std::thread(DrainerThread);
+}
+
+void TraceStop(void)
+{
+    if (!g_TraceDrainer.joinable())
+        return;
+
+    g_TraceStopping.store(true, std::memory_order_release);
+    g_TraceDrainer.join();
+}
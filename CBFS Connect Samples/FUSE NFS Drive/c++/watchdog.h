@@ -0,0 +1,69 @@
+#if !defined _WATCHDOG_H
+#define _WATCHDOG_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <atomic>
+
+// Watchdog of the event handlers.
+//
+// Every handler opens a WATCHDOG_SCOPE, which publishes the operation, the
+// path, the offset, the size and the start time in a slot owned by the
+// calling thread; no locks are taken. A background thread started by
+// WatchdogStart checks the slots and logs every operation that has been
+// running for longer than the threshold, once per operation, so a stalled
+// handler is on record while it still stalls. A handler that finishes late
+// logs its total duration itself.
+//
+// WatchdogDump lists all operations in flight; on Linux and macOS the
+// watchdog thread calls it whenever SIGUSR2 is received.
+
+#ifdef _UNICODE
+typedef wchar_t watchdog_char;
+#else
+typedef char watchdog_char;
+#endif
+
+extern std::atomic<bool> g_WatchdogEnabled;
+
+struct _WATCHDOG_SLOT;
+
+class WatchdogScope
+{
+public:
+    // Name must be a string literal, Path is copied (and truncated); Offset
+    // and Size are -1 for operations without them
+    WatchdogScope(const char* Name, const watchdog_char* Path, int64_t Offset, int64_t Size)
+        : mSlot(NULL)
+    {
+        if (g_WatchdogEnabled.load(std::memory_order_relaxed))
+            Begin(Name, Path, Offset, Size);
+    }
+
+    ~WatchdogScope()
+    {
+        if (mSlot != NULL)
+            End();
+    }
+
+private:
+    WatchdogScope(const WatchdogScope&);
+    WatchdogScope& operator=(const WatchdogScope&);
+
+    void Begin(const char* Name, const watchdog_char* Path, int64_t Offset, int64_t Size);
+    void End(void);
+
+    struct _WATCHDOG_SLOT* mSlot;
+};
+
+#define WATCHDOG_SCOPE(Name, Path, Offset, Size) \
+    WatchdogScope watchdog_scope(Name, Path, Offset, Size)
+
+// Output may be NULL to log to stderr
+void WatchdogStart(int ThresholdMs, FILE* Output);
+
+void WatchdogStop(void);
+
+void WatchdogDump(FILE* Output);
+
+#endif //#if !defined _WATCHDOG_H
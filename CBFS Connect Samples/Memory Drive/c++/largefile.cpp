@@ -0,0 +1,153 @@
+/*
+ * CBFS Connect 2024 C++ Edition - Sample Project
+ *
+ * This sample project demonstrates the usage of CBFS Connect in a
+ * simple, straightforward way. It is not intended to be a complete
+ * application. Error handling and other checks are simplified for clarity.
+ *
+ * www.callback.com/cbfsconnect
+ *
+ * This code is subject to the terms and conditions specified in the
+ * corresponding product license agreement which outlines the authorized
+ * usage and restrictions.
+ */
+
+// Checks VirtualFile::Read and Write at offsets past 2 GiB and 4 GiB, where
+// a position kept in 32 bits would wrap. virtualfile.cpp is built against
+// the stand-in header (standin/cbfs.h), so neither the CBFS library nor the
+// Windows SDK is needed.
+//
+// Windows of data are written across 2 GiB and across 4 GiB, and a larger
+// one past 5 GiB, with every byte derived from its offset. The ranges that
+// a wrapped offset would land on are written with zeros first and must
+// still read as zeros at the end. The buffer of the file grows to more
+// than 5 GiB of address space, of which only the pages written are used.
+//
+//   memdrive_largefile
+//
+// Exits with 1 if a check fails.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "standin/cbfs.h"
+#include "virtualfile.h"
+
+#ifndef CBFS_STANDIN
+#error Build with -DCBFS_STANDIN, see the largefile target of the makefile
+#endif
+
+#define LARGEFILE_GIB   (1024LL * 1024 * 1024)
+
+typedef struct
+{
+    __int64 Offset;
+    __int64 Length;
+}   LARGEFILE_RANGE;
+
+// across 2 GiB, across 4 GiB, and several pages past 5 GiB
+static const LARGEFILE_RANGE g_Windows[] =
+{
+    { 2 * LARGEFILE_GIB - 2048, 4096 },
+    { 4 * LARGEFILE_GIB - 2048, 4096 },
+    { 5 * LARGEFILE_GIB + 100, 100000 }
+};
+
+// where the windows land if their offsets wrap at 4 GiB
+static const LARGEFILE_RANGE g_Wrapped[] =
+{
+    { 0, 4096 },
+    { 1 * LARGEFILE_GIB + 100, 100000 }
+};
+
+static int g_Checks = 0;
+static int g_Failures = 0;
+
+static void Check(const char* What, __int64 Offset, __int64 Result, __int64 Expected)
+{
+    g_Checks++;
+    if (Result != Expected)
+    {
+        g_Failures++;
+        fprintf(stderr, "%s at %lld: %lld, expected %lld\n", What, (long long)Offset, (long long)Result, (long long)Expected);
+    }
+}
+
+// the bits above 32 are part of every byte, a wrapped offset reads wrong
+static char PatternByte(__int64 Offset)
+{
+    return (char)(Offset ^ (Offset >> 11) ^ ((Offset >> 32) * 31));
+}
+
+static void FillPattern(std::vector<char>& Buffer, __int64 Offset)
+{
+    for (size_t i = 0; i < Buffer.size(); i++)
+        Buffer[i] = PatternByte(Offset + (__int64)i);
+}
+
+// the offset of the first byte that differs, -1 if none
+static __int64 Compare(const std::vector<char>& Buffer, const std::vector<char>& Expected, __int64 Offset)
+{
+    for (size_t i = 0; i < Buffer.size(); i++)
+        if (Buffer[i] != Expected[i])
+            return Offset + (__int64)i;
+    return -1;
+}
+
+int main(int argc, char* argv[])
+{
+    VirtualFile* vfile = new VirtualFile(L"largefile");
+    std::vector<char> buffer, expected;
+    __int64 end = 0;
+    DWORD done;
+
+    for (size_t i = 0; i < sizeof(g_Wrapped) / sizeof(g_Wrapped[0]); i++)
+    {
+        buffer.assign((size_t)g_Wrapped[i].Length, 0);
+        Check("Write", g_Wrapped[i].Offset, vfile->Write(buffer.data(), g_Wrapped[i].Offset, (INT)g_Wrapped[i].Length, &done), TRUE);
+        Check("Written", g_Wrapped[i].Offset, done, g_Wrapped[i].Length);
+    }
+
+    for (size_t i = 0; i < sizeof(g_Windows) / sizeof(g_Windows[0]); i++)
+    {
+        buffer.resize((size_t)g_Windows[i].Length);
+        FillPattern(buffer, g_Windows[i].Offset);
+        Check("Write", g_Windows[i].Offset, vfile->Write(buffer.data(), g_Windows[i].Offset, (INT)g_Windows[i].Length, &done), TRUE);
+        Check("Written", g_Windows[i].Offset, done, g_Windows[i].Length);
+        end = g_Windows[i].Offset + g_Windows[i].Length;
+    }
+    Check("Size", 0, vfile->get_Size(), end);
+
+    for (size_t i = 0; i < sizeof(g_Windows) / sizeof(g_Windows[0]); i++)
+    {
+        buffer.assign((size_t)g_Windows[i].Length, 0);
+        expected.resize((size_t)g_Windows[i].Length);
+        FillPattern(expected, g_Windows[i].Offset);
+        vfile->Read(buffer.data(), g_Windows[i].Offset, (INT)g_Windows[i].Length, &done);
+        Check("Read", g_Windows[i].Offset, done, g_Windows[i].Length);
+        Check("Data", g_Windows[i].Offset, Compare(buffer, expected, g_Windows[i].Offset), -1);
+    }
+
+    for (size_t i = 0; i < sizeof(g_Wrapped) / sizeof(g_Wrapped[0]); i++)
+    {
+        buffer.assign((size_t)g_Wrapped[i].Length, 1);
+        expected.assign((size_t)g_Wrapped[i].Length, 0);
+        vfile->Read(buffer.data(), g_Wrapped[i].Offset, (INT)g_Wrapped[i].Length, &done);
+        Check("Read", g_Wrapped[i].Offset, done, g_Wrapped[i].Length);
+        Check("Zeros", g_Wrapped[i].Offset, Compare(buffer, expected, g_Wrapped[i].Offset), -1);
+    }
+
+    // a read across the end is cut there, one past it reads nothing
+    buffer.resize(8192);
+    vfile->Read(buffer.data(), end - 4096, 8192, &done);
+    Check("Read at the end", end - 4096, done, 4096);
+    vfile->Read(buffer.data(), end + 4096, 8192, &done);
+    Check("Read past the end", end + 4096, done, 0);
+
+    delete vfile;
+
+    printf("%d check(s), %d failure(s)\n", g_Checks, g_Failures);
+    return g_Failures == 0 ? 0 : 1;
+}
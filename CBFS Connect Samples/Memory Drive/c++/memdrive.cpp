@@ -38,6 +38,8 @@
 
 #include "cbfsconnectcommon.h"
 #include "virtualfile.h"
+#include "opstats.h"
+#include "watchdog.h"
 
 #ifdef _UNICODE
 #include "../../include/unicode/cbfs.h"
@@ -155,6 +157,9 @@ public: // Events
 
     INT FireCanFileBeDeleted(CBFSCanFileBeDeletedEventParams* e) override
     {
+        OPSTATS_SCOPE("CBFS CanFileBeDeleted", e->ResultCode, OPSTATS_NONZERO_ERROR, -1);
+        WATCHDOG_SCOPE("CBFS CanFileBeDeleted", e->FileName, -1, -1);
+
         VirtualFile* vfile = NULL;
 
         e->CanBeDeleted = FindVirtualFile(e->FileName, vfile);
@@ -174,6 +179,9 @@ public: // Events
 
     INT FireCloseDirectoryEnumeration(CBFSCloseDirectoryEnumerationEventParams* e) override
     {
+        OPSTATS_SCOPE("CBFS CloseDirectoryEnumeration", e->ResultCode, OPSTATS_NONZERO_ERROR, -1);
+        WATCHDOG_SCOPE("CBFS CloseDirectoryEnumeration", e->DirectoryName, -1, -1);
+
         if (e->EnumerationContext != 0)
         {
             PENUM_INFO pInfo = (PENUM_INFO)(e->EnumerationContext);
@@ -185,11 +193,17 @@ public: // Events
 
     INT FireCloseFile(CBFSCloseFileEventParams* e) override
     {
+        OPSTATS_SCOPE("CBFS CloseFile", e->ResultCode, OPSTATS_NONZERO_ERROR, -1);
+        WATCHDOG_SCOPE("CBFS CloseFile", e->FileName, -1, -1);
+
         return 0;
     }
 
     INT FireCreateFile(CBFSCreateFileEventParams* e) override
     {
+        OPSTATS_SCOPE("CBFS CreateFile", e->ResultCode, OPSTATS_NONZERO_ERROR, -1);
+        WATCHDOG_SCOPE("CBFS CreateFile", e->FileName, -1, -1);
+
         assert(e->FileInfo);
 
         VirtualFile* vfile = NULL, * vdir = NULL;
@@ -223,6 +237,9 @@ public: // Events
 
     INT FireDeleteFile(CBFSDeleteFileEventParams* e) override
     {
+        OPSTATS_SCOPE("CBFS DeleteFile", e->ResultCode, OPSTATS_NONZERO_ERROR, -1);
+        WATCHDOG_SCOPE("CBFS DeleteFile", e->FileName, -1, -1);
+
         VirtualFile* vfile = NULL;
 
         LPCWSTR FileName = e->FileName;
@@ -237,6 +254,9 @@ public: // Events
 
     INT FireEnumerateDirectory(CBFSEnumerateDirectoryEventParams* e) override
     {
+        OPSTATS_SCOPE("CBFS EnumerateDirectory", e->ResultCode, OPSTATS_NONZERO_ERROR, -1);
+        WATCHDOG_SCOPE("CBFS EnumerateDirectory", e->DirectoryName, -1, -1);
+
         VirtualFile* vdir = NULL, * vfile = NULL;
         PENUM_INFO pInfo = NULL;
         BOOL ResetEnumeration = FALSE;
@@ -324,6 +344,9 @@ public: // Events
 
     INT FireGetFileInfo(CBFSGetFileInfoEventParams* e) override
     {
+        OPSTATS_SCOPE("CBFS GetFileInfo", e->ResultCode, OPSTATS_NONZERO_ERROR, -1);
+        WATCHDOG_SCOPE("CBFS GetFileInfo", e->FileName, -1, -1);
+
         e->FileExists = FALSE;
 
         VirtualFile* vfile = NULL;
@@ -355,12 +378,18 @@ public: // Events
 
     INT FireGetVolumeId(CBFSGetVolumeIdEventParams* e) override
     {
+        OPSTATS_SCOPE("CBFS GetVolumeId", e->ResultCode, OPSTATS_NONZERO_ERROR, -1);
+        WATCHDOG_SCOPE("CBFS GetVolumeId", NULL, -1, -1);
+
         e->VolumeId = 0x12345678;
         return 0;
     }
 
     INT FireGetVolumeLabel(CBFSGetVolumeLabelEventParams* e) override
     {
+        OPSTATS_SCOPE("CBFS GetVolumeLabel", e->ResultCode, OPSTATS_NONZERO_ERROR, -1);
+        WATCHDOG_SCOPE("CBFS GetVolumeLabel", NULL, -1, -1);
+
         LPWSTR Label = const_cast<LPWSTR>(L"CBFS Connect Virtual Disk");
         e->ResultCode = CopyStringToBuffer(e->Buffer, e->lenBuffer, Label);
         return e->ResultCode;
@@ -368,6 +397,9 @@ public: // Events
 
     INT FireGetVolumeSize(CBFSGetVolumeSizeEventParams* e) override
     {
+        OPSTATS_SCOPE("CBFS GetVolumeSize", e->ResultCode, OPSTATS_NONZERO_ERROR, -1);
+        WATCHDOG_SCOPE("CBFS GetVolumeSize", NULL, -1, -1);
+
         MEMORYSTATUS status;
         GlobalMemoryStatus(&status);
         INT SectorSize = GetSectorSize();
@@ -380,6 +412,9 @@ public: // Events
 
     INT FireIsDirectoryEmpty(CBFSIsDirectoryEmptyEventParams* e) override
     {
+        OPSTATS_SCOPE("CBFS IsDirectoryEmpty", e->ResultCode, OPSTATS_NONZERO_ERROR, -1);
+        WATCHDOG_SCOPE("CBFS IsDirectoryEmpty", e->DirectoryName, -1, -1);
+
         VirtualFile* vdir = NULL, * vfile = NULL;
 
         e->IsEmpty = FALSE;
@@ -395,6 +430,9 @@ public: // Events
 
     INT FireOpenFile(CBFSOpenFileEventParams* e) override
     {
+        OPSTATS_SCOPE("CBFS OpenFile", e->ResultCode, OPSTATS_NONZERO_ERROR, -1);
+        WATCHDOG_SCOPE("CBFS OpenFile", e->FileName, -1, -1);
+
         if (e->FileContext == NULL)
         {
             VirtualFile* vfile = NULL;
@@ -411,11 +449,14 @@ public: // Events
 
     INT FireReadFile(CBFSReadFileEventParams* e) override
     {
+        OPSTATS_SCOPE("CBFS ReadFile", e->ResultCode, OPSTATS_NONZERO_ERROR, e->BytesToRead);
+        WATCHDOG_SCOPE("CBFS ReadFile", e->FileName, e->Position, e->BytesToRead);
+
         VirtualFile* vfile = (VirtualFile*)(e->FileContext);
 
         assert(vfile);
         DWORD BytesRead;
-        vfile->Read(e->Buffer, (LONG)e->Position, (INT)e->BytesToRead, &BytesRead);
+        vfile->Read(e->Buffer, e->Position, (INT)e->BytesToRead, &BytesRead);
         *(e->pBytesRead) = BytesRead;
 
         return 0;
@@ -423,6 +464,9 @@ public: // Events
 
     INT FireRenameOrMoveFile(CBFSRenameOrMoveFileEventParams* e) override
     {
+        OPSTATS_SCOPE("CBFS RenameOrMoveFile", e->ResultCode, OPSTATS_NONZERO_ERROR, -1);
+        WATCHDOG_SCOPE("CBFS RenameOrMoveFile", e->FileName, -1, -1);
+
         VirtualFile* vfile = NULL, * vdir = NULL;
 
         LPCWSTR FileName = e->FileName;
@@ -444,16 +488,23 @@ public: // Events
 
     INT FireSetAllocationSize(CBFSSetAllocationSizeEventParams* e) override
     {
+        OPSTATS_SCOPE("CBFS SetAllocationSize", e->ResultCode, OPSTATS_NONZERO_ERROR, -1);
+        WATCHDOG_SCOPE("CBFS SetAllocationSize", e->FileName, -1, e->AllocationSize);
+
         VirtualFile* vfile = (VirtualFile*)(e->FileContext);
 
         assert(vfile);
-        vfile->set_AllocationSize(e->AllocationSize);
+        if (!vfile->set_AllocationSize(e->AllocationSize))
+            e->ResultCode = ERROR_DISK_FULL;
 
-        return 0;
+        return e->ResultCode;
     }
 
     INT FireSetFileSize(CBFSSetFileSizeEventParams* e) override
     {
+        OPSTATS_SCOPE("CBFS SetFileSize", e->ResultCode, OPSTATS_NONZERO_ERROR, -1);
+        WATCHDOG_SCOPE("CBFS SetFileSize", e->FileName, -1, e->Size);
+
         VirtualFile* vfile = (VirtualFile*)(e->FileContext);
 
         assert(vfile);
@@ -465,6 +516,9 @@ public: // Events
 
     INT FireSetFileAttributes(CBFSSetFileAttributesEventParams* e) override
     {
+        OPSTATS_SCOPE("CBFS SetFileAttributes", e->ResultCode, OPSTATS_NONZERO_ERROR, -1);
+        WATCHDOG_SCOPE("CBFS SetFileAttributes", e->FileName, -1, -1);
+
         VirtualFile* vfile = (VirtualFile*)(e->FileContext);
 
         assert(vfile);
@@ -500,20 +554,27 @@ public: // Events
 
     INT FireWriteFile(CBFSWriteFileEventParams* e) override
     {
+        OPSTATS_SCOPE("CBFS WriteFile", e->ResultCode, OPSTATS_NONZERO_ERROR, e->BytesToWrite);
+        WATCHDOG_SCOPE("CBFS WriteFile", e->FileName, e->Position, e->BytesToWrite);
+
         VirtualFile* vfile = (VirtualFile*)(e->FileContext);
         assert(vfile);
 
         *(e->pBytesWritten) = 0;
 
         DWORD BytesWritten;
-        vfile->Write((LPVOID)e->Buffer, (LONG)e->Position, (INT)e->BytesToWrite, &BytesWritten);
+        if (!vfile->Write((LPVOID)e->Buffer, e->Position, (INT)e->BytesToWrite, &BytesWritten))
+            e->ResultCode = ERROR_DISK_FULL;
         *(e->pBytesWritten) = BytesWritten;
 
-        return 0;
+        return e->ResultCode;
     }
 
     INT FireGetReparsePoint(CBFSGetReparsePointEventParams* e) override
     {
+        OPSTATS_SCOPE("CBFS GetReparsePoint", e->ResultCode, OPSTATS_NONZERO_ERROR, -1);
+        WATCHDOG_SCOPE("CBFS GetReparsePoint", e->FileName, -1, -1);
+
         VirtualFile* vfile = NULL;
         WORD lengthReturned = 0;
 
@@ -555,6 +616,9 @@ public: // Events
 
     INT FireSetReparsePoint(CBFSSetReparsePointEventParams* e) override
     {
+        OPSTATS_SCOPE("CBFS SetReparsePoint", e->ResultCode, OPSTATS_NONZERO_ERROR, -1);
+        WATCHDOG_SCOPE("CBFS SetReparsePoint", e->FileName, -1, -1);
+
         if (!SUPPORT_REPARSE_POINTS)
             return 0;
 
@@ -582,6 +646,9 @@ public: // Events
 
     INT FireDeleteReparsePoint(CBFSDeleteReparsePointEventParams* e) override
     {
+        OPSTATS_SCOPE("CBFS DeleteReparsePoint", e->ResultCode, OPSTATS_NONZERO_ERROR, -1);
+        WATCHDOG_SCOPE("CBFS DeleteReparsePoint", e->FileName, -1, -1);
+
         if (!SUPPORT_REPARSE_POINTS)
             return 0;
 
@@ -645,6 +712,9 @@ void usage(void)
 #ifdef WIN32
     printf("  -drv {cab_file} - Install drivers from CAB file\n");
 #endif
+    printf("  -stats {file} - Collect handler latency histograms and write them to the file\n");
+    printf("  -statsinterval {seconds} - How often the histograms are written (default: 60)\n");
+    printf("  -slowops {milliseconds} - Log the operations that run longer (\"w\" and Enter lists the operations in flight)\n");
     printf("  -- Stop switches scanning\n\n");
     printf("Example: memdrive Y:\n\n");
 }
@@ -829,6 +899,9 @@ int main(int argc, char* argv[]) {
     LPCWSTR opt_icon_path = NULL, root_path = NULL, mount_point = NULL;
     INT argi, arg_len, stop_opt = 0, mounted = 0, opt_network = 0, opt_local = 0;
     INT flags = 0;
+    const char* opt_stats_file = NULL;
+    int opt_stats_interval = 60;
+    int opt_slow_ms = 0;
 
     banner();
     if (argc < 2) {
@@ -866,6 +939,21 @@ int main(int argc, char* argv[]) {
 #endif
                     else if (optcmp(argv[argi], (char*)"-n"))
                         opt_network = 1;
+                    else if (optcmp(argv[argi], (char*)"-stats")) {
+                        argi++;
+                        if (argi < argc)
+                            opt_stats_file = argv[argi];
+                    }
+                    else if (optcmp(argv[argi], (char*)"-statsinterval")) {
+                        argi++;
+                        if (argi < argc)
+                            opt_stats_interval = atoi(argv[argi]);
+                    }
+                    else if (optcmp(argv[argi], (char*)"-slowops")) {
+                        argi++;
+                        if (argi < argc)
+                            opt_slow_ms = atoi(argv[argi]);
+                    }
 #ifdef WIN32
                     else if (optcmp(argv[argi], (char*)"-drv")) {
                         argi++;
@@ -952,11 +1040,18 @@ int main(int argc, char* argv[]) {
                 vFile->Write(header, 0, ((SHORT)strlen(header) + 1), &written);
                 vDir->AddFile(vFile);
 
+                if (opt_stats_file != NULL)
+                    OpStatsStart(opt_stats_file, opt_stats_interval);
+                if (opt_slow_ms > 0)
+                    WatchdogStart(opt_slow_ms, NULL);
+
                 retVal = cbfs.MountMedia(0);
                 if (0 == retVal)
                     printf("Media inserted in storage\n");
                 else {
                     fprintf(stderr, "Error: %s", cbfs.GetLastError());
+                    WatchdogStop();
+                    OpStatsStop();
                     return retVal;
                 }
 
@@ -1012,7 +1107,10 @@ int main(int argc, char* argv[]) {
         while (1) {
             if (poll(cinfd, 1, 1000)) {
 #else
-        getc(stdin);
+        // a line starting with "w" lists the operations in flight, any other line unmounts
+        char line[16];
+        while (fgets(line, sizeof(line), stdin) != NULL && line[0] == 'w' && opt_slow_ms > 0)
+            WatchdogDump(stderr);
 #endif
         printf("Unmounting mounting point\n");
         retVal = cbfs.RemoveMountingPoint(-1, mount_point, flags, 0);
@@ -1045,6 +1143,8 @@ int main(int argc, char* argv[]) {
 #endif
     }
 
+    WatchdogStop();
+    OpStatsStop();
     return 0;
 }
 
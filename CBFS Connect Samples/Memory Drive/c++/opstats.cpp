@@ -0,0 +1,538 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+
+#ifdef UNIX
+#include <signal.h>
+#endif
+
+#include "opstats.h"
+
+// outcome slots of an operation: success, the tracked error codes, other errors
+#define OPSTATS_OUTCOMES (OPSTATS_MAX_ERRORS + 2)
+#define OPSTATS_OTHER_ERRORS (OPSTATS_MAX_ERRORS + 1)
+
+// every counter has a single writer, the thread owning the shard
+typedef struct
+{
+    std::atomic<uint64_t> Count;
+    std::atomic<uint64_t> Sum;
+    std::atomic<uint64_t> Max;
+    std::atomic<uint64_t> Buckets[OPSTATS_BUCKETS];
+}   OPSTATS_HISTOGRAM, * POPSTATS_HISTOGRAM;
+
+typedef struct
+{
+    std::atomic<int> Codes[OPSTATS_MAX_ERRORS];     // 0 while the slot is free
+    std::atomic<POPSTATS_HISTOGRAM> Histograms[OPSTATS_OUTCOMES][OPSTATS_SIZE_BUCKETS];
+    std::atomic<uint64_t> Allocs;
+    std::atomic<uint64_t> AllocBytes;
+}   OPSTATS_OP;
+
+typedef struct _OPSTATS_SHARD
+{
+    std::atomic<bool> InUse;
+    struct _OPSTATS_SHARD* Next;
+    OPSTATS_OP Ops[OPSTATS_MAX_OPS];
+}   OPSTATS_SHARD, * POPSTATS_SHARD;
+
+std::atomic<bool> g_OpStatsEnabled(false);
+
+static std::mutex g_OpNamesLock;
+static const char* g_OpNames[OPSTATS_MAX_OPS];
+static std::atomic<int> g_OpCount(0);
+
+static std::atomic<POPSTATS_SHARD> g_OpStatsShards(NULL);
+
+static const char* g_SizeBucketNames[OPSTATS_SIZE_BUCKETS] = { "-", "<=4K", "<=64K", "<=1M", ">1M" };
+
+static FILE* g_OpStatsOutput = NULL;
+static int g_OpStatsInterval = 0;
+static std::thread g_OpStatsWriter;
+static std::atomic<bool> g_OpStatsStopping(false);
+static std::atomic<bool> g_OpStatsDumpRequested(false);
+static void (*g_OpStatsDumpHook)(FILE* Output) = NULL;
+
+#ifdef OPSTATS_ALLOCS
+
+thread_local uint64_t g_OpStatsAllocCount = 0;
+thread_local uint64_t g_OpStatsAllocBytes = 0;
+
+// runs inside the allocator: no locks, no allocations, only the counters of the thread
+static inline void CountAlloc(size_t Bytes)
+{
+    g_OpStatsAllocCount++;
+    g_OpStatsAllocBytes += Bytes;
+}
+
+#ifdef __GLIBC__
+
+// the replacements count and call the implementation of glibc; free and
+// the aligned allocations are left alone, operator new ends up in malloc
+extern "C" void* __libc_malloc(size_t Size);
+extern "C" void* __libc_calloc(size_t Count, size_t Size);
+extern "C" void* __libc_realloc(void* Ptr, size_t Size);
+
+extern "C" void* malloc(size_t Size) noexcept
+{
+    CountAlloc(Size);
+    return __libc_malloc(Size);
+}
+
+extern "C" void* calloc(size_t Count, size_t Size) noexcept
+{
+    CountAlloc(Count * Size);
+    return __libc_calloc(Count, Size);
+}
+
+extern "C" void* realloc(void* Ptr, size_t Size) noexcept
+{
+    CountAlloc(Size);
+    return __libc_realloc(Ptr, Size);
+}
+
+#else
+
+// the other forms of new and delete of the standard library call these
+void* operator new(size_t Size)
+{
+    CountAlloc(Size);
+    void* ptr = malloc(Size != 0 ? Size : 1);
+    if (ptr == NULL)
+        throw std::bad_alloc();
+    return ptr;
+}
+
+void* operator new[](size_t Size)
+{
+    return operator new(Size);
+}
+
+void operator delete(void* Ptr) noexcept
+{
+    free(Ptr);
+}
+
+void operator delete[](void* Ptr) noexcept
+{
+    free(Ptr);
+}
+
+#endif // __GLIBC__
+
+#endif // OPSTATS_ALLOCS
+
+int OpStatsRegister(const char* Name)
+{
+    std::lock_guard<std::mutex> lock(g_OpNamesLock);
+    int count = g_OpCount.load(std::memory_order_relaxed);
+
+    for (int i = 0; i < count; i++)
+    {
+        if (!strcmp(g_OpNames[i], Name))
+            return i;
+    }
+    assert(count < OPSTATS_MAX_OPS);
+    g_OpNames[count] = Name;
+    g_OpCount.store(count + 1, std::memory_order_release);
+    return count;
+}
+
+static POPSTATS_SHARD AcquireShard(void)
+{
+    // shards are never freed, the counters of a finished thread stay in
+    // the totals and its shard is reused by the next thread
+    for (POPSTATS_SHARD shard = g_OpStatsShards.load(std::memory_order_acquire); shard != NULL; shard = shard->Next)
+    {
+        bool expected = false;
+        if (!shard->InUse.load(std::memory_order_relaxed) &&
+            shard->InUse.compare_exchange_strong(expected, true, std::memory_order_acquire))
+            return shard;
+    }
+
+    POPSTATS_SHARD shard = new OPSTATS_SHARD;
+    for (int op = 0; op < OPSTATS_MAX_OPS; op++)
+    {
+        for (int i = 0; i < OPSTATS_MAX_ERRORS; i++)
+            shard->Ops[op].Codes[i].store(0, std::memory_order_relaxed);
+        for (int i = 0; i < OPSTATS_OUTCOMES; i++)
+            for (int j = 0; j < OPSTATS_SIZE_BUCKETS; j++)
+                shard->Ops[op].Histograms[i][j].store(NULL, std::memory_order_relaxed);
+        shard->Ops[op].Allocs.store(0, std::memory_order_relaxed);
+        shard->Ops[op].AllocBytes.store(0, std::memory_order_relaxed);
+    }
+    shard->InUse.store(true, std::memory_order_relaxed);
+    shard->Next = g_OpStatsShards.load(std::memory_order_relaxed);
+    while (!g_OpStatsShards.compare_exchange_weak(shard->Next, shard, std::memory_order_release, std::memory_order_relaxed))
+        ;
+    return shard;
+}
+
+class OpStatsShardHolder
+{
+public:
+    OpStatsShardHolder() : mShard(AcquireShard()) {}
+    ~OpStatsShardHolder() { mShard->InUse.store(false, std::memory_order_release); }
+    POPSTATS_SHARD mShard;
+};
+
+static POPSTATS_SHARD GetThreadShard(void)
+{
+    static thread_local OpStatsShardHolder holder;
+    return holder.mShard;
+}
+
+static int GetBucket(uint64_t Value)
+{
+    if (Value < 8)
+        return (int)Value;
+
+    int exponent = 63;
+    while ((Value >> exponent) == 0)
+        exponent--;
+
+    int bucket = 8 + (exponent - 3) * 8 + (int)((Value >> (exponent - 3)) & 7);
+    return bucket < OPSTATS_BUCKETS ? bucket : OPSTATS_BUCKETS - 1;
+}
+
+// the highest value that falls into the bucket
+static uint64_t GetBucketLimit(int Bucket)
+{
+    if (Bucket < 8)
+        return (uint64_t)Bucket;
+
+    int exponent = (Bucket - 8) / 8 + 3;
+    uint64_t low = (uint64_t)(8 + (Bucket - 8) % 8) << (exponent - 3);
+    return low + ((uint64_t)1 << (exponent - 3)) - 1;
+}
+
+static int GetSizeBucket(int64_t Size)
+{
+    if (Size < 0)
+        return 0;
+    if (Size <= 4096)
+        return 1;
+    if (Size <= 65536)
+        return 2;
+    if (Size <= 1048576)
+        return 3;
+    return 4;
+}
+
+static inline void Increment(std::atomic<uint64_t>& Counter, uint64_t Value)
+{
+    // single writer, a plain read-modify-write is enough
+    Counter.store(Counter.load(std::memory_order_relaxed) + Value, std::memory_order_relaxed);
+}
+
+void OpStatsRecord(int Op, int ErrorCode, int64_t Size, uint64_t Nanoseconds, uint64_t Allocs, uint64_t AllocBytes)
+{
+    POPSTATS_SHARD shard = GetThreadShard();
+    OPSTATS_OP* op = &shard->Ops[Op];
+    int outcome = 0;
+
+    if (ErrorCode != 0)
+    {
+        outcome = OPSTATS_OTHER_ERRORS;
+        for (int i = 0; i < OPSTATS_MAX_ERRORS; i++)
+        {
+            int code = op->Codes[i].load(std::memory_order_relaxed);
+            if (code == 0)
+            {
+                op->Codes[i].store(ErrorCode, std::memory_order_release);
+                code = ErrorCode;
+            }
+            if (code == ErrorCode)
+            {
+                outcome = i + 1;
+                break;
+            }
+        }
+    }
+
+    std::atomic<POPSTATS_HISTOGRAM>& slot = op->Histograms[outcome][GetSizeBucket(Size)];
+    POPSTATS_HISTOGRAM h = slot.load(std::memory_order_relaxed);
+    if (h == NULL)
+    {
+        h = new OPSTATS_HISTOGRAM;
+        h->Count.store(0, std::memory_order_relaxed);
+        h->Sum.store(0, std::memory_order_relaxed);
+        h->Max.store(0, std::memory_order_relaxed);
+        for (int i = 0; i < OPSTATS_BUCKETS; i++)
+            h->Buckets[i].store(0, std::memory_order_relaxed);
+        slot.store(h, std::memory_order_release);
+    }
+
+    Increment(h->Count, 1);
+    Increment(h->Sum, Nanoseconds);
+    Increment(h->Buckets[GetBucket(Nanoseconds)], 1);
+    if (h->Max.load(std::memory_order_relaxed) < Nanoseconds)
+        h->Max.store(Nanoseconds, std::memory_order_relaxed);
+
+    // the histogram allocated above is not in Allocs, the timer took the counts before the call
+    Increment(op->Allocs, Allocs);
+    Increment(op->AllocBytes, AllocBytes);
+}
+
+typedef struct
+{
+    uint64_t Count;
+    uint64_t Sum;
+    uint64_t Max;
+    uint64_t Buckets[OPSTATS_BUCKETS];
+}   OPSTATS_TOTALS;
+
+static void AddHistogram(OPSTATS_TOTALS* Totals, POPSTATS_HISTOGRAM h)
+{
+    uint64_t max = h->Max.load(std::memory_order_relaxed);
+
+    Totals->Count += h->Count.load(std::memory_order_relaxed);
+    Totals->Sum += h->Sum.load(std::memory_order_relaxed);
+    if (Totals->Max < max)
+        Totals->Max = max;
+    for (int i = 0; i < OPSTATS_BUCKETS; i++)
+        Totals->Buckets[i] += h->Buckets[i].load(std::memory_order_relaxed);
+}
+
+static double GetPercentile(const OPSTATS_TOTALS* Totals, double Percentile)
+{
+    uint64_t total = 0, rank = (uint64_t)(Totals->Count * Percentile / 100.0);
+
+    for (int i = 0; i < OPSTATS_BUCKETS; i++)
+    {
+        total += Totals->Buckets[i];
+        if (total > rank)
+        {
+            uint64_t limit = GetBucketLimit(i);
+            return (limit < Totals->Max ? limit : Totals->Max) / 1000.0;
+        }
+    }
+    return Totals->Max / 1000.0;
+}
+
+static void DumpTotals(FILE* Output, const char* Name, const char* Outcome, int SizeBucket, const OPSTATS_TOTALS* Totals)
+{
+    if (Totals->Count == 0)
+        return;
+
+    fprintf(Output, "%-24s %-12s %-6s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+        Name, Outcome, g_SizeBucketNames[SizeBucket], (unsigned long long)Totals->Count,
+        Totals->Sum / 1000.0 / Totals->Count,
+        GetPercentile(Totals, 50), GetPercentile(Totals, 90), GetPercentile(Totals, 99),
+        GetPercentile(Totals, 99.9), Totals->Max / 1000.0);
+}
+
+#ifdef OPSTATS_ALLOCS
+static void DumpAllocs(FILE* Output)
+{
+    std::vector<OPSTATS_SUMMARY> summary;
+
+    OpStatsSummarize(summary);
+    fprintf(Output, "# allocations per operation\n");
+    fprintf(Output, "%-24s %10s %12s %10s %14s %10s\n",
+        "operation", "count", "allocs", "per call", "bytes", "per call");
+
+    for (size_t op = 0; op < summary.size(); op++)
+    {
+        uint64_t allocs = 0, bytes = 0;
+
+        if (summary[op].Count == 0)
+            continue;
+        for (POPSTATS_SHARD shard = g_OpStatsShards.load(std::memory_order_acquire); shard != NULL; shard = shard->Next)
+        {
+            allocs += shard->Ops[op].Allocs.load(std::memory_order_relaxed);
+            bytes += shard->Ops[op].AllocBytes.load(std::memory_order_relaxed);
+        }
+        fprintf(Output, "%-24s %10llu %12llu %10.1f %14llu %10.1f\n",
+            summary[op].Name, (unsigned long long)summary[op].Count,
+            (unsigned long long)allocs, (double)allocs / summary[op].Count,
+            (unsigned long long)bytes, (double)bytes / summary[op].Count);
+    }
+}
+#endif
+
+void OpStatsDump(FILE* Output)
+{
+    int count = g_OpCount.load(std::memory_order_acquire);
+    OPSTATS_TOTALS* totals = new OPSTATS_TOTALS;
+    std::vector<int> codes;
+    char outcome[32];
+
+    fprintf(Output, "# operation latency, microseconds, at %lld\n", (long long)time(NULL));
+    fprintf(Output, "%-24s %-12s %-6s %10s %10s %10s %10s %10s %10s %10s\n",
+        "operation", "outcome", "size", "count", "mean", "p50", "p90", "p99", "p99.9", "max");
+
+    for (int op = 0; op < count; op++)
+    {
+        // the shards track their error codes in different slots
+        codes.clear();
+        for (POPSTATS_SHARD shard = g_OpStatsShards.load(std::memory_order_acquire); shard != NULL; shard = shard->Next)
+        {
+            for (int i = 0; i < OPSTATS_MAX_ERRORS; i++)
+            {
+                int code = shard->Ops[op].Codes[i].load(std::memory_order_acquire);
+                bool known = code == 0;
+                for (size_t j = 0; j < codes.size() && !known; j++)
+                    known = codes[j] == code;
+                if (!known)
+                    codes.push_back(code);
+            }
+        }
+
+        for (size_t c = 0; c <= codes.size() + 1; c++)
+        {
+            if (c == 0)
+                strcpy(outcome, "ok");
+            else if (c <= codes.size())
+                snprintf(outcome, sizeof(outcome), "error %d", codes[c - 1]);
+            else
+                strcpy(outcome, "error other");
+
+            for (int size = 0; size < OPSTATS_SIZE_BUCKETS; size++)
+            {
+                memset(totals, 0, sizeof(OPSTATS_TOTALS));
+                for (POPSTATS_SHARD shard = g_OpStatsShards.load(std::memory_order_acquire); shard != NULL; shard = shard->Next)
+                {
+                    int slot = -1;
+                    if (c == 0)
+                        slot = 0;
+                    else if (c > codes.size())
+                        slot = OPSTATS_OTHER_ERRORS;
+                    else
+                    {
+                        for (int i = 0; i < OPSTATS_MAX_ERRORS && slot < 0; i++)
+                        {
+                            if (shard->Ops[op].Codes[i].load(std::memory_order_acquire) == codes[c - 1])
+                                slot = i + 1;
+                        }
+                    }
+
+                    POPSTATS_HISTOGRAM h = slot < 0 ? NULL : shard->Ops[op].Histograms[slot][size].load(std::memory_order_acquire);
+                    if (h)
+                        AddHistogram(totals, h);
+                }
+                DumpTotals(Output, g_OpNames[op], outcome, size, totals);
+            }
+        }
+    }
+#ifdef OPSTATS_ALLOCS
+    DumpAllocs(Output);
+#endif
+    if (g_OpStatsDumpHook)
+        g_OpStatsDumpHook(Output);
+    fflush(Output);
+    delete totals;
+}
+
+void OpStatsSummarize(std::vector<OPSTATS_SUMMARY>& Summary)
+{
+    int count = g_OpCount.load(std::memory_order_acquire);
+    OPSTATS_TOTALS* totals = new OPSTATS_TOTALS;
+    OPSTATS_SUMMARY summary;
+
+    Summary.clear();
+    for (int op = 0; op < count; op++)
+    {
+        memset(totals, 0, sizeof(OPSTATS_TOTALS));
+        summary.Errors = 0;
+        for (POPSTATS_SHARD shard = g_OpStatsShards.load(std::memory_order_acquire); shard != NULL; shard = shard->Next)
+        {
+            for (int slot = 0; slot < OPSTATS_OUTCOMES; slot++)
+            {
+                for (int size = 0; size < OPSTATS_SIZE_BUCKETS; size++)
+                {
+                    POPSTATS_HISTOGRAM h = shard->Ops[op].Histograms[slot][size].load(std::memory_order_acquire);
+                    if (h == NULL)
+                        continue;
+                    if (slot > 0)
+                        summary.Errors += h->Count.load(std::memory_order_relaxed);
+                    AddHistogram(totals, h);
+                }
+            }
+        }
+
+        summary.Name = g_OpNames[op];
+        summary.Count = totals->Count;
+        summary.SumUs = totals->Sum / 1000.0;
+        summary.P50Us = GetPercentile(totals, 50);
+        summary.P90Us = GetPercentile(totals, 90);
+        summary.P99Us = GetPercentile(totals, 99);
+        summary.MaxUs = totals->Max / 1000.0;
+        Summary.push_back(summary);
+    }
+    delete totals;
+}
+
+void OpStatsSetDumpHook(void (*Hook)(FILE* Output))
+{
+    g_OpStatsDumpHook = Hook;
+}
+
+#ifdef UNIX
+static void OnDumpSignal(int sig)
+{
+    g_OpStatsDumpRequested.store(true, std::memory_order_relaxed);
+}
+#endif
+
+static void WriterThread(void)
+{
+    time_t last = time(NULL);
+
+    while (!g_OpStatsStopping.load(std::memory_order_acquire))
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+        if (g_OpStatsDumpRequested.exchange(false, std::memory_order_relaxed) ||
+            (g_OpStatsInterval > 0 && time(NULL) - last >= g_OpStatsInterval))
+        {
+            OpStatsDump(g_OpStatsOutput);
+            last = time(NULL);
+        }
+    }
+}
+
+void OpStatsStart(const char* Path, int IntervalSeconds)
+{
+    assert(!g_OpStatsWriter.joinable());
+
+    g_OpStatsOutput = Path ? fopen(Path, "a") : NULL;
+    if (g_OpStatsOutput == NULL)
+        g_OpStatsOutput = stderr;
+    g_OpStatsInterval = IntervalSeconds;
+    g_OpStatsEnabled.store(true, std::memory_order_relaxed);
+
+#ifdef UNIX
+    signal(SIGUSR1, OnDumpSignal);
+#endif
+
+    g_OpStatsStopping.store(false, std::memory_order_relaxed);
+    g_OpStatsWriter = std::thread(WriterThread);
+}
+
+void OpStatsEnable(void)
+{
+    g_OpStatsEnabled.store(true, std::memory_order_relaxed);
+}
+
+void OpStatsStop(void)
+{
+    if (!g_OpStatsWriter.joinable())
+        return;
+
+    g_OpStatsStopping.store(true, std::memory_order_release);
+    g_OpStatsWriter.join();
+
+    OpStatsDump(g_OpStatsOutput);
+    if (g_OpStatsOutput != stderr)
+        fclose(g_OpStatsOutput);
+    g_OpStatsOutput = NULL;
+}
@@ -0,0 +1,56 @@
+#if !defined _STANDIN_CBFS_H
+#define _STANDIN_CBFS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+// Stand-in for the Windows declarations that the VirtualFile of the sample
+// takes from ../../include/cbfs.h.
+//
+// Built with -DCBFS_STANDIN, virtualfile.cpp includes this header instead,
+// so that it compiles on its own, without the CBFS library or the Windows
+// SDK, for the tests of the makefile. The CBFS class is not declared; the
+// handlers of the sample are not built this way.
+//
+// Only the members used by virtualfile.cpp are declared.
+
+typedef void VOID;
+typedef void* PVOID;
+typedef int BOOL;
+typedef int INT;
+typedef short SHORT;
+typedef unsigned short USHORT;
+typedef unsigned short WORD;
+typedef unsigned char UCHAR;
+typedef unsigned char BYTE;
+typedef BYTE* PBYTE;
+typedef uint32_t ULONG;
+typedef uint32_t DWORD;
+typedef DWORD* PDWORD;
+typedef wchar_t WCHAR;
+typedef WCHAR* LPWSTR;
+typedef const WCHAR* LPCWSTR;
+typedef long long __int64;
+
+typedef struct
+{
+    DWORD dwLowDateTime;
+    DWORD dwHighDateTime;
+}   FILETIME;
+
+#define TRUE    1
+#define FALSE   0
+
+#define FILE_ATTRIBUTE_NORMAL           0x00000080
+#define FILE_ATTRIBUTE_REPARSE_POINT    0x00000400
+#define IO_REPARSE_TAG_SYMLINK          0xA000000CL
+
+#define FIELD_OFFSET(type, field)   ((INT)offsetof(type, field))
+#define DUMMYUNIONNAME
+
+#define wcsicmp wcscasecmp
+
+#endif //#if !defined _STANDIN_CBFS_H
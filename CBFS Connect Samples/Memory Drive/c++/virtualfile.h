@@ -55,14 +55,15 @@ public:
 
     VOID Remove(VOID);
 
-    VOID Write(PVOID WriteBuf, LONG Position, INT BytesToWrite, PDWORD BytesWritten);
+    // FALSE if the buffer of the file cannot grow
+    BOOL Write(PVOID WriteBuf, __int64 Position, INT BytesToWrite, PDWORD BytesWritten);
 
-    VOID Read(PVOID ReadBuf, LONG Position, INT BytesToRead, PDWORD BytesRead);
+    VOID Read(PVOID ReadBuf, __int64 Position, INT BytesToRead, PDWORD BytesRead);
 
     
 
 //property
-    VOID set_AllocationSize(__int64 Value);
+    BOOL set_AllocationSize(__int64 Value);
     __int64 get_AllocationSize(VOID);
 
     VOID set_Size(__int64 Value);
@@ -97,8 +98,8 @@ public:
     VirtualFile* get_Parent(VOID);
     VOID set_Parent(VirtualFile* Value);
 
-    VOID VirtualFile::DeleteReparsePoint();
-    VOID VirtualFile::CreateReparsePoint(LPWSTR ReparsePath);
+    VOID DeleteReparsePoint();
+    VOID CreateReparsePoint(LPWSTR ReparsePath);
 
 private:
     VirtualFile();    
@@ -6,6 +6,8 @@
 
 #ifdef _UNICODE
 #include "../../include/unicode/nfs.h"
+#elif defined CBFS_STANDIN
+#include "standin/nfs.h"
 #else
 #include "../../include/nfs.h"
 #endif
@@ -0,0 +1,327 @@
+#include <assert.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef UNIX
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#endif
+
+#include "virtualfile.h"
+#include "opstats.h"
+#include "metrics.h"
+
+// how long a rendering is served before it is rendered again
+#define METRICS_REFRESH_MS      1000
+
+// how long a client of the exporter may take to send its request
+#define METRICS_REQUEST_WAIT_MS 1000
+
+const char* const g_MetricsFileNames[METRICS_FILES] = { "stats", "metrics" };
+
+static std::mutex g_MetricsLock;
+static std::shared_ptr<const std::string> g_MetricsTexts[METRICS_FILES];
+static std::chrono::steady_clock::time_point g_MetricsRendered[METRICS_FILES];
+static const std::chrono::steady_clock::time_point g_MetricsEpoch = std::chrono::steady_clock::now();
+
+// the counts of the previous stats table, for the rates
+static std::vector<uint64_t> g_MetricsPrevCounts;
+static std::chrono::steady_clock::time_point g_MetricsPrevTime = g_MetricsEpoch;
+
+static void Append(std::string& Text, const char* Format, ...)
+{
+    char line[256];
+    va_list args;
+
+    va_start(args, Format);
+    int len = vsnprintf(line, sizeof(line), Format, args);
+    va_end(args);
+    if (len > 0)
+        Text.append(line, (size_t)len < sizeof(line) ? (size_t)len : sizeof(line) - 1);
+}
+
+static void RenderStats(std::string& Text, const std::vector<OPSTATS_SUMMARY>& Ops, std::chrono::steady_clock::time_point Now)
+{
+    double elapsed = std::chrono::duration<double>(Now - g_MetricsPrevTime).count();
+    PAGEARENA_STATS arena;
+    VIRTUALFILE_EXPIRY_STATS expiry;
+
+    Append(Text, "uptime          %.0f s\n", std::chrono::duration<double>(Now - g_MetricsEpoch).count());
+    Append(Text, "files           %lld\n", (long long)VirtualFile::GetFileCount());
+    Append(Text, "bytes in use    %lld\n", (long long)VirtualFile::GetPageBytes());
+    if (VirtualFile::GetDataArenaStats(&arena))
+    {
+        Append(Text, "huge page arena %lld of %lld bytes in %lld regions, %lld pages from the heap%s\n",
+            (long long)arena.UsedBytes, (long long)arena.RegionBytes, (long long)arena.Regions, (long long)arena.Fallbacks,
+            arena.Available ? "" : " (huge pages not available)");
+        Append(Text, "fragmentation   %.3f of %lld resident bytes, %lld compactions returned %lld bytes\n",
+            arena.Fragmentation, (long long)arena.ResidentBytes, (long long)arena.Compactions, (long long)arena.ReleasedBytes);
+    }
+    VirtualFile::GetExpiryStats(&expiry);
+    if (expiry.Policies > 0)
+        Append(Text, "expiry          %lld files tracked, %lld expired\n", (long long)expiry.Tracked, (long long)expiry.Expired);
+    Text.append("\n");
+
+    if (!g_OpStatsEnabled.load(std::memory_order_relaxed))
+    {
+        Text.append("handler latencies are not recorded\n");
+        return;
+    }
+
+    // the rates cover the time since the previous rendering of this file
+    Append(Text, "%-20s %10s %10s %8s %10s %10s %10s %10s %10s\n",
+        "operation", "count", "ops/s", "errors", "mean us", "p50 us", "p90 us", "p99 us", "max us");
+    for (size_t i = 0; i < Ops.size(); i++)
+    {
+        const OPSTATS_SUMMARY& op = Ops[i];
+        uint64_t prev = i < g_MetricsPrevCounts.size() ? g_MetricsPrevCounts[i] : 0;
+
+        if (op.Count == 0)
+            continue;
+        Append(Text, "%-20s %10llu %10.1f %8llu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+            op.Name, (unsigned long long)op.Count, elapsed > 0 ? (op.Count - prev) / elapsed : 0.0,
+            (unsigned long long)op.Errors, op.SumUs / op.Count, op.P50Us, op.P90Us, op.P99Us, op.MaxUs);
+    }
+
+    g_MetricsPrevCounts.resize(Ops.size());
+    for (size_t i = 0; i < Ops.size(); i++)
+        g_MetricsPrevCounts[i] = Ops[i].Count;
+    g_MetricsPrevTime = Now;
+}
+
+static void RenderPrometheus(std::string& Text, const std::vector<OPSTATS_SUMMARY>& Ops, std::chrono::steady_clock::time_point Now)
+{
+    static const double quantiles[] = { 0.5, 0.9, 0.99 };
+
+    Text.append("# HELP cbfs_uptime_seconds Time since the drive started.\n# TYPE cbfs_uptime_seconds gauge\n");
+    Append(Text, "cbfs_uptime_seconds %.3f\n", std::chrono::duration<double>(Now - g_MetricsEpoch).count());
+    Text.append("# HELP cbfs_files Files and directories in the tree.\n# TYPE cbfs_files gauge\n");
+    Append(Text, "cbfs_files %lld\n", (long long)VirtualFile::GetFileCount());
+    Text.append("# HELP cbfs_data_bytes Bytes of the allocated file data pages.\n# TYPE cbfs_data_bytes gauge\n");
+    Append(Text, "cbfs_data_bytes %lld\n", (long long)VirtualFile::GetPageBytes());
+
+    PAGEARENA_STATS arena;
+    if (VirtualFile::GetDataArenaStats(&arena))
+    {
+        Text.append("# HELP cbfs_arena_region_bytes Bytes of the huge page regions of the data arena.\n# TYPE cbfs_arena_region_bytes gauge\n");
+        Append(Text, "cbfs_arena_region_bytes %lld\n", (long long)arena.RegionBytes);
+        Text.append("# HELP cbfs_arena_used_bytes Bytes of the data arena in file data pages.\n# TYPE cbfs_arena_used_bytes gauge\n");
+        Append(Text, "cbfs_arena_used_bytes %lld\n", (long long)arena.UsedBytes);
+        Text.append("# HELP cbfs_arena_fallbacks_total Data pages taken from the heap while the arena was on.\n# TYPE cbfs_arena_fallbacks_total counter\n");
+        Append(Text, "cbfs_arena_fallbacks_total %lld\n", (long long)arena.Fallbacks);
+        Text.append("# HELP cbfs_arena_resident_bytes Bytes of the data arena touched and not returned to the system.\n# TYPE cbfs_arena_resident_bytes gauge\n");
+        Append(Text, "cbfs_arena_resident_bytes %lld\n", (long long)arena.ResidentBytes);
+        Text.append("# HELP cbfs_arena_fragmentation Share of the resident bytes of the data arena not in use.\n# TYPE cbfs_arena_fragmentation gauge\n");
+        Append(Text, "cbfs_arena_fragmentation %.4f\n", arena.Fragmentation);
+        Text.append("# HELP cbfs_arena_released_bytes_total Bytes of the data arena returned to the system by compaction.\n# TYPE cbfs_arena_released_bytes_total counter\n");
+        Append(Text, "cbfs_arena_released_bytes_total %lld\n", (long long)arena.ReleasedBytes);
+    }
+
+    VIRTUALFILE_EXPIRY_STATS expiry;
+    VirtualFile::GetExpiryStats(&expiry);
+    if (expiry.Policies > 0)
+    {
+        Text.append("# HELP cbfs_expiry_tracked_files Files below a directory with an expiry policy.\n# TYPE cbfs_expiry_tracked_files gauge\n");
+        Append(Text, "cbfs_expiry_tracked_files %lld\n", (long long)expiry.Tracked);
+        Text.append("# HELP cbfs_expired_files_total Files deleted by the expiry sweeper.\n# TYPE cbfs_expired_files_total counter\n");
+        Append(Text, "cbfs_expired_files_total %lld\n", (long long)expiry.Expired);
+    }
+
+    if (!g_OpStatsEnabled.load(std::memory_order_relaxed))
+        return;
+
+    Text.append("# HELP cbfs_requests_total Requests completed, by handler.\n# TYPE cbfs_requests_total counter\n");
+    for (size_t i = 0; i < Ops.size(); i++)
+        Append(Text, "cbfs_requests_total{handler=\"%s\"} %llu\n", Ops[i].Name, (unsigned long long)Ops[i].Count);
+
+    Text.append("# HELP cbfs_errors_total Requests that failed, by handler.\n# TYPE cbfs_errors_total counter\n");
+    for (size_t i = 0; i < Ops.size(); i++)
+        Append(Text, "cbfs_errors_total{handler=\"%s\"} %llu\n", Ops[i].Name, (unsigned long long)Ops[i].Errors);
+
+    Text.append("# HELP cbfs_request_duration_seconds Handler latency since the start.\n# TYPE cbfs_request_duration_seconds summary\n");
+    for (size_t i = 0; i < Ops.size(); i++)
+    {
+        const OPSTATS_SUMMARY& op = Ops[i];
+        double values[] = { op.P50Us, op.P90Us, op.P99Us };
+
+        for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++)
+            Append(Text, "cbfs_request_duration_seconds{handler=\"%s\",quantile=\"%g\"} %.9f\n", op.Name, quantiles[q], values[q] / 1e6);
+        Append(Text, "cbfs_request_duration_seconds_sum{handler=\"%s\"} %.9f\n", op.Name, op.SumUs / 1e6);
+        Append(Text, "cbfs_request_duration_seconds_count{handler=\"%s\"} %llu\n", op.Name, (unsigned long long)op.Count);
+    }
+}
+
+std::shared_ptr<const std::string> MetricsGetText(int File)
+{
+    assert(File >= 0 && File < METRICS_FILES);
+
+    std::lock_guard<std::mutex> lock(g_MetricsLock);
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+    if (!g_MetricsTexts[File] || now - g_MetricsRendered[File] >= std::chrono::milliseconds(METRICS_REFRESH_MS))
+    {
+        std::vector<OPSTATS_SUMMARY> ops;
+        std::string* text = new std::string;
+
+        OpStatsSummarize(ops);
+        if (File == METRICS_FILE_STATS)
+            RenderStats(*text, ops, now);
+        else
+            RenderPrometheus(*text, ops, now);
+        g_MetricsTexts[File].reset(text);
+        g_MetricsRendered[File] = now;
+    }
+    return g_MetricsTexts[File];
+}
+
+#ifdef UNIX
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0  // macOS, the socket has SO_NOSIGPIPE instead
+#endif
+
+static int g_MetricsSocket = -1;
+static int g_MetricsStopPipe[2] = { -1, -1 };
+static std::string g_MetricsSocketPath;
+static std::thread g_MetricsServer;
+
+static bool SendAll(int Socket, const char* Data, size_t Length)
+{
+    while (Length > 0)
+    {
+        ssize_t sent = send(Socket, Data, Length, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent <= 0)
+            return false;
+        Data += sent;
+        Length -= (size_t)sent;
+    }
+    return true;
+}
+
+static void ServeClient(int Client)
+{
+    struct pollfd pfd = { Client, POLLIN, 0 };
+    char request[1024];
+    char header[160];
+
+#ifdef SO_NOSIGPIPE
+    int on = 1;
+    setsockopt(Client, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+
+    // the request is not parsed, every request gets the metrics; reading
+    // it keeps the close from resetting the connection of an HTTP client
+    if (poll(&pfd, 1, METRICS_REQUEST_WAIT_MS) > 0)
+        recv(Client, request, sizeof(request), 0);
+
+    std::shared_ptr<const std::string> text = MetricsGetText(METRICS_FILE_PROMETHEUS);
+    int len = snprintf(header, sizeof(header),
+        "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %llu\r\nConnection: close\r\n\r\n",
+        (unsigned long long)text->size());
+
+    if (SendAll(Client, header, (size_t)len))
+        SendAll(Client, text->data(), text->size());
+    close(Client);
+}
+
+static void ServerThread(void)
+{
+    struct pollfd fds[2] = { { g_MetricsSocket, POLLIN, 0 }, { g_MetricsStopPipe[0], POLLIN, 0 } };
+
+    for (;;)
+    {
+        if (poll(fds, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (fds[1].revents != 0)
+            break;
+        if ((fds[0].revents & POLLIN) != 0)
+        {
+            int client = accept(g_MetricsSocket, NULL, NULL);
+            if (client >= 0)
+                ServeClient(client);
+        }
+    }
+}
+
+bool MetricsStart(const char* SocketPath)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+
+    assert(!g_MetricsServer.joinable());
+
+    if (strlen(SocketPath) >= sizeof(addr.sun_path))
+        return false;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, SocketPath);
+
+    // a socket left by a previous run is replaced, anything else is not
+    if (lstat(SocketPath, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(SocketPath);
+
+    g_MetricsSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (g_MetricsSocket < 0)
+        return false;
+    if (bind(g_MetricsSocket, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        listen(g_MetricsSocket, 16) != 0 ||
+        pipe(g_MetricsStopPipe) != 0)
+    {
+        close(g_MetricsSocket);
+        g_MetricsSocket = -1;
+        return false;
+    }
+
+    g_MetricsSocketPath = SocketPath;
+    g_MetricsServer = std::thread(ServerThread);
+    return true;
+}
+
+void MetricsStop(void)
+{
+    char stop = 0;
+
+    if (!g_MetricsServer.joinable())
+        return;
+
+    while (write(g_MetricsStopPipe[1], &stop, 1) < 0 && errno == EINTR)
+        ;
+    g_MetricsServer.join();
+
+    close(g_MetricsSocket);
+    close(g_MetricsStopPipe[0]);
+    close(g_MetricsStopPipe[1]);
+    unlink(g_MetricsSocketPath.c_str());
+    g_MetricsSocket = -1;
+}
+
+#else
+
+bool MetricsStart(const char* SocketPath)
+{
+    return false;
+}
+
+void MetricsStop(void)
+{
+}
+
+#endif // UNIX
@@ -19,7 +19,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string>
+#include <vector>
+#include <algorithm>
 #include <time.h>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
 
 #ifdef WIN32
 #include <conio.h>
@@ -32,6 +39,7 @@
 #include <poll.h>
 #include <dirent.h>
 #include <errno.h>
+#include <signal.h>
 
 #include <sys/param.h>
 #include <sys/mount.h>
@@ -42,9 +50,21 @@
 
 #include "cbfsconnectcommon.h"
 #include "virtualfile.h"
+#include "nfs.h"
+#include "trace.h"
+#include "opstats.h"
+#include "probes.h"
+#include "metrics.h"
+#include "watchdog.h"
+#include "compactor.h"
+#include "sweeper.h"
+#include "treewalk.h"
+#include "recorder.h"
 
 #ifdef _UNICODE
 #include "../../include/unicode/nfs.h"
+#elif defined CBFS_STANDIN
+#include "standin/nfs.h"
 #else
 #include "../../include/nfs.h"
 #endif
@@ -76,12 +96,17 @@ typedef struct
 
 VirtualFile* g_DiskContext = NULL;
 
+// files listed by DumpHotFiles
+int g_HotFileCount = 10;
+
 //support routines
+bool LookupVirtualFile(const nfs_char* FileName, VirtualFile*& vfile);
 bool FindVirtualFile(const nfs_char* FileName, VirtualFile*& vfile);
 bool FindVirtualDirectory(const nfs_char* FileName, VirtualFile*& vfile);
 bool GetParentVirtualDirectory(const nfs_char* FileName, VirtualFile*& vfile);
 const nfs_char* GetFileName(const nfs_char* fullpath);
 void RemoveAllFiles(VirtualFile* root);
+void DumpHotFiles(FILE* Output);
 
 #ifndef UNIX
 #ifndef S_IFMT 
@@ -125,6 +150,27 @@ void RemoveAllFiles(VirtualFile* root);
 // Type -> File, Permissions 644
 #define FILE_MODE S_IFREG | S_IWUSR | S_IRUSR | S_IRGRP | S_IROTH
 
+// The NFS requests are served by a pool of threads in a leader/followers
+// scheme: one thread, the leader, waits in DoEvents, the followers wait on
+// g_ServeCond. A request handler first hands the event loop to a follower,
+// so the next request is read while this one is still being served.
+std::mutex g_ServeLock;
+std::condition_variable g_ServeCond;
+bool g_ServeHasLeader = false;
+thread_local bool g_ServeLeader = false;
+
+// called first by the request handlers
+void handOffEventLoop()
+{
+    if (!g_ServeLeader)
+        return;
+
+    std::lock_guard<std::mutex> lock(g_ServeLock);
+    g_ServeLeader = false;
+    g_ServeHasLeader = false;
+    g_ServeCond.notify_one();
+}
+
 class MemDriveNFS : public NFS
 {
 public: // Events
@@ -134,74 +180,112 @@ public: // Events
         //this->Config(_T("LogLevel=4"));
     }
 
-    int FireAccess(NFSAccessEventParams* e) override { return 0; }
-    int FireChmod(NFSChmodEventParams* e) override { return 0; }
-    int FireChown(NFSChownEventParams* e) override { return 0; }
+    int FireAccess(NFSAccessEventParams* e) override
+    {
+        PROBE_HANDLER(nfs, access, e->Path, -1, -1, e->Result);
+
+        return 0;
+    }
+
+    int FireChmod(NFSChmodEventParams* e) override
+    {
+        PROBE_HANDLER(nfs, chmod, e->Path, -1, -1, e->Result);
+
+        return 0;
+    }
+
+    int FireChown(NFSChownEventParams* e) override
+    {
+        PROBE_HANDLER(nfs, chown, e->Path, -1, -1, e->Result);
+
+        return 0;
+    }
 
     int FireCreateLink(NFSCreateLinkEventParams* e) override
     {
-        sout << _T("FireCreateLink: ") << e->Path << endl;
+        handOffEventLoop();
+        OPSTATS_SCOPE("NFS CreateLink", e->Result, OPSTATS_NONZERO_ERROR, -1);
+        PROBE_HANDLER(nfs, createlink, e->Path, -1, -1, e->Result);
+        WATCHDOG_SCOPE("NFS CreateLink", e->Path, -1, -1);
+        RECORDER_SCOPE(RECORDER_OP_NFS_CREATELINK, e->Path, e->LinkTarget, -1, -1, e->LinkType, e->Result, NULL);
+
+        TRACE(TRACE_LEVEL_DEBUG, _T("FireCreateLink"), e->Path);
         e->Result = NFS4ERR_NOTSUPP;
         return 0;
     }
 
     int FireReadLink(NFSReadLinkEventParams* e) override
     {
-        sout << _T("FireReadLink: ") << e->Path << endl;
+        handOffEventLoop();
+        OPSTATS_SCOPE("NFS ReadLink", e->Result, OPSTATS_NONZERO_ERROR, -1);
+        PROBE_HANDLER(nfs, readlink, e->Path, -1, -1, e->Result);
+        WATCHDOG_SCOPE("NFS ReadLink", e->Path, -1, -1);
+        RECORDER_SCOPE(RECORDER_OP_NFS_READLINK, e->Path, NULL, -1, e->BufferLength, 0, e->Result, NULL);
+
+        TRACE(TRACE_LEVEL_DEBUG, _T("FireReadLink"), e->Path);
         e->Result = NFS4ERR_NOTSUPP;
         return 0;
     }
 
     int FireConnected(NFSConnectedEventParams* e) override
     {
-        sout << _T("Client connected: ") << e->StatusCode << _T(": ") << e->Description << endl;
+        TRACE_EVENT(TRACE_LEVEL_INFO, _T("Client connected"), e->Description, NULL, e->ConnectionId, e->StatusCode);
         return 0;
     }
 
     int FireDisconnected(NFSDisconnectedEventParams* e) override
     {
-        sout << _T("Client disconnected: ") << e->StatusCode << _T(": ") << e->Description << endl;
+        TRACE_EVENT(TRACE_LEVEL_INFO, _T("Client disconnected"), e->Description, NULL, e->ConnectionId, e->StatusCode);
         return 0;
     }
 
     int FireError(NFSErrorEventParams* e) override
     {
-        sout << _T("Error: ") << e->ErrorCode << endl;
+        TRACE_EVENT(TRACE_LEVEL_ERROR, _T("Error"), e->Description, NULL, e->ConnectionId, e->ErrorCode);
         return 0;
     }
 
     int FireLog(NFSLogEventParams* e) override
     {
-        sout << e->ConnectionId << _T(": ") << e->Message << endl;
+        TRACE_EVENT(TRACE_LEVEL_INFO, _T("Log"), e->Message, NULL, e->ConnectionId, TRACE_NO_VALUE);
         return 0;
     }
 
     int FireConnectionRequest(NFSConnectionRequestEventParams* e) override
     {
-        sout << _T("Connection Request: ") << e->Address << _T(": ") << endl;
+        TRACE_EVENT(TRACE_LEVEL_INFO, _T("Connection Request"), e->Address, NULL, e->Port, TRACE_NO_VALUE);
         e->Accept = TRUE;
         return 0;
     }
 
     int FireGetAttr(NFSGetAttrEventParams* e) override
     {
-        sout << _T("FireGetAttr: ") << e->Path << endl;
+        handOffEventLoop();
+        OPSTATS_SCOPE("NFS GetAttr", e->Result, OPSTATS_NONZERO_ERROR, -1);
+        PROBE_HANDLER(nfs, getattr, e->Path, -1, -1, e->Result);
+        WATCHDOG_SCOPE("NFS GetAttr", e->Path, -1, -1);
+        RECORDER_SCOPE(RECORDER_OP_NFS_GETATTR, e->Path, NULL, -1, -1, 0, e->Result, NULL);
+
+        TRACE(TRACE_LEVEL_DEBUG, _T("FireGetAttr"), e->Path);
 
         e->Result = NFS4ERR_NOENT;
 
         VirtualFile* vfile = NULL;
+        VIRTUALFILE_ATTRIBUTES attr;
+        EpochGuard guard;
 
-        if (FindVirtualFile(e->Path, vfile))
+        if (LookupVirtualFile(e->Path, vfile))
         {
+            vfile->GetAttributes(&attr);
             e->Result = 0;
             e->LinkCount = 1;
             e->Group = _T("0");
             e->User = _T("0");
-            *(e->pSize) = vfile->get_Size();
-            e->Mode = vfile->get_Mode();
-            *(e->pCTime) = vfile->get_CreationTime();
-            *(e->pMTime) = vfile->get_LastWriteTime();
-            *(e->pATime) = vfile->get_LastAccessTime();
+            *(e->pSize) = attr.Size;
+            e->Mode = attr.Mode;
+            *(e->pCTime) = attr.CreationTime;
+            *(e->pMTime) = attr.LastWriteTime;
+            *(e->pATime) = attr.LastAccessTime;
         }
 
         return 0;
@@ -209,15 +293,18 @@ public: // Events
 
     int FireLookup(NFSLookupEventParams* e) override
     {
-        sout << _T("FireLookup: ") << e->Path << endl;
+        handOffEventLoop();
+        OPSTATS_SCOPE("NFS Lookup", e->Result, OPSTATS_NONZERO_ERROR, -1);
+        PROBE_HANDLER(nfs, lookup, e->Path, -1, -1, e->Result);
+        WATCHDOG_SCOPE("NFS Lookup", e->Path, -1, -1);
+        RECORDER_SCOPE(RECORDER_OP_NFS_LOOKUP, e->Path, e->Name, -1, -1, 0, e->Result, NULL);
 
-        VirtualFile* vfile;
+        TRACE(TRACE_LEVEL_DEBUG, _T("FireLookup"), e->Path);
 
-        if (FindVirtualDirectory(e->Path, vfile)) {
-            return 0;
-        }
+        VirtualFile* vfile;
+        EpochGuard guard;
 
-        if (FindVirtualFile(e->Path, vfile)) {
+        if (LookupVirtualFile(e->Path, vfile)) {
             return 0;
         }
 
@@ -227,7 +314,13 @@ public: // Events
 
     int FireMkDir(NFSMkDirEventParams* e) override
     {
-        sout << _T("FireMkDir: ") << e->Path << endl;
+        handOffEventLoop();
+        OPSTATS_SCOPE("NFS MkDir", e->Result, OPSTATS_NONZERO_ERROR, -1);
+        PROBE_HANDLER(nfs, mkdir, e->Path, -1, -1, e->Result);
+        WATCHDOG_SCOPE("NFS MkDir", e->Path, -1, -1);
+        RECORDER_SCOPE(RECORDER_OP_NFS_MKDIR, e->Path, NULL, -1, -1, 0, e->Result, NULL);
+
+        TRACE(TRACE_LEVEL_DEBUG, _T("FireMkDir"), e->Path);
 
         VirtualFile* vfile = NULL, * vdir = NULL;
         int64 now;
@@ -240,19 +333,31 @@ public: // Events
         GetSystemTimeAsFileTime((LPFILETIME)&now);
 #endif // WIND32
 
-        if (FindVirtualFile(e->Path, vfile))
+        if (!GetParentVirtualDirectory(e->Path, vdir))
         {
-            e->Result = NFS4ERR_EXIST;
+            e->Result = NFS4ERR_NOENT;
             return 0;
         }
 
-        if (!GetParentVirtualDirectory(e->Path, vdir))
+        vdir->LockExclusive();
+
+        if (vdir->get_Context()->GetFile(GetFileName(e->Path), vfile))
         {
-            e->Result = NFS4ERR_NOENT;
+            vdir->UnlockExclusive();
+            vdir->Release();
+            e->Result = NFS4ERR_EXIST;
             return 0;
         }
 
         vfile = new VirtualFile(GetFileName(e->Path), DIR_MODE);
+        if (vfile->get_Name() == NULL)
+        {
+            vfile->Release();
+            vdir->UnlockExclusive();
+            vdir->Release();
+            e->Result = NFS4ERR_NOSPC;
+            return 0;
+        }
 
         vfile->set_CreationTime(now);
         vfile->set_LastAccessTime(now);
@@ -260,12 +365,21 @@ public: // Events
 
         vdir->AddFile(vfile);
 
+        vdir->UnlockExclusive();
+        vdir->Release();
+
         return 0;
     }
 
     int FireOpen(NFSOpenEventParams* e) override
     {
-        sout << _T("FireOpen: ") << e->Path << _T(", open type: ") << e->OpenType << endl;
+        handOffEventLoop();
+        OPSTATS_SCOPE("NFS Open", e->Result, OPSTATS_NONZERO_ERROR, -1);
+        PROBE_HANDLER(nfs, open, e->Path, -1, -1, e->Result);
+        WATCHDOG_SCOPE("NFS Open", e->Path, -1, -1);
+        RECORDER_SCOPE(RECORDER_OP_NFS_OPEN, e->Path, NULL, -1, -1, e->OpenType, e->Result, NULL);
+
+        TRACE_EVENT(TRACE_LEVEL_DEBUG, _T("FireOpen"), e->Path, NULL, e->OpenType, TRACE_NO_VALUE);
 
         int64 now;
 #ifdef UNIX
@@ -280,25 +394,40 @@ public: // Events
         if (e->OpenType == 1)
         {
             VirtualFile* vfile = NULL, * vdir = NULL;
-            if (FindVirtualFile(e->Path, vfile))
+            if (!GetParentVirtualDirectory(e->Path, vdir))
             {
-                e->Result = NFS4ERR_EXIST;
+                e->Result = NFS4ERR_NOENT;
                 return 0;
             }
 
-            if (!GetParentVirtualDirectory(e->Path, vdir))
+            vdir->LockExclusive();
+
+            if (vdir->get_Context()->GetFile(GetFileName(e->Path), vfile))
             {
-                e->Result = NFS4ERR_NOENT;
+                vdir->UnlockExclusive();
+                vdir->Release();
+                e->Result = NFS4ERR_EXIST;
                 return 0;
             }
 
             vfile = new VirtualFile(GetFileName(e->Path), FILE_MODE);
+            if (vfile->get_Name() == NULL)
+            {
+                vfile->Release();
+                vdir->UnlockExclusive();
+                vdir->Release();
+                e->Result = NFS4ERR_NOSPC;
+                return 0;
+            }
 
             vfile->set_CreationTime(now);
             vfile->set_LastAccessTime(now);
             vfile->set_LastWriteTime(now);
 
             vdir->AddFile(vfile);
+
+            vdir->UnlockExclusive();
+            vdir->Release();
         }
         else
         {
@@ -307,7 +436,12 @@ public: // Events
             if (!FindVirtualFile(e->Path, vfile))
                 e->Result = NFS4ERR_NOENT;
             else
+            {
+                vfile->LockExclusive();
                 vfile->set_LastAccessTime(now);
+                vfile->UnlockExclusive();
+                vfile->Release();
+            }
         }
 
         return 0;
@@ -315,24 +449,35 @@ public: // Events
 
     int FireRead(NFSReadEventParams* e) override
     {
-        sout << _T("FireRead: ") << e->Path << endl;
+        handOffEventLoop();
+        OPSTATS_SCOPE("NFS Read", e->Result, OPSTATS_NONZERO_ERROR, e->Count);
+        PROBE_HANDLER(nfs, read, e->Path, e->Offset, e->Count, e->Result);
+        WATCHDOG_SCOPE("NFS Read", e->Path, e->Offset, e->Count);
+        RECORDER_SCOPE(RECORDER_OP_NFS_READ, e->Path, NULL, e->Offset, e->Count, 0, e->Result, NULL);
+
+        TRACE_EVENT(TRACE_LEVEL_DEBUG, _T("FireRead"), e->Path, NULL, e->Offset, e->Count);
 
         if (e->Count == 0) return 0;
 
-        int BytesRead;
+        int64 BytesRead;
         VirtualFile* vfile;
 
         if (FindVirtualFile(e->Path, vfile))
         {
+            vfile->LockShared();
             if (e->Offset >= vfile->get_Size())
             {
+                vfile->UnlockShared();
+                vfile->Release();
                 e->Count = 0;
                 e->Eof = true;
                 return 0;
             }
-            vfile->Read((void*)e->Buffer, e->Offset, (int)e->Count, &BytesRead);
+            vfile->Read((void*)e->Buffer, e->Offset, e->Count, &BytesRead);
             if (e->Offset + BytesRead == vfile->get_Size()) e->Eof = true;
-            e->Count = BytesRead;
+            vfile->UnlockShared();
+            vfile->Release();
+            e->Count = (int)BytesRead;
         }
         else
             e->Result = NFS4ERR_NOENT;
@@ -342,9 +487,17 @@ public: // Events
 
     int FireReadDir(NFSReadDirEventParams* e) override
     {
-        sout << _T("FireReadDir: ") << e->Path << endl;
+        handOffEventLoop();
+        OPSTATS_SCOPE("NFS ReadDir", e->Result, OPSTATS_NONZERO_ERROR, -1);
+        PROBE_HANDLER(nfs, readdir, e->Path, -1, -1, e->Result);
+        WATCHDOG_SCOPE("NFS ReadDir", e->Path, -1, -1);
+        RECORDER_SCOPE(RECORDER_OP_NFS_READDIR, e->Path, NULL, e->Cookie, -1, 0, e->Result, NULL);
 
-        VirtualFile* vdir = NULL, * vfile = NULL;
+        TRACE(TRACE_LEVEL_DEBUG, _T("FireReadDir"), e->Path);
+
+        VirtualFile* vdir = NULL;
+        std::vector<VIRTUALFILE_ENTRY> entries;
+        EpochGuard guard;
 
         int readOffset = 0;
         long long cookie = baseCookie;  // just an offset to avoid a chance to have cookie set to 0, 1, 2
@@ -355,16 +508,17 @@ public: // Events
             cookie = e->Cookie + 1;
         }
 
-        if (FindVirtualDirectory(e->Path, vdir))
+        if (LookupVirtualFile(e->Path, vdir) && (vdir->get_Mode() & S_IFDIR) != 0)
         {
             int ret_code = 0;
-            for (int i = readOffset; i < vdir->get_Context()->GetCount(); i++)
+            vdir->get_Context()->GetEntries(entries);
+            for (int i = readOffset; i < (int)entries.size(); i++)
             {
-                vdir->get_Context()->GetFile(i, vfile);
-                ret_code = FillDir(e->ConnectionId, vfile->get_Name(), 0, cookie,
-                    vfile->get_Mode(), _T("0"), _T("0"), 1,
-                    vfile->get_Size(), vfile->get_LastAccessTime(),
-                    vfile->get_LastWriteTime(), vfile->get_CreationTime());
+                VIRTUALFILE_ATTRIBUTES& attr = entries[i].Attributes;
+                ret_code = FillDir(e->ConnectionId, entries[i].Name, 0, cookie,
+                    attr.Mode, _T("0"), _T("0"), 1,
+                    attr.Size, attr.LastAccessTime,
+                    attr.LastWriteTime, attr.CreationTime);
 
                 // Return now assuming FillDir returned non-zero value, indicating maximum entries have been provided.
                 if (ret_code) 
@@ -381,98 +535,156 @@ public: // Events
 
     int FireRename(NFSRenameEventParams* e) override
     {
-        sout << _T("FireRename: ") << e->OldPath << _T(" -> ") << e->NewPath << endl;
+        handOffEventLoop();
+        OPSTATS_SCOPE("NFS Rename", e->Result, OPSTATS_NONZERO_ERROR, -1);
+        PROBE_HANDLER(nfs, rename, e->OldPath, -1, -1, e->Result);
+        WATCHDOG_SCOPE("NFS Rename", e->OldPath, -1, -1);
+        RECORDER_SCOPE(RECORDER_OP_NFS_RENAME, e->OldPath, e->NewPath, -1, -1, 0, e->Result, NULL);
+
+        TRACE_EVENT(TRACE_LEVEL_DEBUG, _T("FireRename"), e->OldPath, e->NewPath, TRACE_NO_VALUE, TRACE_NO_VALUE);
 
         if (nfs_scmp(e->OldPath, e->NewPath) == 0) return 0;
 
-        VirtualFile* voldfile = NULL, * vnewfile = NULL, * vnewparent = NULL;
+        VirtualFile* voldfile = NULL, * vnewfile = NULL, * voldparent = NULL, * vnewparent = NULL;
 
-        if (FindVirtualDirectory(e->OldPath, voldfile))
+        if (!GetParentVirtualDirectory(e->OldPath, voldparent))
         {
-            // Check for compatibility
-            if (FindVirtualFile(e->NewPath, vnewfile) && (vnewfile->get_Mode() & S_IFREG) != 0)
-            {
-                e->Result = NFS4ERR_EXIST;
-                return 0;
-            }
+            e->Result = NFS4ERR_NOENT;
+            return 0;
+        }
+
+        if (!GetParentVirtualDirectory(e->NewPath, vnewparent))
+        {
+            voldparent->Release();
+            e->Result = NFS4ERR_NOENT;
+            return 0;
+        }
+
+        VirtualFile::LockRename(voldparent, vnewparent);
 
-            // Remove directory if it exists and is empty
-            int fileCount = 0;
-            if (FindVirtualDirectory(e->NewPath, vnewfile))
+        if (!voldparent->get_Context()->GetFile(GetFileName(e->OldPath), voldfile))
+            e->Result = NFS4ERR_NOENT;
+        else if (voldfile == vnewparent || voldfile->IsAncestorOf(vnewparent))
+            e->Result = NFS4ERR_INVAL;
+        else if (vnewparent->get_Context()->GetFile(GetFileName(e->NewPath), vnewfile))
+        {
+            if ((voldfile->get_Mode() & S_IFDIR) != 0)
             {
-                fileCount = vnewfile->get_Context()->GetCount();
-                if (fileCount != 0)
-                {
+                // Check for compatibility
+                if ((vnewfile->get_Mode() & S_IFDIR) == 0)
                     e->Result = NFS4ERR_EXIST;
-                    return 0;
+                // An ancestor of the source is never empty, and it must not be locked after its descendant
+                else if (vnewfile == voldparent || vnewfile->IsAncestorOf(voldparent))
+                    e->Result = NFS4ERR_EXIST;
+                else
+                {
+                    // Remove directory if it exists and is empty
+                    vnewfile->LockShared();
+                    int fileCount = vnewfile->get_Context()->GetCount();
+                    vnewfile->UnlockShared();
+                    if (fileCount != 0)
+                        e->Result = NFS4ERR_EXIST;
                 }
-                vnewfile->Remove();
-                delete vnewfile;
             }
+            else if ((vnewfile->get_Mode() & S_IFDIR) != 0)
+                e->Result = NFS4ERR_EXIST;
 
-            // Move directory
-            if (GetParentVirtualDirectory(e->NewPath, vnewparent))
-            {
-                voldfile->Remove();
-                voldfile->Rename(GetFileName(e->NewPath));
-                vnewparent->AddFile(voldfile);
-            }
         }
-        else if (FindVirtualFile(e->OldPath, voldfile))
-        {
-            // Check for compatibility
-            if (FindVirtualDirectory(e->NewPath, vnewfile))
-            {
-                e->Result = NFS4ERR_EXIST;
-                return 0;
-            }
 
-            // Remove existing file if it exists
-            if (FindVirtualFile(e->NewPath, vnewfile))
+        // Move file or directory; the existing file or empty directory is
+        // replaced only once the new name is allocated
+        if (voldfile != NULL && e->Result == 0)
+        {
+            voldfile->Remove();
+            if (!voldfile->Rename(GetFileName(e->NewPath)))
             {
-                vnewfile->Remove();
-                delete vnewfile;
+                voldparent->AddFile(voldfile);
+                e->Result = NFS4ERR_NOSPC;
             }
-
-            // Move file
-            if (GetParentVirtualDirectory(e->NewPath, vnewparent))
+            else
             {
-                voldfile->Remove();
-                voldfile->Rename(GetFileName(e->NewPath));
+                if (vnewfile != NULL)
+                {
+                    vnewfile->Remove();
+                    vnewfile->Release();
+                }
                 vnewparent->AddFile(voldfile);
             }
         }
-        else
-            e->Result = NFS4ERR_NOENT;
+
+        VirtualFile::UnlockRename(voldparent, vnewparent);
+
+        voldparent->Release();
+        vnewparent->Release();
 
         return 0;
     }
 
     int FireRmDir(NFSRmDirEventParams* e) override
     {
-        sout << _T("FireRmDir: ") << e->Path << endl;
+        handOffEventLoop();
+        OPSTATS_SCOPE("NFS RmDir", e->Result, OPSTATS_NONZERO_ERROR, -1);
+        PROBE_HANDLER(nfs, rmdir, e->Path, -1, -1, e->Result);
+        WATCHDOG_SCOPE("NFS RmDir", e->Path, -1, -1);
+        RECORDER_SCOPE(RECORDER_OP_NFS_RMDIR, e->Path, NULL, -1, -1, 0, e->Result, NULL);
 
-        VirtualFile* vfile = NULL;
+        TRACE(TRACE_LEVEL_DEBUG, _T("FireRmDir"), e->Path);
 
-        if (FindVirtualFile(e->Path, vfile))
+        VirtualFile* vfile = NULL, * vdir = NULL;
+
+        if (!GetParentVirtualDirectory(e->Path, vdir))
+        {
+            e->Result = NFS4ERR_NOENT;
+            return 0;
+        }
+
+        vdir->LockExclusive();
+
+        if (vdir->get_Context()->GetFile(GetFileName(e->Path), vfile))
         {
-            vfile->Remove();
-            delete vfile;
+            vfile->LockShared();
+            bool directory = (vfile->get_Mode() & S_IFDIR) != 0;
+            bool empty = vfile->get_Context()->IsEmpty();
+            vfile->UnlockShared();
+
+            if (!directory)
+                e->Result = NFS4ERR_NOTDIR;
+            else if (!empty)
+                e->Result = NFS4ERR_NOTEMPTY;
+            else
+            {
+                vfile->Remove();
+                vfile->Release();
+            }
         }
         else
             e->Result = NFS4ERR_NOENT;
 
+        vdir->UnlockExclusive();
+        vdir->Release();
+
         return 0;
     }
 
     int FireTruncate(NFSTruncateEventParams* e) override
     {
-        sout << _T("FireTruncate: ") << e->Path << endl;
+        handOffEventLoop();
+        OPSTATS_SCOPE("NFS Truncate", e->Result, OPSTATS_NONZERO_ERROR, -1);
+        PROBE_HANDLER(nfs, truncate, e->Path, -1, e->Size, e->Result);
+        WATCHDOG_SCOPE("NFS Truncate", e->Path, -1, e->Size);
+        RECORDER_SCOPE(RECORDER_OP_NFS_TRUNCATE, e->Path, NULL, -1, e->Size, 0, e->Result, NULL);
+
+        TRACE(TRACE_LEVEL_DEBUG, _T("FireTruncate"), e->Path);
 
         VirtualFile* vfile = NULL;
 
         if (FindVirtualFile(e->Path, vfile))
+        {
+            vfile->LockExclusive();
             vfile->set_Size(e->Size);
+            vfile->UnlockExclusive();
+            vfile->Release();
+        }
         else
             e->Result = NFS4ERR_NOENT;
 
@@ -481,33 +693,72 @@ public: // Events
 
     int FireUnlink(NFSUnlinkEventParams* e) override
     {
-        sout << _T("FireUnlink: ") << e->Path << endl;
+        handOffEventLoop();
+        OPSTATS_SCOPE("NFS Unlink", e->Result, OPSTATS_NONZERO_ERROR, -1);
+        PROBE_HANDLER(nfs, unlink, e->Path, -1, -1, e->Result);
+        WATCHDOG_SCOPE("NFS Unlink", e->Path, -1, -1);
+        RECORDER_SCOPE(RECORDER_OP_NFS_UNLINK, e->Path, NULL, -1, -1, 0, e->Result, NULL);
 
-        VirtualFile* vfile = NULL;
+        TRACE(TRACE_LEVEL_DEBUG, _T("FireUnlink"), e->Path);
 
-        if (FindVirtualFile(e->Path, vfile))
+        VirtualFile* vfile = NULL, * vdir = NULL;
+
+        if (!GetParentVirtualDirectory(e->Path, vdir))
         {
-            vfile->Remove();
-            delete vfile;
+            e->Result = NFS4ERR_NOENT;
+            return 0;
+        }
+
+        vdir->LockExclusive();
+
+        if (vdir->get_Context()->GetFile(GetFileName(e->Path), vfile))
+        {
+            bool empty = true;
+            if ((vfile->get_Mode() & S_IFDIR) != 0)
+            {
+                vfile->LockShared();
+                empty = vfile->get_Context()->IsEmpty();
+                vfile->UnlockShared();
+            }
+
+            if (!empty)
+                e->Result = NFS4ERR_NOTEMPTY;
+            else
+            {
+                vfile->Remove();
+                vfile->Release();
+            }
         }
         else
             e->Result = NFS4ERR_NOENT;
 
+        vdir->UnlockExclusive();
+        vdir->Release();
+
         return 0;
     }
 
     int FireUTime(NFSUTimeEventParams* e) override
     {
-        sout << _T("FireUTime: ") << e->Path << endl;
+        handOffEventLoop();
+        OPSTATS_SCOPE("NFS UTime", e->Result, OPSTATS_NONZERO_ERROR, -1);
+        PROBE_HANDLER(nfs, utime, e->Path, -1, -1, e->Result);
+        WATCHDOG_SCOPE("NFS UTime", e->Path, -1, -1);
+        RECORDER_SCOPE(RECORDER_OP_NFS_UTIME, e->Path, NULL, e->ATime, e->MTime, 0, e->Result, NULL);
+
+        TRACE(TRACE_LEVEL_DEBUG, _T("FireUTime"), e->Path);
 
         VirtualFile* vfile = NULL;
 
         if (FindVirtualFile(e->Path, vfile))
         {
+            vfile->LockExclusive();
             if (e->ATime != 0)
                 vfile->set_LastAccessTime(e->ATime);
             if (e->MTime != 0)
                 vfile->set_LastWriteTime(e->MTime);
+            vfile->UnlockExclusive();
+            vfile->Release();
         }
         else
             e->Result = NFS4ERR_NOENT;
@@ -517,19 +768,31 @@ public: // Events
 
     int FireWrite(NFSWriteEventParams* e) override
     {
-        sout << _T("FireWrite: ") << e->Path << endl;
+        handOffEventLoop();
+        OPSTATS_SCOPE("NFS Write", e->Result, OPSTATS_NONZERO_ERROR, e->Count);
+        PROBE_HANDLER(nfs, write, e->Path, e->Offset, e->Count, e->Result);
+        WATCHDOG_SCOPE("NFS Write", e->Path, e->Offset, e->Count);
+        RECORDER_SCOPE(RECORDER_OP_NFS_WRITE, e->Path, NULL, e->Offset, e->Count, e->Stable, e->Result, e->Buffer);
+
+        TRACE_EVENT(TRACE_LEVEL_DEBUG, _T("FireWrite"), e->Path, NULL, e->Offset, e->Count);
 
         if (e->Count == 0) return 0;
 
-        int BytesWritten;
+        int64 BytesWritten;
         VirtualFile* vfile;
 
         if (FindVirtualFile(e->Path, vfile))
         {
-            vfile->set_AllocationSize(e->Offset + e->Count);
-            vfile->Write((void*)e->Buffer, e->Offset, (int)e->Count, &BytesWritten);
-
-            e->Count = BytesWritten;
+            // writers of disjoint ranges of the file run in parallel
+            vfile->LockShared();
+            bool written = vfile->Write((void*)e->Buffer, e->Offset, e->Count, &BytesWritten);
+            vfile->UnlockShared();
+            vfile->Release();
+
+            // a write cut short by a lack of memory reports the part written
+            if (!written && BytesWritten == 0)
+                e->Result = NFS4ERR_NOSPC;
+            e->Count = (int)BytesWritten;
             e->Stable = FILE_SYNC4;
         }
         else
@@ -549,9 +812,28 @@ void banner(void)
 
 void usage(void)
 {
-    printf("Usage: nfs [local port or - for default] <mounting point>\n\n");
+    printf("Usage: nfs [-threads <count>] [-trace <level>] [-tracefile <file>]\n");
+    printf("           [-stats <file>] [-statsinterval <seconds>] [-hotfiles <count>] [-metrics <socket>]\n");
+    printf("           [-slowops <milliseconds>] [-record <file> [-recorddata]] [-smallfiles <bytes>]\n");
+    printf("           [-hugepages] [-compact <MB per second>] [-expire <directory> <seconds>]\n");
+    printf("           [local port or - for default] <mounting point>\n\n");
+    printf("  -threads - Number of threads that serve client requests (default: number of processors)\n");
+    printf("  -trace - Trace level: 0 - none, 1 - errors, 2 - connections (default), 3 - every request\n");
+    printf("  -tracefile - Write the trace to a file instead of the standard output\n");
+    printf("  -stats - Collect handler latency histograms and write them to the file\n");
+    printf("  -statsinterval - How often the histograms are written (default: 60; SIGUSR1 writes them at once)\n");
+    printf("  -hotfiles - Number of the most read and written files listed with the statistics (default: 10)\n");
+    printf("  -slowops - Log the requests that run longer than the given time (SIGUSR2 lists the requests in flight)\n");
+    printf("  -metrics - Serve live counters in Prometheus format over HTTP on a Unix domain socket (Linux/macOS)\n");
+    printf("  -record - Record the requests to the file, for replay with nfs_replay\n");
+    printf("  -recorddata - Record the data of writes as well\n");
+    printf("  -smallfiles - Keep files of up to this size in one buffer instead of 64 KB pages (default: 4096, 0 - off)\n");
+    printf("  -hugepages - Take the pages of file data from 2 MB regions backed by transparent huge pages (Linux)\n");
+    printf("  -compact - Move file data out of fragmented regions in the background at up to this rate and return freed memory\n");
+    printf("  -expire - Delete the files below the directory that were not used for this long (repeatable)\n\n");
     printf("Example 1 (any OS): nfs 2049\n");
-    printf("Example 2 (Linux/macOS): sudo nfs - /mnt/mynfs\n\n");
+    printf("Example 2 (Linux/macOS): sudo nfs - /mnt/mynfs\n");
+    printf("Example 3 (any OS): nfs -threads 8 2049\n\n");
 
     printf("'mount' command should be installed on Linux/macOS to use mounting points!\n");
     printf("Automatic mounting to mounting points is supported only on Linux and macOS.\n");
@@ -563,6 +845,77 @@ void usage(void)
 
 MemDriveNFS cbfs_nfs;
 
+// set once the server is asked to stop; the worker threads leave their event loops
+std::atomic<bool> g_Stopping(false);
+
+#ifdef UNIX
+// the signal handler wakes up the main thread through this pipe
+int g_StopPipe[2] = { -1, -1 };
+
+void onStopSignal(int sig)
+{
+    char c = 0;
+    g_Stopping.store(true);
+    if (write(g_StopPipe[1], &c, 1) < 0) {}
+}
+#endif
+
+#ifdef WIN32
+BOOL WINAPI onConsoleCtrl(DWORD CtrlType)
+{
+    g_Stopping.store(true);
+    return TRUE;
+}
+#endif
+
+// longest wait of the leader after a DoEvents call that brought no request
+#define SERVE_IDLE_WAIT_MS 16
+
+void serveRequests()
+{
+    std::unique_lock<std::mutex> lock(g_ServeLock);
+    int idleWait = 0;
+
+    while (!g_Stopping.load(std::memory_order_relaxed))
+    {
+        if (g_ServeHasLeader)
+        {
+            g_ServeCond.wait(lock);
+            continue;
+        }
+
+        g_ServeHasLeader = true;
+        g_ServeLeader = true;
+        lock.unlock();
+        cbfs_nfs.DoEvents();
+        lock.lock();
+
+        if (!g_ServeLeader)
+        {
+            // a handler on this thread passed the event loop on
+            idleWait = 0;
+            continue;
+        }
+
+        // no request came in; the leader waits a little longer every time,
+        // so that an idle server does not spin, and a stop ends the wait
+        if (idleWait < SERVE_IDLE_WAIT_MS)
+            idleWait = idleWait == 0 ? 1 : idleWait * 2;
+        g_ServeCond.wait_for(lock, std::chrono::milliseconds(idleWait),
+            [] { return g_Stopping.load(std::memory_order_relaxed); });
+        g_ServeLeader = false;
+        g_ServeHasLeader = false;
+    }
+}
+
+// wakes up the followers, so that they see g_Stopping
+void stopServing()
+{
+    std::lock_guard<std::mutex> lock(g_ServeLock);
+    g_Stopping.store(true);
+    g_ServeCond.notify_all();
+}
+
 // ----------------------------------------------------------------------------------
 
 #ifdef WIN32
@@ -598,6 +951,51 @@ nfs_char* a2w(char* source)
 #define a2w(str) (nfs_char*)(str)
 #endif
 
+void CreateDiskContext(void)
+{
+    int64 now;
+#ifdef UNIX
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    now = UnixTimeToFileTime(tv.tv_sec, tv.tv_usec * 1000);
+#endif // UNIX
+#ifdef WIN32
+    GetSystemTimeAsFileTime((LPFILETIME)&now);
+#endif // WIND32
+
+    g_DiskContext = new VirtualFile(TEXT("/"), DIR_MODE);
+
+    g_DiskContext->set_CreationTime(now);
+    g_DiskContext->set_LastAccessTime(now);
+    g_DiskContext->set_LastWriteTime(now);
+
+    g_DiskContext->set_Size(4096);
+
+
+    VirtualFile* vfile = new VirtualFile(TEXT("test"), DIR_MODE);
+
+    vfile->set_CreationTime(now);
+    vfile->set_LastAccessTime(now);
+    vfile->set_LastWriteTime(now);
+
+    vfile->set_Size(4096);
+
+    g_DiskContext->AddFile(vfile);
+}
+
+void DeleteDiskContext(void)
+{
+    if (g_DiskContext == NULL)
+        return;
+    RemoveAllFiles(g_DiskContext);
+    g_DiskContext->Release();
+    g_DiskContext = NULL;
+
+    // what was retired is only freed once no reader can see it, which is
+    // now, and leak checks would report it at exit otherwise
+    EpochFlush();
+}
+
 void stopServer()
 {
     sout << _T("Stopping server...") << endl;
@@ -605,140 +1003,356 @@ void stopServer()
     cbfs_nfs.StopListening();
     sout << _T("Server stopped") << endl;
 
-    if (g_DiskContext)
-        delete g_DiskContext;
+    DeleteDiskContext();
 }
 
+// the stand-in build (standin/nfs.h) brings its own main, see standin.cpp
+#ifndef CBFS_STANDIN
 int main(int argc, char* argv[]) {
     // default NFS port
     int port = 2049;
+    int threadCount = (int)std::thread::hardware_concurrency();
+    int argi = 1;
+    int traceLevel = TRACE_LEVEL_INFO;
+    FILE* traceOutput = stdout;
+    const char* statsFile = NULL;
+    int statsInterval = 60;
+    const char* metricsSocket = NULL;
+    int slowMs = 0;
+    int compactRate = 0;
+    bool expire = false;
+    const char* recordFile = NULL;
+    bool recordData = false;
     cbt_string sPort;
+    std::vector<std::thread> workers;
 
 #ifndef WIN32
-    struct pollfd cinfd[1];
+    struct pollfd cinfd[2];
 #endif
 
     banner();
-    if (argc < 2) {
+
+    // switches go before the port, a lone "-" is the default port
+    while (argi < argc && argv[argi][0] == '-' && argv[argi][1] != 0)
+    {
+        if (!strcmp(argv[argi], "-threads") && argi + 1 < argc)
+        {
+            threadCount = atoi(argv[argi + 1]);
+            argi += 2;
+        }
+        else if (!strcmp(argv[argi], "-trace") && argi + 1 < argc)
+        {
+            traceLevel = atoi(argv[argi + 1]);
+            argi += 2;
+        }
+        else if (!strcmp(argv[argi], "-stats") && argi + 1 < argc)
+        {
+            statsFile = argv[argi + 1];
+            argi += 2;
+        }
+        else if (!strcmp(argv[argi], "-statsinterval") && argi + 1 < argc)
+        {
+            statsInterval = atoi(argv[argi + 1]);
+            argi += 2;
+        }
+        else if (!strcmp(argv[argi], "-hotfiles") && argi + 1 < argc)
+        {
+            g_HotFileCount = atoi(argv[argi + 1]);
+            argi += 2;
+        }
+        else if (!strcmp(argv[argi], "-smallfiles") && argi + 1 < argc)
+        {
+            VirtualFile::SetSmallFileLimit(atoi(argv[argi + 1]));
+            argi += 2;
+        }
+        else if (!strcmp(argv[argi], "-hugepages"))
+        {
+            if (!VirtualFile::SetDataArena(true))
+                printf("Huge pages are not available, file data is kept on the heap\n");
+            argi++;
+        }
+        else if (!strcmp(argv[argi], "-compact") && argi + 1 < argc)
+        {
+            compactRate = atoi(argv[argi + 1]);
+            argi += 2;
+        }
+        else if (!strcmp(argv[argi], "-expire") && argi + 2 < argc)
+        {
+            VirtualFile::SetExpiryPolicy(argv[argi + 1], atoi(argv[argi + 2]));
+            expire = true;
+            argi += 3;
+        }
+        else if (!strcmp(argv[argi], "-slowops") && argi + 1 < argc)
+        {
+            slowMs = atoi(argv[argi + 1]);
+            argi += 2;
+        }
+        else if (!strcmp(argv[argi], "-metrics") && argi + 1 < argc)
+        {
+            metricsSocket = argv[argi + 1];
+            argi += 2;
+        }
+        else if (!strcmp(argv[argi], "-record") && argi + 1 < argc)
+        {
+            recordFile = argv[argi + 1];
+            argi += 2;
+        }
+        else if (!strcmp(argv[argi], "-recorddata"))
+        {
+            recordData = true;
+            argi++;
+        }
+        else if (!strcmp(argv[argi], "-tracefile") && argi + 1 < argc)
+        {
+            traceOutput = fopen(argv[argi + 1], "a");
+            if (traceOutput == NULL)
+            {
+                printf("Cannot open trace file %s\n", argv[argi + 1]);
+                return 0;
+            }
+            argi += 2;
+        }
+        else
+        {
+            usage();
+            return 0;
+        }
+    }
+    if (threadCount < 1)
+        threadCount = 1;
+
+    if (argc - argi < 1) {
         usage();
         return 0;
     }
 
-    sPort = a2w(argv[1]);
+    sPort = a2w(argv[argi]);
     if (sPort != _T("-"))
-        port = atoi(argv[1]);
+        port = atoi(argv[argi]);
 
-    if (argc == 3)
+    if (argc - argi == 2)
     {
 #ifdef WIN32
         sout << "Mounting points are not supported on Windows, only on Linux and macOS" << endl;
         return 0;
 #else
-        cbt_string mountPointConfig = cbt_string("MountingPoint=") + a2w(argv[2]);
+        cbt_string mountPointConfig = cbt_string("MountingPoint=") + a2w(argv[argi + 1]);
         cbfs_nfs.Config(mountPointConfig.c_str());
 #endif
     }
 
     if (NULL == g_DiskContext)
-    {
-        int64 now;
-#ifdef UNIX
-        struct timeval tv;
-        gettimeofday(&tv, NULL);
-        now = UnixTimeToFileTime(tv.tv_sec, tv.tv_usec * 1000);
-#endif // UNIX
-#ifdef WIN32
-        GetSystemTimeAsFileTime((LPFILETIME)&now);
-#endif // WIND32
-        
-        g_DiskContext = new VirtualFile(TEXT("/"), DIR_MODE);
-
-        g_DiskContext->set_CreationTime(now);
-        g_DiskContext->set_LastAccessTime(now);
-        g_DiskContext->set_LastWriteTime(now);
-
-        g_DiskContext->set_Size(4096);
-
-
-        VirtualFile* vfile = new VirtualFile(TEXT("test"), DIR_MODE);
-
-        vfile->set_CreationTime(now);
-        vfile->set_LastAccessTime(now);
-        vfile->set_LastWriteTime(now);
+        CreateDiskContext();
 
-        vfile->set_Size(4096);
-
-        g_DiskContext->AddFile(vfile);
+    // handlers only queue their trace records, a background thread writes them out
+    TraceStart(traceLevel, traceOutput);
+    if (statsFile != NULL)
+    {
+        OpStatsSetDumpHook(DumpHotFiles);
+        OpStatsStart(statsFile, statsInterval);
     }
+    if (metricsSocket != NULL)
+    {
+        OpStatsEnable();
+        if (!MetricsStart(metricsSocket))
+            printf("Cannot serve the metrics on %s\n", metricsSocket);
+    }
+    if (slowMs > 0)
+        WatchdogStart(slowMs, NULL);
+    if (compactRate > 0)
+        CompactorStart(compactRate);
+    if (expire)
+        SweeperStart();
+    if (recordFile != NULL && !RecorderStart(recordFile, recordData))
+        printf("Cannot record to %s\n", recordFile);
 
     cbfs_nfs.SetLocalPort(port);
     int ret_code = cbfs_nfs.StartListening();
 
     if (ret_code) {
         sout << _T("Error starting NFS server: ") << cbfs_nfs.GetLastErrorCode() << _T(": ") << cbfs_nfs.GetLastError() << endl;
+        RecorderStop();
+        CompactorStop();
+        SweeperStop();
+        WatchdogStop();
+        MetricsStop();
+        OpStatsStop();
+        TraceStop();
         return 0;
     }
 
-    sout << _T("NFS server started on port ") << port << endl;
+    sout << _T("NFS server started on port ") << port << _T(", ") << threadCount << _T(" serving thread(s)") << endl;
     sout << _T("Press <Enter> to stop the server") << endl;
 
+    for (int i = 0; i < threadCount; i++)
+        workers.push_back(std::thread(serveRequests));
+
+    // the main thread only waits for the request to stop
 #ifndef WIN32
+    if (pipe(g_StopPipe) == 0)
+    {
+        signal(SIGINT, onStopSignal);
+        signal(SIGTERM, onStopSignal);
+    }
+
     cinfd[0].fd = STDIN_FILENO;
     cinfd[0].events = POLLIN;
-    while (1)
+    cinfd[1].fd = g_StopPipe[0];
+    cinfd[1].events = POLLIN;
+    while (poll(cinfd, g_StopPipe[0] != -1 ? 2 : 1, -1) < 0 && errno == EINTR)
+        ;
+#else
+    SetConsoleCtrlHandler(onConsoleCtrl, TRUE);
+    while (!g_Stopping.load() && !_kbhit())
+        Sleep(100);
+#endif
+
+    stopServing();
+    for (size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+
+    // the last dump still lists the files
+    RecorderStop();
+    CompactorStop();
+    SweeperStop();
+    WatchdogStop();
+    MetricsStop();
+    OpStatsStop();
+    stopServer();
+
+    TraceStop();
+    if (traceOutput != stdout)
+        fclose(traceOutput);
+    return 0;
+}
+#endif //#ifndef CBFS_STANDIN
+
+//-----------------------------------------------------------------------------------------------------------
+
+typedef struct
+{
+    cbt_string Path;
+    VIRTUALFILE_IO_STATS Stats;
+}   HOT_FILE;
+
+static bool IsHotter(const HOT_FILE& File1, const HOT_FILE& File2)
+{
+    int64 bytes1 = File1.Stats.ReadBytes + File1.Stats.WriteBytes;
+    int64 bytes2 = File2.Stats.ReadBytes + File2.Stats.WriteBytes;
+
+    if (bytes1 != bytes2)
+        return bytes1 > bytes2;
+    return File1.Stats.ReadOps + File1.Stats.WriteOps > File2.Stats.ReadOps + File2.Stats.WriteOps;
+}
+
+static void CollectHotFiles(VirtualFile* root, const cbt_string& RootPath, std::vector<HOT_FILE>& Files)
+{
+    VirtualFile* vfile;
+    HOT_FILE hot;
+
+    root->LockShared();
+    for (bool found = root->get_Context()->GetFirstFile(vfile); found; found = root->get_Context()->GetNextFile(vfile))
     {
-        cbfs_nfs.DoEvents();
-        if (poll(cinfd, 1, 100))
+        if ((vfile->get_Mode() & S_IFDIR) != 0)
         {
-            break;
+            CollectHotFiles(vfile, RootPath + TEXT("/") + vfile->get_Name(), Files);
+            continue;
         }
-    }
-#else
-    while (true)
-    {
-        cbfs_nfs.DoEvents();
-        if (_kbhit())
+
+        vfile->GetIoStats(&hot.Stats);
+        if (hot.Stats.ReadOps + hot.Stats.WriteOps == 0)
+            continue;
+        hot.Path = RootPath + TEXT("/") + vfile->get_Name();
+        Files.push_back(hot);
+
+        // keep the list short on large trees
+        if (Files.size() >= 2 * (size_t)g_HotFileCount)
         {
-            break;
+            std::nth_element(Files.begin(), Files.begin() + g_HotFileCount - 1, Files.end(), IsHotter);
+            Files.resize(g_HotFileCount);
         }
     }
-#endif
+    root->UnlockShared();
+}
 
-    stopServer();
-    return 0;
+void DumpHotFiles(FILE* Output)
+{
+    static const char* patterns[] = { "-", "sequential", "strided", "random" };
+    std::vector<HOT_FILE> files;
+    int64 now = (int64)time(NULL);
+
+    if (g_HotFileCount <= 0 || g_DiskContext == NULL)
+        return;
+
+    VirtualFile::FlushIoStats();
+    CollectHotFiles(g_DiskContext, cbt_string(), files);
+    std::sort(files.begin(), files.end(), IsHotter);
+    if (files.size() > (size_t)g_HotFileCount)
+        files.resize(g_HotFileCount);
+
+    fprintf(Output, "# hottest files by bytes read and written\n");
+    fprintf(Output, "%10s %14s %10s %14s %-10s %5s %5s %5s %8s  %s\n",
+        "reads", "read bytes", "writes", "write bytes", "pattern", "seq%", "str%", "rnd%", "idle s", "path");
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        const VIRTUALFILE_IO_STATS* st = &files[i].Stats;
+        int64 ops = st->SequentialOps + st->StridedOps + st->RandomOps;
+
+        // the counters are read while other threads flush their batches, so
+        // a file may show accesses but no pattern yet; it shows 0% then
+        if (ops == 0)
+            ops = 1;
+
+#ifdef _UNICODE
+        fprintf(Output, "%10lld %14lld %10lld %14lld %-10s %5d %5d %5d %8lld  %ls\n",
+#else
+        fprintf(Output, "%10lld %14lld %10lld %14lld %-10s %5d %5d %5d %8lld  %s\n",
+#endif
+            (long long)st->ReadOps, (long long)st->ReadBytes, (long long)st->WriteOps, (long long)st->WriteBytes,
+            patterns[st->Pattern], (int)(st->SequentialOps * 100 / ops), (int)(st->StridedOps * 100 / ops),
+            (int)(st->RandomOps * 100 / ops), (long long)(now - st->LastAccess), files[i].Path.c_str());
+    }
 }
 
 //-----------------------------------------------------------------------------------------------------------
 
-bool FindVirtualFile(const nfs_char* FileName, VirtualFile*& vfile)
+bool LookupVirtualFile(const nfs_char* FileName, VirtualFile*& vfile)
 {
+    // lock-free walk, the caller is inside an epoch read section
+    // and the returned node carries no reference
     assert(FileName);
 
-    bool result = true;
-
-    VirtualFile* root = g_DiskContext;
+    bool result;
+    unsigned seq;
 
     nfs_char* buffer = (nfs_char*)malloc((nfs_slen(FileName) + 1) * sizeof(nfs_char));
 
     assert(buffer);
 
-    nfs_scpy(buffer, FileName);
+    do
+    {
+        seq = VirtualFile::RenameSeqBegin();
 
-    nfs_char* token = nfs_stok(buffer, TEXT("/"));
+        nfs_scpy(buffer, FileName);
 
-    vfile = root;
+        nfs_char* context = NULL;
+        nfs_char* token = nfs_stok_r(buffer, TEXT("/"), &context);
 
-    while (token != NULL)
-    {
-        if (nfs_scmp(vfile->get_Name(), token) == 0)
+        VirtualFile* root = g_DiskContext;
+        result = true;
+
+        while (token != NULL)
         {
-            root = vfile;
-            break;
+            if (!root->get_Context()->GetFile(token, root))
+            {
+                result = false;
+                break;
+            }
+            token = nfs_stok_r(NULL, TEXT("/"), &context);
         }
-        else if (result = root->get_Context()->GetFile(token, vfile))
-            root = vfile;
-        token = nfs_stok(NULL, TEXT("/"));
-    }
+        vfile = root;
+    } while (VirtualFile::RenameSeqRetry(seq));
+
     free(buffer);
 
     return result;
@@ -746,6 +1360,20 @@ bool FindVirtualFile(const nfs_char* FileName, VirtualFile*& vfile)
 
 //-----------------------------------------------------------------------------------------------------------
 
+bool FindVirtualFile(const nfs_char* FileName, VirtualFile*& vfile)
+{
+    // the returned node carries a reference that the caller must release
+    EpochGuard guard;
+
+    if (LookupVirtualFile(FileName, vfile) && vfile->TryAddRef())
+        return true;
+
+    vfile = NULL;
+    return false;
+}
+
+//-----------------------------------------------------------------------------------------------------------
+
 bool GetParentVirtualDirectory(const nfs_char* FileName, VirtualFile*& vfile)
 {
     assert(FileName);
@@ -773,8 +1401,12 @@ bool FindVirtualDirectory(const nfs_char* FileName, VirtualFile*& vfile)
 
     bool find = false;
 
-    if (FindVirtualFile(FileName, vfile) && ((vfile->get_Mode() & S_IFDIR) != 0))
-        return true;
+    if (FindVirtualFile(FileName, vfile))
+    {
+        if ((vfile->get_Mode() & S_IFDIR) != 0)
+            return true;
+        vfile->Release();
+    }
 
     return find;
 }
@@ -799,18 +1431,9 @@ const nfs_char* GetFileName(const nfs_char* fullpath)
 void RemoveAllFiles(VirtualFile* root)
 {
     assert(root);
-    VirtualFile* vfile;
-
-    root->get_Context()->ResetEnumeration();
 
-    while (root->get_Context()->GetNextFile(vfile))
-    {
-        if ((vfile->get_Mode() & S_IFDIR) != 0)
-            RemoveAllFiles(vfile);
-        vfile->Remove();
-
-        delete vfile;
-    }
+    // the subtrees are emptied, and their files freed, in parallel
+    TreeWalk(root, TREEWALK_UNLINK, 0, NULL, NULL, NULL);
 }
 
 //-----------------------------------------------------------------------------------------------------------
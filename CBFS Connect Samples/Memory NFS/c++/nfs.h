@@ -1,3 +1,16 @@
- 
- 
- 
+#if !defined _MEMORY_NFS_H
+#define _MEMORY_NFS_H
+
+#include "virtualfile.h"
+
+// the root directory of the drive
+extern VirtualFile* g_DiskContext;
+
+// creates the root directory and the "test" directory in it
+void CreateDiskContext(void);
+
+// frees the tree and the nodes and pages its updates retired; nothing may
+// use the tree any more
+void DeleteDiskContext(void);
+
+#endif //#if !defined _MEMORY_NFS_H
@@ -0,0 +1,117 @@
+#if !defined _PAGE_ARENA_H
+#define _PAGE_ARENA_H
+
+// An arena of the data pages of the VirtualFile tree, backed by transparent
+// huge pages.
+//
+// The arena reserves memory in regions of PAGEARENA_REGION_SIZE bytes that
+// start on a multiple of their size, asks the kernel to back them with huge
+// pages (madvise(MADV_HUGEPAGE)) and cuts them into pages of one size. A
+// page in a region takes no TLB entry of its own, so random reads of big
+// files miss the TLB far less than with pages from the heap. Regions are
+// kept once reserved; freed pages are handed out again before another
+// region is reserved.
+//
+// Freed pages stay resident, so after enough churn the regions are full of
+// holes. The arena remembers the owner of every page for compaction:
+// BeginCompaction picks the region with the most resident pages not in use
+// and stops handing out its pages, the caller moves the pages still in use
+// elsewhere, and EndCompaction returns the region to the system with
+// madvise(MADV_DONTNEED) once it is empty. The address range is kept and
+// handed out again when the other regions are full.
+//
+// Where huge pages are not available (not Linux, THP disabled, or the
+// kernel refuses the advice) the arena reserves nothing, Alloc returns NULL
+// and the caller takes its pages from the heap.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#define PAGEARENA_REGION_SIZE (2 * 1024 * 1024)
+
+typedef struct
+{
+    int64_t Regions;        // regions reserved
+    int64_t RegionBytes;
+    int64_t UsedBytes;      // pages handed out
+    int64_t FreeBytes;      // pages of the regions not handed out
+    int64_t ResidentBytes;  // pages of the regions touched since they were reserved or released
+    int64_t Allocations;
+    int64_t Fallbacks;      // allocations the arena could not serve
+    int64_t Compactions;    // regions compacted
+    int64_t ReleasedBytes;  // bytes returned to the system by compaction
+    double Fragmentation;   // share of ResidentBytes not in use
+    bool Available;         // false once huge pages turned out to be unavailable
+}   PAGEARENA_STATS;
+
+typedef struct
+{
+    void* Page;
+    void* Owner;
+    int64_t Index;
+}   PAGEARENA_PAGE;
+
+class PageArena
+{
+public:
+    // PageSize divides PAGEARENA_REGION_SIZE
+    PageArena(size_t PageSize);
+
+    // a zeroed page, NULL if the arena cannot serve it; Owner and Index are
+    // what compaction reports for the page
+    void* Alloc(void* Owner, int64_t Index);
+    // false for a page that does not come from the arena
+    bool Free(void* Page);
+
+    // false if there is no region with resident pages not in use and at
+    // most MaxPages in use, or a compaction is under way. Pin is called
+    // under the lock of the arena for the owner of every page in use of the
+    // region and returns false for an owner that is going away; Pages gets
+    // the pages whose owner was pinned.
+    bool BeginCompaction(int MaxPages, bool (*Pin)(void* Owner), std::vector<PAGEARENA_PAGE>& Pages);
+    // called once the pages have been moved, or have not been
+    void EndCompaction(void);
+
+    void GetStats(PAGEARENA_STATS* Stats);
+private:
+    typedef struct
+    {
+        void* Owner;
+        int64_t Index;
+    }   PAGEARENA_OWNER;
+
+    typedef struct
+    {
+        char* Base;
+        void* Free;         // freed pages, linked through their first word
+        int Used;
+        int Fresh;          // pages never handed out follow the first Fresh ones
+        bool Draining;      // being compacted, its pages are not handed out
+        PAGEARENA_OWNER* Owners;
+    }   PAGEARENA_REGION;
+
+    PageArena(const PageArena&);
+    PageArena& operator=(const PageArena&);
+
+    PAGEARENA_REGION* Reserve(void);
+
+    std::mutex mLock;
+    size_t mPageSize;
+    int mPagesPerRegion;
+    bool mAvailable;
+    std::map<char*, PAGEARENA_REGION*> mRegions;        // by base address
+    std::vector<PAGEARENA_REGION*> mPartial;            // regions with pages to hand out
+    std::vector<PAGEARENA_REGION*> mEmpty;              // regions returned to the system
+    PAGEARENA_REGION* mDraining;
+    int64_t mUsed;
+    int64_t mResident;      // pages
+    int64_t mAllocations;
+    int64_t mFallbacks;
+    int64_t mCompactions;
+    int64_t mReleased;      // pages
+};
+
+#endif //#if !defined _PAGE_ARENA_H
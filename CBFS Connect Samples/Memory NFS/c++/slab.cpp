@@ -0,0 +1,215 @@
+#include <assert.h>
+#include <stdlib.h>
+
+#include "slab.h"
+
+// objects a thread moves to or from the free list at once
+#define SLAB_CACHE_BATCH 32
+
+// slabs that start at a multiple of SLAB_SIZE are cut from one block of
+// the heap this many at a time, which wastes at most one slab per block
+#define SLAB_ALIGNED_GROUP 16
+
+typedef struct
+{
+    void* First;
+    int Count;
+}   SLAB_CACHE;
+
+static SlabAllocator* g_Allocators[SLAB_MAX_ALLOCATORS];
+static std::atomic<int> g_AllocatorCount(0);
+
+class SlabCacheHolder
+{
+public:
+    SlabCacheHolder()
+    {
+        for (int i = 0; i < SLAB_MAX_ALLOCATORS; i++)
+        {
+            mCaches[i].First = NULL;
+            mCaches[i].Count = 0;
+        }
+    }
+    ~SlabCacheHolder()
+    {
+        // objects freed by a finished thread go back to their allocators
+        for (int i = 0; i < SLAB_MAX_ALLOCATORS; i++)
+        {
+            void* last = mCaches[i].First;
+            if (last == NULL)
+                continue;
+            while (*(void**)last != NULL)
+                last = *(void**)last;
+            g_Allocators[i]->Drain(mCaches[i].First, last, mCaches[i].Count);
+        }
+    }
+    SLAB_CACHE mCaches[SLAB_MAX_ALLOCATORS];
+};
+
+static SLAB_CACHE* GetThreadCache(int Index)
+{
+    static thread_local SlabCacheHolder holder;
+    return &holder.mCaches[Index];
+}
+
+SlabAllocator::SlabAllocator(size_t ObjectSize, size_t ColdSize)
+    :mFree(NULL)
+    ,mSlab(NULL)
+    ,mSlabLeft(0)
+    ,mGroup(NULL)
+    ,mGroupLeft(0)
+    ,mColdSize(0)
+    ,mColdOffset(SLAB_SIZE)
+    ,mObjectShift(0)
+    ,mObjects(0)
+    ,mSlabBytes(0)
+{
+    // objects are linked through their first word while they are free
+    mObjectSize = (ObjectSize + sizeof(void*) - 1) / sizeof(void*) * sizeof(void*);
+    if (ColdSize > 0)
+    {
+        while (((size_t)1 << mObjectShift) < mObjectSize)
+            mObjectShift++;
+        mObjectSize = (size_t)1 << mObjectShift;
+        mColdSize = (ColdSize + sizeof(void*) - 1) / sizeof(void*) * sizeof(void*);
+        mColdOffset = SLAB_SIZE / (mObjectSize + mColdSize) * mObjectSize;
+    }
+    assert(mObjectSize + mColdSize <= SLAB_SIZE);
+
+    mIndex = g_AllocatorCount.fetch_add(1, std::memory_order_relaxed);
+    assert(mIndex < SLAB_MAX_ALLOCATORS);
+    g_Allocators[mIndex] = this;
+}
+
+void* SlabAllocator::Alloc(void)
+{
+    SLAB_CACHE* cache = GetThreadCache(mIndex);
+
+    if (cache->First == NULL)
+        cache->First = Refill(SLAB_CACHE_BATCH, &cache->Count);
+
+    void* object = cache->First;
+    cache->First = *(void**)object;
+    cache->Count--;
+    return object;
+}
+
+void SlabAllocator::Free(void* Object)
+{
+    if (Object == NULL)
+        return;
+
+    SLAB_CACHE* cache = GetThreadCache(mIndex);
+
+    *(void**)Object = cache->First;
+    cache->First = Object;
+    if (++cache->Count < 2 * SLAB_CACHE_BATCH)
+        return;
+
+    // the newest objects stay in the cache, the rest goes back
+    void* last = cache->First;
+    for (int i = 1; i < SLAB_CACHE_BATCH; i++)
+        last = *(void**)last;
+    void* first = *(void**)last;
+    *(void**)last = NULL;
+
+    void* tail = first;
+    while (*(void**)tail != NULL)
+        tail = *(void**)tail;
+    Drain(first, tail, cache->Count - SLAB_CACHE_BATCH);
+    cache->Count = SLAB_CACHE_BATCH;
+}
+
+void* SlabAllocator::Refill(int Count, int* Filled)
+{
+    std::lock_guard<std::mutex> lock(mLock);
+    void* first = NULL, ** last = &first;
+    int i;
+
+    // new objects are handed out in the order of their addresses, so the
+    // objects a thread creates one after the other lie one after the other
+    for (i = 0; i < Count; i++)
+    {
+        void* object;
+        if (mFree != NULL)
+        {
+            object = mFree;
+            mFree = *(void**)object;
+        }
+        else
+        {
+            if (mSlabLeft < mObjectSize)
+            {
+                mSlab = NewSlab();
+                mSlabLeft = mColdOffset;
+            }
+            object = mSlab;
+            mSlab += mObjectSize;
+            mSlabLeft -= mObjectSize;
+        }
+        *last = object;
+        last = (void**)object;
+    }
+    *last = NULL;
+
+    mObjects.fetch_add(i, std::memory_order_relaxed);
+    *Filled = i;
+    return first;
+}
+
+char* SlabAllocator::NewSlab(void)
+{
+    char* slab;
+
+    if (mColdSize == 0)
+    {
+        slab = (char*)malloc(SLAB_SIZE);
+        assert(slab);
+        mSlabBytes.fetch_add(SLAB_SIZE, std::memory_order_relaxed);
+        return slab;
+    }
+
+    // the cold part of an object is found from the start of its slab
+    if (mGroupLeft == 0)
+    {
+        size_t size = (size_t)(SLAB_ALIGNED_GROUP + 1) * SLAB_SIZE;
+        char* block = (char*)malloc(size);
+        assert(block);
+        mGroup = (char*)(((uintptr_t)block + SLAB_SIZE - 1) & ~(uintptr_t)(SLAB_SIZE - 1));
+        mGroupLeft = (int)((block + size - mGroup) / SLAB_SIZE);
+        mSlabBytes.fetch_add(size, std::memory_order_relaxed);
+    }
+    slab = mGroup;
+    mGroup += SLAB_SIZE;
+    mGroupLeft--;
+    return slab;
+}
+
+void SlabAllocator::Drain(void* First, void* Last, int Count)
+{
+    std::lock_guard<std::mutex> lock(mLock);
+
+    *(void**)Last = mFree;
+    mFree = First;
+    mObjects.fetch_sub(Count, std::memory_order_relaxed);
+}
+
+size_t SlabAllocator::GetObjectSize(void)
+{
+    return mObjectSize;
+}
+
+size_t SlabAllocator::GetColdSize(void)
+{
+    return mColdSize;
+}
+
+int64_t SlabAllocator::GetObjects(void)
+{
+    return mObjects.load(std::memory_order_relaxed);
+}
+
+int64_t SlabAllocator::GetSlabBytes(void)
+{
+    return mSlabBytes.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,79 @@
+#if !defined _SLAB_H
+#define _SLAB_H
+
+// Slab allocation of the small objects of the VirtualFile tree.
+//
+// Every SlabAllocator hands out objects of one size, carved from slabs of
+// SLAB_SIZE bytes taken from the heap. Objects carry no header, and objects
+// created one after the other sit next to each other. A thread keeps the
+// objects it frees in a cache of its own and moves them to and from the
+// free list of the allocator in batches; the cache is emptied when the
+// thread exits. Slabs are reused but never returned to the heap.
+//
+// An allocator created with a cold size splits every object in two: the
+// part handed out, whose size is rounded up to a power of two so that it
+// never crosses a cache line, and a cold part of its own that GetCold finds
+// by its position in the slab. Objects that are walked in bulk then only
+// bring their hot fields into the cache, and sit next to each other.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+
+#define SLAB_SIZE 65536
+
+// allocators in a process, every thread has a cache for each of them
+#define SLAB_MAX_ALLOCATORS 40
+
+class SlabAllocator
+{
+public:
+    // allocators are created before the first thread uses them and are
+    // never destroyed while threads still run
+    SlabAllocator(size_t ObjectSize, size_t ColdSize = 0);
+
+    void* Alloc(void);
+    void Free(void* Object);
+
+    size_t GetObjectSize(void);
+    size_t GetColdSize(void);
+
+    // the cold part of an object of an allocator with a cold size
+    void* GetCold(void* Object)
+    {
+        uintptr_t slab = (uintptr_t)Object & ~(uintptr_t)(SLAB_SIZE - 1);
+        return (char*)slab + mColdOffset + (((uintptr_t)Object - slab) >> mObjectShift) * mColdSize;
+    }
+
+    // objects handed out, those in the caches of threads included
+    int64_t GetObjects(void);
+    // bytes taken from the heap for the slabs
+    int64_t GetSlabBytes(void);
+private:
+    friend class SlabCacheHolder;
+
+    // move objects between a thread cache and the free list
+    void* Refill(int Count, int* Filled);
+    void Drain(void* First, void* Last, int Count);
+    char* NewSlab(void);
+
+    SlabAllocator(const SlabAllocator&);
+    SlabAllocator& operator=(const SlabAllocator&);
+
+    std::mutex mLock;
+    void* mFree;            // linked through the first word of the objects
+    char* mSlab;            // the part of the newest slab not handed out yet
+    size_t mSlabLeft;
+    char* mGroup;           // aligned slabs not used yet, see NewSlab
+    int mGroupLeft;
+    size_t mObjectSize;
+    size_t mColdSize;
+    size_t mColdOffset;     // where the cold parts start in a slab, SLAB_SIZE if there are none
+    int mObjectShift;
+    int mIndex;
+    std::atomic<int64_t> mObjects;
+    std::atomic<int64_t> mSlabBytes;
+};
+
+#endif //#if !defined _SLAB_H
@@ -0,0 +1,266 @@
+/*
+ * CBFS Connect 2024 C++ Edition - Sample Project
+ *
+ * This sample project demonstrates the usage of CBFS Connect in a
+ * simple, straightforward way. It is not intended to be a complete
+ * application. Error handling and other checks are simplified for clarity.
+ *
+ * www.callback.com/cbfsconnect
+ *
+ * This code is subject to the terms and conditions specified in the
+ * corresponding product license agreement which outlines the authorized
+ * usage and restrictions.
+ */
+
+// Drives the handlers of MemDriveNFS through the stand-in of the NFS class
+// (standin/nfs.h), without the CBFS library, a network or a client.
+//
+// Every thread is a client connection of its own and runs the same cycle
+// of requests in a directory of its own; in between it creates files in a
+// directory shared by all threads and reads a file shared by all threads.
+// The results of the requests are checked, so the run doubles as a test of
+// the handlers under concurrency; the request rate it reports is that of
+// the handlers alone.
+//
+// -record writes the requests to a trace for nfs_replay.
+//
+//   nfs_standin [-threads N] [-iterations N] [-stats file] [-trace level] [-record file [-recorddata]]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <atomic>
+
+#include "virtualfile.h"
+#include "nfs.h"
+#include "trace.h"
+#include "opstats.h"
+#include "recorder.h"
+
+#ifndef CBFS_STANDIN
+#error Build with -DCBFS_STANDIN, see the standin target of the makefile
+#endif
+
+using namespace cbcConstants;
+
+#define STANDIN_FILE_SIZE       12288
+#define STANDIN_SHARED_SIZE     65536
+#define STANDIN_LISTED_FILES    100
+#define STANDIN_READDIR_ENTRIES 16
+
+typedef struct
+{
+    NFS* Target;
+    int Iterations;
+    std::atomic<int64> Requests;
+    std::atomic<int> Failures;
+}   STANDIN_CONTEXT;
+
+static void Fail(STANDIN_CONTEXT* Context, const char* Request, const std::string& Path, int64 Result, int64 Expected)
+{
+    // the first failures are enough to see what went wrong
+    if (Context->Failures.fetch_add(1) < 20)
+        fprintf(stderr, "%s %s: %lld, expected %lld\n", Request, Path.c_str(), (long long)Result, (long long)Expected);
+}
+
+static void Check(STANDIN_CONTEXT* Context, const char* Request, const std::string& Path, int64 Result, int64 Expected)
+{
+    if (Result != Expected)
+        Fail(Context, Request, Path, Result, Expected);
+}
+
+static void FillPattern(char* Buffer, int Size, int Seed)
+{
+    for (int i = 0; i < Size; i++)
+        Buffer[i] = (char)(Seed + i * 7);
+}
+
+static void RunCycle(STANDIN_CONTEXT* Context, NFSStandin& nfs, int Thread, int Iteration)
+{
+    char data[STANDIN_FILE_SIZE], buffer[STANDIN_FILE_SIZE];
+    char name[64];
+    std::vector<NFS_STANDIN_ENTRY> entries;
+    NFS_STANDIN_ATTR attr;
+    int64 requests = 0;
+    int count;
+    bool eof;
+
+    snprintf(name, sizeof(name), "/t%d/d%d", Thread, Iteration);
+    std::string dir = name;
+    std::string file = dir + "/file";
+    std::string moved = dir + "/moved";
+
+    FillPattern(data, STANDIN_FILE_SIZE, Thread + Iteration);
+
+    Check(Context, "MkDir", dir, nfs.MkDir(dir.c_str()), 0);
+    Check(Context, "Open", file, nfs.Open(file.c_str(), NFS_STANDIN_OPEN_CREATE), 0);
+    Check(Context, "Open", file, nfs.Open(file.c_str(), NFS_STANDIN_OPEN_CREATE), NFS4ERR_EXIST);
+    count = 8192;
+    Check(Context, "Write", file, nfs.Write(file.c_str(), data, 0, &count, UNSTABLE4), 0);
+    Check(Context, "Write count", file, count, 8192);
+    count = 4096;
+    Check(Context, "Write", file, nfs.Write(file.c_str(), data + 8192, 8192, &count, UNSTABLE4), 0);
+    Check(Context, "Write count", file, count, 4096);
+    Check(Context, "GetAttr", file, nfs.GetAttr(file.c_str(), &attr), 0);
+    Check(Context, "GetAttr size", file, attr.Size, STANDIN_FILE_SIZE);
+    count = STANDIN_FILE_SIZE;
+    Check(Context, "Read", file, nfs.Read(file.c_str(), buffer, 0, &count, &eof), 0);
+    Check(Context, "Read count", file, count, STANDIN_FILE_SIZE);
+    Check(Context, "Read eof", file, eof, true);
+    if (memcmp(data, buffer, STANDIN_FILE_SIZE) != 0)
+        Fail(Context, "Read data", file, 1, 0);
+    count = 4096;
+    Check(Context, "Read", file, nfs.Read(file.c_str(), buffer, STANDIN_FILE_SIZE, &count, &eof), 0);
+    Check(Context, "Read count", file, count, 0);
+    Check(Context, "Truncate", file, nfs.Truncate(file.c_str(), 4096), 0);
+    Check(Context, "GetAttr", file, nfs.GetAttr(file.c_str(), &attr), 0);
+    Check(Context, "GetAttr size", file, attr.Size, 4096);
+    Check(Context, "Lookup", file, nfs.Lookup("file", file.c_str()), 0);
+    Check(Context, "ReadDir", dir, nfs.ReadDir(dir.c_str(), entries, STANDIN_READDIR_ENTRIES), 0);
+    Check(Context, "ReadDir entries", dir, entries.size(), 1);
+    Check(Context, "Rename", file, nfs.Rename(file.c_str(), moved.c_str()), 0);
+    Check(Context, "GetAttr", file, nfs.GetAttr(file.c_str(), &attr), NFS4ERR_NOENT);
+    Check(Context, "RmDir", dir, nfs.RmDir(dir.c_str()), NFS4ERR_NOTEMPTY);
+    Check(Context, "RmDir", moved, nfs.RmDir(moved.c_str()), NFS4ERR_NOTDIR);
+    Check(Context, "Unlink", moved, nfs.Unlink(moved.c_str()), 0);
+    Check(Context, "RmDir", dir, nfs.RmDir(dir.c_str()), 0);
+    requests += 18;
+
+    // the directory and the file that every thread uses
+    snprintf(name, sizeof(name), "/shared/t%d_%d", Thread, Iteration);
+    std::string common = name;
+    Check(Context, "Open", common, nfs.Open(common.c_str(), NFS_STANDIN_OPEN_CREATE), 0);
+    Check(Context, "GetAttr", "/shared/file", nfs.GetAttr("/shared/file", &attr), 0);
+    count = 4096;
+    Check(Context, "Read", "/shared/file", nfs.Read("/shared/file", buffer, (Iteration % 16) * 4096, &count, &eof), 0);
+    Check(Context, "Read count", "/shared/file", count, 4096);
+    Check(Context, "Unlink", common, nfs.Unlink(common.c_str()), 0);
+    requests += 4;
+
+    // a listing that takes several requests, continued by cookie
+    if (Iteration % 64 == 0)
+    {
+        snprintf(name, sizeof(name), "/t%d/list", Thread);
+        Check(Context, "ReadDir", name, nfs.ReadDir(name, entries, STANDIN_READDIR_ENTRIES), 0);
+        Check(Context, "ReadDir entries", name, entries.size(), STANDIN_LISTED_FILES);
+        requests += STANDIN_LISTED_FILES / STANDIN_READDIR_ENTRIES + 1;
+    }
+
+    Context->Requests.fetch_add(requests, std::memory_order_relaxed);
+}
+
+static void Worker(int Thread, void* Context)
+{
+    STANDIN_CONTEXT* context = (STANDIN_CONTEXT*)Context;
+    NFSStandin nfs(context->Target, Thread + 1);
+    char path[64];
+
+    nfs.Connect();
+
+    snprintf(path, sizeof(path), "/t%d", Thread);
+    std::string dir = path;
+    std::string list = dir + "/list";
+    Check(context, "MkDir", dir, nfs.MkDir(dir.c_str()), 0);
+    Check(context, "MkDir", list, nfs.MkDir(list.c_str()), 0);
+    for (int i = 0; i < STANDIN_LISTED_FILES; i++)
+    {
+        snprintf(path, sizeof(path), "%s/f%d", list.c_str(), i);
+        Check(context, "Open", path, nfs.Open(path, NFS_STANDIN_OPEN_CREATE), 0);
+    }
+
+    for (int i = 0; i < context->Iterations; i++)
+        RunCycle(context, nfs, Thread, i);
+
+    for (int i = 0; i < STANDIN_LISTED_FILES; i++)
+    {
+        snprintf(path, sizeof(path), "%s/f%d", list.c_str(), i);
+        Check(context, "Unlink", path, nfs.Unlink(path), 0);
+    }
+    Check(context, "RmDir", list, nfs.RmDir(list.c_str()), 0);
+    Check(context, "RmDir", dir, nfs.RmDir(dir.c_str()), 0);
+
+    nfs.Disconnect();
+}
+
+int main(int argc, char* argv[])
+{
+    int threads = (int)std::thread::hardware_concurrency();
+    int iterations = 1000;
+    int traceLevel = TRACE_LEVEL_NONE;
+    const char* statsFile = NULL;
+    const char* recordFile = NULL;
+    bool recordData = false;
+    std::vector<char> data(STANDIN_SHARED_SIZE, 'x');
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-threads") && i + 1 < argc)
+            threads = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-iterations") && i + 1 < argc)
+            iterations = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-stats") && i + 1 < argc)
+            statsFile = argv[++i];
+        else if (!strcmp(argv[i], "-trace") && i + 1 < argc)
+            traceLevel = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-record") && i + 1 < argc)
+            recordFile = argv[++i];
+        else if (!strcmp(argv[i], "-recorddata"))
+            recordData = true;
+        else
+        {
+            fprintf(stderr, "usage: nfs_standin [-threads N] [-iterations N] [-stats file] [-trace level] [-record file [-recorddata]]\n");
+            return 1;
+        }
+    }
+    if (threads < 1)
+        threads = 1;
+
+    // what main of the sample does before StartListening
+    CreateDiskContext();
+    TraceStart(traceLevel, stdout);
+    if (statsFile != NULL)
+        OpStatsStart(statsFile, 3600);
+    if (recordFile != NULL && !RecorderStart(recordFile, recordData))
+    {
+        fprintf(stderr, "Error: cannot record to %s\n", recordFile);
+        return 1;
+    }
+
+    NFSStandin nfs(NFS::GetStandinInstance(), 0);
+    STANDIN_CONTEXT context;
+    int count = STANDIN_SHARED_SIZE;
+
+    context.Target = NFS::GetStandinInstance();
+    context.Iterations = iterations;
+    context.Requests.store(0);
+    context.Failures.store(0);
+
+    Check(&context, "MkDir", "/shared", nfs.MkDir("/shared"), 0);
+    Check(&context, "Open", "/shared/file", nfs.Open("/shared/file", NFS_STANDIN_OPEN_CREATE), 0);
+    Check(&context, "Write", "/shared/file", nfs.Write("/shared/file", data.data(), 0, &count, FILE_SYNC4), 0);
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    StandinRunThreads(threads, Worker, &context);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // everything the threads created is gone again
+    std::vector<NFS_STANDIN_ENTRY> entries;
+    Check(&context, "ReadDir", "/shared", nfs.ReadDir("/shared", entries, STANDIN_READDIR_ENTRIES), 0);
+    Check(&context, "ReadDir entries", "/shared", entries.size(), 1);
+    Check(&context, "ReadDir", "/", nfs.ReadDir("/", entries, STANDIN_READDIR_ENTRIES), 0);
+    Check(&context, "ReadDir entries", "/", entries.size(), 2);
+
+    int64 requests = context.Requests.load();
+    printf("%d thread(s), %d iteration(s) each: %lld requests in %.3f s, %.0f requests/s, %d failure(s)\n",
+        threads, iterations, (long long)requests, seconds, seconds > 0 ? requests / seconds : 0.0, context.Failures.load());
+
+    RecorderStop();
+    OpStatsStop();
+    TraceStop();
+    DeleteDiskContext();
+    return context.Failures.load() == 0 ? 0 : 1;
+}
@@ -0,0 +1,347 @@
+#if !defined _STANDIN_NFS_H
+#define _STANDIN_NFS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "standin.h"
+
+// Stand-in for the NFS class of the CBFS Connect library.
+//
+// Built with -DCBFS_STANDIN, the sample includes this header instead of
+// ../../include/nfs.h. The handlers compile unchanged, but no server is
+// started: StartListening and the other library calls succeed without
+// doing anything, and no client ever connects.
+//
+// The requests are fired by NFSStandin, given the object of the sample
+// (the last NFS object constructed, see GetStandinInstance). It fills the
+// *EventParams structures the way the library does and calls the Fire*
+// overrides directly. Every NFSStandin is a client connection of its own;
+// one connection may be used by several threads at once.
+//
+// Only the members used by the samples are declared.
+
+typedef int64_t int64;
+
+namespace cbcConstants
+{
+    const int NFS4ERR_PERM = 1;
+    const int NFS4ERR_NOENT = 2;
+    const int NFS4ERR_IO = 5;
+    const int NFS4ERR_ACCESS = 13;
+    const int NFS4ERR_EXIST = 17;
+    const int NFS4ERR_NOTDIR = 20;
+    const int NFS4ERR_ISDIR = 21;
+    const int NFS4ERR_INVAL = 22;
+    const int NFS4ERR_FBIG = 27;
+    const int NFS4ERR_NOSPC = 28;
+    const int NFS4ERR_NOTEMPTY = 66;
+    const int NFS4ERR_NOTSUPP = 10004;
+
+    const int UNSTABLE4 = 0;
+    const int DATA_SYNC4 = 1;
+    const int FILE_SYNC4 = 2;
+}
+
+typedef struct { int ConnectionId; const char* Path; int Access; int Supported; int Result; } NFSAccessEventParams;
+typedef struct { int ConnectionId; const char* Path; int Mode; int Result; } NFSChmodEventParams;
+typedef struct { int ConnectionId; const char* Path; const char* User; const char* Group; int Result; } NFSChownEventParams;
+typedef struct { int ConnectionId; const char* Path; const char* LinkTarget; int LinkType; int Result; } NFSCreateLinkEventParams;
+typedef struct { int ConnectionId; const char* Path; void* Buffer; int BufferLength; int Result; } NFSReadLinkEventParams;
+typedef struct { int ConnectionId; int StatusCode; const char* Description; } NFSConnectedEventParams;
+typedef struct { int ConnectionId; int StatusCode; const char* Description; } NFSDisconnectedEventParams;
+typedef struct { int ConnectionId; int ErrorCode; const char* Description; } NFSErrorEventParams;
+typedef struct { int ConnectionId; int LogLevel; const char* Message; const char* LogType; } NFSLogEventParams;
+typedef struct { const char* Address; int Port; int Accept; } NFSConnectionRequestEventParams;
+typedef struct { int ConnectionId; const char* Path; int64 FileContext; int64* pFileId; int Mode; const char* User; const char* Group; int LinkCount; int64* pSize; int64* pATime; int64* pMTime; int64* pCTime; int Result; } NFSGetAttrEventParams;
+typedef struct { int ConnectionId; const char* Name; const char* Path; int Result; } NFSLookupEventParams;
+typedef struct { int ConnectionId; const char* Path; int Result; } NFSMkDirEventParams;
+typedef struct { int ConnectionId; const char* Path; int ShareAccess; int ShareDeny; int OpenType; int CreateMode; int Result; } NFSOpenEventParams;
+typedef struct { int ConnectionId; const char* Path; int64 Offset; void* Buffer; int Count; int Eof; int Result; } NFSReadEventParams;
+typedef struct { int ConnectionId; const char* Path; int64 Cookie; int Result; } NFSReadDirEventParams;
+typedef struct { int ConnectionId; const char* OldPath; const char* NewPath; int Result; } NFSRenameEventParams;
+typedef struct { int ConnectionId; const char* Path; int Result; } NFSRmDirEventParams;
+typedef struct { int ConnectionId; const char* Path; int64 Size; int Result; } NFSTruncateEventParams;
+typedef struct { int ConnectionId; const char* Path; int Result; } NFSUnlinkEventParams;
+typedef struct { int ConnectionId; const char* Path; int64 ATime; int64 MTime; int Result; } NFSUTimeEventParams;
+typedef struct { int ConnectionId; const char* Path; int64 Offset; const void* Buffer; int Count; int Stable; int Result; } NFSWriteEventParams;
+
+// an entry passed to FillDir
+typedef struct
+{
+    std::string Name;
+    int64 FileId;
+    int64 Cookie;
+    int Mode;
+    int64 Size;
+}   NFS_STANDIN_ENTRY;
+
+// the listing a ReadDir request of the calling thread fills
+typedef struct
+{
+    std::vector<NFS_STANDIN_ENTRY>* Entries;
+    int Added;          // by this request
+    int MaxEntries;     // per request, FillDir refuses the entry after these
+    bool Full;
+}   NFS_STANDIN_LISTING;
+
+class NFS
+{
+public:
+    NFS() { GetStandinInstance() = this; }
+    virtual ~NFS() { if (GetStandinInstance() == this) GetStandinInstance() = NULL; }
+
+    // the object of the sample, for the stand-in program
+    static NFS*& GetStandinInstance()
+    {
+        static NFS* instance = NULL;
+        return instance;
+    }
+
+    // the library calls, none of them has an effect
+    char* Config(const char* ConfigurationString) { return (char*)""; }
+    int SetLocalPort(int Value) { return 0; }
+    int StartListening() { return 0; }
+    int StopListening() { return 0; }
+    char* GetLastError() { return (char*)""; }
+    int GetLastErrorCode() { return 0; }
+
+    // no requests arrive this way
+    int DoEvents()
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        return 0;
+    }
+
+    // adds the entry to the listing of the calling thread, see NFSStandin::ReadDir
+    int FillDir(int ConnectionId, const char* Name, int64 FileId, int64 Cookie, int Mode, const char* User, const char* Group,
+        int LinkCount, int64 Size, int64 ATime, int64 MTime, int64 CTime)
+    {
+        NFS_STANDIN_LISTING* listing = GetStandinListing();
+
+        if (listing->Added == listing->MaxEntries)
+        {
+            listing->Full = true;
+            return 1;
+        }
+
+        NFS_STANDIN_ENTRY entry = { Name, FileId, Cookie, Mode, Size };
+        listing->Entries->push_back(entry);
+        listing->Added++;
+        return 0;
+    }
+
+    static NFS_STANDIN_LISTING*& GetStandinListing()
+    {
+        static thread_local NFS_STANDIN_LISTING* listing = NULL;
+        return listing;
+    }
+
+    virtual int FireAccess(NFSAccessEventParams* e) { return 0; }
+    virtual int FireChmod(NFSChmodEventParams* e) { return 0; }
+    virtual int FireChown(NFSChownEventParams* e) { return 0; }
+    virtual int FireCreateLink(NFSCreateLinkEventParams* e) { return 0; }
+    virtual int FireReadLink(NFSReadLinkEventParams* e) { return 0; }
+    virtual int FireConnected(NFSConnectedEventParams* e) { return 0; }
+    virtual int FireDisconnected(NFSDisconnectedEventParams* e) { return 0; }
+    virtual int FireError(NFSErrorEventParams* e) { return 0; }
+    virtual int FireLog(NFSLogEventParams* e) { return 0; }
+    virtual int FireConnectionRequest(NFSConnectionRequestEventParams* e) { return 0; }
+    virtual int FireGetAttr(NFSGetAttrEventParams* e) { return 0; }
+    virtual int FireLookup(NFSLookupEventParams* e) { return 0; }
+    virtual int FireMkDir(NFSMkDirEventParams* e) { return 0; }
+    virtual int FireOpen(NFSOpenEventParams* e) { return 0; }
+    virtual int FireRead(NFSReadEventParams* e) { return 0; }
+    virtual int FireReadDir(NFSReadDirEventParams* e) { return 0; }
+    virtual int FireRename(NFSRenameEventParams* e) { return 0; }
+    virtual int FireRmDir(NFSRmDirEventParams* e) { return 0; }
+    virtual int FireTruncate(NFSTruncateEventParams* e) { return 0; }
+    virtual int FireUnlink(NFSUnlinkEventParams* e) { return 0; }
+    virtual int FireUTime(NFSUTimeEventParams* e) { return 0; }
+    virtual int FireWrite(NFSWriteEventParams* e) { return 0; }
+};
+
+// what NFSStandin::GetAttr returns
+typedef struct
+{
+    int64 FileId;
+    int Mode;
+    const char* User;
+    const char* Group;
+    int LinkCount;
+    int64 Size;
+    int64 ATime;
+    int64 MTime;
+    int64 CTime;
+}   NFS_STANDIN_ATTR;
+
+// OpenType of NFSStandin::Open
+#define NFS_STANDIN_OPEN_NOCREATE   0
+#define NFS_STANDIN_OPEN_CREATE     1
+
+// Fires the requests of one client connection. The methods return the
+// Result of the request: 0 or an NFS4ERR_* code.
+class NFSStandin
+{
+public:
+    NFSStandin(NFS* Target, int ConnectionId) : mTarget(Target), mConnectionId(ConnectionId) {}
+
+    void Connect(void)
+    {
+        NFSConnectedEventParams e = { mConnectionId, 0, "" };
+        mTarget->FireConnected(&e);
+    }
+
+    void Disconnect(void)
+    {
+        NFSDisconnectedEventParams e = { mConnectionId, 0, "" };
+        mTarget->FireDisconnected(&e);
+    }
+
+    int GetAttr(const char* Path, NFS_STANDIN_ATTR* Attr)
+    {
+        NFSGetAttrEventParams e = { mConnectionId, Path, 0, &Attr->FileId, 0, NULL, NULL, 0, &Attr->Size, &Attr->ATime, &Attr->MTime, &Attr->CTime, 0 };
+        mTarget->FireGetAttr(&e);
+        Attr->Mode = e.Mode;
+        Attr->User = e.User;
+        Attr->Group = e.Group;
+        Attr->LinkCount = e.LinkCount;
+        return e.Result;
+    }
+
+    // Path is the full path of Name
+    int Lookup(const char* Name, const char* Path)
+    {
+        NFSLookupEventParams e = { mConnectionId, Name, Path, 0 };
+        mTarget->FireLookup(&e);
+        return e.Result;
+    }
+
+    int MkDir(const char* Path)
+    {
+        NFSMkDirEventParams e = { mConnectionId, Path, 0 };
+        mTarget->FireMkDir(&e);
+        return e.Result;
+    }
+
+    int Open(const char* Path, int OpenType)
+    {
+        NFSOpenEventParams e = { mConnectionId, Path, 0, 0, OpenType, 0, 0 };
+        mTarget->FireOpen(&e);
+        return e.Result;
+    }
+
+    // Count is the size of the request on entry and the bytes read on return
+    int Read(const char* Path, void* Buffer, int64 Offset, int* Count, bool* Eof)
+    {
+        NFSReadEventParams e = { mConnectionId, Path, Offset, Buffer, *Count, 0, 0 };
+        mTarget->FireRead(&e);
+        *Count = e.Count;
+        *Eof = e.Eof != 0;
+        return e.Result;
+    }
+
+    // Count is the size of the request on entry and the bytes written on return
+    int Write(const char* Path, const void* Buffer, int64 Offset, int* Count, int Stable)
+    {
+        NFSWriteEventParams e = { mConnectionId, Path, Offset, Buffer, *Count, Stable, 0 };
+        mTarget->FireWrite(&e);
+        *Count = e.Count;
+        return e.Result;
+    }
+
+    // lists the directory in requests of up to MaxEntries entries, each one
+    // continuing from the cookie of the last entry of the one before, as a
+    // client with a small reply buffer does
+    int ReadDir(const char* Path, std::vector<NFS_STANDIN_ENTRY>& Entries, int MaxEntries)
+    {
+        NFS_STANDIN_LISTING listing = { &Entries, 0, MaxEntries, false };
+        NFSReadDirEventParams e = { mConnectionId, Path, 0, 0 };
+
+        Entries.clear();
+        NFS::GetStandinListing() = &listing;
+        do
+        {
+            listing.Added = 0;
+            listing.Full = false;
+            mTarget->FireReadDir(&e);
+            if (!Entries.empty())
+                e.Cookie = Entries.back().Cookie;
+        } while (e.Result == 0 && listing.Full && listing.Added > 0);
+        NFS::GetStandinListing() = NULL;
+
+        return e.Result;
+    }
+
+    // a single request, continuing from Cookie (0 to start the listing)
+    int ReadDirPart(const char* Path, int64 Cookie, std::vector<NFS_STANDIN_ENTRY>& Entries, int MaxEntries)
+    {
+        NFS_STANDIN_LISTING listing = { &Entries, 0, MaxEntries, false };
+        NFSReadDirEventParams e = { mConnectionId, Path, Cookie, 0 };
+
+        Entries.clear();
+        NFS::GetStandinListing() = &listing;
+        mTarget->FireReadDir(&e);
+        NFS::GetStandinListing() = NULL;
+
+        return e.Result;
+    }
+
+    int CreateLink(const char* Path, const char* LinkTarget, int LinkType)
+    {
+        NFSCreateLinkEventParams e = { mConnectionId, Path, LinkTarget, LinkType, 0 };
+        mTarget->FireCreateLink(&e);
+        return e.Result;
+    }
+
+    int ReadLink(const char* Path, void* Buffer, int BufferLength)
+    {
+        NFSReadLinkEventParams e = { mConnectionId, Path, Buffer, BufferLength, 0 };
+        mTarget->FireReadLink(&e);
+        return e.Result;
+    }
+
+    int Rename(const char* OldPath, const char* NewPath)
+    {
+        NFSRenameEventParams e = { mConnectionId, OldPath, NewPath, 0 };
+        mTarget->FireRename(&e);
+        return e.Result;
+    }
+
+    int RmDir(const char* Path)
+    {
+        NFSRmDirEventParams e = { mConnectionId, Path, 0 };
+        mTarget->FireRmDir(&e);
+        return e.Result;
+    }
+
+    int Truncate(const char* Path, int64 Size)
+    {
+        NFSTruncateEventParams e = { mConnectionId, Path, Size, 0 };
+        mTarget->FireTruncate(&e);
+        return e.Result;
+    }
+
+    int Unlink(const char* Path)
+    {
+        NFSUnlinkEventParams e = { mConnectionId, Path, 0 };
+        mTarget->FireUnlink(&e);
+        return e.Result;
+    }
+
+    int UTime(const char* Path, int64 ATime, int64 MTime)
+    {
+        NFSUTimeEventParams e = { mConnectionId, Path, ATime, MTime, 0 };
+        mTarget->FireUTime(&e);
+        return e.Result;
+    }
+
+private:
+    NFS* mTarget;
+    int mConnectionId;
+};
+
+#endif //#if !defined _STANDIN_NFS_H
@@ -0,0 +1,57 @@
+#if !defined _STANDIN_H
+#define _STANDIN_H
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+// Common part of the stand-ins for the CBFS Connect classes, see fuse.h and
+// nfs.h in this directory.
+
+#ifdef _UNICODE
+#error The stand-ins take narrow strings only
+#endif
+
+#ifndef TRUE
+#define TRUE 1
+#endif
+#ifndef FALSE
+#define FALSE 0
+#endif
+
+typedef struct
+{
+    void (*Worker)(int Thread, void* Context);
+    void* Context;
+    std::atomic<int> Ready;
+    int Threads;
+}   STANDIN_RUN;
+
+inline void StandinThread(STANDIN_RUN* Run, int Thread)
+{
+    // the workers start together, so none of them runs alone for a while
+    Run->Ready.fetch_add(1);
+    while (Run->Ready.load() < Run->Threads)
+        std::this_thread::yield();
+    Run->Worker(Thread, Run->Context);
+}
+
+// calls Worker on Threads threads at once, Thread is 0 .. Threads - 1, and
+// returns when all of them returned
+inline void StandinRunThreads(int Threads, void (*Worker)(int Thread, void* Context), void* Context)
+{
+    STANDIN_RUN run;
+    std::vector<std::thread> threads;
+
+    run.Worker = Worker;
+    run.Context = Context;
+    run.Ready.store(0);
+    run.Threads = Threads;
+
+    for (int i = 0; i < Threads; i++)
+        threads.push_back(std::thread(StandinThread, &run, i));
+    for (size_t i = 0; i < threads.size(); i++)
+        threads[i].join();
+}
+
+#endif //#if !defined _STANDIN_H
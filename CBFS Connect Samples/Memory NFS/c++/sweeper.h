@@ -0,0 +1,22 @@
+#if !defined _SWEEPER_H
+#define _SWEEPER_H
+
+// Background expiry of scratch files.
+//
+// The thread started by SweeperStart wakes every SWEEPER_INTERVAL_MS and
+// deletes the files that outlived the expiry policy of their directory
+// (VirtualFile::SetExpiryPolicy). Files are found through the expiry heap
+// of the tree, the tree is never scanned. Deletions go in batches of at
+// most SWEEPER_BATCH files, with a pause of SWEEPER_PAUSE_MS between the
+// batches; a deletion holds the rename lock and the lock of one directory,
+// so the handlers wait for one file at most.
+
+#define SWEEPER_INTERVAL_MS 1000
+#define SWEEPER_BATCH 64
+#define SWEEPER_PAUSE_MS 10
+
+void SweeperStart(void);
+
+void SweeperStop(void);
+
+#endif //#if !defined _SWEEPER_H
@@ -0,0 +1,58 @@
+#if !defined _TRACE_H
+#define _TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <atomic>
+
+// Asynchronous tracing for the request handlers.
+//
+// TRACE_EVENT copies a fixed-size record into a ring buffer owned by the
+// calling thread and returns; it takes no locks and never waits for the
+// output. A background thread started by TraceStart drains the rings and
+// writes the records as text lines. When a ring is full the record is
+// dropped and counted rather than blocking the handler.
+//
+// Trace points above g_TraceLevel are skipped at run time, trace points
+// above TRACE_MAX_LEVEL are removed at compile time (-DTRACE_MAX_LEVEL=0
+// builds the sample without any tracing).
+
+#define TRACE_LEVEL_NONE    0
+#define TRACE_LEVEL_ERROR   1
+#define TRACE_LEVEL_INFO    2   // connections and server messages
+#define TRACE_LEVEL_DEBUG   3   // every request
+
+#ifndef TRACE_MAX_LEVEL
+#define TRACE_MAX_LEVEL TRACE_LEVEL_DEBUG
+#endif
+
+// a value that is not printed
+#define TRACE_NO_VALUE INT64_MIN
+
+#ifdef _UNICODE
+typedef wchar_t trace_char;
+#else
+typedef char trace_char;
+#endif
+
+extern std::atomic<int> g_TraceLevel;
+
+// Event must be a string literal, the texts are copied (and truncated)
+void TraceWrite(int Level, const trace_char* Event, const trace_char* Text, const trace_char* Text2, int64_t Value1, int64_t Value2);
+
+#define TRACE_EVENT(Level, Event, Text, Text2, Value1, Value2) \
+    do { \
+        if ((Level) <= TRACE_MAX_LEVEL && (Level) <= g_TraceLevel.load(std::memory_order_relaxed)) \
+            TraceWrite(Level, Event, Text, Text2, Value1, Value2); \
+    } while (0)
+
+#define TRACE(Level, Event, Text) \
+    TRACE_EVENT(Level, Event, Text, NULL, TRACE_NO_VALUE, TRACE_NO_VALUE)
+
+// starts the drainer; Output stays open until TraceStop
+void TraceStart(int Level, FILE* Output);
+
+// stops the drainer after it wrote out everything traced so far
+void TraceStop(void);
+
+#endif //#if !defined _TRACE_H
@@ -0,0 +1,366 @@
+#include <assert.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#ifdef UNIX
+#include <sys/stat.h>
+#endif
+
+#include "treewalk.h"
+#include "epoch.h"
+
+// the children of a directory, listed once and visited in chunks
+typedef struct
+{
+    VirtualFile* Parent;                    // pinned until the last chunk is done
+    int Depth;                              // of the children
+    std::vector<VirtualFile*> Children;     // pinned, released once visited or walked
+    std::atomic<int> Chunks;
+}   TREEWALK_LIST;
+
+// a directory to list (List is NULL) or a chunk of a list
+typedef struct
+{
+    VirtualFile* Dir;
+    int Depth;
+    TREEWALK_LIST* List;
+    size_t First;
+    size_t Last;
+}   TREEWALK_ITEM;
+
+typedef struct
+{
+    std::mutex Lock;
+    std::deque<TREEWALK_ITEM> Items;
+    std::vector<TREEWALK_LIST*> Lists;      // done with, kept with their capacity; owner only
+    int64 Directories;
+    int64 Files;
+    int64 Steals;
+}   TREEWALK_QUEUE;
+
+typedef struct
+{
+    int Flags;
+    int Threads;
+    TREEWALK_VISITOR Visitor;
+    void* Context;
+    TREEWALK_QUEUE* Queues;
+    bool Shared;                            // set before the other threads are started
+    std::atomic<int64> Pending;             // items queued or being run, once Shared
+    std::vector<std::thread> Helpers;
+    std::mutex IdleLock;
+    std::condition_variable Idle;           // a push, or Pending down to 0
+    std::atomic<int> Sleepers;              // threads that looked for work and are about to wait
+    int64 Pushes;                           // with IdleLock held
+}   TREEWALK_JOB;
+
+// Until the calling thread starts the others its queue is its own, and it
+// is neither locked nor counted in Pending; RunWorker counts the items left
+// in it when it starts them.
+
+static void PushItem(TREEWALK_JOB* Job, int Worker, const TREEWALK_ITEM& Item)
+{
+    TREEWALK_QUEUE* queue = &Job->Queues[Worker];
+
+    if (!Job->Shared)
+    {
+        queue->Items.push_back(Item);
+        return;
+    }
+
+    // counted first, so that Pending never drops to 0 while work is left
+    Job->Pending.fetch_add(1, std::memory_order_relaxed);
+    {
+        std::lock_guard<std::mutex> lock(queue->Lock);
+        queue->Items.push_back(Item);
+    }
+
+    // a thread that found the queues empty before the push is counted by
+    // now, see WaitForWork
+    if (Job->Sleepers.load(std::memory_order_acquire) > 0)
+    {
+        std::lock_guard<std::mutex> lock(Job->IdleLock);
+        Job->Pushes++;
+        Job->Idle.notify_one();
+    }
+}
+
+static bool PopItem(TREEWALK_JOB* Job, int Worker, TREEWALK_ITEM& Item)
+{
+    TREEWALK_QUEUE* queue = &Job->Queues[Worker];
+    std::unique_lock<std::mutex> lock(queue->Lock, std::defer_lock);
+
+    if (Job->Shared)
+        lock.lock();
+    if (queue->Items.empty())
+        return false;
+    Item = queue->Items.back();
+    queue->Items.pop_back();
+    return true;
+}
+
+static bool StealItem(TREEWALK_JOB* Job, int Worker, TREEWALK_ITEM& Item)
+{
+    for (int i = 1; i < Job->Threads; i++)
+    {
+        TREEWALK_QUEUE* queue = &Job->Queues[(Worker + i) % Job->Threads];
+        std::lock_guard<std::mutex> lock(queue->Lock);
+
+        // the oldest item is the one nearest to the root
+        if (queue->Items.empty())
+            continue;
+        Item = queue->Items.front();
+        queue->Items.pop_front();
+        Job->Queues[Worker].Steals++;
+        return true;
+    }
+    return false;
+}
+
+static bool HasWork(TREEWALK_JOB* Job)
+{
+    for (int i = 0; i < Job->Threads; i++)
+    {
+        std::lock_guard<std::mutex> lock(Job->Queues[i].Lock);
+        if (!Job->Queues[i].Items.empty())
+            return true;
+    }
+    return false;
+}
+
+// Parks an idle thread until there may be work, or the walk is over. The
+// thread is counted in Sleepers before it looks at the queues: a push that
+// the look misses comes after it, sees the count and notifies.
+static void WaitForWork(TREEWALK_JOB* Job)
+{
+    std::unique_lock<std::mutex> lock(Job->IdleLock);
+    int64 pushes = Job->Pushes;
+
+    Job->Sleepers.fetch_add(1, std::memory_order_acq_rel);
+    lock.unlock();
+    if (!HasWork(Job))
+    {
+        lock.lock();
+        Job->Idle.wait(lock, [Job, pushes] { return Job->Pushes != pushes || Job->Pending.load(std::memory_order_acquire) == 0; });
+    }
+    Job->Sleepers.fetch_sub(1, std::memory_order_relaxed);
+}
+
+static void RunChunk(TREEWALK_JOB* Job, int Worker, TREEWALK_LIST* List, size_t First, size_t Last)
+{
+    TREEWALK_QUEUE* queue = &Job->Queues[Worker];
+
+    for (size_t i = First; i < Last; i++)
+    {
+        VirtualFile* vfile = List->Children[i];
+        bool directory = (vfile->get_Mode() & S_IFDIR) != 0;
+        bool descend = directory;
+
+        if (Job->Visitor)
+        {
+            TREEWALK_NODE node = { vfile, List->Parent, List->Depth, Worker };
+            descend = Job->Visitor(&node, Job->Context) && directory;
+        }
+        if (directory)
+            queue->Directories++;
+        else
+            queue->Files++;
+
+        // the directory keeps the reference until it is listed
+        if (descend)
+        {
+            TREEWALK_ITEM item = { vfile, List->Depth + 1, NULL, 0, 0 };
+            PushItem(Job, Worker, item);
+        }
+        else
+            vfile->Release();
+    }
+
+    if (List->Chunks.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+        List->Parent->Release();
+        queue->Lists.push_back(List);
+    }
+}
+
+static void ListDirectory(TREEWALK_JOB* Job, int Worker, VirtualFile* Dir, int Depth)
+{
+    TREEWALK_QUEUE* queue = &Job->Queues[Worker];
+    TREEWALK_LIST* list;
+    VirtualFile* vfile;
+
+    // most directories are small, so the lists are reused rather than
+    // allocated for each of them
+    if (queue->Lists.empty())
+        list = new TREEWALK_LIST;
+    else
+    {
+        list = queue->Lists.back();
+        queue->Lists.pop_back();
+        list->Children.clear();
+    }
+    list->Parent = Dir;
+    list->Depth = Depth;
+    if (Job->Flags & TREEWALK_UNLINK)
+    {
+        // the first child is always found at once
+        Dir->LockExclusive();
+        while (Dir->get_Context()->GetFile(0, vfile))
+        {
+            vfile->AddRef();
+            vfile->Remove();
+            vfile->Release();
+            list->Children.push_back(vfile);
+        }
+        Dir->UnlockExclusive();
+    }
+    else
+    {
+        // a node unlinked meanwhile may already have lost its last reference
+        std::vector<VirtualFile*>& files = list->Children;
+        size_t pinned = 0;
+        EpochGuard guard;
+
+        Dir->get_Context()->GetFiles(files);
+        for (size_t i = 0; i < files.size(); i++)
+        {
+            if (files[i]->TryAddRef())
+                files[pinned++] = files[i];
+        }
+        files.resize(pinned);
+    }
+
+    size_t count = list->Children.size();
+    int chunks = (int)((count + TREEWALK_CHUNK - 1) / TREEWALK_CHUNK);
+    if (chunks == 0)
+    {
+        Dir->Release();
+        queue->Lists.push_back(list);
+        return;
+    }
+
+    // the last chunks are queued first, so that a thief takes the farthest
+    list->Chunks.store(chunks, std::memory_order_relaxed);
+    for (int c = chunks - 1; c > 0; c--)
+    {
+        size_t last = (size_t)(c + 1) * TREEWALK_CHUNK;
+        TREEWALK_ITEM item = { NULL, Depth, list, (size_t)c * TREEWALK_CHUNK, last < count ? last : count };
+        PushItem(Job, Worker, item);
+    }
+    RunChunk(Job, Worker, list, 0, count < TREEWALK_CHUNK ? count : TREEWALK_CHUNK);
+}
+
+static void RunWorker(TREEWALK_JOB* Job, int Worker);
+
+static void StartHelpers(TREEWALK_JOB* Job)
+{
+    for (int i = 1; i < Job->Threads; i++)
+        Job->Helpers.push_back(std::thread(RunWorker, Job, i));
+}
+
+static void RunWorker(TREEWALK_JOB* Job, int Worker)
+{
+    TREEWALK_QUEUE* queue = &Job->Queues[Worker];
+    TREEWALK_ITEM item;
+
+    for (;;)
+    {
+        if (!PopItem(Job, Worker, item) && !(Job->Shared && StealItem(Job, Worker, item)))
+        {
+            if (!Job->Shared || Job->Pending.load(std::memory_order_acquire) == 0)
+                break;
+            WaitForWork(Job);
+            continue;
+        }
+
+        if (item.List == NULL)
+            ListDirectory(Job, Worker, item.Dir, item.Depth);
+        else
+            RunChunk(Job, Worker, item.List, item.First, item.Last);
+
+        if (Job->Shared)
+        {
+            // the last item wakes the threads waiting for more
+            if (Job->Pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            {
+                std::lock_guard<std::mutex> lock(Job->IdleLock);
+                Job->Idle.notify_all();
+            }
+        }
+        else if (Job->Threads > 1 && queue->Directories + queue->Files >= TREEWALK_PARALLEL_NODES && queue->Items.size() > 1)
+        {
+            // the calling thread starts the others once the tree turns out big
+            Job->Pending.store((int64)queue->Items.size(), std::memory_order_relaxed);
+            Job->Shared = true;
+            StartHelpers(Job);
+        }
+    }
+}
+
+void TreeWalk(VirtualFile* Root, int Flags, int Threads, TREEWALK_VISITOR Visitor, void* Context, TREEWALK_STATS* Stats)
+{
+    assert(Root);
+    TREEWALK_JOB job;
+    unsigned seq;
+
+    if (Threads <= 0)
+        Threads = (int)std::thread::hardware_concurrency();
+    if (Threads < 1)
+        Threads = 1;
+    if (Threads > TREEWALK_MAX_THREADS)
+        Threads = TREEWALK_MAX_THREADS;
+
+    job.Flags = Flags;
+    job.Threads = Threads;
+    job.Visitor = Visitor;
+    job.Context = Context;
+    job.Queues = new TREEWALK_QUEUE[Threads];
+    job.Shared = false;
+    job.Pending.store(0, std::memory_order_relaxed);
+    job.Sleepers.store(0, std::memory_order_relaxed);
+    job.Pushes = 0;
+    for (int i = 0; i < Threads; i++)
+    {
+        job.Queues[i].Directories = 0;
+        job.Queues[i].Files = 0;
+        job.Queues[i].Steals = 0;
+    }
+
+    if (Flags & TREEWALK_BLOCK_RENAMES)
+        VirtualFile::BlockRenames();
+    seq = VirtualFile::RenameSeqBegin();
+
+    // the root is released with the last chunk of its list, as any directory
+    Root->AddRef();
+    TREEWALK_ITEM item = { Root, 1, NULL, 0, 0 };
+    PushItem(&job, 0, item);
+    RunWorker(&job, 0);
+    for (size_t i = 0; i < job.Helpers.size(); i++)
+        job.Helpers[i].join();
+
+    if (Stats)
+    {
+        Stats->Directories = 0;
+        Stats->Files = 0;
+        Stats->Steals = 0;
+        Stats->Threads = 1 + (int)job.Helpers.size();
+        Stats->Renamed = VirtualFile::RenameSeqRetry(seq);
+        for (int i = 0; i < Threads; i++)
+        {
+            Stats->Directories += job.Queues[i].Directories;
+            Stats->Files += job.Queues[i].Files;
+            Stats->Steals += job.Queues[i].Steals;
+        }
+    }
+    if (Flags & TREEWALK_BLOCK_RENAMES)
+        VirtualFile::UnblockRenames();
+
+    for (int i = 0; i < Threads; i++)
+    {
+        for (size_t l = 0; l < job.Queues[i].Lists.size(); l++)
+            delete job.Queues[i].Lists[l];
+    }
+    delete[] job.Queues;
+}
@@ -0,0 +1,71 @@
+#if !defined _TREEWALK_H
+#define _TREEWALK_H
+
+// Parallel walks of the VirtualFile tree.
+//
+// TreeWalk calls a visitor for every node below a directory. The calling
+// thread starts alone; once it has visited TREEWALK_PARALLEL_NODES nodes
+// and there is work left in its queue it starts the other threads, so that
+// small trees are walked without starting any. Every thread keeps a queue
+// of work of its own: it takes the newest item of its queue, which walks
+// its subtree depth first, and a thread whose queue is empty steals the
+// oldest item of another one, which is the largest subtree left there. A
+// thread that finds no work anywhere sleeps until an item is queued or the
+// walk is over.
+// Directories with more than TREEWALK_CHUNK children are split into chunks
+// of that many, so a flat directory is shared among the threads too.
+//
+// Every directory is listed in one pass validated against renames
+// (DirectoryEnumerationContext::GetFiles), and the children listed are
+// pinned with a reference before the epoch read section ends. The visitor
+// may lock and read the node it is given for as long as it likes, and the
+// walk never holds back the reclamation of nodes unlinked meanwhile.
+// Creations and deletions in a directory after it was listed are not seen.
+//
+// A rename that moves a subtree while the walk runs may make the walk see
+// it twice or not at all; TREEWALK_STATS::Renamed tells whether a rename
+// ran. TREEWALK_BLOCK_RENAMES keeps renames waiting until the walk ends, so
+// that every node is seen exactly once; the visitor must not rename then.
+//
+// With TREEWALK_UNLINK every directory is locked while it is listed and
+// its children are unlinked from it, which empties the tree in parallel.
+// The nodes are freed when the visitor is done with them.
+
+#include "virtualfile.h"
+
+#define TREEWALK_MAX_THREADS 64
+
+// nodes the calling thread visits alone before it starts the others
+#define TREEWALK_PARALLEL_NODES 4096
+
+// children of a directory in one work item
+#define TREEWALK_CHUNK 1024
+
+#define TREEWALK_BLOCK_RENAMES  0x01
+#define TREEWALK_UNLINK         0x02
+
+typedef struct
+{
+    VirtualFile* File;      // pinned while the visitor runs
+    VirtualFile* Parent;
+    int Depth;              // 1 for the children of the root
+    int Worker;             // 0 to Threads - 1, for results kept per thread
+}   TREEWALK_NODE;
+
+// false for a directory skips its subtree
+typedef bool (*TREEWALK_VISITOR)(const TREEWALK_NODE* Node, void* Context);
+
+typedef struct
+{
+    int64 Directories;      // visited, the root not included
+    int64 Files;
+    int64 Steals;           // work items taken from the queue of another thread
+    int Threads;            // threads that took part
+    bool Renamed;
+}   TREEWALK_STATS;
+
+// Threads 0 uses one thread per core, at most TREEWALK_MAX_THREADS. The
+// visitor runs on all of them at once and may be NULL; Stats may be NULL.
+void TreeWalk(VirtualFile* Root, int Flags, int Threads, TREEWALK_VISITOR Visitor, void* Context, TREEWALK_STATS* Stats);
+
+#endif //#if !defined _TREEWALK_H
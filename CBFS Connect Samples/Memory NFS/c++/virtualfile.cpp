@@ -1,320 +1,2331 @@
 #include <assert.h>
+#include <stdint.h>
+#include <time.h>
+#include <chrono>
+#include <new>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <sys/stat.h>
 
 #include "virtualfile.h"
+#include "slab.h"
+#include "pagearena.h"
+#include "probes.h"
 
 #ifdef _UNICODE
 #include "../../include/unicode/nfs.h"
+#elif defined CBFS_STANDIN
+#include "standin/nfs.h"
 #else
 #include "../../include/nfs.h"
 #endif
 
+// requests a thread counts before it adds them to the file
+#define VIRTUALFILE_IO_BATCH_OPS 64
+
+// concurrent readahead arrives slightly out of order, a request that starts
+// within this many request lengths of the end of the previous one is still
+// sequential
+#define VIRTUALFILE_IO_REORDER 4
+
+// names of up to this many bytes, header included, go to slabs in steps of
+// 8 bytes, up to VIRTUALFILE_NAME_LARGE in steps of 32; longer names come
+// from the heap
+#define VIRTUALFILE_NAME_SMALL 128
+#define VIRTUALFILE_NAME_LARGE 512
+#define VIRTUALFILE_NAME_CLASSES (VIRTUALFILE_NAME_SMALL / 8 - 1 + (VIRTUALFILE_NAME_LARGE - VIRTUALFILE_NAME_SMALL) / 32)
+
+// the smallest buffer of a small file; buffers double up to VIRTUALFILE_SMALL_MAX
+#define VIRTUALFILE_SMALL_MIN 64
+#define VIRTUALFILE_SMALL_CLASSES 7
+
+#ifndef VIRTUALFILE_SMALL_LIMIT
+#define VIRTUALFILE_SMALL_LIMIT VIRTUALFILE_SMALL_MAX
+#endif
+
+// lock attempts of a node before the thread goes to sleep
+#define NODELOCK_SPIN 64
+// condition variables the waiters of all node locks sleep on
+#define NODELOCK_BUCKETS 64
+
+#define NODELOCK_WRITER 0x80000000u
+#define NODELOCK_WAITERS 0x40000000u
+#define NODELOCK_READERS 0x3fffffffu
+
+// the data of a small file, Capacity bytes follow the header
+typedef struct
+{
+    int64 Capacity;
+}   VIRTUALFILE_SMALL_DATA, * PVIRTUALFILE_SMALL_DATA;
+
+// the state of a file that was read or written, see VirtualFile::GetData
+typedef struct _VIRTUALFILE_DATA
+{
+    // the table is replaced when it grows, readers use it in a read section
+    std::atomic<PVIRTUALFILE_PAGE_TABLE> Pages;
+    // set while the file is small, the table is NULL then; replaced as
+    // it grows, readers use it in a read section
+    std::atomic<PVIRTUALFILE_SMALL_DATA> Small;
+    std::mutex PagesLock;
+    ByteRangeLock RangeLock;
+
+    std::atomic<int64> ReadOps;
+    std::atomic<int64> ReadBytes;
+    std::atomic<int64> WriteOps;
+    std::atomic<int64> WriteBytes;
+    std::atomic<int64> SequentialOps;
+    std::atomic<int64> StridedOps;
+    std::atomic<int64> RandomOps;
+    std::atomic<int64> LastIoTime;
+    // the last request of the last batch flushed, for the classification
+    std::atomic<int64> LastIoOffset;
+    std::atomic<int64> LastIoEnd;
+    std::atomic<int64> LastIoStride;
+    // set once a thread batched a request of the file
+    std::atomic<bool> IoBatched;
+}   VIRTUALFILE_DATA, * PVIRTUALFILE_DATA;
+
+// the fields of a node that GetAttributes and directory listings do not
+// read, kept in the cold part of its slab object (see VirtualFile::Cold)
+typedef struct _VIRTUALFILE_COLD
+{
+    std::atomic<VirtualFile*> Parent;
+    // created on first use and kept until the node is deleted
+    std::atomic<DirectoryEnumerationContext*> Children;
+    std::atomic<PVIRTUALFILE_DATA> Data;
+    std::atomic<int64> AllocationSize;
+    NodeLock Lock;
+    std::atomic<int> RefCount;
+}   VIRTUALFILE_COLD, * PVIRTUALFILE_COLD;
+
+// the header of a name, the characters follow it
+typedef struct
+{
+    uint32_t Hash;
+    uint32_t Length;    // in characters, without the terminating zero
+}   VIRTUALFILE_NAME, * PVIRTUALFILE_NAME;
+
+typedef struct _VIRTUALFILE_IO_BATCH
+{
+    std::atomic<bool> Busy;     // held by the owner while counting and by the flushers
+    std::atomic<bool> InUse;
+    VirtualFile* File;          // NULL while the batch is empty
+    int Ops;
+    VIRTUALFILE_IO_STATS Counts;
+    // the first request is classified when the batch is flushed, against
+    // the requests of the other threads; the others against the previous one
+    int64 FirstOffset;
+    int64 FirstLength;
+    int64 LastOffset;
+    int64 LastEnd;
+    int64 LastStride;
+    struct _VIRTUALFILE_IO_BATCH* Next;
+}   VIRTUALFILE_IO_BATCH, * PVIRTUALFILE_IO_BATCH;
+
+static std::atomic<PVIRTUALFILE_IO_BATCH> g_IoBatches(NULL);
+
+static PVIRTUALFILE_IO_BATCH AcquireIoBatch(void)
+{
+    // batches are never freed, the batch of a finished thread is reused
+    for (PVIRTUALFILE_IO_BATCH batch = g_IoBatches.load(std::memory_order_acquire); batch != NULL; batch = batch->Next)
+    {
+        bool expected = false;
+        if (!batch->InUse.load(std::memory_order_relaxed) &&
+            batch->InUse.compare_exchange_strong(expected, true, std::memory_order_acquire))
+            return batch;
+    }
+
+    PVIRTUALFILE_IO_BATCH batch = new VIRTUALFILE_IO_BATCH;
+    batch->Busy.store(false, std::memory_order_relaxed);
+    batch->InUse.store(true, std::memory_order_relaxed);
+    batch->File = NULL;
+    batch->Ops = 0;
+    memset(&batch->Counts, 0, sizeof(batch->Counts));
+    batch->Next = g_IoBatches.load(std::memory_order_relaxed);
+    while (!g_IoBatches.compare_exchange_weak(batch->Next, batch, std::memory_order_release, std::memory_order_relaxed))
+        ;
+    return batch;
+}
+
+static void LockIoBatch(PVIRTUALFILE_IO_BATCH Batch)
+{
+    // only contended while a flush of another thread visits the batch
+    while (Batch->Busy.exchange(true, std::memory_order_acquire))
+        std::this_thread::yield();
+}
+
+static void UnlockIoBatch(PVIRTUALFILE_IO_BATCH Batch)
+{
+    Batch->Busy.store(false, std::memory_order_release);
+}
+
+class IoBatchHolder
+{
+public:
+    IoBatchHolder() : mBatch(AcquireIoBatch()) {}
+    ~IoBatchHolder()
+    {
+        // the batch goes back to the pool empty
+        VirtualFile::FlushIoStats();
+        mBatch->InUse.store(false, std::memory_order_release);
+    }
+    PVIRTUALFILE_IO_BATCH mBatch;
+};
+
+static PVIRTUALFILE_IO_BATCH GetThreadIoBatch(void)
+{
+    static thread_local IoBatchHolder holder;
+    return holder.mBatch;
+}
+
+#ifdef VIRTUALFILE_LOCKSTATS
+// locks a thread holds at once, deeper nesting is counted without the hold time
+#define VIRTUALFILE_LOCKSTATS_HELD 8
+
+typedef struct
+{
+    // only the owning thread writes them, readers sum them up
+    std::atomic<int64> Acquired;
+    std::atomic<int64> Contended;
+    std::atomic<int64> WaitTime;
+    std::atomic<int64> MaxWaitTime;
+    std::atomic<int64> HoldTime;
+    std::atomic<int64> MaxHoldTime;
+}   VIRTUALFILE_LOCK_COUNTS;
+
+typedef struct
+{
+    const void* Lock;
+    int Class;
+    int64 Start;
+}   VIRTUALFILE_HELD_LOCK;
+
+typedef struct _VIRTUALFILE_LOCK_THREAD
+{
+    std::atomic<bool> InUse;
+    VIRTUALFILE_LOCK_COUNTS Counts[VIRTUALFILE_LOCK_CLASSES];
+    VIRTUALFILE_HELD_LOCK Held[VIRTUALFILE_LOCKSTATS_HELD];
+    int HeldCount;
+    struct _VIRTUALFILE_LOCK_THREAD* Next;
+}   VIRTUALFILE_LOCK_THREAD, * PVIRTUALFILE_LOCK_THREAD;
+
+static std::atomic<PVIRTUALFILE_LOCK_THREAD> g_LockStats(NULL);
+
+static PVIRTUALFILE_LOCK_THREAD AcquireLockStats(void)
+{
+    // like the I/O batches, the counters of a finished thread are reused
+    // and keep what it counted
+    for (PVIRTUALFILE_LOCK_THREAD stats = g_LockStats.load(std::memory_order_acquire); stats != NULL; stats = stats->Next)
+    {
+        bool expected = false;
+        if (!stats->InUse.load(std::memory_order_relaxed) &&
+            stats->InUse.compare_exchange_strong(expected, true, std::memory_order_acquire))
+            return stats;
+    }
+
+    PVIRTUALFILE_LOCK_THREAD stats = new VIRTUALFILE_LOCK_THREAD;
+    stats->InUse.store(true, std::memory_order_relaxed);
+    for (int i = 0; i < VIRTUALFILE_LOCK_CLASSES; i++)
+    {
+        stats->Counts[i].Acquired.store(0, std::memory_order_relaxed);
+        stats->Counts[i].Contended.store(0, std::memory_order_relaxed);
+        stats->Counts[i].WaitTime.store(0, std::memory_order_relaxed);
+        stats->Counts[i].MaxWaitTime.store(0, std::memory_order_relaxed);
+        stats->Counts[i].HoldTime.store(0, std::memory_order_relaxed);
+        stats->Counts[i].MaxHoldTime.store(0, std::memory_order_relaxed);
+    }
+    stats->HeldCount = 0;
+    stats->Next = g_LockStats.load(std::memory_order_relaxed);
+    while (!g_LockStats.compare_exchange_weak(stats->Next, stats, std::memory_order_release, std::memory_order_relaxed))
+        ;
+    return stats;
+}
+
+class LockStatsHolder
+{
+public:
+    LockStatsHolder() : mStats(AcquireLockStats()) {}
+    ~LockStatsHolder() { mStats->InUse.store(false, std::memory_order_release); }
+    PVIRTUALFILE_LOCK_THREAD mStats;
+};
+
+static PVIRTUALFILE_LOCK_THREAD GetThreadLockStats(void)
+{
+    static thread_local LockStatsHolder holder;
+    return holder.mStats;
+}
+
+static int64 LockStatsNow(void)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void LockStatsAdd(std::atomic<int64>& Counter, int64 Value)
+{
+    Counter.store(Counter.load(std::memory_order_relaxed) + Value, std::memory_order_relaxed);
+}
+
+static void LockStatsMax(std::atomic<int64>& Counter, int64 Value)
+{
+    if (Counter.load(std::memory_order_relaxed) < Value)
+        Counter.store(Value, std::memory_order_relaxed);
+}
+
+// WaitStart is -1 if the lock was taken without waiting
+static void LockStatsAcquired(const void* Lock, int Class, int64 WaitStart)
+{
+    PVIRTUALFILE_LOCK_THREAD stats = GetThreadLockStats();
+    VIRTUALFILE_LOCK_COUNTS* counts = &stats->Counts[Class];
+    int64 now = LockStatsNow();
+
+    LockStatsAdd(counts->Acquired, 1);
+    if (WaitStart >= 0)
+    {
+        LockStatsAdd(counts->Contended, 1);
+        LockStatsAdd(counts->WaitTime, now - WaitStart);
+        LockStatsMax(counts->MaxWaitTime, now - WaitStart);
+    }
+    if (stats->HeldCount < VIRTUALFILE_LOCKSTATS_HELD)
+    {
+        VIRTUALFILE_HELD_LOCK held = { Lock, Class, now };
+        stats->Held[stats->HeldCount++] = held;
+    }
+}
+
+static void LockStatsReleased(const void* Lock)
+{
+    PVIRTUALFILE_LOCK_THREAD stats = GetThreadLockStats();
+
+    // locks are mostly released in the reverse order
+    for (int i = stats->HeldCount - 1; i >= 0; i--)
+    {
+        if (stats->Held[i].Lock != Lock)
+            continue;
+
+        VIRTUALFILE_LOCK_COUNTS* counts = &stats->Counts[stats->Held[i].Class];
+        int64 held = LockStatsNow() - stats->Held[i].Start;
+        LockStatsAdd(counts->HoldTime, held);
+        LockStatsMax(counts->MaxHoldTime, held);
+        for (; i + 1 < stats->HeldCount; i++)
+            stats->Held[i] = stats->Held[i + 1];
+        stats->HeldCount--;
+        break;
+    }
+}
+
+template <class Mutex> static void CountedLock(Mutex& Lock, int Class)
+{
+    if (Lock.try_lock())
+    {
+        LockStatsAcquired(&Lock, Class, -1);
+        return;
+    }
+    int64 start = LockStatsNow();
+    Lock.lock();
+    LockStatsAcquired(&Lock, Class, start);
+}
+
+template <class Mutex> static void CountedLockShared(Mutex& Lock, int Class)
+{
+    if (Lock.try_lock_shared())
+    {
+        LockStatsAcquired(&Lock, Class, -1);
+        return;
+    }
+    int64 start = LockStatsNow();
+    Lock.lock_shared();
+    LockStatsAcquired(&Lock, Class, start);
+}
+
+template <class Mutex> static void CountedUnlock(Mutex& Lock)
+{
+    LockStatsReleased(&Lock);
+    Lock.unlock();
+}
+
+template <class Mutex> static void CountedUnlockShared(Mutex& Lock)
+{
+    LockStatsReleased(&Lock);
+    Lock.unlock_shared();
+}
+#else
+template <class Mutex> static inline void CountedLock(Mutex& Lock, int Class) { Lock.lock(); }
+template <class Mutex> static inline void CountedLockShared(Mutex& Lock, int Class) { Lock.lock_shared(); }
+template <class Mutex> static inline void CountedUnlock(Mutex& Lock) { Lock.unlock(); }
+template <class Mutex> static inline void CountedUnlockShared(Mutex& Lock) { Lock.unlock_shared(); }
+#endif
+
+// std::lock_guard of a counted lock
+template <class Mutex> class CountedLockGuard
+{
+public:
+    CountedLockGuard(Mutex& Lock, int Class) : mLock(Lock) { CountedLock(mLock, Class); }
+    ~CountedLockGuard() { CountedUnlock(mLock); }
+private:
+    CountedLockGuard(const CountedLockGuard&);
+    CountedLockGuard& operator=(const CountedLockGuard&);
+    Mutex& mLock;
+};
+
+// the allocators live as long as the process, as threads that exit late
+// still return their cached objects to them. They are created by the first
+// node, which may come from a static constructor of another file.
+static SlabAllocator* g_NodeSlab;
+static SlabAllocator* g_DirectorySlab;
+static SlabAllocator* g_DataSlab;
+static SlabAllocator* g_NameSlabs[VIRTUALFILE_NAME_CLASSES];
+static SlabAllocator* g_SmallSlabs[VIRTUALFILE_SMALL_CLASSES];
+static std::atomic<int64> g_HeapNameBytes(0);
+static std::atomic<int> g_SmallFileLimit(VIRTUALFILE_SMALL_LIMIT);
+
+// created by the first SetDataArena(true) and kept, pages from it may be
+// freed after it is turned off
+static std::atomic<PageArena*> g_DataArena(NULL);
+static std::atomic<bool> g_UseDataArena(false);
+static std::mutex g_DataArenaLock;
+
+// expiry of files: a min-heap of the time each tracked file is looked at
+// next, with the position of every file in it so that a file can be moved
+// or taken out. Reads and writes do not touch the heap; a file that was
+// used since it was scheduled is scheduled again when its time comes.
+typedef struct
+{
+    int64 Deadline;
+    VirtualFile* File;
+}   VIRTUALFILE_EXPIRY_ENTRY;
+
+typedef struct
+{
+    std::basic_string<nfs_char> Directory;     // without the trailing slash, empty for the root
+    int64 Seconds;
+}   VIRTUALFILE_EXPIRY_POLICY;
+
+static std::vector<VIRTUALFILE_EXPIRY_POLICY> g_ExpiryPolicies;
+static std::atomic<bool> g_ExpiryEnabled(false);
+static std::mutex g_ExpiryLock;
+static std::vector<VIRTUALFILE_EXPIRY_ENTRY> g_ExpiryHeap;
+static std::unordered_map<VirtualFile*, size_t> g_ExpiryIndex;
+static std::atomic<int64> g_ExpiredFiles(0);
+
+static size_t NameClassSize(int Class)
+{
+    if (Class < VIRTUALFILE_NAME_SMALL / 8 - 1)
+        return (size_t)(Class + 2) * 8;
+    return (size_t)VIRTUALFILE_NAME_SMALL + (size_t)(Class - (VIRTUALFILE_NAME_SMALL / 8 - 1) + 1) * 32;
+}
+
+// -1 for a name that comes from the heap
+static int NameClass(size_t Size)
+{
+    if (Size <= VIRTUALFILE_NAME_SMALL)
+        return (int)((Size + 7) / 8) - 2;
+    if (Size <= VIRTUALFILE_NAME_LARGE)
+        return VIRTUALFILE_NAME_SMALL / 8 - 1 + (int)((Size - VIRTUALFILE_NAME_SMALL + 31) / 32) - 1;
+    return -1;
+}
+
+static bool CreateSlabs(void)
+{
+    g_NodeSlab = new SlabAllocator(sizeof(VirtualFile), sizeof(VIRTUALFILE_COLD));
+    g_DirectorySlab = new SlabAllocator(sizeof(DirectoryEnumerationContext));
+    g_DataSlab = new SlabAllocator(sizeof(VIRTUALFILE_DATA));
+    for (int i = 0; i < VIRTUALFILE_NAME_CLASSES; i++)
+        g_NameSlabs[i] = new SlabAllocator(NameClassSize(i));
+    for (int i = 0; i < VIRTUALFILE_SMALL_CLASSES; i++)
+        g_SmallSlabs[i] = new SlabAllocator(sizeof(VIRTUALFILE_SMALL_DATA) + ((size_t)VIRTUALFILE_SMALL_MIN << i));
+    return true;
+}
+
+// everything else allocated from the slabs belongs to a node
+static void EnsureSlabs(void)
+{
+    static bool created = CreateSlabs();
+    (void)created;
+}
+
+// a zeroed data page, from the arena if it is on and can serve it; the
+// arena reports Owner and Index to compaction. NULL if there is no memory.
+static char* PageAlloc(VirtualFile* Owner, int64 Index)
+{
+    char* page = NULL;
+
+    if (g_UseDataArena.load(std::memory_order_acquire))
+        page = (char*)g_DataArena.load(std::memory_order_acquire)->Alloc(Owner, Index);
+    if (page == NULL)
+        page = (char*)calloc(1, VIRTUALFILE_PAGE_SIZE);
+    return page;
+}
+
+static void PageFree(char* Page)
+{
+    PageArena* arena = g_DataArena.load(std::memory_order_acquire);
+    if (arena == NULL || !arena->Free(Page))
+        free(Page);
+}
+
+// a file whose pages are being compacted stays alive until they are moved
+static bool PinFile(void* Owner)
+{
+    return ((VirtualFile*)Owner)->TryAddRef();
+}
+
+// g_ExpiryLock must be held by the heap functions
+static void ExpiryPlace(size_t Index, const VIRTUALFILE_EXPIRY_ENTRY& Entry)
+{
+    g_ExpiryHeap[Index] = Entry;
+    g_ExpiryIndex[Entry.File] = Index;
+}
+
+static void ExpirySift(size_t Index)
+{
+    VIRTUALFILE_EXPIRY_ENTRY entry = g_ExpiryHeap[Index];
+    size_t count = g_ExpiryHeap.size();
+
+    while(Index > 0 && g_ExpiryHeap[(Index - 1) / 2].Deadline > entry.Deadline)
+    {
+        ExpiryPlace(Index, g_ExpiryHeap[(Index - 1) / 2]);
+        Index = (Index - 1) / 2;
+    }
+    for(;;)
+    {
+        size_t child = 2 * Index + 1;
+        if(child >= count)
+            break;
+        if(child + 1 < count && g_ExpiryHeap[child + 1].Deadline < g_ExpiryHeap[child].Deadline)
+            child++;
+        if(g_ExpiryHeap[child].Deadline >= entry.Deadline)
+            break;
+        ExpiryPlace(Index, g_ExpiryHeap[child]);
+        Index = child;
+    }
+    ExpiryPlace(Index, entry);
+}
+
+static void ExpirySet(VirtualFile* File, int64 Deadline)
+{
+    VIRTUALFILE_EXPIRY_ENTRY entry = { Deadline, File };
+    std::unordered_map<VirtualFile*, size_t>::iterator it = g_ExpiryIndex.find(File);
+
+    if(it == g_ExpiryIndex.end())
+    {
+        g_ExpiryHeap.push_back(entry);
+        ExpirySift(g_ExpiryHeap.size() - 1);
+    }
+    else
+    {
+        g_ExpiryHeap[it->second].Deadline = Deadline;
+        ExpirySift(it->second);
+    }
+}
+
+static void ExpiryErase(VirtualFile* File)
+{
+    std::unordered_map<VirtualFile*, size_t>::iterator it = g_ExpiryIndex.find(File);
+    if(it == g_ExpiryIndex.end())
+        return;
+
+    size_t index = it->second;
+    g_ExpiryIndex.erase(it);
+    VIRTUALFILE_EXPIRY_ENTRY last = g_ExpiryHeap.back();
+    g_ExpiryHeap.pop_back();
+    if(index < g_ExpiryHeap.size())
+    {
+        g_ExpiryHeap[index] = last;
+        ExpirySift(index);
+    }
+}
+
+// 0, a time that was never set, stays 0
+static int64 FileTimeToUnixTime(int64 FileTime)
+{
+    return FileTime > 0 ? FileTime / 10000000 - 11644473600LL : 0;
+}
+
+inline PVIRTUALFILE_COLD VirtualFile::Cold(void)
+{
+    return (PVIRTUALFILE_COLD)g_NodeSlab->GetCold(this);
+}
+
+static uint32_t NameHash(const nfs_char* Name, uint32_t* Length)
+{
+    // FNV-1a over the characters
+    uint32_t hash = 2166136261u, i;
+
+    for (i = 0; Name[i] != 0; i++)
+        hash = (hash ^ (uint32_t)Name[i]) * 16777619u;
+    *Length = i;
+    return hash;
+}
+
+static PVIRTUALFILE_NAME NameHeader(const nfs_char* Name)
+{
+    return (PVIRTUALFILE_NAME)((char*)Name - sizeof(VIRTUALFILE_NAME));
+}
+
+static size_t NameSize(uint32_t Length)
+{
+    return sizeof(VIRTUALFILE_NAME) + ((size_t)Length + 1) * sizeof(nfs_char);
+}
+
+// NULL if a name too long for the slabs finds no memory
+static nfs_char* NameAlloc(const nfs_char* Name)
+{
+    uint32_t length, hash = NameHash(Name, &length);
+    size_t size = NameSize(length);
+    int nameClass = NameClass(size);
+    PVIRTUALFILE_NAME header;
+
+    if (nameClass >= 0)
+        header = (PVIRTUALFILE_NAME)g_NameSlabs[nameClass]->Alloc();
+    else
+    {
+        header = (PVIRTUALFILE_NAME)malloc(size);
+        if (header == NULL)
+            return NULL;
+        g_HeapNameBytes.fetch_add((int64)size, std::memory_order_relaxed);
+    }
+    header->Hash = hash;
+    header->Length = length;
+
+    nfs_char* name = (nfs_char*)(header + 1);
+    memcpy(name, Name, ((size_t)length + 1) * sizeof(nfs_char));
+    return name;
+}
+
+static void NameFree(void* Name)
+{
+    PVIRTUALFILE_NAME header = NameHeader((nfs_char*)Name);
+    size_t size = NameSize(header->Length);
+    int nameClass = NameClass(size);
+
+    if (nameClass >= 0)
+        g_NameSlabs[nameClass]->Free(header);
+    else
+    {
+        g_HeapNameBytes.fetch_sub((int64)size, std::memory_order_relaxed);
+        free(header);
+    }
+}
+
+static int SmallClass(int64 Size)
+{
+    int smallClass = 0;
+
+    while (((int64)VIRTUALFILE_SMALL_MIN << smallClass) < Size)
+        smallClass++;
+    assert(smallClass < VIRTUALFILE_SMALL_CLASSES);
+    return smallClass;
+}
+
+// a zeroed buffer for at least Size bytes
+static PVIRTUALFILE_SMALL_DATA SmallAlloc(int64 Size)
+{
+    int smallClass = SmallClass(Size);
+    PVIRTUALFILE_SMALL_DATA small = (PVIRTUALFILE_SMALL_DATA)g_SmallSlabs[smallClass]->Alloc();
+
+    small->Capacity = (int64)VIRTUALFILE_SMALL_MIN << smallClass;
+    memset(small + 1, 0, (size_t)small->Capacity);
+    return small;
+}
+
+static void SmallFree(void* Small)
+{
+    g_SmallSlabs[SmallClass(((PVIRTUALFILE_SMALL_DATA)Small)->Capacity)]->Free(Small);
+}
+
+static char* SmallBytes(PVIRTUALFILE_SMALL_DATA Small)
+{
+    return (char*)(Small + 1);
+}
+
+//class NodeLock
+
+typedef struct
+{
+    std::mutex Lock;
+    std::condition_variable Wake;
+}   NODELOCK_BUCKET;
+
+static NODELOCK_BUCKET g_NodeLockBuckets[NODELOCK_BUCKETS];
+
+static NODELOCK_BUCKET* GetNodeLockBucket(const void* Lock)
+{
+    uintptr_t hash = (uintptr_t)Lock * (uintptr_t)0x9e3779b97f4a7c15ull;
+    return &g_NodeLockBuckets[(hash >> (sizeof(uintptr_t) * 8 - 6)) % NODELOCK_BUCKETS];
+}
+
+NodeLock::NodeLock()
+    :mState(0)
+{
+
+}
+
+bool NodeLock::try_lock(void)
+{
+    unsigned state = mState.load(std::memory_order_relaxed);
+    return (state & (NODELOCK_WRITER | NODELOCK_READERS)) == 0 &&
+        mState.compare_exchange_strong(state, state | NODELOCK_WRITER, std::memory_order_acquire, std::memory_order_relaxed);
+}
+
+void NodeLock::lock(void)
+{
+    for (int spin = 0; !try_lock(); spin++)
+    {
+        if (spin >= NODELOCK_SPIN)
+            Wait(true);
+    }
+}
+
+void NodeLock::unlock(void)
+{
+    unsigned state = mState.fetch_and(~(NODELOCK_WRITER | NODELOCK_WAITERS), std::memory_order_release);
+    if (state & NODELOCK_WAITERS)
+        Wake();
+}
+
+bool NodeLock::try_lock_shared(void)
+{
+    // readers do not wait for waiting writers, like std::shared_mutex on
+    // most platforms
+    unsigned state = mState.load(std::memory_order_relaxed);
+    while ((state & NODELOCK_WRITER) == 0)
+    {
+        if (mState.compare_exchange_weak(state, state + 1, std::memory_order_acquire, std::memory_order_relaxed))
+            return true;
+    }
+    return false;
+}
+
+void NodeLock::lock_shared(void)
+{
+    for (int spin = 0; !try_lock_shared(); spin++)
+    {
+        if (spin >= NODELOCK_SPIN)
+            Wait(false);
+    }
+}
+
+void NodeLock::unlock_shared(void)
+{
+    unsigned state = mState.fetch_sub(1, std::memory_order_release);
+    if ((state & NODELOCK_READERS) == 1 && (state & NODELOCK_WAITERS))
+    {
+        mState.fetch_and(~NODELOCK_WAITERS, std::memory_order_relaxed);
+        Wake();
+    }
+}
+
+void NodeLock::Wait(bool Exclusive)
+{
+    // a waiter sets the waiters bit with the bucket locked and keeps it
+    // locked until it sleeps, so the thread that clears the bit and then
+    // locks the bucket always finds it asleep
+    NODELOCK_BUCKET* bucket = GetNodeLockBucket(this);
+    std::unique_lock<std::mutex> lock(bucket->Lock);
+    unsigned state = mState.load(std::memory_order_relaxed);
+
+    for (;;)
+    {
+        unsigned blocking = Exclusive ? NODELOCK_WRITER | NODELOCK_READERS : NODELOCK_WRITER;
+        if ((state & blocking) == 0)
+            return;
+        if ((state & NODELOCK_WAITERS) != 0 ||
+            mState.compare_exchange_weak(state, state | NODELOCK_WAITERS, std::memory_order_relaxed))
+            break;
+    }
+    bucket->Wake.wait(lock);
+}
+
+void NodeLock::Wake(void)
+{
+    // every waiter of the bucket tries again, those still blocked set the
+    // waiters bit again
+    NODELOCK_BUCKET* bucket = GetNodeLockBucket(this);
+    std::lock_guard<std::mutex> lock(bucket->Lock);
+    bucket->Wake.notify_all();
+}
+
 //class VirtualFile
-VirtualFile::VirtualFile()
+static void NewCold(void* Cold)
+{
+    PVIRTUALFILE_COLD cold = new (Cold) VIRTUALFILE_COLD;
+    cold->Parent.store(NULL, std::memory_order_relaxed);
+    cold->Children.store(NULL, std::memory_order_relaxed);
+    cold->Data.store(NULL, std::memory_order_relaxed);
+    cold->AllocationSize.store(0, std::memory_order_relaxed);
+    cold->RefCount.store(1, std::memory_order_relaxed);
+}
+
+std::mutex VirtualFile::mRenameLock;
+std::atomic<unsigned> VirtualFile::mRenameSeq(0);
+std::atomic<int64> VirtualFile::mFileCount(0);
+std::atomic<int64> VirtualFile::mPageBytes(0);
+
+VirtualFile::VirtualFile()
+{
+
+}
+
+VirtualFile::VirtualFile(const nfs_char *Name)
+    :mAttributesSeq(0)
+    ,mMode(0)
+    ,mUid(0)
+    ,mGid(0)
+    ,mSize(0)
+    ,mName(NULL)
+    ,mNextSibling(NULL)
+{
+    NewCold(Cold());
+    Initializer(Name);
+}
+
+VirtualFile::VirtualFile(const nfs_char *Name, int Mode)
+    :mAttributesSeq(0)
+    ,mMode(Mode)
+    ,mUid(0)
+    ,mGid(0)
+    ,mSize(0)
+    ,mName(NULL)
+    ,mNextSibling(NULL)
+{
+    NewCold(Cold());
+    Initializer(Name);
+}
+
+VirtualFile::VirtualFile(const nfs_char *Name, int Mode, int InitialSize)
+    :mAttributesSeq(0)
+    ,mMode(Mode)
+    ,mUid(0)
+    ,mGid(0)
+    ,mSize(0)
+    ,mName(NULL)
+    ,mNextSibling(NULL)
+{
+  NewCold(Cold());
+  set_AllocationSize(InitialSize);
+  Initializer(Name);
+}
+
+VirtualFile::~VirtualFile()
+{
+    // the sweeper looks at the node only while it is in the heap
+    if(g_ExpiryEnabled.load(std::memory_order_relaxed))
+    {
+        std::lock_guard<std::mutex> lock(g_ExpiryLock);
+        ExpiryErase(this);
+    }
+    ForgetIoBatches();
+
+    // a directory owns the references to the children still linked to it
+    DirectoryEnumerationContext* children = Cold()->Children.load(std::memory_order_relaxed);
+    if(children)
+    {
+        VirtualFile* vfile;
+        while(children->GetFile(0, vfile))
+        {
+            children->Remove(vfile);
+            vfile->set_Parent(NULL);
+            vfile->Release();
+        }
+        delete children;
+    }
+    PVIRTUALFILE_DATA data = Cold()->Data.load(std::memory_order_relaxed);
+    if(data)
+    {
+        FreePages(0);
+        data->~_VIRTUALFILE_DATA();
+        g_DataSlab->Free(data);
+    }
+    if(mName.load(std::memory_order_relaxed))
+    {
+        NameFree(mName.load(std::memory_order_relaxed));
+        mFileCount.fetch_sub(1, std::memory_order_relaxed);
+    }
+    Cold()->~_VIRTUALFILE_COLD();
+}
+
+void* VirtualFile::operator new(size_t Size)
+{
+    EnsureSlabs();
+    assert(Size <= g_NodeSlab->GetObjectSize());
+    return g_NodeSlab->Alloc();
+}
+
+void VirtualFile::operator delete(void* Ptr)
+{
+    g_NodeSlab->Free(Ptr);
+}
+
+void VirtualFile::Delete(void* vfile)
+{
+    delete (VirtualFile*)vfile;
+}
+
+void VirtualFile::AddRef(void)
+{
+    Cold()->RefCount.fetch_add(1, std::memory_order_relaxed);
+}
+
+bool VirtualFile::TryAddRef(void)
+{
+    // fails for a node whose last reference is already gone
+    int count = Cold()->RefCount.load(std::memory_order_relaxed);
+    while(count > 0)
+    {
+        if(Cold()->RefCount.compare_exchange_weak(count, count + 1, std::memory_order_relaxed))
+            return true;
+    }
+    return false;
+}
+
+void VirtualFile::Release(void)
+{
+    // lock-free readers may still be looking at the node
+    if(Cold()->RefCount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        EpochRetire(this, Delete);
+}
+
+int VirtualFile::GetLockClass(void)
+{
+    return (mMode.load(std::memory_order_relaxed) & S_IFDIR) != 0 ? VIRTUALFILE_LOCK_DIRECTORY : VIRTUALFILE_LOCK_FILE;
+}
+
+void VirtualFile::LockShared(void)
+{
+    CountedLockShared(Cold()->Lock, GetLockClass());
+}
+
+void VirtualFile::UnlockShared(void)
+{
+    CountedUnlockShared(Cold()->Lock);
+}
+
+void VirtualFile::LockExclusive(void)
+{
+    CountedLock(Cold()->Lock, GetLockClass());
+}
+
+void VirtualFile::UnlockExclusive(void)
+{
+    CountedUnlock(Cold()->Lock);
+}
+
+bool VirtualFile::IsAncestorOf(VirtualFile* vfile)
+{
+    // the parent chain only changes under mRenameLock; an unlinked
+    // ancestor may be retired meanwhile, so walk it in a read section
+    EpochGuard guard;
+
+    for(VirtualFile* p = vfile->get_Parent(); p != NULL; p = p->get_Parent())
+    {
+        if(p == this)
+            return true;
+    }
+    return false;
+}
+
+void VirtualFile::LockRename(VirtualFile* OldDir, VirtualFile* NewDir)
+{
+    // every rename takes mRenameLock, as it also guards mRenameSeq
+    CountedLock(mRenameLock, VIRTUALFILE_LOCK_RENAME);
+
+    if(OldDir == NewDir)
+        OldDir->LockExclusive();
+    else
+    {
+        VirtualFile* first = OldDir, * second = NewDir;
+        if(NewDir->IsAncestorOf(OldDir) ||
+            (!OldDir->IsAncestorOf(NewDir) && NewDir < OldDir))
+        {
+            first = NewDir;
+            second = OldDir;
+        }
+        first->LockExclusive();
+        second->LockExclusive();
+    }
+
+    mRenameSeq.store(mRenameSeq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+}
+
+void VirtualFile::UnlockRename(VirtualFile* OldDir, VirtualFile* NewDir)
+{
+    mRenameSeq.store(mRenameSeq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+
+    if(OldDir != NewDir)
+        NewDir->UnlockExclusive();
+    OldDir->UnlockExclusive();
+    CountedUnlock(mRenameLock);
+}
+
+void VirtualFile::BlockRenames(void)
+{
+    CountedLock(mRenameLock, VIRTUALFILE_LOCK_RENAME);
+}
+
+void VirtualFile::UnblockRenames(void)
+{
+    CountedUnlock(mRenameLock);
+}
+
+unsigned VirtualFile::RenameSeqBegin(void)
+{
+    unsigned seq;
+    while((seq = mRenameSeq.load(std::memory_order_acquire)) & 1)
+        std::this_thread::yield();
+    return seq;
+}
+
+bool VirtualFile::RenameSeqRetry(unsigned Seq)
+{
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return mRenameSeq.load(std::memory_order_relaxed) != Seq;
+}
+
+void VirtualFile::BeginAttributesUpdate(void)
+{
+    // writes that extend the file update the size under a shared lock,
+    // so the odd value is claimed rather than just stored
+    unsigned seq = mAttributesSeq.load(std::memory_order_relaxed);
+    for(;;)
+    {
+        if(seq & 1)
+        {
+            std::this_thread::yield();
+            seq = mAttributesSeq.load(std::memory_order_relaxed);
+        }
+        else if(mAttributesSeq.compare_exchange_weak(seq, seq + 1, std::memory_order_acquire))
+            break;
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+}
+
+void VirtualFile::EndAttributesUpdate(void)
+{
+    mAttributesSeq.store(mAttributesSeq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+void VirtualFile::GetAttributes(VIRTUALFILE_ATTRIBUTES* Attributes)
+{
+    unsigned seq;
+    do
+    {
+        while((seq = mAttributesSeq.load(std::memory_order_acquire)) & 1)
+            std::this_thread::yield();
+
+        Attributes->Size = mSize.load(std::memory_order_relaxed);
+        Attributes->Mode = mMode.load(std::memory_order_relaxed);
+        Attributes->Uid = mUid.load(std::memory_order_relaxed);
+        Attributes->Gid = mGid.load(std::memory_order_relaxed);
+        Attributes->CreationTime = mCreationTime.load(std::memory_order_relaxed);
+        Attributes->LastAccessTime = mLastAccessTime.load(std::memory_order_relaxed);
+        Attributes->LastWriteTime = mLastWriteTime.load(std::memory_order_relaxed);
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+    } while(mAttributesSeq.load(std::memory_order_relaxed) != seq);
+}
+
+bool VirtualFile::set_AllocationSize(int64 Value)
+{
+    int64 count = (Value + VIRTUALFILE_PAGE_SIZE - 1) / VIRTUALFILE_PAGE_SIZE;
+    int64 used = (mSize.load(std::memory_order_relaxed) + VIRTUALFILE_PAGE_SIZE - 1) / VIRTUALFILE_PAGE_SIZE;
+
+    // a small file only grows its buffer
+    if(ReserveSmall(Value))
+        return true;
+
+    // the pages reserved before a failure stay with the file
+    for(int64 i = 0; i < count; i++)
+        if(GetPage(i, true) == NULL)
+            return false;
+    FreePages(count > used ? count : used);
+    return true;
+}
+
+int64 VirtualFile::get_AllocationSize(void)
+{
+    return Cold()->AllocationSize.load(std::memory_order_relaxed);
+}
+
+void VirtualFile::set_Size(int64 Value)
+{
+    if(Value < mSize.load(std::memory_order_relaxed))
+    {
+        // the tail of the last page must read as zeros if the file grows again
+        int64 tail = Value % VIRTUALFILE_PAGE_SIZE;
+        char* page;
+
+        FreePages((Value + VIRTUALFILE_PAGE_SIZE - 1) / VIRTUALFILE_PAGE_SIZE);
+        if(tail != 0 && (page = GetPage(Value / VIRTUALFILE_PAGE_SIZE, false)) != NULL)
+            memset(page + tail, 0, VIRTUALFILE_PAGE_SIZE - tail);
+
+        PVIRTUALFILE_DATA data = GetData(false);
+        PVIRTUALFILE_SMALL_DATA small = data ? data->Small.load(std::memory_order_relaxed) : NULL;
+        if(small && Value < small->Capacity)
+            memset(SmallBytes(small) + Value, 0, (size_t)(small->Capacity - Value));
+    }
+
+    BeginAttributesUpdate();
+    mSize.store(Value, std::memory_order_relaxed);
+    EndAttributesUpdate();
+}
+
+int64 VirtualFile::get_Size(void)
+{
+    return mSize.load(std::memory_order_relaxed);
+}
+
+nfs_char *VirtualFile::get_Name(void)
+{
+    // NULL only for a node created without memory for its name
+    return mName.load(std::memory_order_acquire);
+}
+
+int64 VirtualFile::get_CreationTime(void)
+{
+    return mCreationTime.load(std::memory_order_relaxed);
+}
+
+void VirtualFile::set_CreationTime(int64 Value)
+{
+    BeginAttributesUpdate();
+    mCreationTime.store(Value, std::memory_order_relaxed);
+    EndAttributesUpdate();
+}
+
+int64 VirtualFile::get_LastAccessTime(void)
+{
+    return mLastAccessTime.load(std::memory_order_relaxed);
+}
+void VirtualFile::set_LastAccessTime(int64 Value)
+{
+    BeginAttributesUpdate();
+    mLastAccessTime.store(Value, std::memory_order_relaxed);
+    EndAttributesUpdate();
+}
+
+int64 VirtualFile::get_LastWriteTime(void)
+{
+    return mLastWriteTime.load(std::memory_order_relaxed);
+}
+void VirtualFile::set_LastWriteTime(int64 Value)
+{
+    BeginAttributesUpdate();
+    mLastWriteTime.store(Value, std::memory_order_relaxed);
+    EndAttributesUpdate();
+}
+
+int VirtualFile::get_Mode(void)
+{
+    return mMode.load(std::memory_order_relaxed);
+}
+
+void VirtualFile::set_Mode(int Value)
+{
+    BeginAttributesUpdate();
+    mMode.store(Value, std::memory_order_relaxed);
+    EndAttributesUpdate();
+}
+
+int VirtualFile::get_Uid(void)
+{
+    return mUid.load(std::memory_order_relaxed);
+}
+
+void VirtualFile::set_Uid(int Value)
+{
+    BeginAttributesUpdate();
+    mUid.store(Value, std::memory_order_relaxed);
+    EndAttributesUpdate();
+}
+
+int VirtualFile::get_Gid(void)
+{
+    return mGid.load(std::memory_order_relaxed);
+}
+
+void VirtualFile::set_Gid(int Value)
+{
+    BeginAttributesUpdate();
+    mGid.store(Value, std::memory_order_relaxed);
+    EndAttributesUpdate();
+}
+
+VirtualFile* VirtualFile::get_Parent(void)
+{
+    return Cold()->Parent.load(std::memory_order_acquire);
+}
+
+void VirtualFile::set_Parent(VirtualFile* Value)
+{
+    Cold()->Parent.store(Value, std::memory_order_release);
+}
+
+bool VirtualFile::Rename(const nfs_char *NewName)
+{
+    assert(NewName);
+
+    nfs_char* name = NameAlloc(NewName);
+    if(name == NULL)
+        return false;
+
+    // lock-free readers may still compare against the old name
+    nfs_char* oldname = mName.exchange(name, std::memory_order_acq_rel);
+    if(oldname)
+        EpochRetire(oldname, NameFree);
+    return true;
+}
+
+void VirtualFile::AddFile(VirtualFile* vfile)
+{
+    // the node is locked exclusively, so only one thread creates the list
+    DirectoryEnumerationContext* children = Cold()->Children.load(std::memory_order_relaxed);
+    if(children == NULL)
+    {
+        children = new DirectoryEnumerationContext();
+        Cold()->Children.store(children, std::memory_order_release);
+    }
+
+    // set the parent first, the node is reachable once it is in the list
+    vfile->set_Parent(this);
+    children->AddFile(vfile);
+
+    // created, or renamed into another directory
+    if(g_ExpiryEnabled.load(std::memory_order_relaxed) && (vfile->get_Mode() & S_IFDIR) == 0)
+        vfile->ScheduleExpiry(this);
+}
+
+void VirtualFile::Remove(void)
+{
+    VirtualFile* parent = get_Parent();
+    assert(parent);
+    parent->get_Context()->Remove(this);
+    set_Parent(NULL);
+}
+
+DirectoryEnumerationContext* VirtualFile::get_Context(void)
+{
+    // constructed on first use, get_Context may run before the statics of this file
+    static DirectoryEnumerationContext noChildren;
+    DirectoryEnumerationContext* children = Cold()->Children.load(std::memory_order_acquire);
+
+    return children ? children : &noChildren;
+}
+
+PVIRTUALFILE_DATA VirtualFile::GetData(bool Create)
+{
+    PVIRTUALFILE_DATA data = Cold()->Data.load(std::memory_order_acquire), expected = NULL;
+    if(data || !Create)
+        return data;
+
+    // the first reads and writes of a file may race to create it
+    data = new (g_DataSlab->Alloc()) VIRTUALFILE_DATA;
+    data->Pages.store(NULL, std::memory_order_relaxed);
+    data->Small.store(NULL, std::memory_order_relaxed);
+    data->ReadOps.store(0, std::memory_order_relaxed);
+    data->ReadBytes.store(0, std::memory_order_relaxed);
+    data->WriteOps.store(0, std::memory_order_relaxed);
+    data->WriteBytes.store(0, std::memory_order_relaxed);
+    data->SequentialOps.store(0, std::memory_order_relaxed);
+    data->StridedOps.store(0, std::memory_order_relaxed);
+    data->RandomOps.store(0, std::memory_order_relaxed);
+    data->LastIoTime.store(0, std::memory_order_relaxed);
+    data->LastIoOffset.store(0, std::memory_order_relaxed);
+    data->LastIoEnd.store(0, std::memory_order_relaxed);
+    data->LastIoStride.store(0, std::memory_order_relaxed);
+    data->IoBatched.store(false, std::memory_order_relaxed);
+
+    if(!Cold()->Data.compare_exchange_strong(expected, data, std::memory_order_acq_rel, std::memory_order_acquire))
+    {
+        data->~_VIRTUALFILE_DATA();
+        g_DataSlab->Free(data);
+        data = expected;
+    }
+    return data;
+}
+
+void VirtualFile::DeletePageTable(void* Table)
+{
+    PVIRTUALFILE_PAGE_TABLE table = (PVIRTUALFILE_PAGE_TABLE)Table;
+    delete[] table->Pages;
+    delete table;
+}
+
+PVIRTUALFILE_PAGE_TABLE VirtualFile::ReservePages(PVIRTUALFILE_DATA Data, int64 Count)
+{
+    // Data->PagesLock must be held
+    PVIRTUALFILE_PAGE_TABLE table = Data->Pages.load(std::memory_order_relaxed), grown;
+    int64 i;
+
+    if(table && table->Count >= Count)
+        return table;
+
+    grown = new VIRTUALFILE_PAGE_TABLE;
+    grown->Count = table ? table->Count * 2 : 16;
+    if(grown->Count < Count)
+        grown->Count = Count;
+    grown->Pages = new std::atomic<char*>[(size_t)grown->Count];
+
+    for(i = 0; table && i < table->Count; i++)
+        grown->Pages[i].store(table->Pages[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+    for(; i < grown->Count; i++)
+        grown->Pages[i].store(NULL, std::memory_order_relaxed);
+
+    // readers of the old table may still be using it
+    Data->Pages.store(grown, std::memory_order_release);
+    if(table)
+        EpochRetire(table, DeletePageTable);
+    return grown;
+}
+
+char* VirtualFile::GetPage(int64 Index, bool Allocate)
+{
+    PVIRTUALFILE_DATA data = GetData(Allocate);
+    PVIRTUALFILE_PAGE_TABLE table;
+    char* page = NULL;
+
+    if(data == NULL)
+        return NULL;
+
+    {
+        EpochGuard guard;
+        table = data->Pages.load(std::memory_order_acquire);
+        if(table && Index < table->Count)
+            page = table->Pages[Index].load(std::memory_order_acquire);
+    }
+    if(page || !Allocate)
+        return page;
+
+    // pages are only ever freed with the file locked exclusively, or by
+    // compaction with their range locked, so the page stays valid after the
+    // read section; allocation is serialized
+    CountedLockGuard<std::mutex> lock(data->PagesLock, VIRTUALFILE_LOCK_PAGES);
+    if(!MoveSmallToPages(data))
+        return NULL;
+    table = ReservePages(data, Index + 1);
+    page = table->Pages[Index].load(std::memory_order_relaxed);
+    if(page == NULL)
+    {
+        page = PageAlloc(this, Index);
+        if(page == NULL)
+            return NULL;
+        table->Pages[Index].store(page, std::memory_order_release);
+        Cold()->AllocationSize.fetch_add(VIRTUALFILE_PAGE_SIZE, std::memory_order_relaxed);
+        mPageBytes.fetch_add(VIRTUALFILE_PAGE_SIZE, std::memory_order_relaxed);
+    }
+    return page;
+}
+
+void VirtualFile::FreePages(int64 First)
+{
+    PVIRTUALFILE_DATA data = GetData(false);
+    if(data == NULL)
+        return;
+
+    CountedLockGuard<std::mutex> lock(data->PagesLock, VIRTUALFILE_LOCK_PAGES);
+    PVIRTUALFILE_PAGE_TABLE table = data->Pages.load(std::memory_order_relaxed);
+
+    for(int64 i = First; table && i < table->Count; i++)
+    {
+        char* page = table->Pages[i].exchange(NULL, std::memory_order_relaxed);
+        if(page)
+        {
+            PageFree(page);
+            Cold()->AllocationSize.fetch_sub(VIRTUALFILE_PAGE_SIZE, std::memory_order_relaxed);
+            mPageBytes.fetch_sub(VIRTUALFILE_PAGE_SIZE, std::memory_order_relaxed);
+        }
+    }
+
+    // an empty file starts over, and is small again until it grows
+    if(First == 0)
+    {
+        PVIRTUALFILE_SMALL_DATA small = data->Small.exchange(NULL, std::memory_order_relaxed);
+        if(small)
+        {
+            Cold()->AllocationSize.fetch_sub(small->Capacity, std::memory_order_relaxed);
+            mPageBytes.fetch_sub(small->Capacity, std::memory_order_relaxed);
+            EpochRetire(small, SmallFree);
+        }
+        if(table)
+        {
+            data->Pages.store(NULL, std::memory_order_relaxed);
+            EpochRetire(table, DeletePageTable);
+        }
+    }
+}
+
+void VirtualFile::GrowSmall(PVIRTUALFILE_DATA Data, int64 Size)
+{
+    // Data->PagesLock must be held
+    PVIRTUALFILE_SMALL_DATA small = Data->Small.load(std::memory_order_relaxed);
+    PVIRTUALFILE_SMALL_DATA grown = SmallAlloc(Size);
+    int64 added = grown->Capacity;
+
+    if(small)
+    {
+        memcpy(SmallBytes(grown), SmallBytes(small), (size_t)small->Capacity);
+        added -= small->Capacity;
+    }
+    Cold()->AllocationSize.fetch_add(added, std::memory_order_relaxed);
+    mPageBytes.fetch_add(added, std::memory_order_relaxed);
+
+    // readers of other ranges may still be using the old buffer
+    Data->Small.store(grown, std::memory_order_release);
+    if(small)
+        EpochRetire(small, SmallFree);
+}
+
+bool VirtualFile::MoveSmallToPages(PVIRTUALFILE_DATA Data)
+{
+    // Data->PagesLock must be held
+    PVIRTUALFILE_SMALL_DATA small = Data->Small.load(std::memory_order_relaxed);
+    if(small == NULL)
+        return true;
+
+    // the file stays small if there is no page for it
+    char* page = PageAlloc(this, 0);
+    if(page == NULL)
+        return false;
+    PVIRTUALFILE_PAGE_TABLE table = ReservePages(Data, 1);
+    memcpy(page, SmallBytes(small), (size_t)small->Capacity);
+    table->Pages[0].store(page, std::memory_order_release);
+    Cold()->AllocationSize.fetch_add(VIRTUALFILE_PAGE_SIZE - small->Capacity, std::memory_order_relaxed);
+    mPageBytes.fetch_add(VIRTUALFILE_PAGE_SIZE - small->Capacity, std::memory_order_relaxed);
+
+    // the page is published first, so a reader that finds no buffer finds the page
+    Data->Small.store(NULL, std::memory_order_release);
+    EpochRetire(small, SmallFree);
+    return true;
+}
+
+bool VirtualFile::MovePage(int64 Index, char* Page)
+{
+    // the caller holds the file shared, so truncation cannot free the page
+    // now; it may have before, which the check below finds
+    PVIRTUALFILE_DATA data = GetData(false);
+    PVIRTUALFILE_PAGE_TABLE table;
+    char* page;
+    bool moved = false;
+
+    if(data == NULL)
+        return false;
+
+    // readers and writers of the page hold its range
+    data->RangeLock.Lock(Index * VIRTUALFILE_PAGE_SIZE, VIRTUALFILE_PAGE_SIZE, true);
+    page = PageAlloc(this, Index);
+    if(page != NULL)
+    {
+        CountedLockGuard<std::mutex> lock(data->PagesLock, VIRTUALFILE_LOCK_PAGES);
+        table = data->Pages.load(std::memory_order_relaxed);
+        if(table && Index < table->Count && table->Pages[Index].load(std::memory_order_relaxed) == Page)
+        {
+            memcpy(page, Page, VIRTUALFILE_PAGE_SIZE);
+            table->Pages[Index].store(page, std::memory_order_release);
+            moved = true;
+        }
+    }
+    data->RangeLock.Unlock(Index * VIRTUALFILE_PAGE_SIZE, VIRTUALFILE_PAGE_SIZE, true);
+
+    if(page != NULL)
+        PageFree(moved ? Page : page);
+    return moved;
+}
+
+int64 VirtualFile::CompactData(int64 MaxBytes)
+{
+    PageArena* arena = g_DataArena.load(std::memory_order_acquire);
+    std::vector<PAGEARENA_PAGE> pages;
+    int64 moved = 0;
+
+    if(arena == NULL || !arena->BeginCompaction((int)(MaxBytes / VIRTUALFILE_PAGE_SIZE), PinFile, pages))
+        return -1;
+
+    for(size_t i = 0; i < pages.size(); i++)
+    {
+        VirtualFile* vfile = (VirtualFile*)pages[i].Owner;
+
+        vfile->LockShared();
+        if(vfile->MovePage(pages[i].Index, (char*)pages[i].Page))
+            moved += VIRTUALFILE_PAGE_SIZE;
+        vfile->UnlockShared();
+        vfile->Release();
+    }
+
+    arena->EndCompaction();
+    return moved;
+}
+
+bool VirtualFile::ReserveSmall(int64 Size)
 {
+    if(Size <= 0 || Size > g_SmallFileLimit.load(std::memory_order_relaxed))
+        return false;
+
+    PVIRTUALFILE_DATA data = GetData(true);
+    CountedLockGuard<std::mutex> lock(data->PagesLock, VIRTUALFILE_LOCK_PAGES);
+    PVIRTUALFILE_SMALL_DATA small = data->Small.load(std::memory_order_relaxed);
 
+    if(data->Pages.load(std::memory_order_relaxed) != NULL)
+        return false;
+    if(small == NULL || small->Capacity < Size)
+        GrowSmall(data, Size);
+    return true;
 }
 
-VirtualFile::VirtualFile(const nfs_char *Name)
-    :mStream(NULL)
-    ,mSize(0)
-    ,mAllocationSize(0)
-    ,mMode(0)
-    ,mParent(NULL)
-    ,mName(NULL)
+bool VirtualFile::WriteSmall(PVIRTUALFILE_DATA Data, const void* Buffer, int64 Position, int64 Count)
 {
-    Initializer(Name);
+    int64 end = Position + Count;
+
+    // a write past the limit moves the data to pages in GetPage
+    if(end > g_SmallFileLimit.load(std::memory_order_relaxed) || Data->Pages.load(std::memory_order_acquire) != NULL)
+        return false;
+
+    // the buffer may be copied by a write of another range, so the bytes
+    // are written with the lock held
+    CountedLockGuard<std::mutex> lock(Data->PagesLock, VIRTUALFILE_LOCK_PAGES);
+    if(Data->Pages.load(std::memory_order_relaxed) != NULL)
+        return false;
+
+    PVIRTUALFILE_SMALL_DATA small = Data->Small.load(std::memory_order_relaxed);
+    if(small == NULL || small->Capacity < end)
+    {
+        GrowSmall(Data, end);
+        small = Data->Small.load(std::memory_order_relaxed);
+    }
+    memcpy(SmallBytes(small) + Position, Buffer, (size_t)Count);
+    return true;
 }
 
-VirtualFile::VirtualFile(const nfs_char *Name, int Mode)
-    :mStream(NULL)
-    ,mSize(0)
-    ,mAllocationSize(0)
-    ,mMode(Mode)
-    ,mParent(NULL)
-    ,mName(NULL)
+bool VirtualFile::ReadSmall(PVIRTUALFILE_DATA Data, void* Buffer, int64 Position, int64 Count)
 {
-    Initializer(Name);
+    // the range is locked, so the bytes read cannot change even if the
+    // buffer is replaced meanwhile
+    EpochGuard guard;
+    PVIRTUALFILE_SMALL_DATA small = Data->Small.load(std::memory_order_acquire);
+    int64 count = 0;
+
+    if(small == NULL)
+        return false;
+
+    if(Position < small->Capacity)
+        count = small->Capacity - Position < Count ? small->Capacity - Position : Count;
+    if(count > 0)
+        memcpy(Buffer, SmallBytes(small) + Position, (size_t)count);
+    memset((char*)Buffer + count, 0, (size_t)(Count - count));
+    return true;
 }
 
-VirtualFile::VirtualFile(const nfs_char *Name, int Mode, int InitialSize)
-    :mStream(NULL)
-    ,mSize(0)
-    ,mAllocationSize(0)
-    ,mMode(Mode)
-    ,mParent(NULL)
-    ,mName(NULL)
+void VirtualFile::SetSmallFileLimit(int Bytes)
 {
-  mStream = malloc(InitialSize);
-  set_AllocationSize(InitialSize);
-  Initializer(Name);
+    if(Bytes < 0)
+        Bytes = 0;
+    if(Bytes > VIRTUALFILE_SMALL_MAX)
+        Bytes = VIRTUALFILE_SMALL_MAX;
+    g_SmallFileLimit.store(Bytes, std::memory_order_relaxed);
 }
 
-VirtualFile::~VirtualFile()
+bool VirtualFile::SetDataArena(bool Enable)
 {
-    if(mStream)
+    std::lock_guard<std::mutex> lock(g_DataArenaLock);
+    PageArena* arena = g_DataArena.load(std::memory_order_relaxed);
+    PAGEARENA_STATS stats;
+
+    if(!Enable)
     {
-        free(mStream);
+        g_UseDataArena.store(false, std::memory_order_relaxed);
+        return true;
     }
-    if(mName)
+    if(arena == NULL)
     {
-        free(mName);
+        arena = new PageArena(VIRTUALFILE_PAGE_SIZE);
+        g_DataArena.store(arena, std::memory_order_release);
     }
+    arena->GetStats(&stats);
+    g_UseDataArena.store(stats.Available, std::memory_order_release);
+    return stats.Available;
+}
+
+bool VirtualFile::GetDataArenaStats(PAGEARENA_STATS* Stats)
+{
+    PageArena* arena = g_DataArena.load(std::memory_order_acquire);
+
+    memset(Stats, 0, sizeof(PAGEARENA_STATS));
+    if(arena == NULL)
+        return false;
+    arena->GetStats(Stats);
+    return true;
+}
+
+int VirtualFile::GetSmallFileLimit(void)
+{
+    return g_SmallFileLimit.load(std::memory_order_relaxed);
 }
 
-void VirtualFile::set_AllocationSize(int64 Value)
+bool VirtualFile::Write(void *WriteBuf, int64 Position, int64 BytesToWrite, int64 *BytesWritten)
 {
-    if(mAllocationSize != Value) {
+    assert(WriteBuf);
+
+    int64 end = Position + BytesToWrite;
+    int64 offset = Position;
+    bool written = true;
 
-        mStream = realloc(mStream, (size_t)Value);
-        if(Value > 0) {
-            assert(mStream);
+    *BytesWritten = 0;
+    if(BytesToWrite <= 0)
+        return true;
+
+    PROBE3(virtualfile, write_entry, (const void*)get_Name(), Position, BytesToWrite);
+    PVIRTUALFILE_DATA data = GetData(true);
+    data->RangeLock.Lock(Position, BytesToWrite, true);
+
+    // the data of a small file is written in one piece
+    if(WriteSmall(data, WriteBuf, Position, BytesToWrite))
+        offset = end;
+
+    while(offset < end)
+    {
+        int64 inpage = offset % VIRTUALFILE_PAGE_SIZE;
+        int64 count = VIRTUALFILE_PAGE_SIZE - inpage < end - offset ? VIRTUALFILE_PAGE_SIZE - inpage : end - offset;
+
+        char* page = GetPage(offset / VIRTUALFILE_PAGE_SIZE, true);
+
+        // out of memory, the pages written so far are kept
+        if(page == NULL)
+        {
+            written = false;
+            break;
         }
-        mAllocationSize = Value;
+        memcpy(page + inpage, (char*)WriteBuf + (offset - Position), (size_t)count);
+        offset += count;
     }
+
+    // concurrent writers past the end only ever move the size forward
+    if(mSize.load(std::memory_order_relaxed) < offset)
+    {
+        BeginAttributesUpdate();
+        if(mSize.load(std::memory_order_relaxed) < offset)
+            mSize.store(offset, std::memory_order_relaxed);
+        EndAttributesUpdate();
+    }
+
+    data->RangeLock.Unlock(Position, BytesToWrite, true);
+    *BytesWritten = offset - Position;
+    PROBE4(virtualfile, write_return, (const void*)get_Name(), Position, BytesToWrite, *BytesWritten);
+
+    AccountIo(Position, BytesToWrite, *BytesWritten, true);
+    return written;
 }
 
-int64 VirtualFile::get_AllocationSize(void)
+void VirtualFile::Read(void *ReadBuf, int64 Position, int64 BytesToRead, int64 *BytesRead)
 {
-    return mAllocationSize;
+    assert(ReadBuf);
+    int64 MaxRead, size, offset = Position;
+
+    *BytesRead = 0;
+    if(BytesToRead <= 0)
+        return;
+
+    PROBE3(virtualfile, read_entry, (const void*)get_Name(), Position, BytesToRead);
+    PVIRTUALFILE_DATA data = GetData(true);
+    data->RangeLock.Lock(Position, BytesToRead, false);
+
+    size = mSize.load(std::memory_order_relaxed);
+    if (Position > size)
+        MaxRead = 0;
+    else
+        MaxRead = (size - Position) < BytesToRead ? size - Position : BytesToRead;
+
+    if(MaxRead > 0 && ReadSmall(data, ReadBuf, Position, MaxRead))
+        offset = Position + MaxRead;
+
+    while(offset < Position + MaxRead)
+    {
+        int64 inpage = offset % VIRTUALFILE_PAGE_SIZE;
+        int64 count = VIRTUALFILE_PAGE_SIZE - inpage < Position + MaxRead - offset ? VIRTUALFILE_PAGE_SIZE - inpage : Position + MaxRead - offset;
+        char* page = GetPage(offset / VIRTUALFILE_PAGE_SIZE, false);
+
+        // pages that were never written read as zeros
+        if(page)
+            memcpy((char*)ReadBuf + (offset - Position), page + inpage, (size_t)count);
+        else
+            memset((char*)ReadBuf + (offset - Position), 0, (size_t)count);
+        offset += count;
+    }
+
+    data->RangeLock.Unlock(Position, BytesToRead, false);
+    *BytesRead = MaxRead;
+    PROBE4(virtualfile, read_return, (const void*)get_Name(), Position, BytesToRead, MaxRead);
+
+    AccountIo(Position, BytesToRead, MaxRead, false);
 }
 
-void VirtualFile::set_Size(int64 Value)
+// seconds since the epoch at the resolution of the timer tick, which is
+// cheaper to read than time() where the platform has such a clock
+static int64 CoarseTime(void)
 {
-    mSize = Value;
+#if defined CLOCK_REALTIME_COARSE
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+    return (int64)now.tv_sec;
+#else
+    return (int64)time(NULL);
+#endif
 }
 
-int64 VirtualFile::get_Size(void)
+// sequential when the request starts near the end of the previous one,
+// which tolerates reordered readahead, strided when it keeps the distance
+// of the previous one
+static void CountIoPattern(VIRTUALFILE_IO_STATS* Counts, int64 Position, int64 Length,
+    int64 LastOffset, int64 LastEnd, int64 LastStride)
 {
-    return mSize;
+    int64 window = Length * VIRTUALFILE_IO_REORDER;
+    int64 stride = Position - LastOffset;
+
+    if (Position >= LastEnd - window && Position <= LastEnd + window)
+        Counts->SequentialOps++;
+    else if (stride != 0 && stride == LastStride)
+        Counts->StridedOps++;
+    else
+        Counts->RandomOps++;
 }
 
-nfs_char *VirtualFile::get_Name(void)
+void VirtualFile::AccountIo(int64 Position, int64 Length, int64 Bytes, bool Write)
 {
-    assert(mName);
-    return (mName);
+    // a read or write created the data of the file
+    PVIRTUALFILE_IO_BATCH batch = GetThreadIoBatch();
+
+    LockIoBatch(batch);
+    if (batch->File != this)
+    {
+        if (batch->File)
+            FlushIoBatch(batch);
+        batch->File = this;
+
+        PVIRTUALFILE_DATA data = Cold()->Data.load(std::memory_order_acquire);
+        if (!data->IoBatched.load(std::memory_order_relaxed))
+            data->IoBatched.store(true, std::memory_order_relaxed);
+    }
+
+    // nothing of the file is shared here, the batch holds the previous request
+    if (batch->Ops == 0)
+    {
+        batch->FirstOffset = Position;
+        batch->FirstLength = Length;
+        batch->LastStride = 0;
+    }
+    else
+    {
+        CountIoPattern(&batch->Counts, Position, Length, batch->LastOffset, batch->LastEnd, batch->LastStride);
+        batch->LastStride = Position - batch->LastOffset;
+    }
+    batch->LastOffset = Position;
+    batch->LastEnd = Position + Length;
+
+    if (Write)
+    {
+        batch->Counts.WriteOps++;
+        batch->Counts.WriteBytes += Bytes;
+    }
+    else
+    {
+        batch->Counts.ReadOps++;
+        batch->Counts.ReadBytes += Bytes;
+    }
+    batch->Counts.LastAccess = CoarseTime();
+
+    if (++batch->Ops >= VIRTUALFILE_IO_BATCH_OPS)
+        FlushIoBatch(batch);
+    UnlockIoBatch(batch);
 }
 
-int64 VirtualFile::get_CreationTime(void)
+void VirtualFile::FlushIoBatch(PVIRTUALFILE_IO_BATCH Batch)
 {
-    return (mCreationTime);
+    // the batch is locked, and its file is alive as long as it is linked to the batch
+    PVIRTUALFILE_DATA data = Batch->File->Cold()->Data.load(std::memory_order_acquire);
+    int64 lastOffset = data->LastIoOffset.load(std::memory_order_relaxed);
+
+    // the first request follows the last one flushed for the file, which
+    // may come from another thread; concurrent flushes of one file may
+    // overwrite each other here, which only blurs the pattern
+    CountIoPattern(&Batch->Counts, Batch->FirstOffset, Batch->FirstLength, lastOffset,
+        data->LastIoEnd.load(std::memory_order_relaxed), data->LastIoStride.load(std::memory_order_relaxed));
+    if (Batch->Ops == 1)
+        Batch->LastStride = Batch->FirstOffset - lastOffset;
+    data->LastIoOffset.store(Batch->LastOffset, std::memory_order_relaxed);
+    data->LastIoEnd.store(Batch->LastEnd, std::memory_order_relaxed);
+    data->LastIoStride.store(Batch->LastStride, std::memory_order_relaxed);
+
+    data->ReadOps.fetch_add(Batch->Counts.ReadOps, std::memory_order_relaxed);
+    data->ReadBytes.fetch_add(Batch->Counts.ReadBytes, std::memory_order_relaxed);
+    data->WriteOps.fetch_add(Batch->Counts.WriteOps, std::memory_order_relaxed);
+    data->WriteBytes.fetch_add(Batch->Counts.WriteBytes, std::memory_order_relaxed);
+    data->SequentialOps.fetch_add(Batch->Counts.SequentialOps, std::memory_order_relaxed);
+    data->StridedOps.fetch_add(Batch->Counts.StridedOps, std::memory_order_relaxed);
+    data->RandomOps.fetch_add(Batch->Counts.RandomOps, std::memory_order_relaxed);
+    if (data->LastIoTime.load(std::memory_order_relaxed) < Batch->Counts.LastAccess)
+        data->LastIoTime.store(Batch->Counts.LastAccess, std::memory_order_relaxed);
+
+    Batch->File = NULL;
+    Batch->Ops = 0;
+    memset(&Batch->Counts, 0, sizeof(Batch->Counts));
 }
 
-void VirtualFile::set_CreationTime(int64 Value)
+void VirtualFile::FlushIoStats(void)
 {
-    mCreationTime = Value;
+    for (PVIRTUALFILE_IO_BATCH batch = g_IoBatches.load(std::memory_order_acquire); batch != NULL; batch = batch->Next)
+    {
+        LockIoBatch(batch);
+        if (batch->File)
+            FlushIoBatch(batch);
+        UnlockIoBatch(batch);
+    }
 }
 
-int64 VirtualFile::get_LastAccessTime(void)
+void VirtualFile::ForgetIoBatches(void)
 {
-    return (mLastAccessTime);
+    // the file has no references left, so no thread can count a new request
+    // of it; the requests still batched are dropped with the file
+    PVIRTUALFILE_DATA data = Cold()->Data.load(std::memory_order_relaxed);
+    if (data == NULL || !data->IoBatched.load(std::memory_order_relaxed))
+        return;
+
+    for (PVIRTUALFILE_IO_BATCH batch = g_IoBatches.load(std::memory_order_acquire); batch != NULL; batch = batch->Next)
+    {
+        LockIoBatch(batch);
+        if (batch->File == this)
+        {
+            batch->File = NULL;
+            batch->Ops = 0;
+            memset(&batch->Counts, 0, sizeof(batch->Counts));
+        }
+        UnlockIoBatch(batch);
+    }
 }
-void VirtualFile::set_LastAccessTime(int64 Value)
+
+void VirtualFile::GetIoStats(VIRTUALFILE_IO_STATS* Stats)
 {
-    mLastAccessTime = Value;
+    PVIRTUALFILE_DATA data = Cold()->Data.load(std::memory_order_acquire);
+
+    memset(Stats, 0, sizeof(VIRTUALFILE_IO_STATS));
+    if (data)
+    {
+        Stats->ReadOps = data->ReadOps.load(std::memory_order_relaxed);
+        Stats->ReadBytes = data->ReadBytes.load(std::memory_order_relaxed);
+        Stats->WriteOps = data->WriteOps.load(std::memory_order_relaxed);
+        Stats->WriteBytes = data->WriteBytes.load(std::memory_order_relaxed);
+        Stats->SequentialOps = data->SequentialOps.load(std::memory_order_relaxed);
+        Stats->StridedOps = data->StridedOps.load(std::memory_order_relaxed);
+        Stats->RandomOps = data->RandomOps.load(std::memory_order_relaxed);
+        Stats->LastAccess = data->LastIoTime.load(std::memory_order_relaxed);
+    }
+
+    if (Stats->SequentialOps + Stats->StridedOps + Stats->RandomOps == 0)
+        Stats->Pattern = VIRTUALFILE_ACCESS_NONE;
+    else if (Stats->SequentialOps >= Stats->StridedOps && Stats->SequentialOps >= Stats->RandomOps)
+        Stats->Pattern = VIRTUALFILE_ACCESS_SEQUENTIAL;
+    else if (Stats->StridedOps >= Stats->RandomOps)
+        Stats->Pattern = VIRTUALFILE_ACCESS_STRIDED;
+    else
+        Stats->Pattern = VIRTUALFILE_ACCESS_RANDOM;
 }
 
-int64 VirtualFile::get_LastWriteTime(void)
+void VirtualFile::Initializer(const nfs_char *Name)
 {
-    return (mLastWriteTime);
+    assert(Name);
+    assert(mName == NULL);
+
+    mCreationTime = 0;
+    mLastAccessTime = 0;
+    mLastWriteTime = 0;
+
+    // a node without a name is released by the caller
+    nfs_char* name = NameAlloc(Name);
+    if(name == NULL)
+        return;
+    mName.store(name, std::memory_order_release);
+    mFileCount.fetch_add(1, std::memory_order_relaxed);
 }
-void VirtualFile::set_LastWriteTime(int64 Value)
+
+int64 VirtualFile::GetLastUse(void)
 {
-    mLastWriteTime = Value;
+    PVIRTUALFILE_DATA data = GetData(false);
+    int64 last = FileTimeToUnixTime(get_LastAccessTime()), written = FileTimeToUnixTime(get_LastWriteTime());
+
+    // the handlers set the times on create and utimens only, reads and
+    // writes are found in the I/O statistics
+    if(written > last)
+        last = written;
+    if(data && data->LastIoTime.load(std::memory_order_relaxed) > last)
+        last = data->LastIoTime.load(std::memory_order_relaxed);
+    return last;
 }
 
-int VirtualFile::get_Mode(void)
+int64 VirtualFile::GetExpirySeconds(VirtualFile* Dir)
 {
-    return (mMode);
+    std::vector<const nfs_char*> names;
+    std::basic_string<nfs_char> path;
+    int64 seconds = 0;
+    size_t matched = 0;
+
+    // names of renamed ancestors are retired, not freed
+    {
+        EpochGuard guard;
+        for(VirtualFile* p = Dir; p->get_Parent() != NULL; p = p->get_Parent())
+            names.push_back(p->get_Name());
+        for(size_t i = names.size(); i > 0; i--)
+        {
+            path += (nfs_char)'/';
+            path += names[i - 1];
+        }
+    }
+
+    for(size_t i = 0; i < g_ExpiryPolicies.size(); i++)
+    {
+        const std::basic_string<nfs_char>& dir = g_ExpiryPolicies[i].Directory;
+        if(path.compare(0, dir.size(), dir) != 0 || (path.size() > dir.size() && path[dir.size()] != (nfs_char)'/'))
+            continue;
+        if(seconds == 0 || dir.size() >= matched)
+        {
+            seconds = g_ExpiryPolicies[i].Seconds;
+            matched = dir.size();
+        }
+    }
+    return seconds;
 }
 
-void VirtualFile::set_Mode(int Value)
+void VirtualFile::ScheduleExpiry(VirtualFile* Parent)
 {
-    mMode = Value;
+    int64 seconds = GetExpirySeconds(Parent);
+    int64 last = GetLastUse();
+
+    // a file whose times were never set is taken as new
+    if(last == 0)
+        last = (int64)time(NULL);
+
+    std::lock_guard<std::mutex> lock(g_ExpiryLock);
+    if(seconds > 0)
+        ExpirySet(this, last + seconds);
+    else
+        ExpiryErase(this);
 }
 
-int VirtualFile::get_Uid(void)
+bool VirtualFile::Expire(int64 Now)
 {
-  return (mUid);
+    VirtualFile* parent;
+    bool expired = false;
+
+    {
+        EpochGuard guard;
+        parent = get_Parent();
+        if(parent == NULL || !parent->TryAddRef())
+            return false;
+    }
+
+    // neither the file nor any directory above it moves meanwhile, so the
+    // policy found is the one of its path; a file moved away was scheduled
+    // again by AddFile
+    LockRename(parent, parent);
+    if(get_Parent() == parent)
+    {
+        int64 seconds = GetExpirySeconds(parent);
+        int64 last = GetLastUse();
+        if(seconds > 0 && last > 0 && last + seconds <= Now)
+        {
+            Remove();
+            Release();
+            expired = true;
+        }
+        else if(seconds > 0)
+        {
+            std::lock_guard<std::mutex> lock(g_ExpiryLock);
+            ExpirySet(this, (last > 0 ? last : Now) + seconds);
+        }
+    }
+    UnlockRename(parent, parent);
+    parent->Release();
+
+    if(expired)
+        g_ExpiredFiles.fetch_add(1, std::memory_order_relaxed);
+    return expired;
 }
 
-void VirtualFile::set_Uid(int Value)
+void VirtualFile::SetExpiryPolicy(const nfs_char* Directory, int64 Seconds)
 {
-  mUid = Value;
+    VIRTUALFILE_EXPIRY_POLICY policy;
+
+    policy.Directory = Directory;
+    while(!policy.Directory.empty() && policy.Directory[policy.Directory.size() - 1] == (nfs_char)'/')
+        policy.Directory.erase(policy.Directory.size() - 1);
+    policy.Seconds = Seconds;
+    if(Seconds <= 0)
+        return;
+
+    std::lock_guard<std::mutex> lock(g_ExpiryLock);
+    g_ExpiryPolicies.push_back(policy);
+    g_ExpiryEnabled.store(true, std::memory_order_relaxed);
 }
 
-int VirtualFile::get_Gid(void)
+int VirtualFile::ExpireFiles(int64 Now, int MaxFiles)
 {
-  return (mGid);
+    int expired = 0;
+
+    // the last reads and writes of the files are still in the thread batches
+    FlushIoStats();
+
+    for(int i = 0; i < MaxFiles; i++)
+    {
+        VirtualFile* vfile = NULL;
+        {
+            std::lock_guard<std::mutex> lock(g_ExpiryLock);
+            while(!g_ExpiryHeap.empty() && g_ExpiryHeap[0].Deadline <= Now)
+            {
+                // a node whose last reference is gone is being deleted
+                VirtualFile* first = g_ExpiryHeap[0].File;
+                ExpiryErase(first);
+                if(first->TryAddRef())
+                {
+                    vfile = first;
+                    break;
+                }
+            }
+        }
+        if(vfile == NULL)
+            break;
+
+        if(vfile->Expire(Now))
+            expired++;
+        vfile->Release();
+    }
+    return expired;
 }
 
-void VirtualFile::set_Gid(int Value)
+void VirtualFile::GetExpiryStats(VIRTUALFILE_EXPIRY_STATS* Stats)
 {
-  mGid = Value;
+    std::lock_guard<std::mutex> lock(g_ExpiryLock);
+
+    Stats->Policies = (int)g_ExpiryPolicies.size();
+    Stats->Tracked = (int64)g_ExpiryHeap.size();
+    Stats->Expired = g_ExpiredFiles.load(std::memory_order_relaxed);
 }
 
-VirtualFile* VirtualFile::get_Parent(void)
+int64 VirtualFile::GetFileCount(void)
 {
-    return (mParent);
+    return mFileCount.load(std::memory_order_relaxed);
 }
 
-void VirtualFile::set_Parent(VirtualFile* Value)
+int64 VirtualFile::GetPageBytes(void)
 {
-        mParent = Value;
+    return mPageBytes.load(std::memory_order_relaxed);
 }
 
-void VirtualFile::Rename(const nfs_char *NewName)
+bool VirtualFile::GetLockStats(int Class, VIRTUALFILE_LOCK_STATS* Stats)
 {
-    if(mName)
+    memset(Stats, 0, sizeof(VIRTUALFILE_LOCK_STATS));
+#ifdef VIRTUALFILE_LOCKSTATS
+    for(PVIRTUALFILE_LOCK_THREAD stats = g_LockStats.load(std::memory_order_acquire); stats != NULL; stats = stats->Next)
     {
-        free(mName);
-        mName = NULL;
+        VIRTUALFILE_LOCK_COUNTS* counts = &stats->Counts[Class];
+        int64 maxWait = counts->MaxWaitTime.load(std::memory_order_relaxed);
+        int64 maxHold = counts->MaxHoldTime.load(std::memory_order_relaxed);
+
+        Stats->Acquired += counts->Acquired.load(std::memory_order_relaxed);
+        Stats->Contended += counts->Contended.load(std::memory_order_relaxed);
+        Stats->WaitTime += counts->WaitTime.load(std::memory_order_relaxed);
+        Stats->HoldTime += counts->HoldTime.load(std::memory_order_relaxed);
+        if(Stats->MaxWaitTime < maxWait)
+            Stats->MaxWaitTime = maxWait;
+        if(Stats->MaxHoldTime < maxHold)
+            Stats->MaxHoldTime = maxHold;
     }
-    assert(NewName);
-    Initializer(NewName);
+    return true;
+#else
+    return false;
+#endif
 }
 
-void VirtualFile::AddFile(VirtualFile* vfile)
+void VirtualFile::ResetLockStats(void)
 {
-    get_Context()->AddFile(vfile);
-    vfile->set_Parent(this);
+#ifdef VIRTUALFILE_LOCKSTATS
+    for(PVIRTUALFILE_LOCK_THREAD stats = g_LockStats.load(std::memory_order_acquire); stats != NULL; stats = stats->Next)
+    {
+        for(int i = 0; i < VIRTUALFILE_LOCK_CLASSES; i++)
+        {
+            stats->Counts[i].Acquired.store(0, std::memory_order_relaxed);
+            stats->Counts[i].Contended.store(0, std::memory_order_relaxed);
+            stats->Counts[i].WaitTime.store(0, std::memory_order_relaxed);
+            stats->Counts[i].MaxWaitTime.store(0, std::memory_order_relaxed);
+            stats->Counts[i].HoldTime.store(0, std::memory_order_relaxed);
+            stats->Counts[i].MaxHoldTime.store(0, std::memory_order_relaxed);
+        }
+    }
+#endif
 }
 
-void VirtualFile::Remove(void)
+const char* VirtualFile::GetLockClassName(int Class)
 {
-    assert(mParent);
-    mParent->get_Context()->Remove(this);
-    mParent = NULL;
+    static const char* names[VIRTUALFILE_LOCK_CLASSES] = { "directory", "file", "rename", "pages", "range" };
+    return Class >= 0 && Class < VIRTUALFILE_LOCK_CLASSES ? names[Class] : "?";
 }
 
-DirectoryEnumerationContext* VirtualFile::get_Context(void)
+void VirtualFile::GetLayout(std::vector<VIRTUALFILE_FIELD_GROUP>& Groups)
 {
-    return (&mEnumCtx);   
+    VIRTUALFILE_FIELD_GROUP groups[] =
+    {
+        // the hot part
+        { "attributes", (int)(sizeof(mAttributesSeq) + sizeof(mSize) + sizeof(mMode) + sizeof(mUid) + sizeof(mGid) +
+            sizeof(mCreationTime) + sizeof(mLastAccessTime) + sizeof(mLastWriteTime)) },
+        { "name", (int)sizeof(mName) },
+        { "sibling link", (int)sizeof(mNextSibling) },
+        // the cold part
+        { "parent link", (int)sizeof(VIRTUALFILE_COLD::Parent) },
+        { "children", (int)sizeof(VIRTUALFILE_COLD::Children) },
+        { "data", (int)sizeof(VIRTUALFILE_COLD::Data) },
+        { "allocation size", (int)sizeof(VIRTUALFILE_COLD::AllocationSize) },
+        { "node lock", (int)sizeof(VIRTUALFILE_COLD::Lock) },
+        { "reference count", (int)sizeof(VIRTUALFILE_COLD::RefCount) },
+    };
+    int used = 0;
+
+    Groups.clear();
+    for(size_t i = 0; i < sizeof(groups) / sizeof(groups[0]); i++)
+    {
+        Groups.push_back(groups[i]);
+        used += groups[i].Size;
+    }
+    VIRTUALFILE_FIELD_GROUP padding = { "padding", (int)(sizeof(VirtualFile) + sizeof(VIRTUALFILE_COLD)) - used };
+    Groups.push_back(padding);
 }
 
-void VirtualFile::Write(void *WriteBuf, int64 Position, int BytesToWrite, int *BytesWritten)
+void VirtualFile::GetMemoryStats(VIRTUALFILE_MEMORY_STATS* Stats)
 {
-    assert(WriteBuf);
-    
-    if(mSize - Position < BytesToWrite)
+    EnsureSlabs();
+    Stats->Nodes = g_NodeSlab->GetObjects() * (int64)(g_NodeSlab->GetObjectSize() + g_NodeSlab->GetColdSize());
+    Stats->Directories = g_DirectorySlab->GetObjects() * (int64)g_DirectorySlab->GetObjectSize();
+    Stats->FileData = g_DataSlab->GetObjects() * (int64)g_DataSlab->GetObjectSize();
+    Stats->SlabBytes = g_NodeSlab->GetSlabBytes() + g_DirectorySlab->GetSlabBytes() + g_DataSlab->GetSlabBytes();
+    Stats->SmallData = 0;
+    for(int i = 0; i < VIRTUALFILE_SMALL_CLASSES; i++)
+    {
+        Stats->SmallData += g_SmallSlabs[i]->GetObjects() * (int64)g_SmallSlabs[i]->GetObjectSize();
+        Stats->SlabBytes += g_SmallSlabs[i]->GetSlabBytes();
+    }
+    Stats->Names = g_HeapNameBytes.load(std::memory_order_relaxed);
+    for(int i = 0; i < VIRTUALFILE_NAME_CLASSES; i++)
     {
-        set_Size(Position + BytesToWrite);
+        Stats->Names += g_NameSlabs[i]->GetObjects() * (int64)g_NameSlabs[i]->GetObjectSize();
+        Stats->SlabBytes += g_NameSlabs[i]->GetSlabBytes();
     }
-    if(mAllocationSize < mSize)
-        set_AllocationSize(mSize);
+}
+
+//class ByteRangeLock
+
+ByteRangeLock::ByteRangeLock()
+    :mWaiters(0)
+{
 
-    memcpy((void*)&((char*)mStream)[Position] , WriteBuf, BytesToWrite);
-    *BytesWritten = BytesToWrite;
 }
 
-void VirtualFile::Read(void *ReadBuf, int64 Position, int BytesToRead, int *BytesRead)
+bool ByteRangeLock::IsLocked(int64 Offset, int64 End, bool Exclusive)
 {
-    assert(ReadBuf);
-    int MaxRead;
-    if (Position > mSize)
-        MaxRead = 0;
-    else
-        MaxRead = (mSize - Position) < (int64)BytesToRead ? (int)(mSize - Position) : BytesToRead;
-    if (MaxRead > 0)
-        memcpy(ReadBuf, (void*)&((char*)mStream)[Position], MaxRead);
-    *BytesRead = MaxRead;
+    for(size_t i = 0; i < mRanges.size(); i++)
+    {
+        if(mRanges[i].Offset < End && Offset < mRanges[i].End &&
+            (Exclusive || mRanges[i].Exclusive))
+            return true;
+    }
+    return false;
 }
 
-void VirtualFile::Initializer(const nfs_char *Name)
+void ByteRangeLock::Lock(int64 Offset, int64 Length, bool Exclusive)
 {
-    assert(Name);
-    assert(mName == NULL);
+#ifdef VIRTUALFILE_LOCKSTATS
+    int64 start = LockStatsNow();
+    bool waited = false;
+#endif
+    std::unique_lock<std::mutex> lock(mLock);
+    BYTE_RANGE range = { Offset, Offset + Length, Exclusive };
 
-    mCreationTime = 0;
-    mLastAccessTime = 0;
-    mLastWriteTime = 0;
+    if(IsLocked(range.Offset, range.End, Exclusive))
+    {
+        mWaiters++;
+        do
+            mUnlocked.wait(lock);
+        while(IsLocked(range.Offset, range.End, Exclusive));
+        mWaiters--;
+#ifdef VIRTUALFILE_LOCKSTATS
+        waited = true;
+#endif
+    }
+    mRanges.push_back(range);
+#ifdef VIRTUALFILE_LOCKSTATS
+    LockStatsAcquired(this, VIRTUALFILE_LOCK_RANGE, waited ? start : -1);
+#endif
+}
 
-    mName = (nfs_char*)malloc((nfs_slen(Name) + 1) * sizeof(nfs_char));
-    nfs_scpy(mName, Name);
+void ByteRangeLock::Unlock(int64 Offset, int64 Length, bool Exclusive)
+{
+#ifdef VIRTUALFILE_LOCKSTATS
+    LockStatsReleased(this);
+#endif
+    std::lock_guard<std::mutex> lock(mLock);
+
+    for(size_t i = 0; i < mRanges.size(); i++)
+    {
+        if(mRanges[i].Offset == Offset && mRanges[i].End == Offset + Length &&
+            mRanges[i].Exclusive == Exclusive)
+        {
+            mRanges[i] = mRanges.back();
+            mRanges.pop_back();
+            break;
+        }
+    }
+    if(mWaiters > 0)
+        mUnlocked.notify_all();
 }
 
 //class DiskEnumerationContext
 
 DirectoryEnumerationContext::DirectoryEnumerationContext()
+    :mFirst(NULL)
+    ,mLast(NULL)
+    ,mCount(0)
+{
+
+}
+
+void* DirectoryEnumerationContext::operator new(size_t Size)
 {
-    mIndex = mFileList.begin();
+    assert(Size <= g_DirectorySlab->GetObjectSize());
+    return g_DirectorySlab->Alloc();
+}
+
+void DirectoryEnumerationContext::operator delete(void* Ptr)
+{
+    g_DirectorySlab->Free(Ptr);
 }
 
 int DirectoryEnumerationContext::GetCount()
 {
-  return (int)mFileList.size();
+  return mCount.load(std::memory_order_relaxed);
+}
+
+bool DirectoryEnumerationContext::GetFirstFile(VirtualFile*& vfile)
+{
+    vfile = mFirst.load(std::memory_order_acquire);
+    return vfile != NULL;
 }
 
 bool DirectoryEnumerationContext::GetNextFile(VirtualFile*& vfile)
 {
-    bool Result = false;
-    
-    if( mIndex != mFileList.end())
-    {
-        vfile = *mIndex;
-        ++mIndex;
-        Result = true;
-    }
-    return Result;
+    assert(vfile);
+    vfile = vfile->mNextSibling.load(std::memory_order_acquire);
+    return vfile != NULL;
 }
 
 bool DirectoryEnumerationContext::GetFile(int Index, VirtualFile*& vfile)
 {
-    bool Result = false;
-    
-    if( Index < (int)mFileList.size())
-    {
-        std::list<VirtualFile*>::const_iterator p = mFileList.begin();
-        while(Index-- > 0) { ++p; }
-        vfile = *p;            
-        Result = true;
-    }
+    bool Result = GetFirstFile(vfile);
+
+    while(Result && Index-- > 0)
+        Result = GetNextFile(vfile);
     return Result;
 }
 
 bool DirectoryEnumerationContext::GetFile(const nfs_char *FileName, VirtualFile*& vfile)
 {
-    vfile = NULL;
-    std::list<VirtualFile*>::const_iterator p = mFileList.begin();
+    VirtualFile* p;
+    uint32_t length, hash = NameHash(FileName, &length);
+    bool Result = GetFirstFile(p);
 
-    while(p != mFileList.end())
+    // the hash and the length of a name are next to it, most names differ there
+    vfile = NULL;
+    while(Result)
     {
-        if(!nfs_scmp((*p)->get_Name(), FileName))
+        nfs_char* name = p->get_Name();
+        PVIRTUALFILE_NAME header = NameHeader(name);
+        if(header->Hash == hash && header->Length == length && !nfs_scmp(name, FileName))
         {
-            vfile = *p;
+            vfile = p;
             return true;
         }
-        ++p;
+        Result = GetNextFile(p);
     }
     return false;
 }
 
-void DirectoryEnumerationContext::AddFile(VirtualFile* vfile)
+void DirectoryEnumerationContext::GetFiles(std::vector<VirtualFile*>& Files)
 {
-    mFileList.push_back(vfile);
-    ResetEnumeration();
+    unsigned seq;
+    VirtualFile* p;
+
+    do
+    {
+        seq = VirtualFile::RenameSeqBegin();
+        Files.clear();
+        for(bool Result = GetFirstFile(p); Result; Result = GetNextFile(p))
+            Files.push_back(p);
+    } while(VirtualFile::RenameSeqRetry(seq));
 }
 
-void DirectoryEnumerationContext::Remove(VirtualFile* vfile)
+void DirectoryEnumerationContext::GetEntries(std::vector<VIRTUALFILE_ENTRY>& Entries)
 {
-    std::list<VirtualFile*>::const_iterator p = mFileList.begin();
-    while(p != mFileList.end())
+    unsigned seq;
+    VirtualFile* p;
+
+    // the attributes, the name and the link to the next child share the
+    // line of the node, so each child is read once and in list order
+    do
     {
-        if(!nfs_scmp((*p)->get_Name(), vfile->get_Name()))
+        seq = VirtualFile::RenameSeqBegin();
+        Entries.clear();
+        Entries.reserve(GetCount());
+        for(bool Result = GetFirstFile(p); Result; Result = GetNextFile(p))
         {
-            mFileList.remove(vfile);
-            ResetEnumeration();
-            break;
+            VIRTUALFILE_ENTRY entry;
+            entry.File = p;
+            entry.Name = p->get_Name();
+            p->GetAttributes(&entry.Attributes);
+            Entries.push_back(entry);
         }
-        ++p;
-    }
+    } while(VirtualFile::RenameSeqRetry(seq));
+}
+
+void DirectoryEnumerationContext::AddFile(VirtualFile* vfile)
+{
+    // the node is fully initialized before it becomes reachable
+    vfile->mNextSibling.store(NULL, std::memory_order_relaxed);
+    if(mLast)
+        mLast->mNextSibling.store(vfile, std::memory_order_release);
+    else
+        mFirst.store(vfile, std::memory_order_release);
+    mLast = vfile;
+    mCount.fetch_add(1, std::memory_order_relaxed);
 }
 
-void DirectoryEnumerationContext::ResetEnumeration()
+void DirectoryEnumerationContext::Remove(VirtualFile* vfile)
 {
-    mIndex = mFileList.begin();
+    VirtualFile* prev = NULL, * p = mFirst.load(std::memory_order_relaxed);
+
+    while(p != NULL && p != vfile)
+    {
+        prev = p;
+        p = p->mNextSibling.load(std::memory_order_relaxed);
+    }
+    if(p == NULL)
+        return;
+
+    // the removed node keeps its link, readers standing on it can go on
+    VirtualFile* next = vfile->mNextSibling.load(std::memory_order_relaxed);
+    if(prev)
+        prev->mNextSibling.store(next, std::memory_order_release);
+    else
+        mFirst.store(next, std::memory_order_release);
+    if(mLast == vfile)
+        mLast = prev;
+    mCount.fetch_sub(1, std::memory_order_relaxed);
 }
 
 bool DirectoryEnumerationContext::IsEmpty()
 {
-    return (mFileList.size() == 0);
+    return (GetCount() == 0);
 }
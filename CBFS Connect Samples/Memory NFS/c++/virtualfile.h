@@ -7,7 +7,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
-#include <list>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
 #ifndef UNIX
 #include <errno.h>
 #endif
@@ -20,56 +24,305 @@ typedef wchar_t nfs_char;
 #define nfs_scmp(str1, str2) wcscmp(str1, str2)
 #define nfs_scpy(dst, src) wcscpy(dst, src)
 #define nfs_stok(s, delim) _wcstok(s, delim)
+#define nfs_stok_r(s, delim, ctx) wcstok_s(s, delim, ctx)
 #define nfs_stoi(str) _wtoi(str)
 #else
+#ifdef CBFS_STANDIN
+#include "standin/nfs.h"
+#else
 #include "../../include/nfs.h"
+#endif
 typedef char nfs_char;
 #define TEXT(quote) quote
 #define nfs_slen(str) strlen(str)
 #define nfs_scmp(str1, str2) strcmp(str1, str2)
 #define nfs_scpy(dst, src) strcpy(dst, src)
 #define nfs_stok(s, delim) strtok(s, delim)
+#ifdef UNIX
+#define nfs_stok_r(s, delim, ctx) strtok_r(s, delim, ctx)
+#else
+#define nfs_stok_r(s, delim, ctx) strtok_s(s, delim, ctx)
+#endif
 #define nfs_stoi(str) atoi(str)
 #endif
 
+#include "cbfsconnectcommon.h"
+#include "epoch.h"
+#include "pagearena.h"
+
 class VirtualFile;//forward declaration
 
+// file data is kept in pages of this size, allocated on first write
+#define VIRTUALFILE_PAGE_SIZE 65536
+
+// files of up to VirtualFile::GetSmallFileLimit bytes keep their data in one
+// buffer instead of pages; the limit is at most this
+#define VIRTUALFILE_SMALL_MAX 4096
+
+typedef struct
+{
+    int64 Count;
+    std::atomic<char*>* Pages;
+}   VIRTUALFILE_PAGE_TABLE, * PVIRTUALFILE_PAGE_TABLE;
+
+typedef struct
+{
+    int64 Size;
+    int Mode;
+    int Uid;
+    int Gid;
+    int64 CreationTime;
+    int64 LastAccessTime;
+    int64 LastWriteTime;
+}   VIRTUALFILE_ATTRIBUTES;
+
+// a child of a directory, see DirectoryEnumerationContext::GetEntries
+typedef struct
+{
+    VirtualFile* File;
+    nfs_char* Name;
+    VIRTUALFILE_ATTRIBUTES Attributes;
+}   VIRTUALFILE_ENTRY;
+
+// how the reads and writes of a file move through it
+#define VIRTUALFILE_ACCESS_NONE         0   // never read or written
+#define VIRTUALFILE_ACCESS_SEQUENTIAL   1   // each request starts near the end of the previous one
+#define VIRTUALFILE_ACCESS_STRIDED      2   // requests are a constant distance apart
+#define VIRTUALFILE_ACCESS_RANDOM       3
+
+typedef struct
+{
+    int64 ReadOps;
+    int64 ReadBytes;
+    int64 WriteOps;
+    int64 WriteBytes;
+    int64 SequentialOps;
+    int64 StridedOps;
+    int64 RandomOps;
+    int64 LastAccess;   // time() of the last read or write, 0 if none
+    int Pattern;        // VIRTUALFILE_ACCESS_*, the class of most requests
+}   VIRTUALFILE_IO_STATS;
+
+// the locks of the tree, as counted when built with VIRTUALFILE_LOCKSTATS
+#define VIRTUALFILE_LOCK_DIRECTORY      0   // the lock of a directory node
+#define VIRTUALFILE_LOCK_FILE           1   // the lock of a file node
+#define VIRTUALFILE_LOCK_RENAME         2   // the global lock of renames across directories
+#define VIRTUALFILE_LOCK_PAGES          3   // the lock of the page table of a file
+#define VIRTUALFILE_LOCK_RANGE          4   // the byte ranges of a file
+#define VIRTUALFILE_LOCK_CLASSES        5
+
+// times in nanoseconds; a wait is counted only for contended acquisitions
+typedef struct
+{
+    int64 Acquired;
+    int64 Contended;
+    int64 WaitTime;
+    int64 MaxWaitTime;
+    int64 HoldTime;
+    int64 MaxHoldTime;
+}   VIRTUALFILE_LOCK_STATS;
+
+// a group of the fields of a VirtualFile node, see VirtualFile::GetLayout
+typedef struct
+{
+    const char* Name;
+    int Size;
+}   VIRTUALFILE_FIELD_GROUP;
+
+// the bytes in use by the metadata of the tree, see VirtualFile::GetMemoryStats
+typedef struct
+{
+    int64 Nodes;
+    int64 Names;            // the names, with their headers
+    int64 Directories;      // the child lists of directories
+    int64 FileData;         // the data state of files that were read or written, pages not included
+    int64 SmallData;        // the buffers of small files
+    int64 SlabBytes;        // the slabs all of them are carved from
+}   VIRTUALFILE_MEMORY_STATS;
+
+// see VirtualFile::SetExpiryPolicy
+typedef struct
+{
+    int Policies;
+    int64 Tracked;          // files below a directory with a policy
+    int64 Expired;          // files deleted by ExpireFiles
+}   VIRTUALFILE_EXPIRY_STATS;
+
+struct _VIRTUALFILE_IO_BATCH;
+struct _VIRTUALFILE_DATA;
+struct _VIRTUALFILE_COLD;
+
 //class DirectoryEnumerationContext
+// the list of children of a directory, linked through the children
+// themselves. Writers hold the lock of the owning VirtualFile; readers
+// may walk the list without any lock from inside an epoch read section.
 
 class DirectoryEnumerationContext
 {
 public:
     DirectoryEnumerationContext();
+
+    // directories are allocated from a slab
+    static void* operator new(size_t Size);
+    static void operator delete(void* Ptr);
     
     //DirectoryEnumerationContext(VirtualFile* vfile);
 
     int GetCount();
     
-    bool GetNextFile(VirtualFile*& vfile);
-    
     bool GetFile(const nfs_char *FileName, VirtualFile*& vfile);
 
     bool GetFile(int Index, VirtualFile*& vfile);
 
+    bool GetFirstFile(VirtualFile*& vfile);
+
+    bool GetNextFile(VirtualFile*& vfile);
+
+    // consistent copy of the list, safe against concurrent renames
+    void GetFiles(std::vector<VirtualFile*>& Files);
+
+    // the same with the names and attributes, read in the same pass over
+    // the list; the names stay valid until the epoch read section ends
+    void GetEntries(std::vector<VIRTUALFILE_ENTRY>& Entries);
+
     void AddFile(VirtualFile* vfile);
     
     void Remove(VirtualFile* vfile);
-    
-    void ResetEnumeration(void);
 
     bool IsEmpty(void);
 private:
-    std::list <VirtualFile*> mFileList;
-    std::list<VirtualFile*>::const_iterator mIndex;    
+    std::atomic<VirtualFile*> mFirst;
+    VirtualFile* mLast;
+    std::atomic<int> mCount;
+};
+
+//class ByteRangeLock
+// the byte ranges of a file used by the reads and writes in progress.
+// Reads share a range, a write owns it; requests for disjoint ranges
+// never wait for each other.
+
+class ByteRangeLock
+{
+public:
+    ByteRangeLock();
+
+    void Lock(int64 Offset, int64 Length, bool Exclusive);
+
+    void Unlock(int64 Offset, int64 Length, bool Exclusive);
+private:
+    typedef struct
+    {
+        int64 Offset;
+        int64 End;
+        bool Exclusive;
+    }   BYTE_RANGE;
+
+    bool IsLocked(int64 Offset, int64 End, bool Exclusive);
+
+    std::mutex mLock;
+    std::condition_variable mUnlocked;
+    std::vector<BYTE_RANGE> mRanges;
+    int mWaiters;
+};
+
+//class NodeLock
+// the reader/writer lock of a node, in 4 bytes. Threads that have to wait
+// sleep on one of a few condition variables shared by all nodes. It has the
+// interface of std::shared_mutex.
+
+class NodeLock
+{
+public:
+    NodeLock();
+
+    void lock(void);
+    bool try_lock(void);
+    void unlock(void);
+
+    void lock_shared(void);
+    bool try_lock_shared(void);
+    void unlock_shared(void);
+private:
+    NodeLock(const NodeLock&);
+    NodeLock& operator=(const NodeLock&);
+
+    void Wait(bool Exclusive);
+    void Wake(void);
+
+    // a writer bit, a waiters bit and the count of readers
+    std::atomic<unsigned> mState;
 };
 
 // class VirtualFile
 // represent directories and files information
+//
+// Locking rules:
+// - every VirtualFile has a reader/writer lock. For a directory it guards
+//   the list of children (the namespace), for a file it guards the size
+//   and the attributes. The name and parent of a node are guarded by the
+//   lock of its parent directory.
+// - file data is read and written with the file lock held shared; Read and
+//   Write lock the byte range they touch, so non-overlapping requests run in
+//   parallel. Shrinking a file (set_Size, set_AllocationSize) frees pages and
+//   needs the file lock held exclusively.
+// - a parent is always locked before its child. Two directories that are
+//   not parent and child are locked together only by LockRename, which
+//   serializes such renames on a global mutex and then locks the ancestor
+//   first (unrelated directories are ordered by address).
+// - nodes are reference counted. The tree holds one reference, every lookup
+//   adds one, so a node found by a handler stays valid until Release() even
+//   if it is unlinked concurrently.
+//
+// Memory layout:
+// - nodes, names and child lists are allocated from slabs (slab.h). A name
+//   is stored after a header with its length and hash, which lookups compare
+//   before the names themselves.
+// - a node is split in two. The VirtualFile itself is one cache line with
+//   what GetAttributes, lookups and directory listings read: the attributes,
+//   the name and the link to the next sibling. The parent, the child list,
+//   the data state, the allocation size, the lock and the reference count
+//   are kept apart in the same slab. Nodes are handed out in the order of
+//   their addresses, so the children of a directory filled in one go lie
+//   one after the other and a listing reads them as a stream.
+// - a node only has the fields every file and directory needs. The child
+//   list is created by the first AddFile, and the page table, the byte range
+//   lock and the I/O counters of a file by its first read or write; both
+//   stay until the node is deleted.
+// - a file that never grew past the small file limit keeps its data in one
+//   buffer from a slab. It moves to pages when a write or set_AllocationSize
+//   goes past the limit, and may become small again once truncated to 0.
+//
+// I/O accounting:
+// - Read and Write count the request in a batch owned by the calling
+//   thread; the batch is added to the counters of the file when the thread
+//   moves on to another file, after a number of requests, or when
+//   FlushIoStats is called. The access pattern is classified in the batch
+//   as well, each request against the previous one of the thread; only the
+//   first request of a batch is classified against the file, when the batch
+//   is flushed, so that requests arriving on different threads are seen.
+//
+// Lock-free read path:
+// - lookups, GetAttributes and directory listings take no locks. They run
+//   inside an epoch read section (EpochGuard); unlinked nodes and replaced
+//   names are freed through EpochRetire only after all readers moved on.
+// - attributes are published through a sequence counter (GetAttributes
+//   retries while a writer is updating them).
+// - a rename may move a node from one child list to another while a
+//   reader walks it, so lock-free walks are validated with RenameSeqBegin /
+//   RenameSeqRetry and restarted if a rename happened meanwhile.
+//
+// Lock statistics:
+// - built with VIRTUALFILE_LOCKSTATS, every acquisition of the locks above
+//   is counted per lock class (VIRTUALFILE_LOCK_*) by the calling thread,
+//   with the time it waited and the time it held the lock. Without it the
+//   locks are taken directly.
 
 class VirtualFile
 {
 public:
     
+    // get_Name returns NULL if there was no memory for the name; the
+    // caller then releases the node
     VirtualFile(const nfs_char * Name);
     
     VirtualFile(const nfs_char * Name, int Mode);
@@ -77,21 +330,106 @@ public:
     VirtualFile(const nfs_char * Name, int Mode, int InitialSize);
 
     ~VirtualFile();
+
+    // nodes are allocated from a slab
+    static void* operator new(size_t Size);
+    static void operator delete(void* Ptr);
+
+    void AddRef(void);
+    bool TryAddRef(void);
+    void Release(void);
+
+    void LockShared(void);
+    void UnlockShared(void);
+    void LockExclusive(void);
+    void UnlockExclusive(void);
+
+    static void LockRename(VirtualFile* OldDir, VirtualFile* NewDir);
+    static void UnlockRename(VirtualFile* OldDir, VirtualFile* NewDir);
+
+    // renames wait until UnblockRenames, so that a walk of the tree sees
+    // every node once; the caller must not rename meanwhile
+    static void BlockRenames(void);
+    static void UnblockRenames(void);
+
+    static unsigned RenameSeqBegin(void);
+    static bool RenameSeqRetry(unsigned Seq);
+
+    bool IsAncestorOf(VirtualFile* vfile);
         
     void AddFile(VirtualFile* vfile);
     
-    void Rename(const nfs_char * NewName);
+    // false, and the old name is kept, if there is no memory for the new one
+    bool Rename(const nfs_char * NewName);
 
     void Remove(void);
 
-    void Write(void *WriteBuf, int64 Position, int BytesToWrite, int *BytesWritten);
-
-    void Read(void *ReadBuf, int64 Position, int BytesToRead, int *BytesRead);
+    // false if a page could not be allocated; BytesWritten is then the part
+    // written before it
+    bool Write(void *WriteBuf, int64 Position, int64 BytesToWrite, int64 *BytesWritten);
+
+    void Read(void *ReadBuf, int64 Position, int64 BytesToRead, int64 *BytesRead);
+
+    void GetAttributes(VIRTUALFILE_ATTRIBUTES* Attributes);
+
+    // requests still in the batches of other threads are not included
+    void GetIoStats(VIRTUALFILE_IO_STATS* Stats);
+
+    // adds the batches of all threads to their files
+    static void FlushIoStats(void);
+
+    // files and directories alive, and the bytes of their data pages and
+    // small file buffers
+    static int64 GetFileCount(void);
+    static int64 GetPageBytes(void);
+
+    // 0 keeps the data of all files in pages; files that are already small
+    // move to pages as they are written past a lowered limit
+    static void SetSmallFileLimit(int Bytes);
+    static int GetSmallFileLimit(void);
+
+    // takes new data pages from an arena of transparent huge pages
+    // (pagearena.h) instead of the heap; returns false, and keeps using the
+    // heap, if huge pages are not available. Pages already taken stay where
+    // they are.
+    static bool SetDataArena(bool Enable);
+    // returns false if the arena was never turned on
+    static bool GetDataArenaStats(PAGEARENA_STATS* Stats);
+    // moves the pages in use of the data arena region with the most free
+    // resident pages, if there are no more than MaxBytes of them, to other
+    // regions and returns the region to the system. Returns the bytes
+    // moved, -1 if no region qualified. Files are locked shared and a page
+    // only for its range, so I/O elsewhere in the file goes on.
+    static int64 CompactData(int64 MaxBytes);
+
+    // files below Directory, at any depth, that were not read, written or
+    // touched for Seconds are deleted by ExpireFiles; the policy of the
+    // deepest directory applies. Policies are set before files are added.
+    static void SetExpiryPolicy(const nfs_char* Directory, int64 Seconds);
+    // deletes the files whose time (time() seconds) has come; looks at no
+    // more than MaxFiles of them and returns the number deleted
+    static int ExpireFiles(int64 Now, int MaxFiles);
+    static void GetExpiryStats(VIRTUALFILE_EXPIRY_STATS* Stats);
+
+    // the lock statistics of all threads; returns false if the tree was
+    // built without VIRTUALFILE_LOCKSTATS. Reset only while no locks are held.
+    static bool GetLockStats(int Class, VIRTUALFILE_LOCK_STATS* Stats);
+    static void ResetLockStats(void);
+    static const char* GetLockClassName(int Class);
+
+    // the bytes of a node by group of fields, padding last; they add up
+    // to sizeof(VirtualFile) and the size of the cold part
+    static void GetLayout(std::vector<VIRTUALFILE_FIELD_GROUP>& Groups);
+
+    static void GetMemoryStats(VIRTUALFILE_MEMORY_STATS* Stats);
 
 //property
-    void set_AllocationSize(int64 Value);
+    // preallocates the pages up to Value and frees those past Value and the
+    // file size; false if the pages could not be allocated
+    bool set_AllocationSize(int64 Value);
     int64 get_AllocationSize(void);
 
+    // shrinking the file frees its pages past the new size
     void set_Size(int64 Value);
     int64 get_Size(void);
     
@@ -115,32 +453,65 @@ public:
     int get_Gid(void);
     void set_Gid(int Value);
 
+    // the children of the node; a node without children returns an empty
+    // list that must not be changed
     DirectoryEnumerationContext* get_Context(void);
     
     VirtualFile* get_Parent(void);
     void set_Parent(VirtualFile* Value);
 
 private:
+    friend class DirectoryEnumerationContext;
+
     VirtualFile();    
     void Initializer(const nfs_char * Name);
-    
-    DirectoryEnumerationContext mEnumCtx;
-    VirtualFile* mParent;
-
-    nfs_char *mName;
-    void *mStream;
-
-    int64 mSize;
-    int64 mAllocationSize;
-
-    int mMode;
-    int mUid;
-    int mGid;
-
-    int64 mCreationTime;
-    int64 mLastAccessTime;
-    int64 mLastWriteTime;
-
+    void BeginAttributesUpdate(void);
+    void EndAttributesUpdate(void);
+    static void Delete(void* vfile);
+
+    struct _VIRTUALFILE_COLD* Cold(void);
+    struct _VIRTUALFILE_DATA* GetData(bool Create);
+    char* GetPage(int64 Index, bool Allocate);
+    // false if Page is no longer the page at Index
+    bool MovePage(int64 Index, char* Page);
+    PVIRTUALFILE_PAGE_TABLE ReservePages(struct _VIRTUALFILE_DATA* Data, int64 Count);
+    void FreePages(int64 First);
+    static void DeletePageTable(void* Table);
+
+    bool WriteSmall(struct _VIRTUALFILE_DATA* Data, const void* Buffer, int64 Position, int64 Count);
+    bool ReadSmall(struct _VIRTUALFILE_DATA* Data, void* Buffer, int64 Position, int64 Count);
+    bool ReserveSmall(int64 Size);
+    void GrowSmall(struct _VIRTUALFILE_DATA* Data, int64 Size);
+    bool MoveSmallToPages(struct _VIRTUALFILE_DATA* Data);
+
+    int64 GetLastUse(void);
+    static int64 GetExpirySeconds(VirtualFile* Dir);
+    void ScheduleExpiry(VirtualFile* Parent);
+    bool Expire(int64 Now);
+
+    void AccountIo(int64 Position, int64 Length, int64 Bytes, bool Write);
+    static void FlushIoBatch(struct _VIRTUALFILE_IO_BATCH* Batch);
+    void ForgetIoBatches(void);
+    int GetLockClass(void);
+
+    static std::mutex mRenameLock;
+    static std::atomic<unsigned> mRenameSeq;
+    static std::atomic<int64> mFileCount;
+    static std::atomic<int64> mPageBytes;
+
+    // the hot part of the node, the rest is in Cold()
+    std::atomic<unsigned> mAttributesSeq;
+    std::atomic<int> mMode;
+    std::atomic<int> mUid;
+    std::atomic<int> mGid;
+    std::atomic<int64> mSize;
+
+    std::atomic<int64> mCreationTime;
+    std::atomic<int64> mLastAccessTime;
+    std::atomic<int64> mLastWriteTime;
+
+    std::atomic<nfs_char*> mName;
+    std::atomic<VirtualFile*> mNextSibling;
 };
 
 #endif //#if !defined _VIRTUAL_FILE_H
\ No newline at end of file
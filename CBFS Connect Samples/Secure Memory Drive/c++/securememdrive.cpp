@@ -473,7 +473,7 @@ public: // Events
 
         assert(vfile);
         DWORD BytesRead;
-        vfile->Read(e->Buffer, (LONG)e->Position, (INT)e->BytesToRead, &BytesRead);
+        vfile->Read(e->Buffer, e->Position, (INT)e->BytesToRead, &BytesRead);
         *(e->pBytesRead) = BytesRead;
 
         return 0;
@@ -505,9 +505,10 @@ public: // Events
         VirtualFile* vfile = (VirtualFile*)(e->FileContext);
 
         assert(vfile);
-        vfile->set_AllocationSize(e->AllocationSize);
+        if (!vfile->set_AllocationSize(e->AllocationSize))
+            e->ResultCode = ERROR_DISK_FULL;
 
-        return 0;
+        return e->ResultCode;
     }
 
     INT FireSetFileSize(CBFSSetFileSizeEventParams* e) override
@@ -564,10 +565,11 @@ public: // Events
         *(e->pBytesWritten) = 0;
 
         DWORD BytesWritten;
-        vfile->Write((LPVOID)e->Buffer, (LONG)e->Position, (INT)e->BytesToWrite, &BytesWritten);
+        if (!vfile->Write((LPVOID)e->Buffer, e->Position, (INT)e->BytesToWrite, &BytesWritten))
+            e->ResultCode = ERROR_DISK_FULL;
         *(e->pBytesWritten) = BytesWritten;
 
-        return 0;
+        return e->ResultCode;
     }
 
     INT FireSetFileSecurity(CBFSSetFileSecurityEventParams* e) override
@@ -0,0 +1,129 @@
+#if !defined _STANDIN_CBFS_H
+#define _STANDIN_CBFS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+// Stand-in for the Windows declarations that the VirtualFile of the sample
+// takes from ../../include/cbfs.h.
+//
+// Built with -DCBFS_STANDIN, virtualfile.cpp includes this header instead,
+// so that it compiles on its own, without the CBFS library or the Windows
+// SDK, for the tests of the makefile. The CBFS class is not declared; the
+// handlers of the sample are not built this way.
+//
+// There are no security descriptors: the security functions fail, and a
+// file keeps the NULL descriptor it starts with. The tests only read and
+// write.
+//
+// Only the members used by virtualfile.cpp are declared.
+
+typedef void VOID;
+typedef void* PVOID;
+typedef int BOOL;
+typedef int INT;
+typedef int* PINT;
+typedef unsigned char BYTE;
+typedef BYTE* PBYTE;
+typedef uint32_t ULONG;
+typedef uint32_t DWORD;
+typedef DWORD* PDWORD;
+typedef wchar_t WCHAR;
+typedef WCHAR* LPWSTR;
+typedef const WCHAR* LPCWSTR;
+typedef long long __int64;
+typedef void* HANDLE;
+typedef void* PSID;
+typedef void* PACL;
+typedef void* PSECURITY_DESCRIPTOR;
+typedef DWORD* PULONG;
+
+typedef struct
+{
+    DWORD dwLowDateTime;
+    DWORD dwHighDateTime;
+}   FILETIME;
+
+typedef struct
+{
+    BYTE Revision;
+    PSID Owner;
+    PSID Group;
+    PACL Sacl;
+    PACL Dacl;
+}   SECURITY_DESCRIPTOR;
+
+typedef struct
+{
+    struct
+    {
+        PSID Sid;
+        DWORD Attributes;
+    }   User;
+}   TOKEN_USER, *PTOKEN_USER;
+
+enum { TokenUser = 1 };
+
+#define TRUE    1
+#define FALSE   0
+
+#define ERROR_SUCCESS               0
+#define ERROR_NO_TOKEN              1008
+#define ERROR_INSUFFICIENT_BUFFER   122
+#define ERROR_MORE_DATA             234
+#define ERROR_CALL_NOT_IMPLEMENTED  120
+
+#define OWNER_SECURITY_INFORMATION  0x00000001
+#define GROUP_SECURITY_INFORMATION  0x00000002
+#define DACL_SECURITY_INFORMATION   0x00000004
+#define SACL_SECURITY_INFORMATION   0x00000008
+#define SECURITY_DESCRIPTOR_REVISION    1
+
+#define DELETE                  0x00010000
+#define FILE_GENERIC_READ       0x00120089
+#define FILE_GENERIC_WRITE      0x00120116
+#define FILE_GENERIC_EXECUTE    0x001200A0
+#define FILE_ALL_ACCESS         0x001F01FF
+#define TOKEN_QUERY             0x0008
+#define LPTR                    0x0040
+
+#define FILE_ATTRIBUTE_DIRECTORY    0x00000010
+
+#define wcsicmp wcscasecmp
+#define _T(x) L##x
+#define _tprintf wprintf
+#define wsprintf(Buffer, ...) swprintf(Buffer, 2048, __VA_ARGS__)
+
+inline DWORD GetLastError(void) { return ERROR_CALL_NOT_IMPLEMENTED; }
+inline HANDLE GetCurrentThread(void) { return NULL; }
+inline HANDLE GetCurrentProcess(void) { return NULL; }
+inline BOOL CloseHandle(HANDLE) { return TRUE; }
+inline PVOID LocalAlloc(INT, size_t Bytes) { return calloc(1, Bytes); }
+inline PVOID LocalFree(PVOID Memory) { free(Memory); return NULL; }
+
+inline BOOL OpenThreadToken(HANDLE, DWORD, BOOL, HANDLE*) { return FALSE; }
+inline BOOL OpenProcessToken(HANDLE, DWORD, HANDLE*) { return FALSE; }
+inline BOOL GetTokenInformation(HANDLE, INT, PVOID, DWORD, PDWORD) { return FALSE; }
+inline BOOL ConvertSidToStringSid(PSID, LPWSTR* StringSid) { *StringSid = NULL; return FALSE; }
+inline BOOL ConvertStringSecurityDescriptorToSecurityDescriptor(LPCWSTR, DWORD, PSECURITY_DESCRIPTOR* SecurityDescriptor, PULONG Length)
+{
+    *SecurityDescriptor = NULL;
+    *Length = 0;
+    return FALSE;
+}
+
+inline BOOL InitializeSecurityDescriptor(PSECURITY_DESCRIPTOR, DWORD) { return FALSE; }
+inline BOOL MakeSelfRelativeSD(PSECURITY_DESCRIPTOR, PSECURITY_DESCRIPTOR, PDWORD) { return FALSE; }
+inline BOOL GetSecurityDescriptorOwner(PSECURITY_DESCRIPTOR, PSID*, BOOL*) { return FALSE; }
+inline BOOL SetSecurityDescriptorOwner(PSECURITY_DESCRIPTOR, PSID, BOOL) { return FALSE; }
+inline BOOL GetSecurityDescriptorGroup(PSECURITY_DESCRIPTOR, PSID*, BOOL*) { return FALSE; }
+inline BOOL SetSecurityDescriptorGroup(PSECURITY_DESCRIPTOR, PSID, BOOL) { return FALSE; }
+inline BOOL GetSecurityDescriptorDacl(PSECURITY_DESCRIPTOR, BOOL*, PACL*, BOOL*) { return FALSE; }
+inline BOOL SetSecurityDescriptorDacl(PSECURITY_DESCRIPTOR, BOOL, PACL, BOOL) { return FALSE; }
+inline BOOL GetSecurityDescriptorSacl(PSECURITY_DESCRIPTOR, BOOL*, PACL*, BOOL*) { return FALSE; }
+inline BOOL SetSecurityDescriptorSacl(PSECURITY_DESCRIPTOR, BOOL, PACL, BOOL) { return FALSE; }
+
+#endif //#if !defined _STANDIN_CBFS_H
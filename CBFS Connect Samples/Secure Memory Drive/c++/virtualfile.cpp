@@ -2,13 +2,17 @@
 
 #ifdef _UNICODE
 #include "../../include/unicode/cbfs.h"
+#elif defined CBFS_STANDIN
+#include "standin/cbfs.h"
 #else
 #include "../../include/cbfs.h"
 #endif
 
 #include "virtualfile.h"
+#ifndef CBFS_STANDIN
 #include <sddl.h>
 #include <tchar.h>
+#endif
 
 //class VirtualFile
 VirtualFile::VirtualFile()
@@ -59,16 +63,21 @@ VirtualFile::~VirtualFile()
     }
 }
 
-VOID VirtualFile::set_AllocationSize(__int64 Value)
+BOOL VirtualFile::set_AllocationSize(__int64 Value)
 {
     if(mAllocationSize != Value) {
 
-        mStream = realloc(mStream, (size_t)Value);
-        if(Value > 0) {
-            assert(mStream);
-        }
+        // a buffer of several gigabytes may not be there to have, the file
+        // then keeps the one it has
+        if((unsigned __int64)Value > (size_t)-1)
+            return FALSE;
+        PVOID stream = realloc(mStream, (size_t)Value);
+        if(stream == NULL && Value > 0)
+            return FALSE;
+        mStream = stream;
         mAllocationSize = Value;
     }
+    return TRUE;
 }
 
 __int64 VirtualFile::get_AllocationSize(VOID)
@@ -478,30 +487,35 @@ DirectoryEnumerationContext* VirtualFile::get_Context(VOID)
    
 }
 
-VOID VirtualFile::Write(PVOID WriteBuf, LONG Position, INT BytesToWrite, PDWORD BytesWritten)
+BOOL VirtualFile::Write(PVOID WriteBuf, __int64 Position, INT BytesToWrite, PDWORD BytesWritten)
 {
     assert(WriteBuf);
-    
-    if(mSize - Position < BytesToWrite)
+    __int64 end = Position + BytesToWrite;
+
+    *BytesWritten = 0;
+    if(mAllocationSize < end && !set_AllocationSize(end))
+        return FALSE;
+    if(mSize < end)
     {
-        set_Size(Position + BytesToWrite);
+        set_Size(end);
     }
-    if(mAllocationSize < mSize)
-        set_AllocationSize(mSize);
 
     memcpy((PVOID)&((PBYTE)mStream)[Position] , WriteBuf, BytesToWrite);
     *BytesWritten = BytesToWrite;
+    return TRUE;
 }
 
-VOID VirtualFile::Read(PVOID ReadBuf, LONG Position, INT BytesToRead, PDWORD BytesRead)
+VOID VirtualFile::Read(PVOID ReadBuf, __int64 Position, INT BytesToRead, PDWORD BytesRead)
 {
     assert(ReadBuf);
-    assert((Position + BytesToRead) <= mAllocationSize);
-    {
-        LONG MaxRead = (mSize - (__int64)Position) < BytesToRead ? (LONG)(mSize - (__int64)Position) : BytesToRead;
+    INT MaxRead = 0;
+
+    // nothing is read past the end of the file
+    if(Position < mSize)
+        MaxRead = (mSize - Position) < BytesToRead ? (INT)(mSize - Position) : BytesToRead;
+    if(MaxRead > 0)
         memcpy(ReadBuf, (PVOID)&((PBYTE)mStream)[Position], MaxRead);
-        *BytesRead = MaxRead;
-    }
+    *BytesRead = MaxRead;
 }
 
 VOID VirtualFile::Initializer(LPCWSTR Name)